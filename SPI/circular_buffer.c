@@ -15,7 +15,8 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
-#include <asm/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
 
 #define __NO_VERSION__
 
@@ -45,14 +46,26 @@ struct circular_buffer* circular_buffer_init(
 	
    if (capacity > 0)
    {
-      buf = kmalloc(sizeof(struct circular_buffer), GFP_KERNEL | GFP_DMA);
+      buf = kmalloc(sizeof(struct circular_buffer), GFP_KERNEL);
+
+      if (NULL == buf)
+      {
+         return NULL;
+      }
 
       buf->_size	= 0;
       buf->_beginIndex	= 0;
       buf->_endIndex	= 0;
 
       buf->_capacity	= capacity;
-      buf->_data	= kmalloc(buf->_capacity, GFP_KERNEL | GFP_DMA);
+      buf->_data	= vmalloc(buf->_capacity);
+
+      if (NULL == buf->_data)
+      {
+         kfree(buf);
+
+         buf = NULL;
+      }
    }
 
    return buf;
@@ -82,7 +95,7 @@ void circular_buffer_term(
 {
    if (buf != NULL)
    {
-      kfree(buf->_data);
+      vfree(buf->_data);
       kfree(buf);
 
       buf = NULL;
@@ -417,6 +430,117 @@ const int circular_buffer_read_user(
    return result;
 }
 
+#if SPIMOD_HAVE_READ_ITER
+
+/******************************************************************************
+ *
+ * Function: circular_buffer_write_iter()
+ * Purpose:  Writes bytes to the circular buffer from an iterator, as much
+ *           as fits.
+ *
+ * Parameters:
+ *
+ * - IN:     length (the most bytes to take from the iterator).
+ * - OUT:    N/A
+ * - IN/OUT: buf (the circular buffer to use).
+ *           from (the iterator).
+ *
+ * Returns:  The number of bytes written to the circular buffer.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_write_iter(
+   struct circular_buffer* buf,
+   struct iov_iter* from,
+   const int length)
+{
+   int result = 0;
+
+   if (buf != NULL && from != NULL && length > 0)
+   {
+      int bytesToWrite = min(length, buf->_capacity - buf->_size);
+      int size1 = min(bytesToWrite, buf->_capacity - buf->_endIndex);
+
+      // Up to the end of the storage, then from its start
+
+      result = copy_from_iter(buf->_data + buf->_endIndex, size1, from);
+
+      if (result == size1 && bytesToWrite > size1)
+      {
+         result += copy_from_iter(buf->_data, bytesToWrite - size1, from);
+      }
+
+      buf->_endIndex += result;
+
+      if (buf->_endIndex >= buf->_capacity)
+      {
+         buf->_endIndex -= buf->_capacity;
+      }
+
+      buf->_size += result;
+   }
+
+   return result;
+}
+
+/******************************************************************************
+ *
+ * Function: circular_buffer_read_iter()
+ * Purpose:  Reads bytes from the circular buffer into an iterator.
+ *
+ * Parameters:
+ *
+ * - IN:     length (the most bytes to read).
+ * - OUT:    N/A
+ * - IN/OUT: buf (the circular buffer to use).
+ *           to (the iterator).
+ *
+ * Returns:  The number of bytes read from the circular buffer.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_read_iter(
+   struct circular_buffer* buf,
+   struct iov_iter* to,
+   const int length)
+{
+   int result = 0;
+
+   if (buf != NULL && to != NULL && length > 0)
+   {
+      int bytesToRead = min(length, buf->_size);
+      int size1 = min(bytesToRead, buf->_capacity - buf->_beginIndex);
+
+      result = copy_to_iter(buf->_data + buf->_beginIndex, size1, to);
+
+      if (result == size1 && bytesToRead > size1)
+      {
+         result += copy_to_iter(buf->_data, bytesToRead - size1, to);
+      }
+
+      buf->_beginIndex += result;
+
+      if (buf->_beginIndex >= buf->_capacity)
+      {
+         buf->_beginIndex -= buf->_capacity;
+      }
+
+      buf->_size -= result;
+   }
+
+   return result;
+}
+
+#endif
+
 /******************************************************************************
  *
  * Function: circular_buffer_num_bytes_available()
@@ -481,6 +605,230 @@ void circular_buffer_reset(
    }
 }
 
+/******************************************************************************
+ *
+ * Function: circular_buffer_peek()
+ * Purpose:  Copies length bytes starting offset bytes into the circular
+ *           buffer, without removing them.
+ *
+ * Parameters:
+ *
+ * - IN:     buf (the circular buffer to use).
+ *           offset (bytes from the oldest byte).
+ *           length (size of the byte array).
+ * - OUT:    data (byte array).
+ * - IN/OUT: N/A
+ *
+ * Returns:  length, or 0 if fewer than offset + length bytes are held.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_peek(
+   const struct circular_buffer* buf,
+   const int offset,
+   char* data,
+   const int length)
+{
+   int start, size1;
+
+   if (NULL == buf || NULL == data || offset < 0 || length <= 0
+    || offset + length > buf->_size)
+   {
+      return 0;
+   }
+
+   start = (buf->_beginIndex + offset) % buf->_capacity;
+   size1 = min(length, buf->_capacity - start);
+
+   memcpy(data, buf->_data + start, size1);
+   memcpy(data + size1, buf->_data, length - size1);
+
+   return length;
+}
+
+/******************************************************************************
+ *
+ * Function: circular_buffer_poke()
+ * Purpose:  Overwrites length bytes already held in the circular buffer,
+ *           starting offset bytes in.  The size is unchanged.
+ *
+ * Parameters:
+ *
+ * - IN:     offset (bytes from the oldest byte).
+ *           data (byte array).
+ *           length (size of the byte array).
+ * - OUT:    N/A
+ * - IN/OUT: buf (the circular buffer to use).
+ *
+ * Returns:  length, or 0 if fewer than offset + length bytes are held.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_poke(
+   struct circular_buffer* buf,
+   const int offset,
+   const char* data,
+   const int length)
+{
+   int start, size1;
+
+   if (NULL == buf || NULL == data || offset < 0 || length <= 0
+    || offset + length > buf->_size)
+   {
+      return 0;
+   }
+
+   start = (buf->_beginIndex + offset) % buf->_capacity;
+   size1 = min(length, buf->_capacity - start);
+
+   memcpy(buf->_data + start, data, size1);
+   memcpy(buf->_data, data + size1, length - size1);
+
+   return length;
+}
+
+/******************************************************************************
+ *
+ * Function: circular_buffer_discard()
+ * Purpose:  Removes up to length of the oldest bytes without copying them.
+ *
+ * Parameters:
+ *
+ * - IN:     length (number of bytes to remove).
+ * - OUT:    N/A
+ * - IN/OUT: buf (the circular buffer to use).
+ *
+ * Returns:  The number of bytes removed.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_discard(
+   struct circular_buffer* buf,
+   const int length)
+{
+   int bytes;
+
+   if (NULL == buf || length <= 0)
+   {
+      return 0;
+   }
+
+   bytes = min(length, buf->_size);
+
+   buf->_beginIndex = (buf->_beginIndex + bytes) % buf->_capacity;
+   buf->_size -= bytes;
+
+   return bytes;
+}
+
+/******************************************************************************
+ *
+ * Function: circular_buffer_unwrite()
+ * Purpose:  Removes up to length of the newest bytes, undoing earlier
+ *           writes.
+ *
+ * Parameters:
+ *
+ * - IN:     length (number of bytes to remove).
+ * - OUT:    N/A
+ * - IN/OUT: buf (the circular buffer to use).
+ *
+ * Returns:  The number of bytes removed.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_unwrite(
+   struct circular_buffer* buf,
+   const int length)
+{
+   int bytes;
+
+   if (NULL == buf || length <= 0)
+   {
+      return 0;
+   }
+
+   bytes = min(length, buf->_size);
+
+   buf->_endIndex = (buf->_endIndex - bytes + buf->_capacity) % buf->_capacity;
+   buf->_size -= bytes;
+
+   return bytes;
+}
+
+/******************************************************************************
+ *
+ * Function: circular_buffer_resize()
+ * Purpose:  Changes the capacity of a circular buffer, preserving its
+ *           contents (which move to the start of the new storage).
+ *
+ *           Fails if the buffer holds more than capacity bytes.  Must not
+ *           be called while the buffer is in use elsewhere.
+ *
+ * Parameters:
+ *
+ * - IN:     capacity (the new capacity).
+ * - OUT:    N/A
+ * - IN/OUT: buf (the circular buffer to use).
+ *
+ * Returns:  0 on success, -1 on failure (buffer unchanged).
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_resize(
+   struct circular_buffer* buf,
+   const int capacity)
+{
+   char* data;
+   int size;
+
+   if (NULL == buf || capacity <= 0 || capacity < buf->_size)
+   {
+      return -1;
+   }
+
+   data = vmalloc(capacity);
+
+   if (NULL == data)
+   {
+      return -1;
+   }
+
+   size = buf->_size;
+
+   circular_buffer_read(buf, data, size);
+
+   vfree(buf->_data);
+
+   buf->_data		= data;
+   buf->_capacity	= capacity;
+   buf->_size		= size;
+   buf->_beginIndex	= 0;
+   buf->_endIndex	= (size == capacity) ? 0 : size;
+
+   return 0;
+}
+
 /******************************************************************************
  *
  * Function: circular_buffer_print_state()
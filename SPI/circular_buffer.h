@@ -5,8 +5,8 @@
  * Module Name: circular_buffer
  *
  * Purpose:     Provides a simple circular buffer, initialised to _capacity
- *              bytes.  Note writes will fail if asked to add more than
- *              (_capacity - _size) bytes.
+ *              bytes of vmalloc() memory.  Note writes will fail if asked to
+ *              add more than (_capacity - _size) bytes.
  *
  * ***************************************************************************/
 
@@ -14,6 +14,8 @@
 #ifndef CIRCULAR_BUFFER_H
 #define CIRCULAR_BUFFER_H
 
+#include "spi_compat.h"
+
 /* The circular buffer structure */
 
 struct circular_buffer
@@ -171,6 +173,65 @@ const int circular_buffer_read_user(
    char* data,
    const int length);
 
+#if SPIMOD_HAVE_READ_ITER
+
+/******************************************************************************
+ *
+ * Function: circular_buffer_write_iter()
+ * Purpose:  Writes bytes to the circular buffer from an iterator, such as
+ *           the segments of a writev().  Unlike the other writes, writes
+ *           as much as fits rather than nothing if not all of it does.
+ *
+ * Parameters:
+ *
+ * - IN:     length (the most bytes to take from the iterator).
+ * - OUT:    N/A
+ * - IN/OUT: buf (the circular buffer to use).
+ *           from (the iterator, advanced past the bytes written).
+ *
+ * Returns:  The number of bytes written to the circular buffer, short of
+ *           what fits only if the iterator faulted.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_write_iter(
+   struct circular_buffer* buf,
+   struct iov_iter* from,
+   const int length);
+
+/******************************************************************************
+ *
+ * Function: circular_buffer_read_iter()
+ * Purpose:  As circular_buffer_read() but reads into an iterator, such as
+ *           the segments of a readv().
+ *
+ * Parameters:
+ *
+ * - IN:     length (the most bytes to read).
+ * - OUT:    N/A
+ * - IN/OUT: buf (the circular buffer to use).
+ *           to (the iterator, advanced past the bytes read).
+ *
+ * Returns:  The number of bytes read from the circular buffer, short of
+ *           what was available only if the iterator faulted.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_read_iter(
+   struct circular_buffer* buf,
+   struct iov_iter* to,
+   const int length);
+
+#endif
+
 /******************************************************************************
  *
  * Function: circular_buffer_num_bytes_available()
@@ -217,6 +278,136 @@ const int circular_buffer_num_bytes_available(
 void circular_buffer_reset(
    struct circular_buffer* buf);
 
+/******************************************************************************
+ *
+ * Function: circular_buffer_peek()
+ * Purpose:  Copies length bytes starting offset bytes into the circular
+ *           buffer, without removing them.
+ *
+ * Parameters:
+ *
+ * - IN:     buf (the circular buffer to use).
+ *           offset (bytes from the oldest byte).
+ *           length (size of the byte array).
+ * - OUT:    data (byte array).
+ * - IN/OUT: N/A
+ *
+ * Returns:  length, or 0 if fewer than offset + length bytes are held.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_peek(
+   const struct circular_buffer* buf,
+   const int offset,
+   char* data,
+   const int length);
+
+/******************************************************************************
+ *
+ * Function: circular_buffer_poke()
+ * Purpose:  Overwrites length bytes already held in the circular buffer,
+ *           starting offset bytes in.  The size is unchanged.
+ *
+ * Parameters:
+ *
+ * - IN:     offset (bytes from the oldest byte).
+ *           data (byte array).
+ *           length (size of the byte array).
+ * - OUT:    N/A
+ * - IN/OUT: buf (the circular buffer to use).
+ *
+ * Returns:  length, or 0 if fewer than offset + length bytes are held.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_poke(
+   struct circular_buffer* buf,
+   const int offset,
+   const char* data,
+   const int length);
+
+/******************************************************************************
+ *
+ * Function: circular_buffer_discard()
+ * Purpose:  Removes up to length of the oldest bytes without copying them.
+ *
+ * Parameters:
+ *
+ * - IN:     length (number of bytes to remove).
+ * - OUT:    N/A
+ * - IN/OUT: buf (the circular buffer to use).
+ *
+ * Returns:  The number of bytes removed.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_discard(
+   struct circular_buffer* buf,
+   const int length);
+
+/******************************************************************************
+ *
+ * Function: circular_buffer_unwrite()
+ * Purpose:  Removes up to length of the newest bytes, undoing earlier
+ *           writes.
+ *
+ * Parameters:
+ *
+ * - IN:     length (number of bytes to remove).
+ * - OUT:    N/A
+ * - IN/OUT: buf (the circular buffer to use).
+ *
+ * Returns:  The number of bytes removed.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_unwrite(
+   struct circular_buffer* buf,
+   const int length);
+
+/******************************************************************************
+ *
+ * Function: circular_buffer_resize()
+ * Purpose:  Changes the capacity of a circular buffer, preserving its
+ *           contents (which move to the start of the new storage).
+ *
+ *           Fails if the buffer holds more than capacity bytes.  Must not
+ *           be called while the buffer is in use elsewhere.
+ *
+ * Parameters:
+ *
+ * - IN:     capacity (the new capacity).
+ * - OUT:    N/A
+ * - IN/OUT: buf (the circular buffer to use).
+ *
+ * Returns:  0 on success, -1 on failure (buffer unchanged).
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+const int circular_buffer_resize(
+   struct circular_buffer* buf,
+   const int capacity);
+
 /******************************************************************************
  *
  * Function: circular_buffer_print_state()
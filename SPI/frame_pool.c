@@ -0,0 +1,272 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: frame_pool
+ *
+ * Purpose:     Provides a fixed pool of cache line aligned frames, see
+ *              frame_pool.h.  Free frames are kept on a singly linked list
+ *              threaded through their first bytes.
+ *
+ * ***************************************************************************/
+
+#include "frame_pool.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/cache.h>
+#include <linux/dma-mapping.h>
+
+#define __NO_VERSION__
+
+/******************************************************************************
+ *
+ * Function: frame_pool_init()
+ * Purpose:  Initialises a new pool of count frames of at least frameSize
+ *           bytes, all zeroed.
+ *
+ * Parameters:
+ *
+ * - IN:     dmaDevice (device to allocate DMA-coherent frames for, or NULL
+ *           for kmalloc() frames).
+ *           count (number of frames).
+ *           frameSize (minimum size of each frame).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  An initialised frame pool, or NULL.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+struct frame_pool* frame_pool_init(
+   struct device* dmaDevice,
+   const int count,
+   const int frameSize)
+{
+   struct frame_pool* pool = NULL;
+   size_t size;
+   int i;
+
+   if (count <= 0 || frameSize <= 0)
+   {
+      return NULL;
+   }
+
+   pool = kzalloc(sizeof(struct frame_pool), GFP_KERNEL);
+
+   if (NULL == pool)
+   {
+      return NULL;
+   }
+
+   pool->_stride = L1_CACHE_ALIGN(max_t(int, frameSize, sizeof(void*)));
+   pool->_count = count;
+
+   size = (size_t)pool->_stride * count;
+
+   if (dmaDevice != NULL)
+   {
+      pool->_block = dma_alloc_coherent(dmaDevice,
+                                        size,
+                                        &pool->_blockDma,
+                                        GFP_KERNEL);
+
+      pool->_dmaDevice = dmaDevice;
+   }
+   else
+   {
+      pool->_block = kmalloc(size, GFP_KERNEL);
+   }
+
+   if (NULL == pool->_block)
+   {
+      kfree(pool);
+
+      return NULL;
+   }
+
+   memset(pool->_block, 0, size);
+
+   spin_lock_init(&pool->_lock);
+
+   // Thread the free list through the frames, first frame at the head
+
+   for (i = count - 1; i >= 0; --i)
+   {
+      void* frame = pool->_block + (size_t)i * pool->_stride;
+
+      *(void**)frame = pool->_freeList;
+
+      pool->_freeList = frame;
+   }
+
+   pool->_available = count;
+   pool->_lowWater = count;
+
+   return pool;
+}
+
+/******************************************************************************
+ *
+ * Function: frame_pool_term()
+ * Purpose:  Terminates a frame pool, freeing every frame whether or not it
+ *           has been returned.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: pool (the frame pool to terminate, may be NULL).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void frame_pool_term(
+   struct frame_pool* pool)
+{
+   if (pool != NULL)
+   {
+      if (pool->_dmaDevice != NULL)
+      {
+         dma_free_coherent(pool->_dmaDevice,
+                           (size_t)pool->_stride * pool->_count,
+                           pool->_block,
+                           pool->_blockDma);
+      }
+      else
+      {
+         kfree(pool->_block);
+      }
+
+      kfree(pool);
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: frame_pool_get()
+ * Purpose:  Takes a frame from the pool.  The frame's contents are
+ *           undefined.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: pool (the frame pool to use).
+ *
+ * Returns:  A frame, or NULL if every frame is in use.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void* frame_pool_get(
+   struct frame_pool* pool)
+{
+   unsigned long flags;
+   void* frame;
+
+   spin_lock_irqsave(&pool->_lock, flags);
+
+   frame = pool->_freeList;
+
+   if (frame != NULL)
+   {
+      pool->_freeList = *(void**)frame;
+
+      --pool->_available;
+
+      if (pool->_available < pool->_lowWater)
+      {
+         pool->_lowWater = pool->_available;
+      }
+   }
+   else
+   {
+      ++pool->_exhausted;
+   }
+
+   spin_unlock_irqrestore(&pool->_lock, flags);
+
+   return frame;
+}
+
+/******************************************************************************
+ *
+ * Function: frame_pool_put()
+ * Purpose:  Returns a frame to the pool.
+ *
+ * Parameters:
+ *
+ * - IN:     frame (a frame from frame_pool_get(), may be NULL).
+ * - OUT:    N/A
+ * - IN/OUT: pool (the frame pool to use).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void frame_pool_put(
+   struct frame_pool* pool,
+   void* frame)
+{
+   unsigned long flags;
+
+   if (NULL == frame)
+   {
+      return;
+   }
+
+   spin_lock_irqsave(&pool->_lock, flags);
+
+   *(void**)frame = pool->_freeList;
+
+   pool->_freeList = frame;
+
+   ++pool->_available;
+
+   spin_unlock_irqrestore(&pool->_lock, flags);
+}
+
+/******************************************************************************
+ *
+ * Function: frame_pool_dma()
+ * Purpose:  Returns the DMA address of a frame from a DMA-coherent pool.
+ *
+ * Parameters:
+ *
+ * - IN:     pool (the frame pool to use).
+ *           frame (a frame from the pool).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The DMA address of the frame (meaningless for kmalloc() pools).
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+dma_addr_t frame_pool_dma(
+   const struct frame_pool* pool,
+   const void* frame)
+{
+   return pool->_blockDma + ((const char*)frame - pool->_block);
+}
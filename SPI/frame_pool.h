@@ -0,0 +1,161 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: frame_pool
+ *
+ * Purpose:     Provides a fixed pool of cache line aligned frames carved from
+ *              a single allocation made at initialisation - DMA-coherent if a
+ *              DMA device is given, otherwise kmalloc()ed.  Getting and
+ *              putting a frame is O(1), never allocates and is safe from
+ *              interrupt context.  Getting a frame fails only when every
+ *              frame is in use.
+ *
+ * ***************************************************************************/
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+
+struct device;
+
+/* The frame pool structure */
+
+struct frame_pool
+{
+   spinlock_t		_lock;
+   char*		_block;
+   dma_addr_t		_blockDma;
+   struct device*	_dmaDevice;
+   void*		_freeList;
+   u32			_stride;
+   u32			_count;
+   u32			_available;
+   u32			_lowWater;
+   u32			_exhausted;
+};
+
+/******************************************************************************
+ *
+ * Function: frame_pool_init()
+ * Purpose:  Initialises a new pool of count frames of at least frameSize
+ *           bytes, all zeroed.
+ *
+ * Parameters:
+ *
+ * - IN:     dmaDevice (device to allocate DMA-coherent frames for, or NULL
+ *           for kmalloc() frames).
+ *           count (number of frames).
+ *           frameSize (minimum size of each frame).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  An initialised frame pool, or NULL.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+struct frame_pool* frame_pool_init(
+   struct device* dmaDevice,
+   const int count,
+   const int frameSize);
+
+/******************************************************************************
+ *
+ * Function: frame_pool_term()
+ * Purpose:  Terminates a frame pool, freeing every frame whether or not it
+ *           has been returned.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: pool (the frame pool to terminate, may be NULL).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void frame_pool_term(
+   struct frame_pool* pool);
+
+/******************************************************************************
+ *
+ * Function: frame_pool_get()
+ * Purpose:  Takes a frame from the pool.  The frame's contents are
+ *           undefined.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: pool (the frame pool to use).
+ *
+ * Returns:  A frame, or NULL if every frame is in use.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void* frame_pool_get(
+   struct frame_pool* pool);
+
+/******************************************************************************
+ *
+ * Function: frame_pool_put()
+ * Purpose:  Returns a frame to the pool.
+ *
+ * Parameters:
+ *
+ * - IN:     frame (a frame from frame_pool_get(), may be NULL).
+ * - OUT:    N/A
+ * - IN/OUT: pool (the frame pool to use).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void frame_pool_put(
+   struct frame_pool* pool,
+   void* frame);
+
+/******************************************************************************
+ *
+ * Function: frame_pool_dma()
+ * Purpose:  Returns the DMA address of a frame from a DMA-coherent pool.
+ *
+ * Parameters:
+ *
+ * - IN:     pool (the frame pool to use).
+ *           frame (a frame from the pool).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The DMA address of the frame (meaningless for kmalloc() pools).
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+dma_addr_t frame_pool_dma(
+   const struct frame_pool* pool,
+   const void* frame);
+
+#endif
@@ -0,0 +1,573 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: kernel_shim
+ *
+ * Purpose:     User space implementation of the kernel API declared in
+ *              kernel_shim.h: a virtual clock, hrtimers fired by a single
+ *              threaded event loop, and an SPI bus completing messages
+ *              against the slave model after the time they would take on
+ *              the wire.
+ *
+ * ***************************************************************************/
+
+#include "kernel_shim.h"
+#include "../spi_slave_model.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <math.h>
+
+/* Constants */
+
+#define SHIM_MAX_TIMERS		32
+
+/* printk() */
+
+int shim_verbose = 0;
+unsigned long shim_printk_count = 0;
+
+int printk(const char* fmt, ...)
+{
+   int result = 0;
+
+   ++shim_printk_count;
+
+   if (shim_verbose)
+   {
+      va_list args;
+
+      va_start(args, fmt);
+      result = vfprintf(stderr, fmt, args);
+      va_end(args);
+   }
+
+   return result;
+}
+
+/* Inert devices, debugfs and relay */
+
+struct bus_type spi_bus_type = { "spi" };
+const struct file_operations relay_file_operations = { 0 };
+
+struct device* bus_find_device_by_name(struct bus_type* bus,
+                                       struct device* start, const char* name)
+{
+   return NULL;
+}
+
+void put_device(struct device* dev)
+{
+}
+
+struct dentry* debugfs_create_file(const char* name, umode_t mode,
+                                   struct dentry* parent, void* data,
+                                   const struct file_operations* fops)
+{
+   return NULL;
+}
+
+void debugfs_remove(struct dentry* dentry)
+{
+}
+
+struct dentry* debugfs_create_u32(const char* name, umode_t mode,
+                                  struct dentry* parent, u32* value)
+{
+   return NULL;
+}
+
+struct dentry* debugfs_create_x32(const char* name, umode_t mode,
+                                  struct dentry* parent, u32* value)
+{
+   return NULL;
+}
+
+struct dentry* debugfs_create_u64(const char* name, umode_t mode,
+                                  struct dentry* parent, u64* value)
+{
+   return NULL;
+}
+
+/* DMA */
+
+void* dma_alloc_coherent(struct device* dev, size_t size, dma_addr_t* handle,
+                         gfp_t flags)
+{
+   void* p = calloc(1, size);
+
+   *handle = (dma_addr_t)(uintptr_t)p;
+
+   return p;
+}
+
+void dma_free_coherent(struct device* dev, size_t size, void* cpu_addr,
+                       dma_addr_t handle)
+{
+   free(cpu_addr);
+}
+
+struct rchan* relay_open(const char* base, struct dentry* parent,
+                         size_t subbuf_size, size_t n_subbufs,
+                         struct rchan_callbacks* cb, void* data)
+{
+   return NULL;
+}
+
+void relay_close(struct rchan* chan)
+{
+}
+
+void* relay_reserve(struct rchan* chan, size_t length)
+{
+   return NULL;
+}
+
+int relay_buf_full(struct rchan_buf* buf)
+{
+   return 0;
+}
+
+/* Iterators */
+
+void iov_iter_kvec(struct iov_iter* i, unsigned int direction,
+                   const struct kvec* kvec, unsigned long nr_segs,
+                   size_t count)
+{
+   i->kvec = kvec;
+   i->nr_segs = nr_segs;
+   i->iov_offset = 0;
+   i->count = count;
+}
+
+static size_t shim_iter_copy(struct iov_iter* i, char* addr, size_t bytes,
+                             const int toIter)
+{
+   size_t done = 0;
+
+   bytes = (bytes < i->count) ? bytes : i->count;
+
+   while (done < bytes)
+   {
+      char* base = (char*)i->kvec->iov_base + i->iov_offset;
+      size_t n = i->kvec->iov_len - i->iov_offset;
+
+      n = (n < bytes - done) ? n : bytes - done;
+
+      if (toIter)
+      {
+         memcpy(base, addr + done, n);
+      }
+      else
+      {
+         memcpy(addr + done, base, n);
+      }
+
+      done += n;
+      i->count -= n;
+      i->iov_offset += n;
+
+      if (i->iov_offset == i->kvec->iov_len)
+      {
+         ++i->kvec;
+         --i->nr_segs;
+         i->iov_offset = 0;
+      }
+   }
+
+   return done;
+}
+
+size_t copy_from_iter(void* addr, size_t bytes, struct iov_iter* i)
+{
+   return shim_iter_copy(i, addr, bytes, 0);
+}
+
+size_t copy_to_iter(const void* addr, size_t bytes, struct iov_iter* i)
+{
+   return shim_iter_copy(i, (char*)addr, bytes, 1);
+}
+
+/* Pages */
+
+int pin_user_pages_fast(unsigned long start, int nr_pages,
+                        unsigned int gup_flags, struct page** pages)
+{
+   int i;
+
+   for (i = 0; i < nr_pages; ++i)
+   {
+      pages[i] = (struct page*)(start + i * PAGE_SIZE);
+   }
+
+   return nr_pages;
+}
+
+/* Virtual time and hrtimers */
+
+static ktime_t shim_now = 0;
+static struct hrtimer* shim_timers[SHIM_MAX_TIMERS];
+static int shim_num_timers = 0;
+
+ktime_t ktime_get(void)
+{
+   return shim_now;
+}
+
+void hrtimer_init(struct hrtimer* timer, clockid_t clock,
+                  enum hrtimer_mode mode)
+{
+   int i;
+
+   memset(timer, 0, sizeof(struct hrtimer));
+
+   for (i = 0; i < shim_num_timers; ++i)
+   {
+      if (shim_timers[i] == timer)
+      {
+         return;
+      }
+   }
+
+   if (shim_num_timers < SHIM_MAX_TIMERS)
+   {
+      shim_timers[shim_num_timers++] = timer;
+   }
+}
+
+int hrtimer_start(struct hrtimer* timer, ktime_t tim,
+                  const enum hrtimer_mode mode)
+{
+   int wasActive = timer->_active;
+
+   timer->_expires = (HRTIMER_MODE_REL == mode) ? shim_now + tim : tim;
+   timer->_active = 1;
+
+   return wasActive;
+}
+
+int hrtimer_cancel(struct hrtimer* timer)
+{
+   int wasActive = timer->_active;
+
+   timer->_active = 0;
+
+   return wasActive;
+}
+
+/* Callbacks run to completion, so a timer is never caught in one */
+
+int hrtimer_try_to_cancel(struct hrtimer* timer)
+{
+   return hrtimer_cancel(timer);
+}
+
+u64 hrtimer_forward_now(struct hrtimer* timer, ktime_t interval)
+{
+   u64 overruns;
+
+   if (interval <= 0 || timer->_expires > shim_now)
+   {
+      return 0;
+   }
+
+   overruns = (shim_now - timer->_expires) / interval + 1;
+
+   timer->_expires += overruns * interval;
+
+   return overruns;
+}
+
+unsigned long shim_run_until(const ktime_t end)
+{
+   unsigned long callbacks = 0;
+
+   for (;;)
+   {
+      struct hrtimer* next = NULL;
+      int i;
+
+      for (i = 0; i < shim_num_timers; ++i)
+      {
+         struct hrtimer* timer = shim_timers[i];
+
+         if (timer->_active
+          && (NULL == next || timer->_expires < next->_expires))
+         {
+            next = timer;
+         }
+      }
+
+      if (NULL == next || next->_expires > end)
+      {
+         shim_now = end;
+
+         return callbacks;
+      }
+
+      shim_now = next->_expires;
+
+      next->_active = 0;
+
+      if (HRTIMER_RESTART == next->function(next))
+      {
+         next->_active = 1;
+      }
+
+      ++callbacks;
+   }
+}
+
+/* crc32c(), slice-by-8 like the kernel's generic implementation: eight
+   tables let the loop consume eight bytes per step */
+
+#define CRC32C_POLY		0x82F63B78u
+
+static u32 crc32c_table[8][256];
+
+static void crc32c_init(void)
+{
+   u32 i, t;
+
+   for (i = 0; i < 256; ++i)
+   {
+      u32 crc = i;
+      int bit;
+
+      for (bit = 0; bit < 8; ++bit)
+      {
+         crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+      }
+
+      crc32c_table[0][i] = crc;
+   }
+
+   for (i = 0; i < 256; ++i)
+   {
+      for (t = 1; t < 8; ++t)
+      {
+         u32 prev = crc32c_table[t - 1][i];
+
+         crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+      }
+   }
+}
+
+u32 crc32c(u32 crc, const void* data, unsigned int len)
+{
+   const u8* p = data;
+
+   if (0 == crc32c_table[0][1])
+   {
+      crc32c_init();
+   }
+
+   for (; len >= 8; len -= 8, p += 8)
+   {
+      u32 lo, hi;
+
+      memcpy(&lo, p, 4);
+      memcpy(&hi, p + 4, 4);
+
+      lo ^= crc;
+
+      crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF]
+          ^ crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24]
+          ^ crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF]
+          ^ crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+   }
+
+   for (; len > 0; --len)
+   {
+      crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+   }
+
+   return crc;
+}
+
+/* The simulated bus */
+
+static struct
+{
+   struct hrtimer		_timer;
+   struct list_head		_queue;
+   struct spimod_slave*		_slave;
+   u32				_clockHz;
+   u32				_latencyNs;
+   u32				_wordGapNs;
+   // Bit errors: a fixed seed keeps runs deterministic
+   double			_bitErrorRate;
+   u64				_nextError;
+   u64				_random;
+   u8				_tx[4096];
+} shim_bus;
+
+unsigned long shim_bit_errors = 0;
+
+static u64 shim_random(void)
+{
+   // xorshift64
+
+   shim_bus._random ^= shim_bus._random << 13;
+   shim_bus._random ^= shim_bus._random >> 7;
+   shim_bus._random ^= shim_bus._random << 17;
+
+   return shim_bus._random;
+}
+
+static void shim_bus_next_error(void)
+{
+   // Bits to the next error are geometrically distributed
+
+   double u = (shim_random() >> 11) * (1.0 / 9007199254740992.0);
+
+   shim_bus._nextError = (u64)(log1p(-u) / log1p(-shim_bus._bitErrorRate));
+}
+
+static void shim_bus_corrupt(u8* buf, const u32 len)
+{
+   u64 bits = (u64)len * 8;
+   u64 pos = 0;
+
+   if (shim_bus._bitErrorRate <= 0.0 || NULL == buf)
+   {
+      return;
+   }
+
+   while (pos + shim_bus._nextError < bits)
+   {
+      pos += shim_bus._nextError;
+
+      buf[pos / 8] ^= 1 << (pos % 8);
+
+      ++shim_bit_errors;
+      ++pos;
+
+      shim_bus_next_error();
+   }
+
+   shim_bus._nextError -= bits - pos;
+}
+
+static ktime_t shim_bus_duration(struct spi_message* msg)
+{
+   struct spi_transfer* xfer;
+   ktime_t ns = shim_bus._latencyNs;
+
+   list_for_each_entry(xfer, &msg->transfers, transfer_list)
+   {
+      u32 hz = shim_bus._clockHz ? shim_bus._clockHz : msg->spi->max_speed_hz;
+      u32 bits = xfer->bits_per_word ? xfer->bits_per_word
+                                     : msg->spi->bits_per_word;
+
+      ns += (ktime_t)xfer->len * 8 * NSEC_PER_SEC / hz;
+      ns += (ktime_t)(xfer->len / (bits > 8 ? bits / 8 : 1)) * shim_bus._wordGapNs;
+   }
+
+   return ns;
+}
+
+static enum hrtimer_restart shim_bus_complete(struct hrtimer* timer)
+{
+   struct spi_message* msg;
+   struct spi_transfer* xfer;
+
+   msg = list_first_entry(&shim_bus._queue, struct spi_message, queue);
+
+   list_del_init(&msg->queue);
+
+   list_for_each_entry(xfer, &msg->transfers, transfer_list)
+   {
+      const void* tx = xfer->tx_buf;
+
+      if (shim_bus._bitErrorRate > 0.0 && tx != NULL
+       && xfer->len <= sizeof(shim_bus._tx))
+      {
+         memcpy(shim_bus._tx, tx, xfer->len);
+
+         shim_bus_corrupt(shim_bus._tx, xfer->len);
+
+         tx = shim_bus._tx;
+      }
+
+      spimod_slave_transfer(shim_bus._slave, tx, xfer->rx_buf, xfer->len);
+
+      shim_bus_corrupt(xfer->rx_buf, xfer->len);
+
+      msg->actual_length += xfer->len;
+   }
+
+   msg->status = 0;
+
+   if (msg->complete)
+   {
+      msg->complete(msg->context);
+   }
+
+   if (list_empty(&shim_bus._queue))
+   {
+      return HRTIMER_NORESTART;
+   }
+
+   msg = list_first_entry(&shim_bus._queue, struct spi_message, queue);
+
+   hrtimer_forward_now(timer, shim_bus_duration(msg));
+
+   return HRTIMER_RESTART;
+}
+
+void shim_bus_init(struct spimod_slave* slave, const u32 clockHz,
+                   const u32 latencyNs)
+{
+   hrtimer_init(&shim_bus._timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+
+   shim_bus._timer.function = shim_bus_complete;
+
+   INIT_LIST_HEAD(&shim_bus._queue);
+
+   shim_bus._slave = slave;
+   shim_bus._clockHz = clockHz;
+   shim_bus._latencyNs = latencyNs;
+}
+
+void shim_bus_set_word_gap(const u32 wordGapNs)
+{
+   shim_bus._wordGapNs = wordGapNs;
+}
+
+void shim_bus_set_bit_error_rate(const double bitErrorRate)
+{
+   shim_bus._bitErrorRate = bitErrorRate;
+   shim_bus._random = 0x9E3779B97F4A7C15ULL;
+
+   if (bitErrorRate > 0.0)
+   {
+      shim_bus_next_error();
+   }
+}
+
+int spi_setup(struct spi_device* spi)
+{
+   return 0;
+}
+
+int spi_async(struct spi_device* spi, struct spi_message* message)
+{
+   int idle = list_empty(&shim_bus._queue);
+
+   message->spi = spi;
+   message->actual_length = 0;
+   message->status = -EINPROGRESS;
+
+   list_add_tail(&message->queue, &shim_bus._queue);
+
+   if (idle)
+   {
+      hrtimer_start(&shim_bus._timer,
+                    shim_bus_duration(message),
+                    HRTIMER_MODE_REL);
+   }
+
+   return 0;
+}
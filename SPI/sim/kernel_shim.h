@@ -0,0 +1,488 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: kernel_shim
+ *
+ * Purpose:     Just enough of the kernel API for the driver's protocol core
+ *              (circular_buffer.c, spi_protocol.c, spi_capture.c and
+ *              spi_slave_model.c) to be compiled and run in user space.
+ *
+ *              Memory comes from malloc(), user copies are memcpy(), locks
+ *              are no-ops (the simulation is single threaded) and time is
+ *              a virtual clock advanced by the event loop in kernel_shim.c:
+ *              hrtimers and SPI transfers complete in virtual time.
+ *
+ * ***************************************************************************/
+
+#ifndef KERNEL_SHIM_H
+#define KERNEL_SHIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <linux/types.h>
+
+#define ERESTARTSYS			512
+
+/* Types (__u8 and friends come from the system's <linux/types.h>) */
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+typedef unsigned int gfp_t;
+typedef unsigned short umode_t;
+typedef u64 dma_addr_t;
+typedef s64 ktime_t;
+typedef int clockid_t;
+
+/* Compiler and module annotations */
+
+#define LINUX_VERSION_CODE		KERNEL_VERSION(6, 6, 0)
+#define KERNEL_VERSION(a, b, c)		(((a) << 16) + ((b) << 8) + (c))
+
+#define __user
+#define __init
+#define __exit
+#define likely(x)			__builtin_expect(!!(x), 1)
+#define unlikely(x)			__builtin_expect(!!(x), 0)
+#define READ_ONCE(x)			(*(volatile __typeof__(x)*)&(x))
+#define WRITE_ONCE(x, val)		(*(volatile __typeof__(x)*)&(x) = (val))
+
+#define THIS_MODULE			NULL
+#define EXPORT_SYMBOL(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_LICENSE(x)
+#define MODULE_VERSION(x)
+#define MODULE_PARM_DESC(n, d)
+#define module_param(n, t, p)		static void* __shim_param_##n \
+						__attribute__((unused)) = &n
+#define module_param_named(a, n, t, p)	static void* __shim_param_##a \
+						__attribute__((unused)) = &n
+
+/* Kernel utilities */
+
+#define min(a, b)			((a) < (b) ? (a) : (b))
+#define max(a, b)			((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)			min((t)(a), (t)(b))
+#define max_t(t, a, b)			max((t)(a), (t)(b))
+#define clamp_t(t, v, lo, hi)		min_t(t, max_t(t, v, lo), hi)
+#define ARRAY_SIZE(a)			(sizeof(a) / sizeof((a)[0]))
+#define container_of(p, t, m)		((t*)((char*)(p) - offsetof(t, m)))
+#define IS_ERR_OR_NULL(p)		((p) == NULL)
+#define IS_ERR(p)			0
+#define ALIGN(x, a)			(((x) + (a) - 1) & ~((a) - 1))
+#define L1_CACHE_BYTES			64
+#define L1_CACHE_ALIGN(x)		ALIGN(x, L1_CACHE_BYTES)
+
+#define NSEC_PER_USEC			1000L
+#define NSEC_PER_MSEC			1000000L
+#define NSEC_PER_SEC			1000000000L
+
+#define do_div(n, base)			({ u32 __rem = (n) % (base); \
+					   (n) /= (base); __rem; })
+
+static inline u64 div_u64(u64 dividend, u32 divisor)
+{
+   return dividend / divisor;
+}
+
+/* printk() is counted, and only printed when shim_verbose is set */
+
+#define KERN_ALERT			""
+#define KERN_NOTICE			""
+#define KERN_INFO			""
+
+extern int shim_verbose;
+extern unsigned long shim_printk_count;
+
+int printk(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* CRC-32C (Castagnoli), as lib/crc32.c: no pre or post inversion */
+
+u32 crc32c(u32 crc, const void* data, unsigned int len);
+
+/* Memory */
+
+#define GFP_KERNEL			0x01u
+#define GFP_DMA				0x02u
+#define GFP_ATOMIC			0x04u
+
+static inline void* kmalloc(size_t size, gfp_t flags)
+{
+   return malloc(size);
+}
+
+static inline void* kzalloc(size_t size, gfp_t flags)
+{
+   return calloc(1, size);
+}
+
+static inline void kfree(const void* p)
+{
+   free((void*)p);
+}
+
+static inline void* vmalloc(unsigned long size)
+{
+   return malloc(size);
+}
+
+static inline void vfree(const void* p)
+{
+   free((void*)p);
+}
+
+static inline unsigned long copy_from_user(void* to, const void* from,
+                                           unsigned long n)
+{
+   memcpy(to, from, n);
+   return 0;
+}
+
+static inline unsigned long copy_to_user(void* to, const void* from,
+                                         unsigned long n)
+{
+   memcpy(to, from, n);
+   return 0;
+}
+
+#define get_user(x, p)			({ (x) = *(p); 0; })
+#define put_user(x, p)			({ *(p) = (x); 0; })
+
+/* <linux/mm.h> and <linux/highmem.h>: user memory is ordinary memory, so
+   a page is its address, pinning it is a no-op and so is mapping it */
+
+#define PAGE_SHIFT			12
+#define PAGE_SIZE			(1UL << PAGE_SHIFT)
+
+#define offset_in_page(p)		((unsigned long)(p) & (PAGE_SIZE - 1))
+
+struct page;
+
+int pin_user_pages_fast(unsigned long start, int nr_pages,
+                        unsigned int gup_flags, struct page** pages);
+
+static inline void unpin_user_pages(struct page** pages, unsigned long npages)
+{
+}
+
+#define kmap_local_page(page)		((void*)(page))
+#define kunmap_local(addr)		((void)(addr))
+
+/* <linux/uio.h>: iterators over kernel memory (iov_iter_kvec()) only,
+   which is all the simulation and the tests need */
+
+struct kvec
+{
+   void*			iov_base;
+   size_t			iov_len;
+};
+
+struct iov_iter
+{
+   const struct kvec*		kvec;
+   unsigned long		nr_segs;
+   size_t			iov_offset;
+   size_t			count;
+};
+
+#define READ				0
+#define WRITE				1
+#define ITER_DEST			READ
+#define ITER_SOURCE			WRITE
+
+void iov_iter_kvec(struct iov_iter* i, unsigned int direction,
+                   const struct kvec* kvec, unsigned long nr_segs,
+                   size_t count);
+size_t copy_from_iter(void* addr, size_t bytes, struct iov_iter* i);
+size_t copy_to_iter(const void* addr, size_t bytes, struct iov_iter* i);
+
+static inline size_t iov_iter_count(const struct iov_iter* i)
+{
+   return i->count;
+}
+
+/* Locking - the simulation is single threaded */
+
+typedef struct { int _unused; } spinlock_t;
+
+struct semaphore { int _count; };
+
+#define spin_lock_init(l)		((void)(l))
+#define spin_lock_irqsave(l, f)		((void)(l), (f) = 0)
+#define spin_unlock_irqrestore(l, f)	((void)(l), (void)(f))
+#define local_irq_save(f)		((f) = 0)
+#define local_irq_restore(f)		((void)(f))
+
+#define sema_init(s, n)			((s)->_count = (n))
+#define down(s)				((void)(s))
+#define down_interruptible(s)		0
+#define up(s)				((void)(s))
+
+/* Wait queues - nothing ever sleeps in the simulation */
+
+typedef struct { int _unused; } wait_queue_head_t;
+
+#define init_waitqueue_head(q)		((void)(q))
+#define wake_up_interruptible(q)	((void)(q))
+
+typedef struct { int counter; } atomic_t;
+
+#define atomic_read(a)			((a)->counter)
+#define atomic_set(a, v)		((a)->counter = (v))
+#define atomic_inc(a)			((a)->counter++)
+#define atomic_dec(a)			((a)->counter--)
+
+typedef struct { long long counter; } atomic64_t;
+
+#define atomic64_read(a)		((a)->counter)
+#define atomic64_set(a, v)		((a)->counter = (v))
+#define atomic64_add(i, a)		((a)->counter += (i))
+#define atomic64_add_return(i, a)	((a)->counter += (i))
+
+/* Lists */
+
+struct list_head
+{
+   struct list_head* next;
+   struct list_head* prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head* list)
+{
+   list->next = list;
+   list->prev = list;
+}
+
+static inline void list_add_tail(struct list_head* item, struct list_head* head)
+{
+   item->prev = head->prev;
+   item->next = head;
+   head->prev->next = item;
+   head->prev = item;
+}
+
+static inline void list_del_init(struct list_head* item)
+{
+   item->prev->next = item->next;
+   item->next->prev = item->prev;
+
+   INIT_LIST_HEAD(item);
+}
+
+static inline int list_empty(const struct list_head* head)
+{
+   return head->next == head;
+}
+
+#define list_first_entry(h, t, m)	container_of((h)->next, t, m)
+
+#define list_for_each_entry(p, h, m) \
+   for (p = container_of((h)->next, __typeof__(*p), m); \
+        &p->m != (h); \
+        p = container_of(p->m.next, __typeof__(*p), m))
+
+/* Virtual time and hrtimers */
+
+enum hrtimer_restart { HRTIMER_NORESTART, HRTIMER_RESTART };
+enum hrtimer_mode { HRTIMER_MODE_ABS, HRTIMER_MODE_REL };
+
+#define CLOCK_MONOTONIC			1
+
+/* Work queues - the simulation never defers work, what is scheduled is
+   run there and then */
+
+struct work_struct { void (*func)(struct work_struct*); };
+struct delayed_work { struct work_struct work; };
+
+#define INIT_WORK(w, f)			((w)->func = (f))
+
+static inline int schedule_work(struct work_struct* work)
+{
+   work->func(work);
+
+   return 1;
+}
+
+struct hrtimer
+{
+   enum hrtimer_restart		(*function)(struct hrtimer*);
+   ktime_t			_expires;
+   int				_active;
+};
+
+static inline ktime_t ktime_set(const s64 secs, const unsigned long nsecs)
+{
+   return secs * NSEC_PER_SEC + nsecs;
+}
+
+#define ktime_to_ns(kt)			((s64)(kt))
+#define ns_to_ktime(ns)			((ktime_t)(ns))
+
+ktime_t ktime_get(void);
+
+#define ktime_get_real()		ktime_get()
+
+void hrtimer_init(struct hrtimer* timer, clockid_t clock,
+                  enum hrtimer_mode mode);
+int hrtimer_start(struct hrtimer* timer, ktime_t tim,
+                  const enum hrtimer_mode mode);
+int hrtimer_cancel(struct hrtimer* timer);
+int hrtimer_try_to_cancel(struct hrtimer* timer);
+u64 hrtimer_forward_now(struct hrtimer* timer, ktime_t interval);
+
+/* Devices, debugfs and relay - present but inert */
+
+struct module;
+struct dentry;
+struct rchan;
+struct rchan_buf;
+struct file_operations { int _unused; };
+struct cdev { int _unused; };
+struct class;
+struct device_driver { const char* name; };
+struct bus_type { const char* name; };
+struct device { struct device* parent; struct device_driver* driver; };
+
+extern struct bus_type spi_bus_type;
+extern const struct file_operations relay_file_operations;
+
+struct rchan_callbacks
+{
+   int (*subbuf_start)(struct rchan_buf*, void*, void*, size_t);
+   struct dentry* (*create_buf_file)(const char*, struct dentry*, umode_t,
+                                     struct rchan_buf*, int*);
+   int (*remove_buf_file)(struct dentry*);
+};
+
+#define DEFINE_SIMPLE_ATTRIBUTE(n, get, set, fmt) \
+   static const struct file_operations n __attribute__((unused)) = { 0 }; \
+   static void* __shim_attr_##n[] __attribute__((unused)) = \
+      { (void*)get, (void*)set }
+
+struct device* bus_find_device_by_name(struct bus_type* bus,
+                                       struct device* start, const char* name);
+void put_device(struct device* dev);
+struct dentry* debugfs_create_file(const char* name, umode_t mode,
+                                   struct dentry* parent, void* data,
+                                   const struct file_operations* fops);
+void debugfs_remove(struct dentry* dentry);
+struct dentry* debugfs_create_u32(const char* name, umode_t mode,
+                                  struct dentry* parent, u32* value);
+struct dentry* debugfs_create_x32(const char* name, umode_t mode,
+                                  struct dentry* parent, u32* value);
+struct dentry* debugfs_create_u64(const char* name, umode_t mode,
+                                  struct dentry* parent, u64* value);
+struct rchan* relay_open(const char* base, struct dentry* parent,
+                         size_t subbuf_size, size_t n_subbufs,
+                         struct rchan_callbacks* cb, void* data);
+void relay_close(struct rchan* chan);
+void* relay_reserve(struct rchan* chan, size_t length);
+int relay_buf_full(struct rchan_buf* buf);
+
+/* DMA - coherent memory is ordinary memory, addressed by its pointer */
+
+void* dma_alloc_coherent(struct device* dev, size_t size, dma_addr_t* handle,
+                         gfp_t flags);
+void dma_free_coherent(struct device* dev, size_t size, void* cpu_addr,
+                       dma_addr_t handle);
+
+/* SPI - transfers complete in virtual time against the simulated slave */
+
+struct spi_controller
+{
+   struct device		dev;
+};
+
+#define SPI_MODE_0			0
+#define SPI_CPHA			0x01
+#define SPI_CPOL			0x02
+
+struct spi_device
+{
+   struct device		dev;
+   struct spi_controller*	controller;
+   u32				max_speed_hz;
+   u8				chip_select;
+   u8				mode;
+   u8				bits_per_word;
+};
+
+struct spi_transfer
+{
+   const void*			tx_buf;
+   void*			rx_buf;
+   unsigned			len;
+   dma_addr_t			tx_dma;
+   dma_addr_t			rx_dma;
+   u8				bits_per_word;
+   u32				speed_hz;
+   struct list_head		transfer_list;
+};
+
+struct spi_message
+{
+   struct list_head		transfers;
+   struct spi_device*		spi;
+   unsigned			is_dma_mapped:1;
+   void				(*complete)(void* context);
+   void*			context;
+   unsigned			actual_length;
+   int				status;
+   struct list_head		queue;
+};
+
+static inline void spi_message_init(struct spi_message* m)
+{
+   memset(m, 0, sizeof(*m));
+
+   INIT_LIST_HEAD(&m->transfers);
+}
+
+static inline void spi_message_add_tail(struct spi_transfer* t,
+                                        struct spi_message* m)
+{
+   list_add_tail(&t->transfer_list, &m->transfers);
+}
+
+int spi_setup(struct spi_device* spi);
+int spi_async(struct spi_device* spi, struct spi_message* message);
+
+/* The simulated bus: clock, per-message latency and the slave behind it */
+
+struct spimod_slave;
+
+void shim_bus_init(struct spimod_slave* slave, const u32 clockHz,
+                   const u32 latencyNs);
+
+/* Adds wordGapNs per word to every transfer, as a controller moving each
+   word through its FIFO would, so wider words transfer faster */
+
+void shim_bus_set_word_gap(const u32 wordGapNs);
+
+/* Flips bits on the wire, in both directions, at random with probability
+   bitErrorRate per bit.  Counts them in shim_bit_errors. */
+
+extern unsigned long shim_bit_errors;
+
+void shim_bus_set_bit_error_rate(const double bitErrorRate);
+
+/* The event loop: fires hrtimers in expiry order until the virtual clock
+   passes end.  Returns the number of timer callbacks run. */
+
+unsigned long shim_run_until(const ktime_t end);
+
+#endif
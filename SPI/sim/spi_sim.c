@@ -0,0 +1,1005 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_sim
+ *
+ * Purpose:     Deterministic user space simulation of the driver's pump.
+ *              The real circular_buffer.c, spi_protocol.c and
+ *              spi_slave_model.c run against kernel_shim.c on a virtual
+ *              clock, with a simulated application writing timestamped
+ *              messages and reading them back from an echoing slave.
+ *
+ *              With -n the messages use channel 0 while every other channel
+ *              is kept saturated with bulk data, and with -u the
+ *              application also sends priority messages on channel 0.  -e
+ *              flips bits on the wire at the given rate, -k protects the
+ *              packets with a CRC so the damaged ones are discarded, -q
+ *              resends those with a retransmission window of that many
+ *              packets, and -f repairs them with forward error correction of
+ *              that many bytes per codeword.  -w sets the bits per word and
+ *              -i the time the controller spends on each word.  -F has
+ *              both ends agree on frames of up to that many bytes at start.
+ *              -P has channels 1 and up send that many bytes at a time
+ *              from pinned pages rather than their transmit buffers, and
+ *              checks what the slave echoes back.  -I has the pump only
+ *              poll the slave's header after that many empty frames.
+ *
+ *              Reports goodput, message latency percentiles and how many
+ *              frames per second of wall clock time were simulated.
+ *
+ *              Usage: spi_sim [-d seconds] [-p pump_us] [-c clock_hz]
+ *                             [-l latency_us] [-m msg_bytes] [-r msgs_per_s]
+ *                             [-a app_poll_us] [-M echo|generator|sink] [-g]
+ *                             [-n channels] [-u priority_msgs_per_s]
+ *                             [-e bit_error_rate] [-k] [-q arq_window]
+ *                             [-f fec_bytes] [-w bits_per_word]
+ *                             [-i word_gap_ns] [-F max_frame_bytes]
+ *                             [-R slave_resets] [-P bulk_bytes]
+ *                             [-I idle_frames] [-v]
+ *
+ * ***************************************************************************/
+
+#include "kernel_shim.h"
+#include "../spi_protocol.h"
+#include "../spi_slave_model.h"
+#include "../spi_datagram.h"
+#include "../spi_priority.h"
+#include "../spi_arq.h"
+#include "../spi_fec.h"
+#include "../spi_hello.h"
+#include "../spi_bulk.h"
+#include "../spi_cursor.h"
+#include "../circular_buffer.h"
+#include "../spi4.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define LATENCY_BUCKETS		1000000		// 1 us buckets up to 1 s
+#define MAX_MSG_SIZE		4096
+
+static const int TX_BUFFER_SIZE = 1024 * 16;
+static const int RX_BUFFER_SIZE = 1024 * 64;
+static const int SLAVE_FIFO_SIZE = 1024 * 64;
+static const int ARQ_TIMEOUT = 4;
+static const int SLAVE_BOOT_FRAMES = 20;
+
+/* Globals normally defined in spi_core.c */
+
+struct spimod_device_state device_state;
+struct spimod_transaction device_transaction;
+
+/* The simulation settings */
+
+struct sim_config
+{
+   double			_seconds;
+   u32				_pumpPeriodNs;
+   u32				_clockHz;
+   u32				_bitsPerWord;
+   u32				_wordGapNs;
+   u32				_latencyNs;
+   u32				_msgSize;
+   u32				_msgRate;
+   u32				_appPeriodNs;
+   slaveModelType		_model;
+   int				_datagram;
+   u32				_channels;
+   u32				_priorityRate;
+   double			_bitErrorRate;
+   int				_crc;
+   u32				_arqWindow;
+   u32				_fec;
+   u32				_maxFrame;
+   u32				_slaveResets;
+   u32				_bulkSize;
+   u32				_idleFrames;
+};
+
+/* A latency histogram */
+
+struct sim_latency
+{
+   u32*				_buckets;
+   u64				_count;
+   u64				_overflow;
+   u64				_sumNs;
+   u64				_maxNs;
+};
+
+/* The simulated application */
+
+struct sim_app
+{
+   struct hrtimer		_timer;
+   struct sim_config*		_config;
+   struct spimod_channel*	_chan;
+   u64				_msgsDue;
+   u64				_msgsSent;
+   u64				_msgsReceived;
+   u64				_bytesOffered;
+   u64				_bytesRefused;
+   u64				_bytesReceived;
+   u64				_skipped;
+   u64				_outOfOrder;
+   u32				_nextSeq;
+   u32				_expectedSeq;
+   u32				_partialLen;
+   char				_partial[MAX_MSG_SIZE];
+   struct sim_latency		_latency;
+   u64				_prioritySent;
+   u64				_priorityRefused;
+   u64				_priorityDue;
+   struct sim_latency		_priorityLatency;
+   u64				_bulkBytesReceived;
+   char*			_bulkData;
+   u32				_bulkExpected[SPIMOD_MAX_CHANNELS];
+   u64				_bulkMismatches;
+};
+
+/* Resets of the simulated slave, spread over the run */
+
+struct sim_reset
+{
+   struct hrtimer		_timer;
+   struct spimod_slave*		_slave;
+   u64				_periodNs;
+   u32				_left;
+   u32				_done;
+};
+
+/******************************************************************************
+ *
+ * Function: sim_pump_callback()
+ * Purpose:  Mirrors spimod_timer_callback() in spi_core.c.
+ *
+ * ***************************************************************************/
+
+static enum hrtimer_restart sim_pump_callback(struct hrtimer* timer)
+{
+   ++device_state._statTimerWakeups;
+
+   if (device_state._timer_running)
+   {
+      spimod_pump();
+   }
+
+   hrtimer_forward_now(timer, spimod_pump_interval());
+
+   return HRTIMER_RESTART;
+}
+
+/******************************************************************************
+ *
+ * Function: sim_latency_add()
+ * Purpose:  Records one latency in a histogram.
+ *
+ * ***************************************************************************/
+
+static void sim_latency_add(struct sim_latency* lat, const u64 ns)
+{
+   lat->_sumNs += ns;
+
+   if (ns > lat->_maxNs)
+   {
+      lat->_maxNs = ns;
+   }
+
+   if (ns / 1000 < LATENCY_BUCKETS)
+   {
+      ++lat->_buckets[ns / 1000];
+   }
+   else
+   {
+      ++lat->_overflow;
+   }
+
+   ++lat->_count;
+}
+
+/******************************************************************************
+ *
+ * Function: sim_app_send()
+ * Purpose:  Writes one timestamped message to the transmit buffer, as
+ *           IOCTL_SEND_DATA would (in stream or datagram mode).
+ *
+ * Returns:  1 if the message was accepted, 0 if the buffer was full.
+ *
+ * ***************************************************************************/
+
+static int sim_app_send(struct sim_app* app)
+{
+   char msg[MAX_MSG_SIZE];
+   u64 now = ktime_to_ns(ktime_get());
+   u32 size = app->_config->_msgSize;
+   int n;
+
+   memset(msg, 0, size);
+   memcpy(msg, &now, sizeof(now));
+   memcpy(msg + sizeof(now), &app->_nextSeq, sizeof(app->_nextSeq));
+
+   app->_bytesOffered += size;
+
+   n = app->_config->_datagram
+          ? spimod_datagram_send_user(app->_chan, msg, size)
+          : circular_buffer_write_user(app->_chan->_txBuffer, msg, size);
+
+   if (n > 0)
+   {
+      spimod_cursor_queued(app->_chan, n);
+   }
+
+   if (n != size)
+   {
+      app->_bytesRefused += size;
+
+      return 0;
+   }
+
+   ++app->_nextSeq;
+   ++app->_msgsSent;
+
+   spimod_pump_wake();
+
+   return 1;
+}
+
+/******************************************************************************
+ *
+ * Function: sim_app_message()
+ * Purpose:  Records the sequence number and latency of an echoed message.
+ *
+ * ***************************************************************************/
+
+static void sim_app_message(struct sim_app* app, const char* msg)
+{
+   u64 sent, latency;
+   u32 seq;
+
+   memcpy(&sent, msg, sizeof(sent));
+   memcpy(&seq, msg + sizeof(sent), sizeof(seq));
+
+   // Messages lost on the way are skipped; one delivered twice or late is
+   // out of order
+
+   if ((s32)(seq - app->_expectedSeq) > 0)
+   {
+      app->_skipped += seq - app->_expectedSeq;
+   }
+   else if (seq != app->_expectedSeq)
+   {
+      ++app->_outOfOrder;
+   }
+
+   app->_expectedSeq = seq + 1;
+
+   latency = ktime_to_ns(ktime_get()) - sent;
+
+   sim_latency_add(&app->_latency, latency);
+
+   ++app->_msgsReceived;
+}
+
+/******************************************************************************
+ *
+ * Function: sim_app_receive()
+ * Purpose:  Drains the receive buffer, as IOCTL_RECEIVE_DATA would, and
+ *           reassembles echoed messages to measure their latency (in
+ *           datagram mode the driver returns them whole).
+ *
+ * ***************************************************************************/
+
+static void sim_app_receive(struct sim_app* app)
+{
+   const u32 size = app->_config->_msgSize;
+   char chunk[MAX_MSG_SIZE];
+   int n;
+
+   if (app->_config->_datagram)
+   {
+      while ((n = spimod_datagram_receive_user(app->_chan,
+                                               chunk,
+                                               sizeof(chunk))) > 0)
+      {
+         app->_bytesReceived += n;
+
+         if (app->_config->_model == SLAVE_MODEL_ECHO && n == size)
+         {
+            sim_app_message(app, chunk);
+         }
+      }
+
+      return;
+   }
+
+   while ((n = circular_buffer_read_user(app->_chan->_rxBuffer,
+                                         chunk,
+                                         PACKET_DATA_SIZE)) > 0)
+   {
+      int offset = 0;
+
+      app->_bytesReceived += n;
+
+      if (app->_config->_model != SLAVE_MODEL_ECHO)
+      {
+         continue;
+      }
+
+      while (offset < n)
+      {
+         u32 take = min_t(u32, size - app->_partialLen, n - offset);
+
+         memcpy(app->_partial + app->_partialLen, chunk + offset, take);
+
+         app->_partialLen += take;
+         offset += take;
+
+         if (app->_partialLen == size)
+         {
+            sim_app_message(app, app->_partial);
+
+            app->_partialLen = 0;
+         }
+      }
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: sim_app_priority()
+ * Purpose:  Sends the priority messages due, as IOCTL_SEND_PRIORITY would,
+ *           and receives the echoed ones to measure their latency.
+ *
+ * ***************************************************************************/
+
+static void sim_app_priority(struct sim_app* app)
+{
+   char msg[MAX_MSG_SIZE];
+   u64 now = ktime_to_ns(ktime_get());
+   u64 due = now * app->_config->_priorityRate / NSEC_PER_SEC;
+   int n;
+
+   memset(msg, 0, sizeof(now) * 2);
+
+   while (app->_priorityDue < due)
+   {
+      memcpy(msg, &now, sizeof(now));
+
+      if (spimod_priority_send_user(app->_chan, msg, sizeof(now) * 2) > 0)
+      {
+         ++app->_prioritySent;
+
+         spimod_pump_wake();
+      }
+      else
+      {
+         ++app->_priorityRefused;
+      }
+
+      ++app->_priorityDue;
+   }
+
+   while ((n = spimod_priority_receive_user(app->_chan, msg, sizeof(msg))) > 0)
+   {
+      u64 sent;
+
+      memcpy(&sent, msg, sizeof(sent));
+
+      sim_latency_add(&app->_priorityLatency, now - sent);
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: sim_app_bulk()
+ * Purpose:  Keeps the transmit buffers of channels 1 and up full, or a
+ *           bulk send under way on each with -P, and drains their receive
+ *           buffers.
+ *
+ * ***************************************************************************/
+
+static void sim_app_bulk(struct sim_app* app)
+{
+   static char bulk[PACKET_DATA_SIZE];
+   u32 c;
+
+   for (c = 1; c < device_state._numChannels; ++c)
+   {
+      struct spimod_channel* chan = &device_state._channels[c];
+      int n, i;
+
+      if (0 == app->_config->_bulkSize)
+      {
+         while (circular_buffer_write(chan->_txBuffer, bulk, sizeof(bulk)) > 0)
+         {
+         }
+      }
+      else if (!spimod_bulk_active(chan))
+      {
+         spimod_bulk_start(chan, app->_bulkData, app->_config->_bulkSize);
+      }
+
+      while ((n = circular_buffer_read(chan->_rxBuffer, bulk, sizeof(bulk))) > 0)
+      {
+         app->_bulkBytesReceived += n;
+
+         // Each bulk send is the same pattern, so the echo must follow it
+
+         for (i = 0; i < n && app->_config->_bulkSize > 0; ++i)
+         {
+            if (bulk[i] != app->_bulkData[app->_bulkExpected[c]])
+            {
+               ++app->_bulkMismatches;
+            }
+
+            app->_bulkExpected[c] =
+               (app->_bulkExpected[c] + 1) % app->_config->_bulkSize;
+         }
+      }
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: sim_app_callback()
+ * Purpose:  Periodic application activity: sends the messages due at the
+ *           configured rate (or as many as fit, if saturating) and reads
+ *           whatever has been received.
+ *
+ * ***************************************************************************/
+
+static enum hrtimer_restart sim_app_callback(struct hrtimer* timer)
+{
+   struct sim_app* app = container_of(timer, struct sim_app, _timer);
+
+   if (0 == app->_config->_msgRate)
+   {
+      while (sim_app_send(app))
+      {
+      }
+   }
+   else
+   {
+      u64 due = (u64)ktime_to_ns(ktime_get()) * app->_config->_msgRate
+              / NSEC_PER_SEC;
+
+      while (app->_msgsDue < due)
+      {
+         sim_app_send(app);
+
+         ++app->_msgsDue;
+      }
+   }
+
+   sim_app_receive(app);
+
+   sim_app_priority(app);
+
+   sim_app_bulk(app);
+
+   hrtimer_forward_now(timer, ns_to_ktime(app->_config->_appPeriodNs));
+
+   return HRTIMER_RESTART;
+}
+
+/******************************************************************************
+ *
+ * Function: sim_reset_callback()
+ * Purpose:  Resets the slave, as a power glitch would, mid-transfer or not.
+ *
+ * ***************************************************************************/
+
+static enum hrtimer_restart sim_reset_callback(struct hrtimer* timer)
+{
+   struct sim_reset* reset = container_of(timer, struct sim_reset, _timer);
+
+   spimod_slave_reset(reset->_slave, SLAVE_BOOT_FRAMES);
+
+   ++reset->_done;
+
+   if (--reset->_left == 0)
+   {
+      return HRTIMER_NORESTART;
+   }
+
+   hrtimer_forward_now(timer, ns_to_ktime(reset->_periodNs));
+
+   return HRTIMER_RESTART;
+}
+
+/******************************************************************************
+ *
+ * Function: sim_percentile()
+ * Purpose:  Returns the latency (us) below which the fraction p of the
+ *           recorded messages fall.
+ *
+ * ***************************************************************************/
+
+static double sim_percentile(struct sim_latency* lat, const double p)
+{
+   u64 target = (u64)(p * lat->_count);
+   u64 count = 0;
+   u32 i;
+
+   for (i = 0; i < LATENCY_BUCKETS; ++i)
+   {
+      count += lat->_buckets[i];
+
+      if (count > target)
+      {
+         return i;
+      }
+   }
+
+   return lat->_maxNs / 1000.0;
+}
+
+static double wall_seconds(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char* name)
+{
+   fprintf(stderr,
+           "Usage: %s [-d seconds] [-p pump_us] [-c clock_hz] "
+           "[-l latency_us]\n"
+           "       [-m msg_bytes] [-r msgs_per_s (0 = saturate)] "
+           "[-a app_poll_us]\n"
+           "       [-M echo|generator|sink] [-g (datagram mode)] "
+           "[-n channels]\n"
+           "       [-u priority_msgs_per_s] [-e bit_error_rate] "
+           "[-k (CRC)]\n"
+           "       [-q arq_window] [-f fec_bytes] [-w bits_per_word] "
+           "[-i word_gap_ns]\n"
+           "       [-F max_frame_bytes] [-R slave_resets] [-P bulk_bytes] "
+           "[-I idle_frames]\n"
+           "       [-v]\n",
+           name);
+}
+
+int main(int argc, char* argv[])
+{
+   struct sim_config config;
+   struct sim_app app;
+   struct sim_reset reset;
+   struct spimod_slave slave;
+   struct spi_device spi;
+   struct spi_controller controller;
+   struct device controllerParent;
+   double wallStart, wallTime;
+   unsigned long callbacks;
+   int opt;
+   u32 c;
+
+   config._seconds = 10.0;
+   config._pumpPeriodNs = NSEC_PER_SEC / WRITE_FREQUENCY;
+   config._clockHz = SPI_BUS_SPEED;
+   config._bitsPerWord = 8;
+   config._wordGapNs = 0;
+   config._latencyNs = 0;
+   config._msgSize = 64;
+   config._msgRate = 0;
+   config._appPeriodNs = 100000;
+   config._model = SLAVE_MODEL_ECHO;
+   config._datagram = 0;
+   config._channels = 1;
+   config._priorityRate = 0;
+   config._bitErrorRate = 0.0;
+   config._crc = 0;
+   config._arqWindow = 0;
+   config._fec = 0;
+   config._maxFrame = 0;
+   config._slaveResets = 0;
+   config._bulkSize = 0;
+   config._idleFrames = 0;
+
+   while ((opt = getopt(argc, argv, "d:p:c:l:m:r:a:M:gn:u:e:kq:f:w:i:F:R:P:I:vh")) != -1)
+   {
+      switch (opt)
+      {
+         case 'd': config._seconds = atof(optarg); break;
+         case 'p': config._pumpPeriodNs = atoi(optarg) * 1000; break;
+         case 'c': config._clockHz = atoi(optarg); break;
+         case 'l': config._latencyNs = atoi(optarg) * 1000; break;
+         case 'm': config._msgSize = atoi(optarg); break;
+         case 'r': config._msgRate = atoi(optarg); break;
+         case 'a': config._appPeriodNs = atoi(optarg) * 1000; break;
+         case 'g': config._datagram = 1; break;
+         case 'n': config._channels = atoi(optarg); break;
+         case 'u': config._priorityRate = atoi(optarg); break;
+         case 'e': config._bitErrorRate = atof(optarg); break;
+         case 'k': config._crc = 1; break;
+         case 'q': config._arqWindow = atoi(optarg); break;
+         case 'f': config._fec = atoi(optarg); break;
+         case 'w': config._bitsPerWord = atoi(optarg); break;
+         case 'i': config._wordGapNs = atoi(optarg); break;
+         case 'F': config._maxFrame = atoi(optarg); break;
+         case 'R': config._slaveResets = atoi(optarg); break;
+         case 'P': config._bulkSize = atoi(optarg); break;
+         case 'I': config._idleFrames = atoi(optarg); break;
+         case 'v': shim_verbose = 1; break;
+
+         case 'M':
+            if (0 == strcmp(optarg, "generator"))
+            {
+               config._model = SLAVE_MODEL_GENERATOR;
+            }
+            else if (0 == strcmp(optarg, "sink"))
+            {
+               config._model = SLAVE_MODEL_SINK;
+            }
+            else
+            {
+               config._model = SLAVE_MODEL_ECHO;
+            }
+            break;
+
+         default:
+            usage(argv[0]);
+            return 1;
+      }
+   }
+
+   if (config._msgSize < 12 || config._msgSize > MAX_MSG_SIZE
+    || config._pumpPeriodNs == 0 || config._appPeriodNs == 0
+    || config._clockHz == 0
+    || config._bitErrorRate < 0.0 || config._bitErrorRate >= 1.0
+    || config._arqWindow > SPIMOD_ARQ_MAX_WINDOW
+    || config._fec > SPIMOD_FEC_MAX_T
+    || config._channels < 1 || config._channels > SPIMOD_MAX_CHANNELS
+    || config._bulkSize > SPIMOD_BULK_MAX
+    || (config._bulkSize > 0 && config._channels < 2))
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   // Driver state, as set up by spimod_init() and spimod_open()
+
+   memset(&device_state, 0, sizeof(device_state));
+   memset(&device_transaction, 0, sizeof(device_transaction));
+
+   device_state._numChannels = config._channels;
+   device_state._crc = config._crc;
+   device_state._dataSize = PACKET_DATA_SIZE;
+   device_state._maxData = spimod_hello_max_data(config._maxFrame);
+
+   for (c = 0; c < SPIMOD_MAX_CHANNELS; ++c)
+   {
+      device_state._channels[c]._txBufferSize = TX_BUFFER_SIZE;
+      device_state._channels[c]._rxBufferSize = RX_BUFFER_SIZE;
+
+      INIT_WORK(&device_state._channels[c]._bulkWork, spimod_bulk_work);
+      spin_lock_init(&device_state._channels[c]._txLock);
+   }
+
+   memset(&spi, 0, sizeof(spi));
+   memset(&controller, 0, sizeof(controller));
+   memset(&controllerParent, 0, sizeof(controllerParent));
+
+   controller.dev.parent = &controllerParent;
+
+   spi.controller = &controller;
+   spi.max_speed_hz = config._clockHz;
+   spi.bits_per_word = 8;
+
+   spimod_probe(&spi);
+
+   if (spimod_bus_setup(config._clockHz, SPI_MODE_0, config._bitsPerWord) < 0)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   if (spimod_resources_acquire() < 0)
+   {
+      fprintf(stderr, "spimod_resources_acquire() failed\n");
+      return 1;
+   }
+
+   device_state._channels[0]._datagram = config._datagram;
+   device_state._idleFrames = config._idleFrames;
+
+   if (spimod_arq_init(&device_state._arq, config._arqWindow, ARQ_TIMEOUT,
+                       device_state._maxData) < 0)
+   {
+      fprintf(stderr, "spimod_arq_init() failed\n");
+      return 1;
+   }
+
+   if (spimod_fec_init(&device_state._fec, config._fec) < 0)
+   {
+      fprintf(stderr, "spimod_fec_init() failed\n");
+      return 1;
+   }
+
+   // The slave and the bus
+
+   if (spimod_slave_init(&slave, SLAVE_FIFO_SIZE) < 0)
+   {
+      fprintf(stderr, "spimod_slave_init() failed\n");
+      return 1;
+   }
+
+   slave._model = config._model;
+   slave._crc = config._crc;
+   slave._maxData = spimod_hello_max_data(config._maxFrame);
+
+   if (spimod_arq_init(&slave._arq, config._arqWindow, ARQ_TIMEOUT,
+                       slave._maxData) < 0)
+   {
+      fprintf(stderr, "spimod_arq_init() failed\n");
+      return 1;
+   }
+
+   if (spimod_fec_init(&slave._fec, config._fec) < 0)
+   {
+      fprintf(stderr, "spimod_fec_init() failed\n");
+      return 1;
+   }
+
+   shim_bus_init(&slave, config._clockHz, config._latencyNs);
+   shim_bus_set_word_gap(config._wordGapNs);
+   shim_bus_set_bit_error_rate(config._bitErrorRate);
+
+   // Timers: the pump and the application
+
+   device_state._timer_period_ns = config._pumpPeriodNs;
+
+   hrtimer_init(&device_state._timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   device_state._timer.function = sim_pump_callback;
+
+   memset(&app, 0, sizeof(app));
+
+   app._config = &config;
+   app._chan = &device_state._channels[0];
+   app._latency._buckets = calloc(LATENCY_BUCKETS, sizeof(u32));
+   app._priorityLatency._buckets = calloc(LATENCY_BUCKETS, sizeof(u32));
+   app._bulkData = malloc(config._bulkSize + 1);
+
+   for (c = 0; c < config._bulkSize; ++c)
+   {
+      app._bulkData[c] = (char)(c * 7 + c / 256);
+   }
+
+   hrtimer_init(&app._timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   app._timer.function = sim_app_callback;
+
+   memset(&reset, 0, sizeof(reset));
+
+   reset._slave = &slave;
+   reset._left = config._slaveResets;
+   reset._periodNs = (u64)(config._seconds * NSEC_PER_SEC)
+                   / (config._slaveResets + 1);
+
+   hrtimer_init(&reset._timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   reset._timer.function = sim_reset_callback;
+
+   spimod_handshake_start();
+
+   device_state._timer_running = 1;
+
+   hrtimer_start(&device_state._timer, ns_to_ktime(config._pumpPeriodNs),
+                 HRTIMER_MODE_REL);
+   hrtimer_start(&app._timer, ns_to_ktime(config._appPeriodNs),
+                 HRTIMER_MODE_REL);
+
+   if (config._slaveResets > 0)
+   {
+      hrtimer_start(&reset._timer, ns_to_ktime(reset._periodNs),
+                    HRTIMER_MODE_REL);
+   }
+
+   // Run
+
+   wallStart = wall_seconds();
+
+   callbacks = shim_run_until(ktime_set(0, 0)
+                              + (ktime_t)(config._seconds * NSEC_PER_SEC));
+
+   wallTime = wall_seconds() - wallStart;
+
+   // Report
+
+   printf("Simulated %.3f s: pump %u us, bus %u Hz %u bit words, "
+          "slave latency %u us, %u byte messages ",
+          config._seconds,
+          config._pumpPeriodNs / 1000,
+          config._clockHz,
+          config._bitsPerWord,
+          config._latencyNs / 1000,
+          config._msgSize);
+
+   if (config._msgRate > 0)
+   {
+      printf("at %u/s\n", config._msgRate);
+   }
+   else
+   {
+      printf("saturating the transmit buffer\n");
+   }
+
+   printf("Frames:      %lu of %u bytes transferred (%.0f/s), %llu pump "
+          "ticks skipped (bus busy)\n",
+          slave._framesReceived,
+          PACKET_HEADER_SIZE + device_state._dataSize,
+          slave._framesReceived / config._seconds,
+          (unsigned long long)(device_state._statTimerWakeups
+                               - slave._framesReceived
+                               - device_state._statIdlePolls));
+
+   printf("Idle:        %llu timer wakeups (%.0f/s), %llu header-only polls, "
+          "idle %u times\n",
+          (unsigned long long)device_state._statTimerWakeups,
+          device_state._statTimerWakeups / config._seconds,
+          (unsigned long long)device_state._statIdlePolls,
+          device_state._statIdleEntries);
+
+   printf("Goodput:     %.1f KB/s to slave, %.1f KB/s from slave, "
+          "%.1f%% of frame bytes were payload\n",
+          slave._bytesReceived / config._seconds / 1024.0,
+          app._bytesReceived / config._seconds / 1024.0,
+          slave._framesReceived
+             ? 100.0 * slave._bytesReceived
+               / ((double)slave._framesReceived
+                  * (PACKET_HEADER_SIZE + device_state._dataSize))
+             : 0.0);
+
+   printf("Application: %llu messages sent, %llu received, %llu bytes "
+          "refused (TX full), %llu skipped, %llu out of order\n",
+          (unsigned long long)app._msgsSent,
+          (unsigned long long)app._msgsReceived,
+          (unsigned long long)app._bytesRefused,
+          (unsigned long long)app._skipped,
+          (unsigned long long)app._outOfOrder);
+
+   printf("Cursors:     %llu bytes queued on channel 0, %llu sent, %llu "
+          "acknowledged, %llu discarded\n",
+          (unsigned long long)atomic64_read(&app._chan->_txQueued),
+          (unsigned long long)atomic64_read(&app._chan->_txSent),
+          (unsigned long long)atomic64_read(&app._chan->_txAcked),
+          (unsigned long long)atomic64_read(&app._chan->_txDiscarded));
+
+   if (app._latency._count > 0)
+   {
+      printf("Latency:     mean %.0f us, p50 %.0f us, p90 %.0f us, "
+             "p99 %.0f us, max %.0f us\n",
+             app._latency._sumNs / 1000.0 / app._latency._count,
+             sim_percentile(&app._latency, 0.50),
+             sim_percentile(&app._latency, 0.90),
+             sim_percentile(&app._latency, 0.99),
+             app._latency._maxNs / 1000.0);
+   }
+
+   if (config._priorityRate > 0)
+   {
+      printf("Priority:    %llu sent, %llu received, %llu refused; queued "
+             "mean %.0f us, max %.0f us\n",
+             (unsigned long long)app._prioritySent,
+             (unsigned long long)app._priorityLatency._count,
+             (unsigned long long)app._priorityRefused,
+             device_state._statPriorityMessages
+                ? device_state._statPriorityNs / 1000.0
+                  / device_state._statPriorityMessages
+                : 0.0,
+             device_state._statPriorityMaxNs / 1000.0);
+   }
+
+   if (app._priorityLatency._count > 0)
+   {
+      printf("             round trip p50 %.0f us, p99 %.0f us, "
+             "max %.0f us\n",
+             sim_percentile(&app._priorityLatency, 0.50),
+             sim_percentile(&app._priorityLatency, 0.99),
+             app._priorityLatency._maxNs / 1000.0);
+   }
+
+   printf("Slave:       %lu bytes dropped, %lu bad frames; driver printk: "
+          "%lu\n",
+          slave._bytesDropped,
+          slave._badFrames,
+          shim_printk_count);
+
+   if (config._crc || config._bitErrorRate > 0.0)
+   {
+      printf("Integrity:   %lu bits flipped, CRC %s; %u bad frames and %u "
+             "CRC errors from slave, %lu bad frames and %lu CRC errors "
+             "to slave\n",
+             shim_bit_errors,
+             config._crc ? "on" : "off",
+             device_state._statBadFrames,
+             device_state._statCrcErrors,
+             slave._badFrames,
+             slave._crcErrors);
+   }
+
+   if (config._arqWindow > 0)
+   {
+      printf("ARQ:         window %u; %u resent, %u duplicates, %u lost "
+             "from slave; %u resent, %u duplicates, %u lost to slave\n",
+             config._arqWindow,
+             slave._arq._retransmits,
+             device_state._arq._duplicates,
+             device_state._arq._lost,
+             device_state._arq._retransmits,
+             slave._arq._duplicates,
+             slave._arq._lost);
+   }
+
+   if (config._fec > 0)
+   {
+      printf("FEC:         %u bytes per codeword, %d bytes parity per frame "
+             "(%.1f%%); %u bytes corrected, %u frames repaired, %u beyond "
+             "repair from slave; %u, %u, %u to slave\n",
+             config._fec,
+             spimod_fec_overhead(&device_state._fec),
+             100.0 * spimod_fec_overhead(&device_state._fec)
+                / (PACKET_HEADER_SIZE + device_state._dataSize),
+             device_state._fec._corrected,
+             device_state._fec._repaired,
+             device_state._fec._failed,
+             slave._fec._corrected,
+             slave._fec._repaired,
+             slave._fec._failed);
+   }
+
+   if (config._slaveResets > 0 || device_state._statResyncs > 0)
+   {
+      printf("Resync:      %u slave resets, %u resyncs, %u slips "
+             "realigned\n",
+             reset._done,
+             device_state._statResyncs,
+             device_state._statSlips);
+   }
+
+   if (config._channels > 1)
+   {
+      printf("Channels:    %u, %.1f KB/s bulk from slave on channels 1-%u, "
+             "%u bad segments\n",
+             config._channels,
+             app._bulkBytesReceived / config._seconds / 1024.0,
+             config._channels - 1,
+             device_state._statSegmentErrors);
+   }
+
+   if (config._bulkSize > 0)
+   {
+      printf("Bulk:        %u sends of %u bytes from pinned pages, %llu "
+             "bytes sent, %llu echoed bytes out of pattern\n",
+             device_state._statBulkSends,
+             config._bulkSize,
+             (unsigned long long)device_state._statBulkBytes,
+             (unsigned long long)app._bulkMismatches);
+   }
+
+   if (config._datagram)
+   {
+      printf("Datagrams:   %u incomplete, %u dropped for lack of space\n",
+             device_state._statDatagramErrors,
+             device_state._statDatagramDropped);
+   }
+
+   printf("Wall clock:  %.3f s, %lu events, %.2f M frames/s simulated\n",
+          wallTime,
+          callbacks,
+          wallTime > 0 ? slave._framesReceived / wallTime / 1e6 : 0.0);
+
+   spimod_slave_term(&slave);
+
+   spimod_resources_release();
+
+   free(app._latency._buckets);
+   free(app._priorityLatency._buckets);
+   free(app._bulkData);
+
+   return 0;
+}
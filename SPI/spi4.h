@@ -33,10 +33,195 @@ struct spi_ioc_status
    __u32	_clearToSend;
 };
 
+/* Structure defining the transmit / receive buffer capacities, used by
+   IOCTL_GET_BUFFER_SIZES and IOCTL_SET_BUFFER_SIZES (0 leaves a buffer
+   unchanged) */
+
+struct spi_ioc_buffer_sizes
+{
+   __u32	_txSize;
+   __u32	_rxSize;
+};
+
+/* Structure defining the bus settings of the device, used by
+   IOCTL_GET_BUS_CONFIG and IOCTL_SET_BUS_CONFIG.  _mode is SPI_MODE_0 to
+   SPI_MODE_3 and _bitsPerWord 8, 16 or 32; frames are padded to a whole
+   number of words.  Wider words are sent most significant bit first, so
+   the slave must use the same word size. */
+
+struct spi_ioc_bus_config
+{
+   __u32	_speedHz;
+   __u32	_mode;
+   __u32	_bitsPerWord;
+};
+
+/* One message of a vectored send or receive.  _result is set to what
+   IOCTL_SEND_DATA or IOCTL_RECEIVE_DATA would have returned for it. */
+
+struct spi_ioc_iovec
+{
+   __u8*	_buf;
+   __u16	_bufLen;
+   __s32	_result;
+};
+
+/* _count messages for IOCTL_SEND_VECTOR or IOCTL_RECEIVE_VECTOR, at most
+   SPIMOD_VECTOR_MAX.  _done is set to the number handled in full. */
+
+struct spi_ioc_vector
+{
+   struct spi_ioc_iovec*	_entries;
+   __u32			_count;
+   __u32			_done;
+};
+
+/* Structure used by IOCTL_TRANSFER_VECTOR: sends _send, then receives
+   into _receive, then reports the status, all in one call.  _send._done
+   and _receive._done are set to the number sent and received. */
+
+struct spi_ioc_batch
+{
+   struct spi_ioc_vector	_send;
+   struct spi_ioc_vector	_receive;
+   struct spi_ioc_status	_status;
+};
+
+/* Structure used by IOCTL_SEND_BULK and IOCTL_GET_BULK_STATUS: _len bytes
+   at _buf, of which _sent have been sent so far */
+
+struct spi_ioc_bulk
+{
+   __u8*	_buf;
+   __u32	_len;
+   __u32	_sent;
+};
+
+/* Structure used by IOCTL_SEND_TRACKED: as struct spi_ioc_transfer, and
+   _cursor is set to the transmit cursor just past the data queued */
+
+struct spi_ioc_tracked
+{
+   __u8*	_buf;
+   __u16	_bufLen;
+   __u64	_cursor;
+};
+
+/* Structure used by IOCTL_GET_TX_CURSOR: the bytes ever queued to send on
+   the channel, clocked out and acknowledged by the slave, and discarded
+   without being sent */
+
+struct spi_ioc_tx_cursor
+{
+   __u64	_queued;
+   __u64	_sent;
+   __u64	_acked;
+   __u64	_discarded;
+};
+
+/* Structure used by IOCTL_WAIT_TX: waits up to _timeoutMs for _sent, or
+   _acked if _acked is set, to reach _cursor */
+
+struct spi_ioc_tx_wait
+{
+   __u64	_cursor;
+   __u32	_timeoutMs;
+   __u32	_acked;
+};
+
+/* Header preceding every packet recorded by the capture channel (see
+   spi_capture.c).  The first four fields match a nanosecond pcap record
+   header, so the per-CPU capture files need only a pcap file header to be
+   read by standard tools (link type LINKTYPE_USER0). */
+
+struct spi_capture_record
+{
+   __u32	_tsSec;
+   __u32	_tsNsec;
+   __u32	_capLen;
+   __u32	_origLen;
+   __u8		_direction;
+   __u8		_reserved[3];
+};
+
+#define SPIMOD_CAPTURE_TX	0
+#define SPIMOD_CAPTURE_RX	1
+
 /* ioctl() constants */
 
 #define IOCTL_SEND_DATA		_IOR(MAJOR_NUM, 0, void*)
 #define IOCTL_RECEIVE_DATA	_IOR(MAJOR_NUM, 1, void*)
 #define IOCTL_GET_STATUS	_IOR(MAJOR_NUM, 2, void*)
+#define IOCTL_GET_BUFFER_SIZES	_IOR(MAJOR_NUM, 3, void*)
+#define IOCTL_SET_BUFFER_SIZES	_IOR(MAJOR_NUM, 4, void*)
+#define IOCTL_SET_MODE		_IOR(MAJOR_NUM, 5, void*)
+#define IOCTL_SEND_PRIORITY	_IOR(MAJOR_NUM, 6, void*)
+#define IOCTL_RECEIVE_PRIORITY	_IOR(MAJOR_NUM, 7, void*)
+#define IOCTL_GET_BUS_CONFIG	_IOR(MAJOR_NUM, 8, void*)
+#define IOCTL_SET_BUS_CONFIG	_IOR(MAJOR_NUM, 9, void*)
+#define IOCTL_SEND_VECTOR	_IOR(MAJOR_NUM, 10, void*)
+#define IOCTL_RECEIVE_VECTOR	_IOR(MAJOR_NUM, 11, void*)
+#define IOCTL_TRANSFER_VECTOR	_IOR(MAJOR_NUM, 12, void*)
+#define IOCTL_SEND_BULK		_IOR(MAJOR_NUM, 13, void*)
+#define IOCTL_GET_BULK_STATUS	_IOR(MAJOR_NUM, 14, void*)
+#define IOCTL_SEND_TRACKED	_IOR(MAJOR_NUM, 15, void*)
+#define IOCTL_GET_TX_CURSOR	_IOR(MAJOR_NUM, 16, void*)
+#define IOCTL_WAIT_TX		_IOR(MAJOR_NUM, 17, void*)
+
+/* Modes for IOCTL_SET_MODE, passed by value.  In datagram mode every
+   IOCTL_SEND_DATA is one message (1 to 65535 bytes) and IOCTL_RECEIVE_DATA
+   returns one whole message, failing with EMSGSIZE if the buffer is too
+   small; _rxBytesAvailable is the size of the next message. */
+
+#define SPIMOD_MODE_STREAM	0
+#define SPIMOD_MODE_DATAGRAM	1
+
+/* IOCTL_SEND_PRIORITY queues one message of up to SPIMOD_PRIORITY_MAX
+   bytes that is sent ahead of any data queued by IOCTL_SEND_DATA, at the
+   start of the next frame.  Messages received the same way are returned,
+   one per call, by IOCTL_RECEIVE_PRIORITY (EMSGSIZE if the buffer is too
+   small, 0 if there is none).  Both take a struct spi_ioc_transfer.  With
+   the module loaded crc=1 the limit is 4 bytes lower, and lower again by
+   the trailer and parity of arq_window and fec. */
+
+#define SPIMOD_PRIORITY_MAX	1536
+
+/* IOCTL_SEND_VECTOR queues its messages in order, as many IOCTL_SEND_DATA
+   would, and stops at the first not queued whole, so they are never
+   reordered; it returns how many were.  IOCTL_RECEIVE_VECTOR fills its
+   buffers in order, as many IOCTL_RECEIVE_DATA would, and stops at the
+   first that received nothing; it returns how many received anything.
+   Both take a struct spi_ioc_vector, IOCTL_TRANSFER_VECTOR a struct
+   spi_ioc_batch (it returns how many buffers received anything, as
+   IOCTL_RECEIVE_VECTOR does, and how many messages were queued in
+   _send._done).  Entries after the one stopped at are left untouched. */
+
+#define SPIMOD_VECTOR_MAX	1024
+
+/* IOCTL_SEND_BULK sends up to SPIMOD_BULK_MAX bytes on a stream channel
+   straight from the caller's buffer, which is pinned rather than copied
+   into the transmit buffer, and returns _len at once.  The buffer must
+   not be changed until IOCTL_GET_BULK_STATUS reports all of it _sent
+   (it returns 1 while a send is under way, else 0).  Data queued before
+   the bulk send goes first, data queued after it waits for it, and a
+   second one fails with EBUSY until then.  Closing the channel abandons
+   what is left. */
+
+#define SPIMOD_BULK_MAX		(64 << 20)
+
+/* Transmit cursors: every byte queued to send on a channel, by any call
+   other than IOCTL_SEND_PRIORITY, is counted in _queued, and in _sent once
+   the frame carrying it has been clocked out, and in _acked once the slave
+   has acknowledged it (with arq_window set, else once sent).  The counts
+   only ever grow.  IOCTL_SEND_TRACKED returns as IOCTL_SEND_DATA and sets
+   the cursor of its data, _queued just after it; in datagram mode that
+   counts the message data, not its length.  IOCTL_WAIT_TX returns 0 once
+   the cursor has been reached, EAGAIN at once if not with a _timeoutMs of
+   0, ETIMEDOUT once _timeoutMs has passed, and EINVAL for a cursor beyond
+   _queued.  Data discarded by IOCTL_SET_MODE or a reopen, or left of a bulk
+   send abandoned on close, is never sent: it is counted in _discarded, and
+   _sent and _acked pass over it so later cursors can still be reached.
+   IOCTL_WAIT_TX returns ECANCELED rather than 0 for a cursor at the end of
+   the last run of discarded data. */
 
 #endif
@@ -0,0 +1,699 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_arq
+ *
+ * Purpose:     Selective-repeat retransmission, see spi_arq.h.
+ *
+ *              _frames holds the _window packets sent and not yet
+ *              acknowledged, then the _window packets received ahead of
+ *              _expected, each at its sequence number modulo _window.
+ *              The packets themselves are in _packets, allocated with
+ *              _frames, with room for the largest frame the handshake may
+ *              agree on rather than PACKET_DATA_MAX.
+ *              Sequence numbers are 16 bit and compared as differences, so
+ *              they wrap.  _ticks counts the packets sent, and is the clock
+ *              for _timeout.
+ *
+ *              A receiver never waits for a packet older than the peer's
+ *              _base, as it will not be resent; a _base more than a window
+ *              away means the peer restarted, and numbering is taken up
+ *              from there.  A _base behind _expected is never taken up
+ *              otherwise, so packets are not delivered twice.
+ *
+ * ***************************************************************************/
+
+#include "spi_arq.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/vmalloc.h>
+
+#define __NO_VERSION__
+
+/* Constants */
+
+static const int ARQ_TRAILER_SIZE = sizeof(struct packet_arq);
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_packet()
+ * Purpose:  Returns the packet kept in a slot.
+ *
+ * Parameters:
+ *
+ * - IN:     arq (the state).
+ *           frame (the slot).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The packet.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static struct packet* spimod_arq_packet(
+   const struct spimod_arq* arq,
+   const struct spimod_arq_frame* frame)
+{
+   const size_t stride = PACKET_HEADER_SIZE + arq->_maxData;
+
+   return (struct packet*)(arq->_packets + (frame - arq->_frames) * stride);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_sent()
+ * Purpose:  Returns the slot of a packet sent.
+ *
+ * Parameters:
+ *
+ * - IN:     arq (the state).
+ *           seq (the packet's sequence number).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The slot.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static struct spimod_arq_frame* spimod_arq_sent(
+   const struct spimod_arq* arq,
+   const u16 seq)
+{
+   return &arq->_frames[seq % arq->_window];
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_held()
+ * Purpose:  Returns the slot of a packet received out of order.
+ *
+ * Parameters:
+ *
+ * - IN:     arq (the state).
+ *           seq (the packet's sequence number).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The slot.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static struct spimod_arq_frame* spimod_arq_held(
+   const struct spimod_arq* arq,
+   const u16 seq)
+{
+   return &arq->_frames[arq->_window + seq % arq->_window];
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_init()
+ * Purpose:  Allocates the window, discarding any packets still held.
+ *
+ * Parameters:
+ *
+ * - IN:     window (packets held, 0 to disable).
+ *           timeout (packets sent before an unacknowledged one is resent).
+ *           maxData (the data in the largest frame that may be agreed).
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state to initialise).
+ *
+ * Returns:  0 on success, -1 on failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_arq_init(
+   struct spimod_arq* arq,
+   const u32 window,
+   const u32 timeout,
+   const u32 maxData)
+{
+   size_t size;
+
+   spimod_arq_term(arq);
+
+   if (0 == arq->_dataSize)
+   {
+      arq->_dataSize = PACKET_DATA_SIZE;
+   }
+
+   if (0 == window)
+   {
+      return 0;
+   }
+
+   arq->_window = min_t(u32, window, SPIMOD_ARQ_MAX_WINDOW);
+   arq->_timeout = max_t(u32, timeout, 1);
+   arq->_maxData = clamp_t(u32, maxData, PACKET_DATA_SIZE, PACKET_DATA_MAX);
+
+   size = 2 * arq->_window
+        * (sizeof(struct spimod_arq_frame) + PACKET_HEADER_SIZE
+           + arq->_maxData);
+
+   arq->_frames = vmalloc(size);
+
+   if (NULL == arq->_frames)
+   {
+      arq->_window = 0;
+
+      return -1;
+   }
+
+   memset(arq->_frames, 0, size);
+
+   arq->_packets = (u8*)&arq->_frames[2 * arq->_window];
+
+   // Packets held are gone, so the peer is told not to wait for them
+
+   arq->_base = arq->_next;
+
+   return 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_term()
+ * Purpose:  Frees the window and disables retransmission.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state to terminate).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_arq_term(
+   struct spimod_arq* arq)
+{
+   if (arq->_frames != NULL)
+   {
+      vfree(arq->_frames);
+   }
+
+   arq->_frames = NULL;
+   arq->_packets = NULL;
+   arq->_window = 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_resize()
+ * Purpose:  Changes the size of the frames the trailer is placed in,
+ *           discarding any packets held when it changes.  The slots need
+ *           no reallocating, which could not be done from the pump.
+ *
+ * Parameters:
+ *
+ * - IN:     dataSize (the data in a frame of the new size, at most
+ *           _maxData).
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_arq_resize(
+   struct spimod_arq* arq,
+   const u32 dataSize)
+{
+   if (dataSize == arq->_dataSize)
+   {
+      return;
+   }
+
+   arq->_dataSize = dataSize;
+
+   if (arq->_frames != NULL)
+   {
+      memset(arq->_frames, 0,
+             2 * arq->_window * sizeof(struct spimod_arq_frame));
+
+      arq->_base = arq->_next;
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_resync()
+ * Purpose:  Has the next trailer received set the packet expected, after
+ *           the receiving state was reset.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_arq_resync(
+   struct spimod_arq* arq)
+{
+   arq->_adopt = 1;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_resend()
+ * Purpose:  Copies the oldest packet due to be resent, if any, into pkt.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    pkt (the outbound packet).
+ * - IN/OUT: arq (the state).
+ *
+ * Returns:  1 if a packet is to be resent, else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_arq_resend(
+   struct spimod_arq* arq,
+   struct packet* pkt)
+{
+   u16 seq;
+
+   for (seq = arq->_base; seq != arq->_next; ++seq)
+   {
+      struct spimod_arq_frame* frame = spimod_arq_sent(arq, seq);
+
+      // Packets acknowledged selectively are skipped
+
+      if (frame->_valid && frame->_seq == seq
+       && arq->_ticks - frame->_sentAt >= arq->_timeout)
+      {
+         memcpy(pkt, spimod_arq_packet(arq, frame),
+                PACKET_HEADER_SIZE + arq->_dataSize);
+
+         frame->_sentAt = arq->_ticks;
+
+         ++arq->_retransmits;
+
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_window_open()
+ * Purpose:  Returns whether a new packet of data may be sent.
+ *
+ * Parameters:
+ *
+ * - IN:     arq (the state).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 if there is room in the window, else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_arq_window_open(
+   const struct spimod_arq* arq)
+{
+   return (u16)(arq->_next - arq->_base) < arq->_window;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_stamp()
+ * Purpose:  Numbers and keeps an outbound packet carrying new data, then
+ *           writes its trailer.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state).
+ *           pkt (the outbound packet).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_arq_stamp(
+   struct spimod_arq* arq,
+   struct packet* pkt)
+{
+   struct packet_arq trailer;
+   int fresh = !(pkt->_status & PACKET_FLAG_SEQ) && pkt->_len > 0;
+   int i;
+
+   // A packet being resent keeps its number
+
+   if (pkt->_status & PACKET_FLAG_SEQ)
+   {
+      memcpy(&trailer, pkt->_data + arq->_dataSize - PACKET_TRAILER_SIZE, ARQ_TRAILER_SIZE);
+   }
+   else
+   {
+      trailer._seq = fresh ? arq->_next : 0;
+   }
+
+   trailer._base = arq->_base;
+   trailer._ack = arq->_expected;
+   trailer._sack = 0;
+
+   for (i = 0; i < arq->_window - 1; ++i)
+   {
+      const u16 seq = arq->_expected + 1 + i;
+      const struct spimod_arq_frame* frame = spimod_arq_held(arq, seq);
+
+      if (frame->_valid && frame->_seq == seq)
+      {
+         trailer._sack |= 1 << i;
+      }
+   }
+
+   pkt->_status |= PACKET_FLAG_ARQ;
+
+   if (fresh)
+   {
+      pkt->_status |= PACKET_FLAG_SEQ;
+   }
+
+   memcpy(pkt->_data + arq->_dataSize - PACKET_TRAILER_SIZE, &trailer, ARQ_TRAILER_SIZE);
+
+   if (fresh)
+   {
+      struct spimod_arq_frame* frame = spimod_arq_sent(arq, arq->_next);
+
+      frame->_valid = 1;
+      frame->_seq = arq->_next;
+      frame->_sentAt = arq->_ticks;
+
+      memcpy(spimod_arq_packet(arq, frame), pkt,
+             PACKET_HEADER_SIZE + arq->_dataSize);
+
+      ++arq->_next;
+   }
+
+   ++arq->_ticks;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_acknowledge()
+ * Purpose:  Releases the packets acknowledged by an inbound trailer and
+ *           advances _base past them.  A trailer acknowledging packets not
+ *           yet sent is ignored.
+ *
+ * Parameters:
+ *
+ * - IN:     trailer (the inbound trailer).
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static void spimod_arq_acknowledge(
+   struct spimod_arq* arq,
+   const struct packet_arq* trailer)
+{
+   u16 seq;
+   int i;
+
+   if ((s16)(trailer->_ack - arq->_base) < 0
+    || (s16)(arq->_next - trailer->_ack) < 0)
+   {
+      return;
+   }
+
+   for (seq = arq->_base; seq != trailer->_ack; ++seq)
+   {
+      spimod_arq_sent(arq, seq)->_valid = 0;
+   }
+
+   for (i = 0; i < arq->_window - 1; ++i)
+   {
+      seq = trailer->_ack + 1 + i;
+
+      if ((trailer->_sack & (1 << i)) && (s16)(arq->_next - seq) > 0)
+      {
+         spimod_arq_sent(arq, seq)->_valid = 0;
+      }
+   }
+
+   arq->_base = trailer->_ack;
+
+   while (arq->_base != arq->_next && !spimod_arq_sent(arq, arq->_base)->_valid)
+   {
+      ++arq->_base;
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_advance()
+ * Purpose:  Moves _expected up to seq, delivering the packets held on the
+ *           way and counting those missing in _lost, then delivers any
+ *           held packets that follow in order.
+ *
+ * Parameters:
+ *
+ * - IN:     seq (the packet now expected, at or after _expected).
+ *           deliver (called for each packet of data in order).
+ *           context (passed to deliver).
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static void spimod_arq_advance(
+   struct spimod_arq* arq,
+   const u16 seq,
+   void (*deliver)(void* context, const struct packet* pkt),
+   void* context)
+{
+   struct spimod_arq_frame* frame;
+
+   while (arq->_expected != seq)
+   {
+      frame = spimod_arq_held(arq, arq->_expected);
+
+      if (frame->_valid && frame->_seq == arq->_expected)
+      {
+         deliver(context, spimod_arq_packet(arq, frame));
+      }
+      else
+      {
+         ++arq->_lost;
+      }
+
+      frame->_valid = 0;
+
+      ++arq->_expected;
+   }
+
+   frame = spimod_arq_held(arq, arq->_expected);
+
+   while (frame->_valid && frame->_seq == arq->_expected)
+   {
+      deliver(context, spimod_arq_packet(arq, frame));
+
+      frame->_valid = 0;
+
+      frame = spimod_arq_held(arq, ++arq->_expected);
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_jump()
+ * Purpose:  Takes up the peer's numbering at base, which is not in step
+ *           with _expected, dropping the packets held and counting them in
+ *           _lost.
+ *
+ * Parameters:
+ *
+ * - IN:     base (the peer's _base).
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static void spimod_arq_jump(
+   struct spimod_arq* arq,
+   const u16 base)
+{
+   struct spimod_arq_frame* frame;
+   int i;
+
+   for (i = 0; i < arq->_window; ++i)
+   {
+      frame = &arq->_frames[arq->_window + i];
+
+      if (frame->_valid)
+      {
+         ++arq->_lost;
+      }
+
+      frame->_valid = 0;
+   }
+
+   arq->_expected = base;
+   arq->_adopt = 0;
+
+   ++arq->_resyncs;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_receive()
+ * Purpose:  Handles a validated inbound packet flagged PACKET_FLAG_ARQ.
+ *
+ * Parameters:
+ *
+ * - IN:     pkt (the inbound packet).
+ *           deliver (called for each packet of data in order).
+ *           context (passed to deliver).
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_arq_receive(
+   struct spimod_arq* arq,
+   const struct packet* pkt,
+   void (*deliver)(void* context, const struct packet* pkt),
+   void* context)
+{
+   const int window = arq->_window;
+   struct packet_arq trailer;
+   struct spimod_arq_frame* frame;
+   s16 distance;
+
+   memcpy(&trailer, pkt->_data + arq->_dataSize - PACKET_TRAILER_SIZE, ARQ_TRAILER_SIZE);
+
+   spimod_arq_acknowledge(arq, &trailer);
+
+   // The peer will not resend anything before its _base.  One behind
+   // _expected is only an acknowledgement not yet received, as a peer
+   // that restarted near our numbering cannot be told from one that did
+   // not, and is left alone so nothing is delivered twice.
+
+   distance = (s16)(trailer._base - arq->_expected);
+
+   if (arq->_adopt || distance > window || distance < -window)
+   {
+      spimod_arq_jump(arq, trailer._base);
+   }
+   else if (distance > 0)
+   {
+      spimod_arq_advance(arq, trailer._base, deliver, context);
+   }
+
+   if (!(pkt->_status & PACKET_FLAG_SEQ))
+   {
+      return;
+   }
+
+   distance = (s16)(trailer._seq - arq->_expected);
+
+   if (distance < 0)
+   {
+      // Resent because our acknowledgement was lost
+
+      ++arq->_duplicates;
+   }
+   else if (0 == distance)
+   {
+      deliver(context, pkt);
+
+      ++arq->_expected;
+
+      spimod_arq_advance(arq, arq->_expected, deliver, context);
+   }
+   else if (distance < window)
+   {
+      frame = spimod_arq_held(arq, trailer._seq);
+
+      if (frame->_valid && frame->_seq == trailer._seq)
+      {
+         ++arq->_duplicates;
+      }
+      else
+      {
+         frame->_valid = 1;
+         frame->_seq = trailer._seq;
+
+         memcpy(spimod_arq_packet(arq, frame), pkt,
+                PACKET_HEADER_SIZE + arq->_dataSize);
+      }
+   }
+}
@@ -0,0 +1,243 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_arq
+ *
+ * Purpose:     Optional selective-repeat retransmission, so packets lost
+ *              to a bad sync word, length or CRC are sent again.  Every
+ *              packet carries a packet_arq trailer acknowledging what has
+ *              been received.  Packets carrying data are numbered and kept
+ *              in a window of _window packets until acknowledged, and each
+ *              one not acknowledged within _timeout packets is resent on
+ *              its own.  Packets received ahead of a lost one are held
+ *              until it arrives, so data is delivered once and in order.
+ *              No new data is sent while the window is full.
+ *
+ *              Shared by the driver and the slave model; both ends of the
+ *              link must use it.
+ *
+ * ***************************************************************************/
+
+#ifndef SPI_ARQ_H
+#define SPI_ARQ_H
+
+#include "spi_protocol.h"
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_init()
+ * Purpose:  Allocates the window, discarding any packets still held.  The
+ *           sequence numbers carry on from where they were, so the peer
+ *           sees a restart as lost packets rather than duplicates.
+ *
+ * Parameters:
+ *
+ * - IN:     window (packets held, 0 to disable, at most
+ *           SPIMOD_ARQ_MAX_WINDOW).
+ *           timeout (packets sent before an unacknowledged one is resent).
+ *           maxData (the data in the largest frame the handshake may agree
+ *           on, which sizes the slots, from PACKET_DATA_SIZE to
+ *           PACKET_DATA_MAX).
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state to initialise).
+ *
+ * Returns:  0 on success, -1 on failure (disabled).
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_arq_init(
+   struct spimod_arq* arq,
+   const u32 window,
+   const u32 timeout,
+   const u32 maxData);
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_term()
+ * Purpose:  Frees the window and disables retransmission.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state to terminate).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_arq_term(
+   struct spimod_arq* arq);
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_resize()
+ * Purpose:  Changes the frame size, which places the trailer, once both
+ *           ends have agreed on it.  Packets still held are discarded, as
+ *           by spimod_arq_init().
+ *
+ * Parameters:
+ *
+ * - IN:     dataSize (the data in a frame of the new size, no more than
+ *           the maxData given to spimod_arq_init()).
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_arq_resize(
+   struct spimod_arq* arq,
+   const u32 dataSize);
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_resync()
+ * Purpose:  Called when this end restarted, with _expected and the
+ *           packets held reset: the next trailer received sets the packet
+ *           expected from the peer, wherever its sequence numbers now are.
+ *           Packets sent and not acknowledged are kept, and resent as
+ *           usual.
+ *
+ *           Not for a peer that may have restarted: its numbering is taken
+ *           up once its _base is more than a window from _expected, and
+ *           taking up a _base behind _expected would deliver packets
+ *           again.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_arq_resync(
+   struct spimod_arq* arq);
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_resend()
+ * Purpose:  Copies the oldest packet due to be resent, if any, into pkt.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    pkt (the outbound packet).
+ * - IN/OUT: arq (the state).
+ *
+ * Returns:  1 if a packet is to be resent, else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_arq_resend(
+   struct spimod_arq* arq,
+   struct packet* pkt);
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_window_open()
+ * Purpose:  Returns whether a new packet of data may be sent.
+ *
+ * Parameters:
+ *
+ * - IN:     arq (the state).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 if there is room in the window, else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_arq_window_open(
+   const struct spimod_arq* arq);
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_stamp()
+ * Purpose:  Completes an outbound packet: numbers it and keeps a copy if it
+ *           carries new data, then writes the trailer and flags it
+ *           PACKET_FLAG_ARQ.  Must be called for every packet sent, before
+ *           any CRC is added.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state).
+ *           pkt (the outbound packet, _len at most _dataSize less
+ *           PACKET_TRAILER_SIZE).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_arq_stamp(
+   struct spimod_arq* arq,
+   struct packet* pkt);
+
+/******************************************************************************
+ *
+ * Function: spimod_arq_receive()
+ * Purpose:  Handles a validated inbound packet flagged PACKET_FLAG_ARQ:
+ *           releases the packets it acknowledges, then passes its data, and
+ *           any held packets it completes, to deliver in order.  Duplicates
+ *           are counted in _duplicates, and packets the peer gave up on,
+ *           or held when it restarted, in _lost.
+ *
+ * Parameters:
+ *
+ * - IN:     pkt (the inbound packet).
+ *           deliver (called with context for each packet of data in
+ *           order).
+ *           context (passed to deliver).
+ * - OUT:    N/A
+ * - IN/OUT: arq (the state).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_arq_receive(
+   struct spimod_arq* arq,
+   const struct packet* pkt,
+   void (*deliver)(void* context, const struct packet* pkt),
+   void* context);
+
+#endif
@@ -0,0 +1,321 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_bulk
+ *
+ * Purpose:     Bulk sends straight from pinned user pages, see spi_bulk.h.
+ *
+ *              A send is under way while _bulkSent is short of _bulkLen,
+ *              which is set last, with the pump stopped, so the pump never
+ *              sees the pages change.  Once done the pump no longer
+ *              touches them and _bulkWork unpins them, leaving _bulkLen
+ *              and _bulkSent for IOCTL_GET_BULK_STATUS.
+ *
+ * ***************************************************************************/
+
+#include "spi_bulk.h"
+#include "spi_compat.h"
+#include "spi_cursor.h"
+#include "circular_buffer.h"
+#include "spi4.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/vmalloc.h>
+
+#define __NO_VERSION__
+
+/* Externs, declared in spi_core.c */
+
+extern struct spimod_device_state device_state;
+
+/******************************************************************************
+ *
+ * Function: spimod_bulk_start()
+ * Purpose:  Pins a user space buffer and starts sending it.
+ *
+ * Parameters:
+ *
+ * - IN:     data (user space data).
+ *           length (size of the data).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel).
+ *
+ * Returns:  length on success, negative integer on failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_bulk_start(
+   struct spimod_channel* chan,
+   const char __user* data,
+   const u32 length)
+{
+   const unsigned long start = (unsigned long)data;
+   const u32 offset = offset_in_page(start);
+   struct page** pages;
+   u32 numPages;
+   int pinned;
+
+   if (chan->_datagram || 0 == length || length > SPIMOD_BULK_MAX)
+   {
+      return -EINVAL;
+   }
+
+   if (spimod_bulk_active(chan))
+   {
+      return -EBUSY;
+   }
+
+   // The work item may not yet have unpinned the last one
+
+   spimod_bulk_release(chan);
+
+   numPages = (offset + length + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+   pages = vmalloc(numPages * sizeof(struct page*));
+
+   if (NULL == pages)
+   {
+      return -ENOMEM;
+   }
+
+   pinned = spimod_pin_user_pages(start - offset, numPages, pages);
+
+   if (pinned != numPages)
+   {
+      if (pinned > 0)
+      {
+         spimod_unpin_user_pages(pages, pinned);
+      }
+
+      vfree(pages);
+
+      return (pinned < 0) ? pinned : -EFAULT;
+   }
+
+   chan->_bulkPages = pages;
+   chan->_bulkNumPages = numPages;
+   chan->_bulkOffset = offset;
+   chan->_bulkAfter = circular_buffer_num_bytes_available(chan->_txBuffer);
+   chan->_bulkSent = 0;
+   chan->_bulkLen = length;
+
+   return length;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_bulk_release()
+ * Purpose:  Unpins the pages of a bulk send, abandoning what is left.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_bulk_release(
+   struct spimod_channel* chan)
+{
+   if (chan->_bulkPages != NULL)
+   {
+      spimod_unpin_user_pages(chan->_bulkPages, chan->_bulkNumPages);
+
+      vfree(chan->_bulkPages);
+   }
+
+   // What is abandoned will never be sent.  A send that is done leaves
+   // nothing, and the pump may still be running then
+
+   if (chan->_bulkLen != chan->_bulkSent)
+   {
+      spimod_cursor_skip(chan, chan->_bulkLen - chan->_bulkSent);
+   }
+
+   chan->_bulkPages = NULL;
+   chan->_bulkNumPages = 0;
+   chan->_bulkLen = chan->_bulkSent;
+   chan->_bulkAfter = 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_bulk_active()
+ * Purpose:  Reports whether a channel has a bulk send under way.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 or 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_bulk_active(
+   const struct spimod_channel* chan)
+{
+   return chan->_bulkSent < chan->_bulkLen;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_bulk_pending()
+ * Purpose:  Returns how many bytes a bulk send has left to send.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The bytes left, 0 if none.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_bulk_pending(
+   const struct spimod_channel* chan)
+{
+   if (!spimod_bulk_active(chan))
+   {
+      return 0;
+   }
+
+   return chan->_bulkAfter + (chan->_bulkLen - chan->_bulkSent);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_bulk_fill()
+ * Purpose:  Removes up to space bytes of a bulk send for the next frame.
+ *
+ * Parameters:
+ *
+ * - IN:     space (room left in the packet).
+ * - OUT:    data (where to copy the bytes).
+ * - IN/OUT: chan (the channel).
+ *
+ * Returns:  Number of bytes copied.
+ *
+ * Globals:
+ *
+ * - device_state._statBulkSends, _statBulkBytes (updated).
+ *
+ * ***************************************************************************/
+
+int spimod_bulk_fill(
+   struct spimod_channel* chan,
+   char* data,
+   const int space)
+{
+   const int ahead = min_t(int, chan->_bulkAfter, space);
+   int len = 0;
+
+   if (!spimod_bulk_active(chan))
+   {
+      return 0;
+   }
+
+   // What was queued ahead of the bulk send goes first.  Less than that
+   // means the circular buffer was emptied under it.
+
+   if (ahead > 0)
+   {
+      len = circular_buffer_read(chan->_txBuffer, data, ahead);
+
+      chan->_bulkAfter = (len < ahead) ? 0 : chan->_bulkAfter - len;
+
+      if (chan->_bulkAfter > 0)
+      {
+         return len;
+      }
+   }
+
+   while (len < space && spimod_bulk_active(chan))
+   {
+      const u32 pos = chan->_bulkOffset + chan->_bulkSent;
+      const u32 inPage = pos & (PAGE_SIZE - 1);
+      u32 n = min_t(u32, PAGE_SIZE - inPage, chan->_bulkLen - chan->_bulkSent);
+      char* addr;
+
+      n = min_t(u32, n, space - len);
+
+      addr = spimod_kmap(chan->_bulkPages[pos >> PAGE_SHIFT]);
+
+      memcpy(data + len, addr + inPage, n);
+
+      spimod_kunmap(addr);
+
+      len += n;
+      chan->_bulkSent += n;
+      device_state._statBulkBytes += n;
+   }
+
+   if (!spimod_bulk_active(chan))
+   {
+      ++device_state._statBulkSends;
+
+      schedule_work(&chan->_bulkWork);
+   }
+
+   return len;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_bulk_work()
+ * Purpose:  Work item unpinning the pages of a finished bulk send.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: work (the channel's _bulkWork).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._fop_sem (held).
+ *
+ * ***************************************************************************/
+
+void spimod_bulk_work(
+   struct work_struct* work)
+{
+   struct spimod_channel* chan =
+      container_of(work, struct spimod_channel, _bulkWork);
+
+   down(&device_state._fop_sem);
+
+   // A new bulk send may have taken its place since
+
+   if (!spimod_bulk_active(chan))
+   {
+      spimod_bulk_release(chan);
+   }
+
+   up(&device_state._fop_sem);
+}
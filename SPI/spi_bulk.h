@@ -0,0 +1,176 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_bulk
+ *
+ * Purpose:     Bulk sends on a stream channel, straight from pinned pages of
+ *              the caller's buffer.  Transfers larger than the transmit
+ *              circular buffer are neither copied into it nor split into
+ *              calls of _bufLen bytes: the pump copies each frame's data
+ *              from the pages, and the pages are unpinned by a work item
+ *              once the last of it has been sent.
+ *
+ *              Ordering is kept with the circular buffer: what was queued
+ *              before the bulk send goes first, what is queued after it
+ *              waits for it to finish.
+ *
+ * ***************************************************************************/
+
+#ifndef SPI_BULK_H
+#define SPI_BULK_H
+
+#include "spi_protocol.h"
+
+/******************************************************************************
+ *
+ * Function: spimod_bulk_start()
+ * Purpose:  Pins a user space buffer and starts sending it.  Must be called
+ *           with device_state._fop_sem held and the read / write timer
+ *           stopped, and not in datagram mode.
+ *
+ * Parameters:
+ *
+ * - IN:     data (user space data).
+ *           length (size of the data, up to SPIMOD_BULK_MAX).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel, the pages of a finished bulk send unpinned
+ *           and those of data pinned).
+ *
+ * Returns:  length on success, -EINVAL for a datagram channel or a length
+ *           out of range, -EBUSY if a bulk send is under way, -ENOMEM if
+ *           the page array could not be allocated, -EFAULT (or the error
+ *           from pinning) if not all of data could be pinned.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_bulk_start(
+   struct spimod_channel* chan,
+   const char __user* data,
+   const u32 length);
+
+/******************************************************************************
+ *
+ * Function: spimod_bulk_release()
+ * Purpose:  Unpins the pages of a bulk send, abandoning whatever is left of
+ *           it, which counts as sent (see spi_cursor.h).  Must not race the
+ *           pump while the send is under way: call it with the read / write
+ *           timer stopped, or once it is done.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel, its bulk send finished).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_bulk_release(
+   struct spimod_channel* chan);
+
+/******************************************************************************
+ *
+ * Function: spimod_bulk_active()
+ * Purpose:  Reports whether a channel has a bulk send under way.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 if some of it is yet to be sent, else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_bulk_active(
+   const struct spimod_channel* chan);
+
+/******************************************************************************
+ *
+ * Function: spimod_bulk_pending()
+ * Purpose:  Returns how many bytes a bulk send, with what was queued ahead
+ *           of it, has left to send.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The bytes left, 0 if no bulk send is under way.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_bulk_pending(
+   const struct spimod_channel* chan);
+
+/******************************************************************************
+ *
+ * Function: spimod_bulk_fill()
+ * Purpose:  Removes up to space bytes of a bulk send for the next frame:
+ *           first what was queued in the transmit circular buffer ahead of
+ *           it, then data from its pages.  Schedules the pages to be
+ *           unpinned once the last byte has gone.  Called by the pump.
+ *
+ * Parameters:
+ *
+ * - IN:     space (room left in the packet).
+ * - OUT:    data (where to copy the bytes).
+ * - IN/OUT: chan (the channel, its bulk send advanced).
+ *
+ * Returns:  Number of bytes copied.
+ *
+ * Globals:
+ *
+ * - device_state._statBulkSends, _statBulkBytes (updated).
+ *
+ * ***************************************************************************/
+
+int spimod_bulk_fill(
+   struct spimod_channel* chan,
+   char* data,
+   const int space);
+
+/******************************************************************************
+ *
+ * Function: spimod_bulk_work()
+ * Purpose:  Work item unpinning the pages of a finished bulk send, out of
+ *           the pump's context.  Initialised as each channel's _bulkWork.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: work (the channel's _bulkWork).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._fop_sem (held while the pages are unpinned).
+ *
+ * ***************************************************************************/
+
+void spimod_bulk_work(
+   struct work_struct* work);
+
+#endif
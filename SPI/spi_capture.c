@@ -0,0 +1,376 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_capture
+ *
+ * Purpose:     Optional capture of every outbound and inbound packet into a
+ *              per-CPU relay channel for offline analysis.  Records are
+ *              written without blocking; if user space falls behind, records
+ *              are dropped and counted rather than stalling the pump.
+ *
+ *              The relay files appear as <debugfs>/<driver>/capture<cpu>
+ *              and may be drained with cat or the spicap tool.
+ *
+ * ***************************************************************************/
+
+#include "spi_capture.h"
+#include "spi_compat.h"
+#include "spi4.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/relay.h>
+#include <linux/ktime.h>
+#include <asm/div64.h>
+
+#define __NO_VERSION__
+
+/* Externs, declared in spi_core.c */
+
+extern struct spimod_device_state device_state;
+
+/* Constants */
+
+static const unsigned int PCAP_RECORD_HEADER_SIZE =
+   offsetof(struct spi_capture_record, _direction);
+
+/* Module parameters */
+
+static bool capture = 0;
+module_param(capture, bool, 0644);
+MODULE_PARM_DESC(capture, "Record outbound and inbound packets (default 0)");
+
+static unsigned int capture_snaplen = 0;
+module_param(capture_snaplen, uint, 0644);
+MODULE_PARM_DESC(capture_snaplen, "Bytes recorded per packet, 0 for all");
+
+static unsigned int capture_subbuf_size = 1024 * 16;
+module_param(capture_subbuf_size, uint, 0444);
+MODULE_PARM_DESC(capture_subbuf_size, "Size of each relay sub-buffer");
+
+static unsigned int capture_subbufs = 8;
+module_param(capture_subbufs, uint, 0444);
+MODULE_PARM_DESC(capture_subbufs, "Number of relay sub-buffers per CPU");
+
+/* The capture state */
+
+struct spimod_capture_state
+{
+   struct rchan*		_chan;
+   struct dentry*		_captured_file;
+   struct dentry*		_dropped_file;
+   atomic_t			_captured;
+   atomic_t			_dropped;
+};
+
+static struct spimod_capture_state capture_state;
+
+/******************************************************************************
+ *
+ * Function: spimod_capture_subbuf_start()
+ * Purpose:  Relay callback on switching to a new sub-buffer.  Refuses the
+ *           switch when every sub-buffer is still unread, so that the write
+ *           is dropped instead of overwriting data not yet consumed.
+ *
+ * Parameters:
+ *
+ * - IN:     subbuf, prev_subbuf, prev_padding (not used).
+ * - OUT:    N/A
+ * - IN/OUT: buf (the per-CPU relay buffer).
+ *
+ * Returns:  1 to accept the new sub-buffer, 0 to drop the write.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static int spimod_capture_subbuf_start(
+   struct rchan_buf* buf,
+   void* subbuf,
+   void* prev_subbuf,
+   size_t prev_padding)
+{
+   return relay_buf_full(buf) ? 0 : 1;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_capture_create_buf_file()
+ * Purpose:  Relay callback creating the debugfs file for a per-CPU buffer.
+ *
+ * Parameters:
+ *
+ * - IN:     filename (name of the file to create).
+ *           mode (file permissions).
+ * - OUT:    is_global (left as 0 - one file per CPU).
+ * - IN/OUT: parent (debugfs directory).
+ *           buf (the per-CPU relay buffer).
+ *
+ * Returns:  The created dentry, or NULL.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static struct dentry* spimod_capture_create_buf_file(
+   const char* filename,
+   struct dentry* parent,
+   spimod_umode_t mode,
+   struct rchan_buf* buf,
+   int* is_global)
+{
+   return debugfs_create_file(filename,
+                              mode,
+                              parent,
+                              buf,
+                              &relay_file_operations);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_capture_remove_buf_file()
+ * Purpose:  Relay callback removing the debugfs file for a per-CPU buffer.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: dentry (the file to remove).
+ *
+ * Returns:  Always 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static int spimod_capture_remove_buf_file(
+   struct dentry* dentry)
+{
+   debugfs_remove(dentry);
+
+   return 0;
+}
+
+static struct rchan_callbacks spimod_capture_callbacks = {
+   .subbuf_start	= spimod_capture_subbuf_start,
+   .create_buf_file	= spimod_capture_create_buf_file,
+   .remove_buf_file	= spimod_capture_remove_buf_file,
+};
+
+/* debugfs counters */
+
+static int spimod_capture_captured_get(void* data, u64* val)
+{
+   *val = atomic_read(&capture_state._captured);
+
+   return 0;
+}
+
+static int spimod_capture_dropped_get(void* data, u64* val)
+{
+   *val = atomic_read(&capture_state._dropped);
+
+   return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(spimod_capture_captured_fops,
+                        spimod_capture_captured_get, NULL, "%llu\n");
+DEFINE_SIMPLE_ATTRIBUTE(spimod_capture_dropped_fops,
+                        spimod_capture_dropped_get, NULL, "%llu\n");
+
+/******************************************************************************
+ *
+ * Function: spimod_capture_init()
+ * Purpose:  Creates the relay channel and its control files under the
+ *           supplied debugfs directory.
+ *
+ * Parameters:
+ *
+ * - IN:     parent (debugfs directory of this device, may be NULL).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 on success, -1 on failure.
+ *
+ * Globals:
+ *
+ * - capture_state (initialised).
+ *
+ * ***************************************************************************/
+
+int spimod_capture_init(
+   struct dentry* parent)
+{
+   const unsigned int recordSize = sizeof(struct spi_capture_record)
+                                 + PACKET_MAX_SIZE;
+
+   memset(&capture_state, 0, sizeof(struct spimod_capture_state));
+
+   if (IS_ERR_OR_NULL(parent))
+   {
+      printk(KERN_ALERT "spimod_capture_init() - debugfs unavailable\n");
+
+      return -1;
+   }
+
+   // A sub-buffer must hold at least one full record
+
+   if (capture_subbuf_size < recordSize)
+   {
+      capture_subbuf_size = recordSize;
+   }
+
+   if (capture_subbufs < 2)
+   {
+      capture_subbufs = 2;
+   }
+
+   capture_state._chan = relay_open("capture",
+                                    parent,
+                                    capture_subbuf_size,
+                                    capture_subbufs,
+                                    &spimod_capture_callbacks,
+                                    NULL);
+
+   if (NULL == capture_state._chan)
+   {
+      printk(KERN_ALERT "relay_open() failed\n");
+
+      return -1;
+   }
+
+   capture_state._captured_file = debugfs_create_file(
+      "capture_packets", 0444, parent, NULL, &spimod_capture_captured_fops);
+
+   capture_state._dropped_file = debugfs_create_file(
+      "capture_dropped", 0444, parent, NULL, &spimod_capture_dropped_fops);
+
+   return 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_capture_term()
+ * Purpose:  Closes the relay channel and removes its control files.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - capture_state (terminated).
+ *
+ * ***************************************************************************/
+
+void spimod_capture_term(void)
+{
+   capture = 0;
+
+   debugfs_remove(capture_state._captured_file);
+   debugfs_remove(capture_state._dropped_file);
+
+   if (capture_state._chan != NULL)
+   {
+      relay_close(capture_state._chan);
+
+      capture_state._chan = NULL;
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_capture_packet()
+ * Purpose:  Appends a timestamped copy of up to capture_snaplen bytes of the
+ *           packet to the relay buffer of the current CPU.  Does nothing
+ *           unless capture is enabled.
+ *
+ *           Safe to call from the timer (interrupt) context.
+ *
+ * Parameters:
+ *
+ * - IN:     direction (SPIMOD_CAPTURE_TX or SPIMOD_CAPTURE_RX).
+ *           pkt (the packet to record).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - capture_state._chan (record appended).
+ * - capture_state._captured (incremented on success).
+ * - capture_state._dropped (incremented if the relay buffer is full).
+ * - device_state._dataSize (the size of the frames recorded).
+ *
+ * ***************************************************************************/
+
+void spimod_capture_packet(
+   const int direction,
+   const struct packet* pkt)
+{
+   struct spi_capture_record record;
+   unsigned long flags;
+   const unsigned int size = PACKET_HEADER_SIZE + device_state._dataSize;
+   unsigned int len;
+   char* slot;
+   u64 ns;
+
+   if (likely(!capture) || NULL == capture_state._chan)
+   {
+      return;
+   }
+
+   len = size;
+
+   if (capture_snaplen > 0 && capture_snaplen < len)
+   {
+      len = capture_snaplen;
+   }
+
+   ns = ktime_to_ns(ktime_get_real());
+
+   // Everything after the pcap record header counts as captured data
+
+   record._tsNsec	= do_div(ns, NSEC_PER_SEC);
+   record._tsSec	= (u32)ns;
+   record._capLen	= sizeof(record) + len - PCAP_RECORD_HEADER_SIZE;
+   record._origLen	= sizeof(record) + size - PCAP_RECORD_HEADER_SIZE;
+   record._direction	= direction;
+
+   memset(record._reserved, 0, sizeof(record._reserved));
+
+   // relay_reserve() is lockless per CPU, so keep this CPU to ourselves
+
+   local_irq_save(flags);
+
+   slot = relay_reserve(capture_state._chan, sizeof(record) + len);
+
+   if (slot != NULL)
+   {
+      memcpy(slot, &record, sizeof(record));
+      memcpy(slot + sizeof(record), pkt, len);
+   }
+
+   local_irq_restore(flags);
+
+   if (slot != NULL)
+   {
+      atomic_inc(&capture_state._captured);
+   }
+   else
+   {
+      atomic_inc(&capture_state._dropped);
+   }
+}
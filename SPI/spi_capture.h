@@ -0,0 +1,95 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_capture
+ *
+ * Purpose:     Optional capture of every outbound and inbound packet into a
+ *              per-CPU relay channel for offline analysis.  Records are
+ *              written without blocking; if user space falls behind, records
+ *              are dropped and counted rather than stalling the pump.
+ *
+ * ***************************************************************************/
+
+#ifndef SPI_CAPTURE_H
+#define SPI_CAPTURE_H
+
+#include "spi_protocol.h"
+
+#include <linux/debugfs.h>
+
+/******************************************************************************
+ *
+ * Function: spimod_capture_init()
+ * Purpose:  Creates the relay channel and its control files under the
+ *           supplied debugfs directory.
+ *
+ * Parameters:
+ *
+ * - IN:     parent (debugfs directory of this device, may be NULL).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 on success, -1 on failure.
+ *
+ * Globals:
+ *
+ * - capture_state (initialised).
+ *
+ * ***************************************************************************/
+
+int spimod_capture_init(
+   struct dentry* parent);
+
+/******************************************************************************
+ *
+ * Function: spimod_capture_term()
+ * Purpose:  Closes the relay channel and removes its control files.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - capture_state (terminated).
+ *
+ * ***************************************************************************/
+
+void spimod_capture_term(void);
+
+/******************************************************************************
+ *
+ * Function: spimod_capture_packet()
+ * Purpose:  Appends a timestamped copy of up to capture_snaplen bytes of the
+ *           packet to the relay buffer of the current CPU.  Does nothing
+ *           unless capture is enabled.
+ *
+ *           Safe to call from the timer (interrupt) context.
+ *
+ * Parameters:
+ *
+ * - IN:     direction (SPIMOD_CAPTURE_TX or SPIMOD_CAPTURE_RX).
+ *           pkt (the packet to record).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - capture_state._chan (record appended).
+ * - capture_state._captured (incremented on success).
+ * - capture_state._dropped (incremented if the relay buffer is full).
+ *
+ * ***************************************************************************/
+
+void spimod_capture_packet(
+   const int direction,
+   const struct packet* pkt);
+
+#endif
@@ -0,0 +1,232 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_compat
+ *
+ * Purpose:     Kernel API differences between the LEC-3517 BSP kernel the
+ *              driver was written for and the current host kernels used
+ *              with the loopback controller (spi_loopback.c).
+ *
+ * ***************************************************************************/
+
+#ifndef SPI_COMPAT_H
+#define SPI_COMPAT_H
+
+#include <linux/version.h>
+#include <linux/hrtimer.h>
+
+/* ACCESS_ONCE() was split into READ_ONCE() / WRITE_ONCE() in 3.19 */
+
+#ifndef READ_ONCE
+#define READ_ONCE(x)			ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val)		(ACCESS_ONCE(x) = (val))
+#endif
+
+/* __devinit / __devexit annotations were removed in 3.8 */
+
+#ifndef __devexit_p
+#define __devexit_p(x)			x
+#endif
+
+/* Relay file modes became umode_t in 3.3 */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 3, 0)
+typedef umode_t spimod_umode_t;
+#else
+typedef int spimod_umode_t;
+#endif
+
+/* The SPI master was renamed the SPI controller in 4.13 */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
+#define spi_controller			spi_master
+#define spi_controller_get_devdata	spi_master_get_devdata
+#define spi_controller_get		spi_master_get
+#define spi_controller_put		spi_master_put
+#define spi_register_controller		spi_register_master
+#define spi_unregister_controller	spi_unregister_master
+#define spimod_controller_of(spi)	((spi)->master)
+#else
+#define spimod_controller_of(spi)	((spi)->controller)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+#define spi_alloc_host			spi_alloc_master
+#endif
+
+/* spi_busnum_to_master() was removed in 5.16 - devices must then be
+   declared by board code, the device tree or spi_loopback */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+#define SPIMOD_HAVE_BUSNUM_TO_MASTER	1
+#else
+#define SPIMOD_HAVE_BUSNUM_TO_MASTER	0
+#endif
+
+/* Transfers can be handed to the controller already DMA mapped
+   (spi_message.is_dma_mapped) until 6.10 */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+#define SPIMOD_HAVE_IS_DMA_MAPPED	1
+#else
+#define SPIMOD_HAVE_IS_DMA_MAPPED	0
+#endif
+
+/* spi_driver.remove() returns void from 5.18 */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+#define SPIMOD_REMOVE_RETURNS_VOID	1
+#else
+#define SPIMOD_REMOVE_RETURNS_VOID	0
+#endif
+
+/* class_create() lost its module argument in 6.4 */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define spimod_class_create(name)	class_create(name)
+#else
+#define spimod_class_create(name)	class_create(THIS_MODULE, name)
+#endif
+
+/* crc32c() moved from <linux/crc32c.h> to <linux/crc32.h> in 6.14 */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+#include <linux/crc32.h>
+#else
+#include <linux/crc32c.h>
+#endif
+
+/* random32() was renamed prandom_u32() in 3.8, which gave way to
+   get_random_u32() (from 4.11) in 6.2 */
+
+#include <linux/random.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#define spimod_random_u32()		get_random_u32()
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 8, 0)
+#define spimod_random_u32()		prandom_u32()
+#else
+#define spimod_random_u32()		random32()
+#endif
+
+/* read_iter / write_iter, with copy_from_iter() and copy_to_iter(),
+   arrived in 3.16 - older kernels only have read / write for each
+   segment of a readv() / writev() */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+#include <linux/uio.h>
+#define SPIMOD_HAVE_READ_ITER		1
+#else
+#define SPIMOD_HAVE_READ_ITER		0
+#endif
+
+/* splice() into the device goes through write_iter with
+   iter_file_splice_write(), where read_iter is.  Out of it, read_iter is
+   used by generic_file_splice_read() from 4.9 (pipe iterators), which gave
+   way to copy_splice_read() in 6.5.  Otherwise, until 5.10 removed them,
+   the default splice handlers go through write / read. */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define SPIMOD_HAVE_SPLICE_READ		1
+#define spimod_splice_read		copy_splice_read
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
+#define SPIMOD_HAVE_SPLICE_READ		1
+#define spimod_splice_read		generic_file_splice_read
+#else
+#define SPIMOD_HAVE_SPLICE_READ		0
+#endif
+
+/* IOCB_NOWAIT (4.13) asks read_iter / write_iter not to block, and a file
+   opened with FMODE_NOWAIT (4.14) honours it, so io_uring tries each read
+   and write inline and waits on poll() rather than in a worker thread */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+#define SPIMOD_HAVE_NOWAIT		1
+#else
+#define SPIMOD_HAVE_NOWAIT		0
+#endif
+
+/* poll() returns a __poll_t of EPOLL flags from 4.16, before then an
+   unsigned int of the same POLL flags */
+
+#include <linux/poll.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+typedef __poll_t spimod_poll_t;
+#else
+typedef unsigned int spimod_poll_t;
+#define EPOLLIN				POLLIN
+#define EPOLLPRI			POLLPRI
+#define EPOLLOUT			POLLOUT
+#define EPOLLRDNORM			POLLRDNORM
+#define EPOLLWRNORM			POLLWRNORM
+#endif
+
+/* Pages of user memory are pinned with pin_user_pages_fast() and released
+   with unpin_user_pages() from 5.6; before then each holds a reference
+   taken by get_user_pages_fast() */
+
+#include <linux/mm.h>
+#include <linux/highmem.h>
+
+static inline int spimod_pin_user_pages(
+   const unsigned long start,
+   const int numPages,
+   struct page** pages)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+   return pin_user_pages_fast(start, numPages, 0, pages);
+#else
+   return get_user_pages_fast(start, numPages, 0, pages);
+#endif
+}
+
+static inline void spimod_unpin_user_pages(
+   struct page** pages,
+   const int numPages)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+   unpin_user_pages(pages, numPages);
+#else
+   int i;
+
+   for (i = 0; i < numPages; ++i)
+   {
+      put_page(pages[i]);
+   }
+#endif
+}
+
+/* A page is mapped for a moment, from any context, with kmap_local_page()
+   from 5.11, before then kmap_atomic(), which took a slot until 3.4 */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+#define spimod_kmap(page)		kmap_local_page(page)
+#define spimod_kunmap(addr)		kunmap_local(addr)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 4, 0)
+#define spimod_kmap(page)		kmap_atomic(page)
+#define spimod_kunmap(addr)		kunmap_atomic(addr)
+#else
+#define spimod_kmap(page)		kmap_atomic(page, KM_IRQ0)
+#define spimod_kunmap(addr)		kunmap_atomic(addr, KM_IRQ0)
+#endif
+
+/* hrtimer_init() was replaced by hrtimer_setup() in 6.13 */
+
+static inline void spimod_hrtimer_setup(
+   struct hrtimer* timer,
+   enum hrtimer_restart (*function)(struct hrtimer*),
+   const clockid_t clock,
+   const enum hrtimer_mode mode)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+   hrtimer_setup(timer, function, clock, mode);
+#else
+   hrtimer_init(timer, clock, mode);
+
+   timer->function = function;
+#endif
+}
+
+#endif
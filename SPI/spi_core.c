@@ -12,6 +12,10 @@
 #include "spi4.h"
 #include "spi_protocol.h"
 #include "spi_fops.h"
+#include "spi_capture.h"
+#include "spi_hello.h"
+#include "spi_bulk.h"
+#include "spi_compat.h"
 #include "circular_buffer.h"
 
 #define LINUX
@@ -19,11 +23,37 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/delay.h>
 
-/* Constants */
+/* Module parameters */
 
-static const int TX_BUFFER_SIZE = 1024 * 16;
-static const int RX_BUFFER_SIZE = 1024 * 64;
+static unsigned int tx_buffer_size = 1024 * 16;
+module_param(tx_buffer_size, uint, 0444);
+MODULE_PARM_DESC(tx_buffer_size, "Transmit buffer size in bytes (default 16 KB)");
+
+static unsigned int rx_buffer_size = 1024 * 64;
+module_param(rx_buffer_size, uint, 0444);
+MODULE_PARM_DESC(rx_buffer_size, "Receive buffer size in bytes (default 64 KB)");
+
+static unsigned int channels = 1;
+module_param(channels, uint, 0444);
+MODULE_PARM_DESC(channels,
+                 "Logical channels, each its own minor device (1 to 8, default 1)");
+
+static bool crc = 0;
+module_param(crc, bool, 0444);
+MODULE_PARM_DESC(crc,
+                 "Protect every packet with a CRC-32C, the slave must too (default 0)");
+
+static unsigned int max_frame_size = 0;
+module_param(max_frame_size, uint, 0444);
+MODULE_PARM_DESC(max_frame_size,
+                 "Largest frame to agree with the slave at open, 0 for no handshake (up to 8192, default 0)");
+
+/* Minor numbers: channel N of the driver built with makedev_id M is minor
+   M + N * MINORS_PER_CHANNEL, so spimod1 and spimod2 interleave */
+
+static const int MINORS_PER_CHANNEL = 2;
 
 /* Global variables, used here and in other modules */
 
@@ -36,6 +66,15 @@ extern const int SPI_BUS;
 extern const char this_driver_name[];
 extern const int makedev_id;
 
+/* Adapts spimod_remove() to kernels where the callback returns void */
+
+#if SPIMOD_REMOVE_RETURNS_VOID
+static void spimod_remove_void(struct spi_device* spi_device)
+{
+   spimod_remove(spi_device);
+}
+#endif
+
 /* Instance of the driver handler */
 
 static struct spi_driver spimod_driver = {
@@ -45,7 +84,11 @@ static struct spi_driver spimod_driver = {
    },
 
    .probe	= spimod_probe,
+#if SPIMOD_REMOVE_RETURNS_VOID
+   .remove	= spimod_remove_void,
+#else
    .remove	= __devexit_p(spimod_remove),
+#endif
 };
 
 /* The file operations this driver is handling */
@@ -54,6 +97,15 @@ static const struct file_operations spimod_fops = {
    .owner		= THIS_MODULE,
    .read		= spimod_read,
    .write		= spimod_write,
+#if SPIMOD_HAVE_READ_ITER
+   .read_iter		= spimod_read_iter,
+   .write_iter		= spimod_write_iter,
+   .splice_write	= iter_file_splice_write,
+#endif
+#if SPIMOD_HAVE_SPLICE_READ
+   .splice_read		= spimod_splice_read,
+#endif
+   .poll		= spimod_poll,
    .unlocked_ioctl	= spimod_ioctl,
    .open		= spimod_open,
    .release		= spimod_close,
@@ -64,7 +116,8 @@ static const struct file_operations spimod_fops = {
  * Function: spimod_timer_callback()
  * Purpose:  Timer callback that performs the read / write transaction on the
  *           SPI device.  It will not perform a read / write transaction if
- *           the previous one is still in progress.
+ *           the previous one is still in progress.  The timer is forwarded
+ *           by spimod_pump_interval(), longer while the pump is idle.
  *
  * Parameters:
  *
@@ -77,26 +130,21 @@ static const struct file_operations spimod_fops = {
  * Globals:
  *
  * - device_state._timer_running (sanity check).
- * - device_transaction._busy (checks to see if a read / write transaction is
- *   already in progress).
  * - device_state._timer (the timer to use).
+ * - device_state._statTimerWakeups (updated).
  *
  * ***************************************************************************/
 
 static enum hrtimer_restart spimod_timer_callback(struct hrtimer* timer)
 {
-   if (device_state._timer_running && !device_transaction._busy)
-   {
-      spimod_create_outbound_packet();
-
-      spimod_queue_spi_read_write();
+   ++device_state._statTimerWakeups;
 
-      spimod_process_inbound_packet();
+   if (device_state._timer_running)
+   {
+      spimod_pump();
    }
 
-   hrtimer_forward_now(
-      &device_state._timer,
-      ktime_set(device_state._timer_period_s, device_state._timer_period_ns));
+   hrtimer_forward_now(&device_state._timer, spimod_pump_interval());
 
    return HRTIMER_RESTART;
 };
@@ -145,11 +193,42 @@ static int __init spimod_init_spi(void)
    return 0;
 };
 
+/******************************************************************************
+ *
+ * Function: spimod_term_cdev()
+ * Purpose:  Removes the character devices of the first count channels.
+ *
+ * Parameters:
+ *
+ * - IN:     count (number of channels to remove).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._channels (their _cdev and _devt released).
+ *
+ * ***************************************************************************/
+
+static void spimod_term_cdev(
+   const u32 count)
+{
+   u32 c;
+
+   for (c = 0; c < count; ++c)
+   {
+      cdev_del(&device_state._channels[c]._cdev);
+      unregister_chrdev_region(device_state._channels[c]._devt, 1);
+   }
+};
+
 /******************************************************************************
  *
  * Function: spimod_init_cdev()
- * Purpose:  Initialises the character device and registers its declared
- *           file operations.
+ * Purpose:  Initialises a character device per channel and registers its
+ *           declared file operations.
  *
  * Parameters:
  *
@@ -161,8 +240,8 @@ static int __init spimod_init_spi(void)
  *
  * Globals:
  *
- * - device_state._devt (updated with the device handle).
- * - device_state._cdev (update with the character device handle).
+ * - device_state._channels (_devt and _cdev updated with the device and
+ *   character device handles).
  * - spimod_fops (the declared list of file operations).
  *
  * ***************************************************************************/
@@ -170,40 +249,86 @@ static int __init spimod_init_spi(void)
 static int __init spimod_init_cdev(void)
 {
    int error;
+   u32 c;
 
-   device_state._devt = MKDEV(247, makedev_id);
+   for (c = 0; c < device_state._numChannels; ++c)
+   {
+      struct spimod_channel* chan = &device_state._channels[c];
 
-   error = register_chrdev_region(device_state._devt, 1, this_driver_name);
+      chan->_devt = MKDEV(247, makedev_id + c * MINORS_PER_CHANNEL);
 
-   if (error < 0)
-   {
-      printk(KERN_ALERT "alloc_chrdev_region() failed: %d \n", error);
+      error = register_chrdev_region(chan->_devt, 1, this_driver_name);
 
-      return -1;
-   }
+      if (error < 0)
+      {
+         printk(KERN_ALERT "alloc_chrdev_region() failed: %d \n", error);
 
-   cdev_init(&device_state._cdev, &spimod_fops);
+         spimod_term_cdev(c);
 
-   device_state._cdev.owner = THIS_MODULE;
+         return -1;
+      }
 
-   error = cdev_add(&device_state._cdev, device_state._devt, 1);
+      cdev_init(&chan->_cdev, &spimod_fops);
 
-   if (error)
-   {
-      printk(KERN_ALERT "cdev_add() failed: %d\n", error);
+      chan->_cdev.owner = THIS_MODULE;
 
-      unregister_chrdev_region(device_state._devt, 1);
+      error = cdev_add(&chan->_cdev, chan->_devt, 1);
 
-      return -1;
+      if (error)
+      {
+         printk(KERN_ALERT "cdev_add() failed: %d\n", error);
+
+         unregister_chrdev_region(chan->_devt, 1);
+
+         spimod_term_cdev(c);
+
+         return -1;
+      }
    }
 
    return 0;
 };
 
+/******************************************************************************
+ *
+ * Function: spimod_term_class()
+ * Purpose:  Removes the device nodes of the first count channels and the
+ *           class.
+ *
+ * Parameters:
+ *
+ * - IN:     count (number of device nodes to remove).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._class (destroyed).
+ * - device_state._channels (their _devt used).
+ *
+ * ***************************************************************************/
+
+static void spimod_term_class(
+   const u32 count)
+{
+   u32 c;
+
+   for (c = 0; c < count; ++c)
+   {
+      device_destroy(device_state._class, device_state._channels[c]._devt);
+   }
+
+   class_destroy(device_state._class);
+};
+
 /******************************************************************************
  *
  * Function: spimod_init_class()
- * Purpose:  Initialises the class of the character device.
+ * Purpose:  Initialises the class of the character device and a device
+ *           node per channel: /dev/spimodN for channel 0 and
+ *           /dev/spimodN.C for channel C.
  *
  * Parameters:
  *
@@ -216,13 +341,15 @@ static int __init spimod_init_cdev(void)
  * Globals:
  *
  * - device_state._class (updated with the class handle).
- * - device_state._devt (the device handle to use).
+ * - device_state._channels (their _devt used).
  *
  * ***************************************************************************/
 
 static int __init spimod_init_class(void)
 {
-   device_state._class = class_create(THIS_MODULE, this_driver_name);
+   u32 c;
+
+   device_state._class = spimod_class_create(this_driver_name);
 
    if (!device_state._class)
    {
@@ -231,17 +358,38 @@ static int __init spimod_init_class(void)
       return -1;
    }
 
-   if (!device_create(device_state._class,
-                      NULL,
-                      device_state._devt,
-                      NULL,
-                      this_driver_name))
+   for (c = 0; c < device_state._numChannels; ++c)
    {
-      printk(KERN_ALERT "device_create(..., %s) failed\n", this_driver_name);
-
-      class_destroy(device_state._class);
-
-      return -1;
+      struct device* dev;
+
+      if (0 == c)
+      {
+         dev = device_create(device_state._class,
+                             NULL,
+                             device_state._channels[c]._devt,
+                             NULL,
+                             this_driver_name);
+      }
+      else
+      {
+         dev = device_create(device_state._class,
+                             NULL,
+                             device_state._channels[c]._devt,
+                             NULL,
+                             "%s.%u",
+                             this_driver_name,
+                             c);
+      }
+
+      if (IS_ERR_OR_NULL(dev))
+      {
+         printk(KERN_ALERT "device_create(..., %s) channel %u failed\n",
+                this_driver_name, c);
+
+         spimod_term_class(c);
+
+         return -1;
+      }
    }
 
    return 0;
@@ -257,7 +405,8 @@ static int __init spimod_init_class(void)
  *
  *           The character device, the device class and the SPI driver are
  *           all initialised.  The outbound and inbound packets along with
- *           the transmit and receive circular buffers are also created.
+ *           the transmit and receive circular buffers are created when the
+ *           device is first opened (see spimod_open()).
  *
  * Parameters:
  *
@@ -271,34 +420,49 @@ static int __init spimod_init_class(void)
  *
  * - device_state (defaulted)
  * - device_transaction (defaulted)
- * - device_transaction._outPacket (created / defaulted)
- * - device_transaction._inPacket (created / defaulted)
  * - device_state._timer (initialised)
- * - device_state._txBuffer (created)
- * - device_state._rxBuffer (created)
+ * - device_state._numChannels (set from channels)
+ * - device_state._crc (set from crc)
+ * - device_state._dataSize (PACKET_DATA_SIZE until the handshake)
+ * - device_state._maxData (set from max_frame_size)
+ * - device_state._channels (buffer sizes set from tx_buffer_size and
+ *   rx_buffer_size, _bulkWork initialised)
+ * - device_state._releaseWork (initialised)
+ * - device_state._debugfs (created)
  *
  * ***************************************************************************/
 
 static int __init spimod_init(void)
 {
+   u32 c;
+
    printk(KERN_ALERT "Initialising module...\n");
 
    memset(&device_state, 0, sizeof(struct spimod_device_state));
    memset(&device_transaction, 0, sizeof(struct spimod_transaction));
 
-   device_transaction._outPacket = kmalloc(PACKET_SIZE, GFP_KERNEL | GFP_DMA);
-
-   memset(device_transaction._outPacket, 0, PACKET_SIZE);
-
-   device_transaction._inPacket = kmalloc(PACKET_SIZE, GFP_KERNEL | GFP_DMA);
-
-   memset(device_transaction._inPacket, 0, PACKET_SIZE);
-
    spin_lock_init(&device_state._spi_lock);
 
    sema_init(&device_state._fop_sem, 1);
    sema_init(&device_state._spi_sem, 1);
 
+   device_state._numChannels = clamp_t(u32, channels, 1, SPIMOD_MAX_CHANNELS);
+   device_state._crc = crc;
+   device_state._dataSize = PACKET_DATA_SIZE;
+   device_state._maxData = spimod_hello_max_data(max_frame_size);
+
+   for (c = 0; c < SPIMOD_MAX_CHANNELS; ++c)
+   {
+      device_state._channels[c]._txBufferSize =
+         clamp_t(u32, tx_buffer_size, PACKET_DATA_SIZE, MAX_BUFFER_SIZE);
+      device_state._channels[c]._rxBufferSize =
+         clamp_t(u32, rx_buffer_size, PACKET_DATA_SIZE, MAX_BUFFER_SIZE);
+
+      INIT_WORK(&device_state._channels[c]._bulkWork, spimod_bulk_work);
+      init_waitqueue_head(&device_state._channels[c]._wait);
+      spin_lock_init(&device_state._channels[c]._txLock);
+   }
+
    if (spimod_init_cdev() < 0)
    {
       goto fail_1;
@@ -319,21 +483,22 @@ static int __init spimod_init(void)
    device_state._timer_period_s = 0;
    device_state._timer_period_ns = NANOSECS_PER_SEC / WRITE_FREQUENCY;
 
-   hrtimer_init(&device_state._timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   spimod_hrtimer_setup(&device_state._timer,
+                        spimod_timer_callback,
+                        CLOCK_MONOTONIC,
+                        HRTIMER_MODE_REL);
 
-   device_state._timer.function = spimod_timer_callback;
+   INIT_DELAYED_WORK(&device_state._releaseWork, spimod_release_work);
 
-   device_state._txBuffer = circular_buffer_init(TX_BUFFER_SIZE);
-   device_state._rxBuffer = circular_buffer_init(RX_BUFFER_SIZE);
+   // Diagnostics are optional - the driver works without them
 
-   if ((NULL == device_state._txBuffer)
-    || (NULL == device_state._rxBuffer))
-   {
-      printk(KERN_ALERT "circular_buffer_init() failed tx = %X rx = %X\n",
-             (unsigned int)device_state._txBuffer,
-             (unsigned int)device_state._rxBuffer);
+   device_state._debugfs = debugfs_create_dir(this_driver_name, NULL);
 
-      goto fail_3;
+   spimod_stats_init(device_state._debugfs);
+
+   if (spimod_capture_init(device_state._debugfs) < 0)
+   {
+      printk(KERN_ALERT "Packet capture unavailable\n");
    }
 
    printk(KERN_ALERT "Module initialised\n");
@@ -341,12 +506,10 @@ static int __init spimod_init(void)
    return 0;
 
 fail_3:
-        device_destroy(device_state._class, device_state._devt);
-        class_destroy(device_state._class);
+        spimod_term_class(device_state._numChannels);
 
 fail_2:
-        cdev_del(&device_state._cdev);
-        unregister_chrdev_region(device_state._devt, 1);
+        spimod_term_cdev(device_state._numChannels);
 
 fail_1:
         return -1;
@@ -374,36 +537,64 @@ fail_1:
  *
  * Globals:
  *
- * - device_state._spi_device (unregistered)
+ * - device_state._spi_device (unregistered, if added by this driver)
  * - spimod_driver (unregistered)
  * - device_state._class (destroyed)
- * - device_state._cdev (destroyed)
- * - device_state._devt (unregistered)
- * - device_state._txBuffer (destroyed)
- * - device_state._rxBuffer (destroyed)
- * - device_transaction._outPacket (destroyed)
- * - device_transaction._inPacket (destroyed)
+ * - device_state._channels (_cdev destroyed, _devt unregistered, buffers
+ *   destroyed if allocated)
+ * - device_state._releaseWork (cancelled)
+ * - device_state._channels (_bulkWork cancelled)
+ * - device_transaction._busy (a transfer in flight is waited for, up to
+ *   100ms)
+ * - device_transaction._pool (destroyed, if allocated and no transfer is
+ *   still in flight)
+ * - device_state._debugfs (removed)
  *
  * ***************************************************************************/
 
 static void __exit spimod_exit(void)
 {
+   u32 c;
+   int waitMs;
+
    printk(KERN_ALERT "Terminating module...\n");
 
+#if SPIMOD_HAVE_BUSNUM_TO_MASTER
    spi_unregister_device(device_state._spi_device);
+#endif
    spi_unregister_driver(&spimod_driver);
 
-   device_destroy(device_state._class, device_state._devt);
-   class_destroy(device_state._class);
+   spimod_term_class(device_state._numChannels);
+
+   spimod_term_cdev(device_state._numChannels);
 
-   cdev_del(&device_state._cdev);
-   unregister_chrdev_region(device_state._devt, 1);
+   spimod_capture_term();
 
-   circular_buffer_term(device_state._txBuffer);
-   circular_buffer_term(device_state._rxBuffer);
+   if (!IS_ERR_OR_NULL(device_state._debugfs))
+   {
+      debugfs_remove_recursive(device_state._debugfs);
+   }
+
+   cancel_delayed_work_sync(&device_state._releaseWork);
+
+   for (c = 0; c < SPIMOD_MAX_CHANNELS; ++c)
+   {
+      cancel_work_sync(&device_state._channels[c]._bulkWork);
+   }
 
-   kfree(device_transaction._outPacket);
-   kfree(device_transaction._inPacket);
+   // A persistent pump, stopped above, may have left a transfer in flight.
+   // Should it never complete, its frames are leaked rather than freed
+   // under the controller.
+
+   for (waitMs = 0; device_transaction._busy && waitMs < 100; ++waitMs)
+   {
+      msleep(1);
+   }
+
+   if (!WARN(device_transaction._busy, "Transfer still in flight\n"))
+   {
+      spimod_resources_release();
+   }
 
    printk(KERN_ALERT "Module terminated\n");
 };
@@ -0,0 +1,135 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_crc
+ *
+ * Purpose:     Packet CRC, see spi_crc.h.
+ *
+ *              The CRC covers the header as sent, PACKET_FLAG_CRC included,
+ *              so a corrupted flag or length is caught as well as corrupted
+ *              data, the ARQ trailer of a packet flagged PACKET_FLAG_ARQ
+ *              and the hello of one flagged PACKET_FLAG_HELLO.  The
+ *              trailer is stored in host byte order, like the header
+ *              fields.
+ *
+ * ***************************************************************************/
+
+#include "spi_crc.h"
+#include "spi_compat.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+
+#define __NO_VERSION__
+
+/******************************************************************************
+ *
+ * Function: spimod_packet_crc()
+ * Purpose:  Computes the CRC-32C of a packet's header and data.
+ *
+ * Parameters:
+ *
+ * - IN:     pkt (the packet).
+ *           dataSize (the data in a frame of the size in use).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The CRC.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+u32 spimod_packet_crc(
+   const struct packet* pkt,
+   const u32 dataSize)
+{
+   // The header and data are contiguous, so one pass covers both.  A
+   // hello carries no data, only the hello itself.
+
+   u32 crc = crc32c(~0U, pkt, PACKET_HEADER_SIZE
+                              + ((pkt->_status & PACKET_FLAG_HELLO)
+                                    ? sizeof(struct packet_hello)
+                                    : pkt->_len));
+
+   if (pkt->_status & PACKET_FLAG_ARQ)
+   {
+      crc = crc32c(crc, pkt->_data + dataSize - PACKET_TRAILER_SIZE,
+                   sizeof(struct packet_arq));
+   }
+
+   return ~crc;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_packet_seal()
+ * Purpose:  Flags a packet PACKET_FLAG_CRC and stores its CRC in the
+ *           trailer.
+ *
+ * Parameters:
+ *
+ * - IN:     dataSize (the data in a frame of the size in use).
+ * - OUT:    N/A
+ * - IN/OUT: pkt (the packet).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_packet_seal(
+   struct packet* pkt,
+   const u32 dataSize)
+{
+   u32 crc;
+
+   pkt->_status |= PACKET_FLAG_CRC;
+
+   crc = spimod_packet_crc(pkt, dataSize);
+
+   memcpy(pkt->_data + dataSize - sizeof(crc), &crc, sizeof(crc));
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_packet_verify()
+ * Purpose:  Checks a received packet against the CRC in its trailer.
+ *
+ * Parameters:
+ *
+ * - IN:     pkt (the packet).
+ *           dataSize (the data in a frame of the size in use).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 if the packet is intact, else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_packet_verify(
+   const struct packet* pkt,
+   const u32 dataSize)
+{
+   u32 crc;
+
+   if (!(pkt->_status & PACKET_FLAG_CRC)
+    || (pkt->_len > dataSize - sizeof(crc)))
+   {
+      return 0;
+   }
+
+   memcpy(&crc, pkt->_data + dataSize - sizeof(crc), sizeof(crc));
+
+   return crc == spimod_packet_crc(pkt, dataSize);
+}
@@ -0,0 +1,99 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_crc
+ *
+ * Purpose:     Optional CRC-32C protecting each packet.  A protected packet
+ *              is flagged PACKET_FLAG_CRC and carries the CRC of its header
+ *              and its _len bytes of data in the last PACKET_CRC_SIZE bytes
+ *              of _data, so the frame size is unchanged and the data it can
+ *              hold drops by PACKET_CRC_SIZE.  The CRC is computed by the
+ *              kernel's crc32c library, which uses the CPU's CRC instructions
+ *              where it has them and a slice-by-8 table otherwise.
+ *
+ *              Shared by the driver and the slave model.
+ *
+ * ***************************************************************************/
+
+#ifndef SPI_CRC_H
+#define SPI_CRC_H
+
+#include "spi_protocol.h"
+
+/******************************************************************************
+ *
+ * Function: spimod_packet_crc()
+ * Purpose:  Computes the CRC-32C of a packet's header and data, and its
+ *           ARQ trailer if it has one.
+ *
+ * Parameters:
+ *
+ * - IN:     pkt (the packet, _len at most dataSize - PACKET_CRC_SIZE).
+ *           dataSize (the data in a frame of the size in use).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The CRC.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+u32 spimod_packet_crc(
+   const struct packet* pkt,
+   const u32 dataSize);
+
+/******************************************************************************
+ *
+ * Function: spimod_packet_seal()
+ * Purpose:  Flags a packet PACKET_FLAG_CRC and stores its CRC in the
+ *           trailer.  Must be the last change made to the packet.
+ *
+ * Parameters:
+ *
+ * - IN:     dataSize (the data in a frame of the size in use).
+ * - OUT:    N/A
+ * - IN/OUT: pkt (the packet, _len at most dataSize - PACKET_CRC_SIZE).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_packet_seal(
+   struct packet* pkt,
+   const u32 dataSize);
+
+/******************************************************************************
+ *
+ * Function: spimod_packet_verify()
+ * Purpose:  Checks that a received packet is flagged PACKET_FLAG_CRC, that
+ *           its data leaves room for the trailer and that the trailer holds
+ *           its CRC.
+ *
+ * Parameters:
+ *
+ * - IN:     pkt (the packet).
+ *           dataSize (the data in a frame of the size in use).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 if the packet is intact, else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_packet_verify(
+   const struct packet* pkt,
+   const u32 dataSize);
+
+#endif
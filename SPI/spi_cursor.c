@@ -0,0 +1,411 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_cursor
+ *
+ * Purpose:     Transmit cursors, see spi_cursor.h.
+ *
+ *              With retransmission a packet is acknowledged only once all
+ *              those before it are, so _txAcked follows _txFramed as of the
+ *              packet before _base, kept in _txFramedAt by sequence number.
+ *              Packets from _base - 1 to _next - 1 are never more than a
+ *              window and one apart, so SPIMOD_CURSOR_SLOTS of them are
+ *              plenty.
+ *
+ *              Only the last run of discarded data is kept.  Runs are rare
+ *              (a mode change, a reopen, an abandoned bulk send) and a
+ *              waiter checks as soon as its cursor is reached, so it is
+ *              not overwritten first in practice.
+ *
+ * ***************************************************************************/
+
+#include "spi_cursor.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+
+#define __NO_VERSION__
+
+/* Externs, declared in spi_core.c */
+
+extern struct spimod_device_state device_state;
+extern struct spimod_transaction device_transaction;
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_drop()
+ * Purpose:  Counts the data between two cursors as discarded.
+ *
+ * Parameters:
+ *
+ * - IN:     from (the cursor before the data).
+ *           to (the cursor after it).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static void spimod_cursor_drop(
+   struct spimod_channel* chan,
+   const u64 from,
+   const u64 to)
+{
+   unsigned long flags;
+
+   if (to == from)
+   {
+      return;
+   }
+
+   atomic64_add(to - from, &chan->_txDiscarded);
+
+   spin_lock_irqsave(&chan->_txLock, flags);
+
+   chan->_txDiscardFrom = from;
+   chan->_txDiscardTo = to;
+
+   spin_unlock_irqrestore(&chan->_txLock, flags);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_queued()
+ * Purpose:  Counts data queued to send on a channel.
+ *
+ * Parameters:
+ *
+ * - IN:     length (bytes queued).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel).
+ *
+ * Returns:  The new _txQueued.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+u64 spimod_cursor_queued(
+   struct spimod_channel* chan,
+   const u32 length)
+{
+   return atomic64_add_return(length, &chan->_txQueued);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_framed()
+ * Purpose:  Counts data put into the outbound frame for a channel.
+ *
+ * Parameters:
+ *
+ * - IN:     length (bytes put into the frame).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_cursor_framed(
+   struct spimod_channel* chan,
+   const u32 length)
+{
+   atomic64_add(length, &chan->_txFramed);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_skip()
+ * Purpose:  Counts data that will never be sent as discarded, sent and
+ *           acknowledged.
+ *
+ * Parameters:
+ *
+ * - IN:     length (bytes abandoned).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_cursor_skip(
+   struct spimod_channel* chan,
+   const u32 length)
+{
+   const u64 from = atomic64_read(&chan->_txFramed);
+
+   atomic64_add(length, &chan->_txFramed);
+   atomic64_add(length, &chan->_txSent);
+   atomic64_add(length, &chan->_txAcked);
+
+   spimod_cursor_drop(chan, from, from + length);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_discard()
+ * Purpose:  Counts everything queued on a channel and not yet framed as
+ *           discarded, and everything as sent and acknowledged.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_cursor_discard(
+   struct spimod_channel* chan)
+{
+   const u64 queued = atomic64_read(&chan->_txQueued);
+
+   spimod_cursor_drop(chan, atomic64_read(&chan->_txFramed), queued);
+
+   atomic64_set(&chan->_txFramed, queued);
+   atomic64_set(&chan->_txSent, queued);
+   atomic64_set(&chan->_txAcked, queued);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_transmitted()
+ * Purpose:  Counts the data framed so far as sent, and without
+ *           retransmission as acknowledged, unless the last transfer
+ *           failed.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_transaction._failed (read).
+ * - device_state._arq (_window read).
+ * - device_state._channels (their _txSent, _txAcked, _txDiscarded and
+ *   _wake updated).
+ *
+ * ***************************************************************************/
+
+void spimod_cursor_transmitted(void)
+{
+   u32 c;
+
+   for (c = 0; c < device_state._numChannels; ++c)
+   {
+      struct spimod_channel* chan = &device_state._channels[c];
+      const u64 framed = atomic64_read(&chan->_txFramed);
+
+      // A frame that never reached the bus is resent with retransmission,
+      // and otherwise lost
+
+      if (device_transaction._failed)
+      {
+         if (0 == device_state._arq._window)
+         {
+            spimod_cursor_drop(chan, atomic64_read(&chan->_txSent), framed);
+         }
+         else
+         {
+            continue;
+         }
+      }
+
+      if (atomic64_read(&chan->_txSent) != framed)
+      {
+         atomic64_set(&chan->_txSent, framed);
+         chan->_wake = 1;
+      }
+
+      if (0 == device_state._arq._window)
+      {
+         atomic64_set(&chan->_txAcked, framed);
+      }
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_stamp()
+ * Purpose:  Records every channel's _txFramed as of a numbered packet.
+ *
+ * Parameters:
+ *
+ * - IN:     seq (the packet's sequence number).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._channels (their _txFramedAt updated).
+ *
+ * ***************************************************************************/
+
+void spimod_cursor_stamp(
+   const u16 seq)
+{
+   u32 c;
+
+   for (c = 0; c < device_state._numChannels; ++c)
+   {
+      struct spimod_channel* chan = &device_state._channels[c];
+
+      chan->_txFramedAt[seq % SPIMOD_CURSOR_SLOTS] =
+         atomic64_read(&chan->_txFramed);
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_acknowledge()
+ * Purpose:  Advances every channel's _txAcked to what was framed as of the
+ *           last packet acknowledged in order.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._arq (_window, _base and _next read).
+ * - device_state._channels (their _txAcked and _wake updated).
+ *
+ * ***************************************************************************/
+
+void spimod_cursor_acknowledge(void)
+{
+   const struct spimod_arq* arq = &device_state._arq;
+   const u16 last = arq->_base - 1;
+   u32 c;
+
+   if (0 == arq->_window)
+   {
+      return;
+   }
+
+   for (c = 0; c < device_state._numChannels; ++c)
+   {
+      struct spimod_channel* chan = &device_state._channels[c];
+      u64 acked;
+
+      // With nothing in flight all that has been framed has been sent
+
+      if (arq->_base == arq->_next)
+      {
+         acked = atomic64_read(&chan->_txFramed);
+      }
+      else
+      {
+         acked = chan->_txFramedAt[last % SPIMOD_CURSOR_SLOTS];
+      }
+
+      acked = min(acked, (u64)atomic64_read(&chan->_txSent));
+
+      if (acked > (u64)atomic64_read(&chan->_txAcked))
+      {
+         atomic64_set(&chan->_txAcked, acked);
+         chan->_wake = 1;
+      }
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_reached()
+ * Purpose:  Reports whether a channel's data up to a cursor has been sent,
+ *           or acknowledged.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           cursor (the cursor).
+ *           acked (1 for the acknowledgement, 0 for the transfer).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 or 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_cursor_reached(
+   const struct spimod_channel* chan,
+   const u64 cursor,
+   const int acked)
+{
+   return (u64)atomic64_read(acked ? &chan->_txAcked : &chan->_txSent) >=
+          cursor;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_discarded()
+ * Purpose:  Reports whether the data just before a cursor was discarded.
+ *
+ * Parameters:
+ *
+ * - IN:     cursor (the cursor).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel).
+ *
+ * Returns:  1 or 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_cursor_discarded(
+   struct spimod_channel* chan,
+   const u64 cursor)
+{
+   unsigned long flags;
+   int discarded;
+
+   spin_lock_irqsave(&chan->_txLock, flags);
+
+   discarded = (cursor > chan->_txDiscardFrom) &&
+               (cursor <= chan->_txDiscardTo);
+
+   spin_unlock_irqrestore(&chan->_txLock, flags);
+
+   return discarded;
+}
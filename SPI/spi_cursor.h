@@ -0,0 +1,263 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_cursor
+ *
+ * Purpose:     Transmit cursors, so a sender can tell when its data has
+ *              left on the wire rather than only that it was queued.  Each
+ *              channel counts the bytes ever queued to send (_txQueued),
+ *              put into a frame (_txFramed), clocked out once that frame's
+ *              transfer has completed (_txSent) and acknowledged by the
+ *              slave (_txAcked).  The counts only ever grow, so the value
+ *              of _txQueued after a send is a cursor that the others reach
+ *              once the last of its data has been sent or acknowledged.
+ *
+ *              Without retransmission nothing is acknowledged, and data
+ *              counts as acknowledged once sent.  Data that will never be
+ *              sent, emptied by IOCTL_SET_MODE or a reopen or left of an
+ *              abandoned bulk send, is counted in _txDiscarded.  The others
+ *              pass over it, so no one waits for it, but a cursor at the
+ *              end of it can be told from one reached by sending (see
+ *              spimod_cursor_discarded()).  Priority messages are not
+ *              counted.
+ *
+ * ***************************************************************************/
+
+#ifndef SPI_CURSOR_H
+#define SPI_CURSOR_H
+
+#include "spi_protocol.h"
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_queued()
+ * Purpose:  Counts data queued to send on a channel.  Must be called with
+ *           device_state._fop_sem held.
+ *
+ * Parameters:
+ *
+ * - IN:     length (bytes queued, of message data in datagram mode).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel, its _txQueued advanced).
+ *
+ * Returns:  The new _txQueued, the cursor of the data.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+u64 spimod_cursor_queued(
+   struct spimod_channel* chan,
+   const u32 length);
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_framed()
+ * Purpose:  Counts data put into the outbound frame for a channel.  Called
+ *           by the pump.
+ *
+ * Parameters:
+ *
+ * - IN:     length (bytes put into the frame).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel, its _txFramed advanced).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_cursor_framed(
+   struct spimod_channel* chan,
+   const u32 length);
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_skip()
+ * Purpose:  Counts data that will never be sent as discarded, sent and
+ *           acknowledged.
+ *
+ * Parameters:
+ *
+ * - IN:     length (bytes abandoned).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel, its _txFramed, _txSent, _txAcked and
+ *           _txDiscarded advanced, and the run recorded).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_cursor_skip(
+   struct spimod_channel* chan,
+   const u32 length);
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_discard()
+ * Purpose:  Counts everything queued on a channel and not yet framed as
+ *           discarded, and everything as sent and acknowledged, once its
+ *           transmit buffer has been emptied.  Must not race the pump:
+ *           call it with the read / write timer stopped.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel, its _txFramed, _txSent and _txAcked set to
+ *           _txQueued, the rest counted in _txDiscarded).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_cursor_discard(
+   struct spimod_channel* chan);
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_transmitted()
+ * Purpose:  Counts the data of the frames framed so far as sent, and
+ *           without retransmission as acknowledged.  If the last transfer
+ *           failed its data is not counted then: without retransmission
+ *           it is counted as discarded, with it the frame is resent, and
+ *           its data counted as sent with the next frame that goes and as
+ *           acknowledged once the slave has it.  Called by the pump
+ *           once the last transfer has completed, before the next frame.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_transaction._failed (whether the last transfer failed).
+ * - device_state._arq (whether retransmission is enabled).
+ * - device_state._channels (their _txSent, _txAcked, _txDiscarded and
+ *   _wake updated).
+ *
+ * ***************************************************************************/
+
+void spimod_cursor_transmitted(void);
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_stamp()
+ * Purpose:  Records every channel's _txFramed as of a numbered packet, to be
+ *           taken as acknowledged with it.  Called by the pump once the
+ *           packet has been numbered.
+ *
+ * Parameters:
+ *
+ * - IN:     seq (the packet's sequence number).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._channels (their _txFramedAt updated).
+ *
+ * ***************************************************************************/
+
+void spimod_cursor_stamp(
+   const u16 seq);
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_acknowledge()
+ * Purpose:  With retransmission, advances every channel's _txAcked to what
+ *           was framed as of the last packet the slave has acknowledged,
+ *           all the packets before it acknowledged too, and flags the
+ *           channels that moved to be woken.  Called by the pump after
+ *           each inbound packet.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._arq (_base and _next read).
+ * - device_state._channels (their _txAcked and _wake updated).
+ *
+ * ***************************************************************************/
+
+void spimod_cursor_acknowledge(void);
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_reached()
+ * Purpose:  Reports whether a channel's data up to a cursor has been sent,
+ *           or acknowledged.  Checked without device_state._fop_sem.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           cursor (from spimod_cursor_queued()).
+ *           acked (1 for the acknowledgement, 0 for the transfer).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 or 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_cursor_reached(
+   const struct spimod_channel* chan,
+   const u64 cursor,
+   const int acked);
+
+/******************************************************************************
+ *
+ * Function: spimod_cursor_discarded()
+ * Purpose:  Reports whether the data just before a cursor was discarded
+ *           rather than sent, as of the last run discarded.  Checked
+ *           without device_state._fop_sem.
+ *
+ * Parameters:
+ *
+ * - IN:     cursor (from spimod_cursor_queued()).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel, its _txLock taken).
+ *
+ * Returns:  1 or 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_cursor_discarded(
+   struct spimod_channel* chan,
+   const u64 cursor);
+
+#endif
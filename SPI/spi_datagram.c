@@ -0,0 +1,611 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_datagram
+ *
+ * Purpose:     Optional message-oriented mode, see spi_datagram.h.
+ *
+ *              Both circular buffers of a channel hold messages as a 16 bit
+ *              length followed by the data.  The message being reassembled
+ *              is always the newest bytes of the receive buffer; its length
+ *              is filled in once the last fragment arrives, and only then
+ *              is it counted in _rxMessages and visible to the reader.
+ *
+ * ***************************************************************************/
+
+#include "spi_datagram.h"
+#include "circular_buffer.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+
+#define __NO_VERSION__
+
+/* Constants */
+
+static const int DATAGRAM_HEADER_SIZE = sizeof(u16);
+static const int DATAGRAM_MAX_SIZE = 0xFFFF;
+
+/* Externs, declared in spi_core.c */
+
+extern struct spimod_device_state device_state;
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_reset()
+ * Purpose:  Forgets any message part sent or reassembled.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel's datagram state is cleared).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_datagram_reset(
+   struct spimod_channel* chan)
+{
+   chan->_txRemaining = 0;
+   chan->_rxActive = 0;
+   chan->_rxPartial = 0;
+   chan->_rxLength = 0;
+
+   atomic_set(&chan->_rxMessages, 0);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_send_user()
+ * Purpose:  Queues one message from user space in the transmit circular
+ *           buffer, whole or not at all.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           data (user space message).
+ *           length (size of the message).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  length if queued, 0 if there is not yet room, negative integer
+ *           on failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_send_user(
+   struct spimod_channel* chan,
+   const char __user* data,
+   const int length)
+{
+   struct circular_buffer* buf = chan->_txBuffer;
+   u16 header = length;
+
+   if (length <= 0)
+   {
+      return -EINVAL;
+   }
+
+   if (length > DATAGRAM_MAX_SIZE
+    || DATAGRAM_HEADER_SIZE + length > buf->_capacity)
+   {
+      return -EMSGSIZE;
+   }
+
+   if (DATAGRAM_HEADER_SIZE + length > buf->_capacity - buf->_size)
+   {
+      return 0;
+   }
+
+   circular_buffer_write(buf, (const char*)&header, DATAGRAM_HEADER_SIZE);
+
+   // The pump only takes a message once all of it is queued, so a failed
+   // copy can simply be taken back
+
+   if (circular_buffer_write_user(buf, data, length) != length)
+   {
+      circular_buffer_unwrite(buf, DATAGRAM_HEADER_SIZE);
+
+      return -EFAULT;
+   }
+
+   return length;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_receive_user()
+ * Purpose:  Removes the oldest complete message from the receive circular
+ *           buffer into user space.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           length (size of the user space buffer).
+ * - OUT:    data (user space buffer).
+ * - IN/OUT: N/A
+ *
+ * Returns:  Size of the message, 0 if there is none, negative integer on
+ *           failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_receive_user(
+   struct spimod_channel* chan,
+   char __user* data,
+   const int length)
+{
+   struct circular_buffer* buf = chan->_rxBuffer;
+   int size = spimod_datagram_next_length(chan);
+
+   if (0 == size)
+   {
+      return 0;
+   }
+
+   if (size > length)
+   {
+      return -EMSGSIZE;
+   }
+
+   circular_buffer_discard(buf, DATAGRAM_HEADER_SIZE);
+
+   atomic_dec(&chan->_rxMessages);
+
+   if (circular_buffer_read_user(buf, data, size) != size)
+   {
+      circular_buffer_discard(buf, size);
+
+      return -EFAULT;
+   }
+
+   return size;
+}
+
+#if SPIMOD_HAVE_READ_ITER
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_send_iter()
+ * Purpose:  Queues what is left in an iterator as one message in the
+ *           transmit circular buffer, whole or not at all.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: from (the iterator).
+ *
+ * Returns:  Size of the message if queued, 0 if there is not yet room,
+ *           negative integer on failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_send_iter(
+   struct spimod_channel* chan,
+   struct iov_iter* from)
+{
+   struct circular_buffer* buf = chan->_txBuffer;
+   size_t count = iov_iter_count(from);
+   int length, copied;
+   u16 header;
+
+   if (0 == count)
+   {
+      return -EINVAL;
+   }
+
+   if (count > DATAGRAM_MAX_SIZE)
+   {
+      return -EMSGSIZE;
+   }
+
+   length = count;
+   header = length;
+
+   if (DATAGRAM_HEADER_SIZE + length > buf->_capacity)
+   {
+      return -EMSGSIZE;
+   }
+
+   if (DATAGRAM_HEADER_SIZE + length > buf->_capacity - buf->_size)
+   {
+      return 0;
+   }
+
+   circular_buffer_write(buf, (const char*)&header, DATAGRAM_HEADER_SIZE);
+
+   copied = circular_buffer_write_iter(buf, from, length);
+
+   if (copied != length)
+   {
+      circular_buffer_unwrite(buf, DATAGRAM_HEADER_SIZE + copied);
+
+      return -EFAULT;
+   }
+
+   return length;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_receive_iter()
+ * Purpose:  Removes the oldest complete message from the receive circular
+ *           buffer into an iterator.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: to (the iterator).
+ *
+ * Returns:  Size of the message, 0 if there is none, negative integer on
+ *           failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_receive_iter(
+   struct spimod_channel* chan,
+   struct iov_iter* to)
+{
+   struct circular_buffer* buf = chan->_rxBuffer;
+   int size = spimod_datagram_next_length(chan);
+   int copied;
+
+   if (0 == size)
+   {
+      return 0;
+   }
+
+   if ((size_t)size > iov_iter_count(to))
+   {
+      return -EMSGSIZE;
+   }
+
+   circular_buffer_discard(buf, DATAGRAM_HEADER_SIZE);
+
+   atomic_dec(&chan->_rxMessages);
+
+   copied = circular_buffer_read_iter(buf, to, size);
+
+   if (copied != size)
+   {
+      circular_buffer_discard(buf, size - copied);
+
+      return -EFAULT;
+   }
+
+   return size;
+}
+
+#endif
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_next_length()
+ * Purpose:  Returns the size of the oldest complete message received.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  Size of the message, 0 if there is none.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_next_length(
+   struct spimod_channel* chan)
+{
+   u16 header = 0;
+
+   if (0 == atomic_read(&chan->_rxMessages))
+   {
+      return 0;
+   }
+
+   circular_buffer_peek(chan->_rxBuffer,
+                        0,
+                        (char*)&header,
+                        DATAGRAM_HEADER_SIZE);
+
+   return header;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_room()
+ * Purpose:  Returns the largest message that could be queued now.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 to DATAGRAM_MAX_SIZE bytes.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_room(
+   struct spimod_channel* chan)
+{
+   struct circular_buffer* buf = chan->_txBuffer;
+   int room = buf->_capacity - buf->_size - DATAGRAM_HEADER_SIZE;
+
+   return clamp_t(int, room, 0, DATAGRAM_MAX_SIZE);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_pending()
+ * Purpose:  Returns how many bytes of message data could be sent now.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  Bytes left of the message being sent, else the size of the next
+ *           message if it is completely queued, else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_pending(
+   struct spimod_channel* chan)
+{
+   struct circular_buffer* buf = chan->_txBuffer;
+   u16 header;
+
+   if (chan->_txRemaining != 0)
+   {
+      return chan->_txRemaining;
+   }
+
+   if (circular_buffer_peek(buf, 0, (char*)&header, DATAGRAM_HEADER_SIZE)
+          != DATAGRAM_HEADER_SIZE
+    || DATAGRAM_HEADER_SIZE + header > buf->_size)
+   {
+      return 0;
+   }
+
+   return header;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_fragment()
+ * Purpose:  Copies the next fragment of the message being sent, up to space
+ *           bytes, and flags it.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           space (room left in the packet).
+ * - OUT:    data (the fragment).
+ *           flags (PACKET_FLAG_FIRST / _LAST as appropriate, else 0).
+ * - IN/OUT: N/A
+ *
+ * Returns:  Size of the fragment, 0 if there is nothing to send.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_fragment(
+   struct spimod_channel* chan,
+   char* data,
+   const int space,
+   short* flags)
+{
+   struct circular_buffer* buf = chan->_txBuffer;
+   int len;
+
+   *flags = 0;
+
+   if (space <= 0)
+   {
+      return 0;
+   }
+
+   if (0 == chan->_txRemaining)
+   {
+      int size = spimod_datagram_pending(chan);
+
+      if (0 == size)
+      {
+         return 0;
+      }
+
+      circular_buffer_discard(buf, DATAGRAM_HEADER_SIZE);
+
+      chan->_txRemaining = size;
+
+      *flags |= PACKET_FLAG_FIRST;
+   }
+
+   len = min_t(int, chan->_txRemaining, space);
+
+   circular_buffer_read(buf, data, len);
+
+   chan->_txRemaining -= len;
+
+   if (0 == chan->_txRemaining)
+   {
+      *flags |= PACKET_FLAG_LAST;
+   }
+
+   return len;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_reassemble()
+ * Purpose:  Appends an inbound fragment to the message being reassembled in
+ *           the receive circular buffer, and completes it on the last
+ *           fragment.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           flags (the fragment's PACKET_FLAG_FIRST / _LAST).
+ *           data (the fragment).
+ *           len (size of the fragment).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._statDatagramErrors, _statDatagramDropped (updated).
+ *
+ * ***************************************************************************/
+
+void spimod_datagram_reassemble(
+   struct spimod_channel* chan,
+   short flags,
+   const char* data,
+   const int len)
+{
+   struct circular_buffer* buf = chan->_rxBuffer;
+   u16 header = 0;
+
+   flags &= PACKET_FLAG_FIRST | PACKET_FLAG_LAST;
+
+   if (0 == flags)
+   {
+      // Idle, a middle fragment, or from a slave that does not flag
+      // fragments
+
+      if (0 == len)
+      {
+         return;
+      }
+
+      if (!chan->_rxActive)
+      {
+         flags = PACKET_FLAG_FIRST | PACKET_FLAG_LAST;
+      }
+   }
+
+   if (flags & PACKET_FLAG_FIRST)
+   {
+      if (chan->_rxActive)
+      {
+         // The last fragment of the previous message was lost
+
+         circular_buffer_unwrite(buf, chan->_rxPartial);
+
+         ++device_state._statDatagramErrors;
+      }
+
+      chan->_rxActive = 1;
+      chan->_rxLength = 0;
+      chan->_rxPartial = 0;
+
+      if (circular_buffer_write(buf, (const char*)&header, DATAGRAM_HEADER_SIZE)
+             == DATAGRAM_HEADER_SIZE)
+      {
+         chan->_rxPartial = DATAGRAM_HEADER_SIZE;
+      }
+      else
+      {
+         ++device_state._statDatagramDropped;
+      }
+   }
+   else if (!chan->_rxActive)
+   {
+      // The first fragment of this message was lost
+
+      ++device_state._statDatagramErrors;
+
+      return;
+   }
+
+   // A zero _rxPartial means the message is being discarded
+
+   if (chan->_rxPartial != 0 && len > 0)
+   {
+      if (chan->_rxLength + len > DATAGRAM_MAX_SIZE
+       || circular_buffer_write(buf, data, len) != len)
+      {
+         circular_buffer_unwrite(buf, chan->_rxPartial);
+
+         chan->_rxPartial = 0;
+
+         ++device_state._statDatagramDropped;
+      }
+      else
+      {
+         chan->_rxPartial += len;
+         chan->_rxLength += len;
+      }
+   }
+
+   if (flags & PACKET_FLAG_LAST)
+   {
+      if (chan->_rxPartial != 0)
+      {
+         if (chan->_rxLength > 0)
+         {
+            header = chan->_rxLength;
+
+            circular_buffer_poke(buf,
+                                 buf->_size - chan->_rxPartial,
+                                 (const char*)&header,
+                                 DATAGRAM_HEADER_SIZE);
+
+            atomic_inc(&chan->_rxMessages);
+         }
+         else
+         {
+            // Empty messages are not delivered
+
+            circular_buffer_unwrite(buf, chan->_rxPartial);
+         }
+      }
+
+      chan->_rxActive = 0;
+      chan->_rxPartial = 0;
+   }
+}
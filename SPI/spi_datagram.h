@@ -0,0 +1,288 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_datagram
+ *
+ * Purpose:     Optional message-oriented mode.  Each message sent is queued
+ *              in the channel's transmit circular buffer behind a 16 bit
+ *              length, and sent as one or more fragments flagged
+ *              PACKET_FLAG_FIRST / PACKET_FLAG_LAST (in the packet _status,
+ *              or the segment header with several channels).  Inbound
+ *              fragments are reassembled in place in the receive circular
+ *              buffer and handed to the reader only once complete, a whole
+ *              message at a time.
+ *
+ * ***************************************************************************/
+
+#ifndef SPI_DATAGRAM_H
+#define SPI_DATAGRAM_H
+
+#include "spi_protocol.h"
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_reset()
+ * Purpose:  Forgets any message part sent or reassembled.  Called whenever
+ *           the circular buffers are reset.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel's datagram state is cleared).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_datagram_reset(
+   struct spimod_channel* chan);
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_send_user()
+ * Purpose:  Queues one message from user space in the transmit circular
+ *           buffer.  The message is queued whole or not at all.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel, its _txBuffer receives the message).
+ *           data (user space message).
+ *           length (size of the message, 1 to 65535 bytes).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  length if queued, 0 if there is not yet room for it, -EINVAL if
+ *           it is empty, -EMSGSIZE if it can never fit, -EFAULT if it could
+ *           not be copied.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_send_user(
+   struct spimod_channel* chan,
+   const char __user* data,
+   const int length);
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_receive_user()
+ * Purpose:  Removes the oldest complete message from the receive circular
+ *           buffer into user space.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel, the message is removed from its _rxBuffer).
+ *           length (size of the user space buffer).
+ * - OUT:    data (user space buffer).
+ * - IN/OUT: N/A
+ *
+ * Returns:  Size of the message, 0 if there is none, -EMSGSIZE if it is
+ *           larger than length (the message is kept), -EFAULT if it could
+ *           not be copied (the message is lost).
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_receive_user(
+   struct spimod_channel* chan,
+   char __user* data,
+   const int length);
+
+#if SPIMOD_HAVE_READ_ITER
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_send_iter()
+ * Purpose:  As spimod_datagram_send_user(), but the message is everything
+ *           left in an iterator, so a writev() sends its segments as one
+ *           message.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel, its _txBuffer receives the message).
+ * - OUT:    N/A
+ * - IN/OUT: from (the iterator, advanced past the message if queued).
+ *
+ * Returns:  As spimod_datagram_send_user().
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_send_iter(
+   struct spimod_channel* chan,
+   struct iov_iter* from);
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_receive_iter()
+ * Purpose:  As spimod_datagram_receive_user(), but into an iterator, so a
+ *           readv() can scatter one message over its segments.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel, the message is removed from its _rxBuffer).
+ * - OUT:    N/A
+ * - IN/OUT: to (the iterator, advanced past the message).
+ *
+ * Returns:  As spimod_datagram_receive_user(), with the room left in the
+ *           iterator as length.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_receive_iter(
+   struct spimod_channel* chan,
+   struct iov_iter* to);
+
+#endif
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_next_length()
+ * Purpose:  Returns the size of the oldest complete message received.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  Size of the message, 0 if there is none.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_next_length(
+   struct spimod_channel* chan);
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_room()
+ * Purpose:  Returns the largest message that could be queued now.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 to 65535 bytes.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_room(
+   struct spimod_channel* chan);
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_pending()
+ * Purpose:  Returns how many bytes of message data could be sent now.  A
+ *           message is not started until it has been queued completely.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  Bytes left of the message being sent, else the size of the next
+ *           message if it is completely queued, else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_pending(
+   struct spimod_channel* chan);
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_fragment()
+ * Purpose:  Removes the next fragment of the message being sent, up to space
+ *           bytes, from the channel's transmit circular buffer, and returns
+ *           the flags it is to be sent with.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           space (room left in the packet).
+ * - OUT:    data (the fragment).
+ *           flags (PACKET_FLAG_FIRST / _LAST as appropriate, else 0).
+ * - IN/OUT: N/A
+ *
+ * Returns:  Size of the fragment, 0 if there is nothing to send.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_datagram_fragment(
+   struct spimod_channel* chan,
+   char* data,
+   const int space,
+   short* flags);
+
+/******************************************************************************
+ *
+ * Function: spimod_datagram_reassemble()
+ * Purpose:  Appends an inbound fragment to the message being reassembled in
+ *           the channel's receive circular buffer, and completes it on the
+ *           last fragment.  An unflagged fragment with data outside a
+ *           message is taken as a whole message.  Incomplete messages (a
+ *           missing first or last fragment) are counted in
+ *           _statDatagramErrors and messages that do not fit in
+ *           _statDatagramDropped, and discarded.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           flags (the fragment's PACKET_FLAG_FIRST / _LAST).
+ *           data (the fragment, already validated).
+ *           len (size of the fragment).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._statDatagramErrors, _statDatagramDropped (updated).
+ *
+ * ***************************************************************************/
+
+void spimod_datagram_reassemble(
+   struct spimod_channel* chan,
+   short flags,
+   const char* data,
+   const int len);
+
+#endif
@@ -0,0 +1,832 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_fec
+ *
+ * Purpose:     Forward error correction, see spi_fec.h.
+ *
+ *              Byte i of the frame belongs to codeword i % _codewords,
+ *              parity included.  The parity takes a multiple of
+ *              _codewords bytes, so each codeword has 2 * _t of them, and
+ *              a burst of up to _codewords * _t bytes anywhere is
+ *              corrected.  Each codeword is a shortened RS(255, k) code
+ *              whose generator polynomial has the roots a^0 to
+ *              a^(2 * _t - 1), its data bytes in packet order then its
+ *              parity.  _codewords is the fewest codewords of at most 255
+ *              bytes that cover a frame of the size in use.
+ *
+ *              The parity is the remainder of the codeword divided by the
+ *              generator, computed a byte at a time like a table driven
+ *              CRC: one lookup of the feedback byte gives the whole
+ *              multiple of the generator to add, a word at a time.  A
+ *              received codeword is checked by computing its parity again;
+ *              the difference has the same syndromes as the errors, so
+ *              only a damaged codeword costs more than encoding, and then
+ *              only 2 * _t squared for the syndromes before the errors are
+ *              located (Berlekamp-Massey, then a Chien search) and valued
+ *              (Forney).
+ *
+ * ***************************************************************************/
+
+#include "spi_fec.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/vmalloc.h>
+
+#define __NO_VERSION__
+
+/* Constants */
+
+// x^8 + x^4 + x^3 + x^2 + 1, as used by most byte oriented Reed-Solomon
+// codes
+
+static const int FEC_GF_POLY = 0x11D;
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_mul()
+ * Purpose:  Multiplies two elements of GF(2^8).
+ *
+ * Parameters:
+ *
+ * - IN:     tables (the lookup tables).
+ *           a, b (the elements).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The product.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static u8 spimod_fec_mul(
+   const struct spimod_fec_tables* tables,
+   const u8 a,
+   const u8 b)
+{
+   if (0 == a || 0 == b)
+   {
+      return 0;
+   }
+
+   return tables->_exp[tables->_log[a] + tables->_log[b]];
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_div()
+ * Purpose:  Divides two elements of GF(2^8).
+ *
+ * Parameters:
+ *
+ * - IN:     tables (the lookup tables).
+ *           a (the dividend).
+ *           b (the divisor, not 0).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The quotient.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static u8 spimod_fec_div(
+   const struct spimod_fec_tables* tables,
+   const u8 a,
+   const u8 b)
+{
+   if (0 == a)
+   {
+      return 0;
+   }
+
+   return tables->_exp[tables->_log[a] + SPIMOD_FEC_MAX_SYMBOLS
+                       - tables->_log[b]];
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_pow()
+ * Purpose:  Returns a power of a, the generator of GF(2^8).
+ *
+ * Parameters:
+ *
+ * - IN:     tables (the lookup tables).
+ *           power (the exponent, may be negative).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  a^power.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static u8 spimod_fec_pow(
+   const struct spimod_fec_tables* tables,
+   const int power)
+{
+   int e = power % SPIMOD_FEC_MAX_SYMBOLS;
+
+   return tables->_exp[(e < 0) ? e + SPIMOD_FEC_MAX_SYMBOLS : e];
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_eval()
+ * Purpose:  Evaluates a polynomial over GF(2^8).
+ *
+ * Parameters:
+ *
+ * - IN:     tables (the lookup tables).
+ *           poly (the coefficients, lowest order first).
+ *           degree (the degree of poly).
+ *           x (the point to evaluate it at).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  poly(x).
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static u8 spimod_fec_eval(
+   const struct spimod_fec_tables* tables,
+   const u8* poly,
+   const int degree,
+   const u8 x)
+{
+   u8 y = 0;
+   int i;
+
+   for (i = degree; i >= 0; --i)
+   {
+      y = spimod_fec_mul(tables, y, x) ^ poly[i];
+   }
+
+   return y;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_gather()
+ * Purpose:  Copies the data bytes of one codeword into _symbols, and its
+ *           parity bytes into parity.
+ *
+ * Parameters:
+ *
+ * - IN:     pkt (the packet).
+ *           codeword (the codeword to gather).
+ * - OUT:    parity (2 * _t bytes).
+ * - IN/OUT: fec (the state).
+ *
+ * Returns:  The number of data bytes in the codeword.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static int spimod_fec_gather(
+   struct spimod_fec* fec,
+   const struct packet* pkt,
+   const int codeword,
+   u8* parity)
+{
+   const u8* bytes = (const u8*)pkt;
+   const int start = PACKET_HEADER_SIZE + fec->_offset;
+   const int end = start + spimod_fec_overhead(fec);
+   const int frame = PACKET_HEADER_SIZE + fec->_dataSize;
+   int len = 0;
+   int i;
+
+   for (i = codeword; i < frame; i += fec->_codewords)
+   {
+      if (i >= start && i < end)
+      {
+         *parity++ = bytes[i];
+      }
+      else
+      {
+         fec->_symbols[len++] = bytes[i];
+      }
+   }
+
+   return len;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_scatter()
+ * Purpose:  Copies the data bytes of one codeword from _symbols, or its
+ *           parity bytes from _parity, back into the packet.
+ *
+ * Parameters:
+ *
+ * - IN:     fec (the state).
+ *           codeword (the codeword to scatter).
+ *           parity (1 for the parity bytes, 0 for the data bytes).
+ * - OUT:    N/A
+ * - IN/OUT: pkt (the packet).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static void spimod_fec_scatter(
+   const struct spimod_fec* fec,
+   struct packet* pkt,
+   const int codeword,
+   const int parity)
+{
+   u8* bytes = (u8*)pkt;
+   const int start = PACKET_HEADER_SIZE + fec->_offset;
+   const int end = start + spimod_fec_overhead(fec);
+   const u8* from = parity ? fec->_parity : fec->_symbols;
+   const int frame = PACKET_HEADER_SIZE + fec->_dataSize;
+   int i;
+
+   for (i = codeword; i < frame; i += fec->_codewords)
+   {
+      if ((i >= start && i < end) == parity)
+      {
+         bytes[i] = *from++;
+      }
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_remainder()
+ * Purpose:  Computes the parity of the len bytes in _symbols into _parity.
+ *
+ * Parameters:
+ *
+ * - IN:     len (the number of data bytes).
+ * - OUT:    N/A
+ * - IN/OUT: fec (the state).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static void spimod_fec_remainder(
+   struct spimod_fec* fec,
+   const int len)
+{
+   const int roots = 2 * fec->_t;
+   const int words = (roots + 7) / 8;
+   u64 reg[SPIMOD_FEC_WORDS] = { 0 };
+   int i, w;
+
+   // Byte j of the remainder is byte j % 8 of reg[j / 8], so shifting the
+   // remainder one byte towards the first is shifting reg right
+
+   for (i = 0; i < len; ++i)
+   {
+      const u64* row =
+         fec->_tables->_encode[(fec->_symbols[i] ^ reg[0]) & 0xFF];
+
+      for (w = 0; w < words - 1; ++w)
+      {
+         reg[w] = ((reg[w] >> 8) | (reg[w + 1] << 56)) ^ row[w];
+      }
+
+      reg[words - 1] = (reg[words - 1] >> 8) ^ row[words - 1];
+   }
+
+   for (i = 0; i < roots; ++i)
+   {
+      fec->_parity[i] = reg[i / 8] >> (8 * (i % 8));
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_correct()
+ * Purpose:  Corrects the data bytes of a damaged codeword in _symbols.
+ *
+ * Parameters:
+ *
+ * - IN:     len (the number of data bytes).
+ *           diff (the received parity less that of the received data).
+ * - OUT:    N/A
+ * - IN/OUT: fec (the state).
+ *
+ * Returns:  Bytes found in error, data and parity, or -1 if there are too
+ *           many to correct.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static int spimod_fec_correct(
+   struct spimod_fec* fec,
+   const int len,
+   const u8* diff)
+{
+   const struct spimod_fec_tables* tables = fec->_tables;
+   const int roots = 2 * fec->_t;
+   const int n = len + roots;
+   u8 syndromes[2 * SPIMOD_FEC_MAX_T];
+   u8 lambda[2 * SPIMOD_FEC_MAX_T + 1];
+   u8 prev[2 * SPIMOD_FEC_MAX_T + 1];
+   u8 saved[2 * SPIMOD_FEC_MAX_T + 1];
+   u8 omega[2 * SPIMOD_FEC_MAX_T];
+   int where[SPIMOD_FEC_MAX_T];
+   u8 lastDiscrepancy = 1;
+   int errors = 0;
+   int shift = 1;
+   int found = 0;
+   int i, j, k;
+
+   // diff is the parity of a codeword with no data, so the syndromes are
+   // its parity bytes evaluated at each root, the first the highest order
+
+   for (i = 0; i < roots; ++i)
+   {
+      u8 root = spimod_fec_pow(tables, i);
+      u8 sum = 0;
+
+      for (j = 0; j < roots; ++j)
+      {
+         sum = spimod_fec_mul(tables, sum, root) ^ diff[j];
+      }
+
+      syndromes[i] = sum;
+   }
+
+   // Berlekamp-Massey: the error locator lambda, whose roots are the
+   // inverses of the error positions
+
+   memset(lambda, 0, sizeof(lambda));
+   memset(prev, 0, sizeof(prev));
+
+   lambda[0] = 1;
+   prev[0] = 1;
+
+   for (i = 0; i < roots; ++i)
+   {
+      u8 discrepancy = syndromes[i];
+      u8 scale;
+
+      for (j = 1; j <= errors; ++j)
+      {
+         discrepancy ^= spimod_fec_mul(tables, lambda[j], syndromes[i - j]);
+      }
+
+      if (0 == discrepancy)
+      {
+         ++shift;
+
+         continue;
+      }
+
+      scale = spimod_fec_div(tables, discrepancy, lastDiscrepancy);
+
+      memcpy(saved, lambda, sizeof(saved));
+
+      for (j = 0; j + shift <= roots; ++j)
+      {
+         lambda[j + shift] ^= spimod_fec_mul(tables, scale, prev[j]);
+      }
+
+      if (2 * errors <= i)
+      {
+         errors = i + 1 - errors;
+
+         memcpy(prev, saved, sizeof(prev));
+
+         lastDiscrepancy = discrepancy;
+         shift = 1;
+      }
+      else
+      {
+         ++shift;
+      }
+   }
+
+   if (errors > fec->_t)
+   {
+      return -1;
+   }
+
+   // Chien search: an error at order k where lambda(a^-k) is 0, which must
+   // account for every root of lambda within the codeword
+
+   for (k = 0; k < n && found < errors; ++k)
+   {
+      if (0 == spimod_fec_eval(tables, lambda, errors,
+                               spimod_fec_pow(tables, -k)))
+      {
+         where[found++] = k;
+      }
+   }
+
+   if (found != errors)
+   {
+      return -1;
+   }
+
+   // Forney: the error evaluator omega is syndromes * lambda mod x^roots,
+   // and the value at X = a^k is X omega(1/X) / lambda'(1/X), lambda'
+   // having only the odd order terms of lambda
+
+   for (i = 0; i < roots; ++i)
+   {
+      omega[i] = 0;
+
+      for (j = 0; j <= i && j <= errors; ++j)
+      {
+         omega[i] ^= spimod_fec_mul(tables, syndromes[i - j], lambda[j]);
+      }
+   }
+
+   for (i = 0; i < found; ++i)
+   {
+      u8 inverse = spimod_fec_pow(tables, -where[i]);
+      u8 numerator = spimod_fec_mul(tables,
+                                    spimod_fec_pow(tables, where[i]),
+                                    spimod_fec_eval(tables, omega, roots - 1,
+                                                    inverse));
+      u8 denominator = 0;
+
+      for (j = 1; j <= errors; j += 2)
+      {
+         denominator ^= spimod_fec_mul(tables, lambda[j],
+                                       spimod_fec_pow(tables,
+                                                      -where[i] * (j - 1)));
+      }
+
+      if (0 == denominator)
+      {
+         return -1;
+      }
+
+      // Errors in the parity need no correcting
+
+      k = n - 1 - where[i];
+
+      if (k < len)
+      {
+         fec->_symbols[k] ^= spimod_fec_div(tables, numerator, denominator);
+      }
+   }
+
+   return found;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_layout()
+ * Purpose:  Places the codewords and parity in a frame of _dataSize bytes
+ *           of data.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: fec (the state).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static void spimod_fec_layout(
+   struct spimod_fec* fec)
+{
+   fec->_codewords = (PACKET_HEADER_SIZE + fec->_dataSize
+                      + SPIMOD_FEC_MAX_SYMBOLS - 1) / SPIMOD_FEC_MAX_SYMBOLS;
+   fec->_offset = fec->_dataSize - PACKET_TRAILER_SIZE
+                  - spimod_fec_overhead(fec);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_init()
+ * Purpose:  Builds the lookup tables for t correctable bytes per codeword.
+ *
+ * Parameters:
+ *
+ * - IN:     t (bytes corrected per codeword, 0 to disable).
+ * - OUT:    N/A
+ * - IN/OUT: fec (the state to initialise).
+ *
+ * Returns:  0 on success, -1 on failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_fec_init(
+   struct spimod_fec* fec,
+   const u32 t)
+{
+   struct spimod_fec_tables* tables;
+   u8 generator[2 * SPIMOD_FEC_MAX_T + 1];
+   int roots;
+   int i, j, x;
+
+   spimod_fec_term(fec);
+
+   if (0 == fec->_dataSize)
+   {
+      fec->_dataSize = PACKET_DATA_SIZE;
+   }
+
+   if (0 == t)
+   {
+      return 0;
+   }
+
+   tables = vmalloc(sizeof(struct spimod_fec_tables));
+
+   if (NULL == tables)
+   {
+      return -1;
+   }
+
+   memset(tables, 0, sizeof(struct spimod_fec_tables));
+
+   for (i = 0, x = 1; i < SPIMOD_FEC_MAX_SYMBOLS; ++i)
+   {
+      tables->_exp[i] = x;
+      tables->_exp[i + SPIMOD_FEC_MAX_SYMBOLS] = x;
+      tables->_log[x] = i;
+
+      x <<= 1;
+
+      if (x & 0x100)
+      {
+         x ^= FEC_GF_POLY;
+      }
+   }
+
+   // The generator, lowest order first, is the product of (x + a^i)
+
+   roots = 2 * min_t(u32, t, SPIMOD_FEC_MAX_T);
+
+   memset(generator, 0, sizeof(generator));
+
+   generator[0] = 1;
+
+   for (i = 0; i < roots; ++i)
+   {
+      u8 root = spimod_fec_pow(tables, i);
+
+      generator[i + 1] = 1;
+
+      for (j = i; j > 0; --j)
+      {
+         generator[j] = generator[j - 1]
+                        ^ spimod_fec_mul(tables, root, generator[j]);
+      }
+
+      generator[0] = spimod_fec_mul(tables, root, generator[0]);
+   }
+
+   // Byte j of the remainder, the first the highest order, gains the
+   // feedback times the coefficient of x^(roots - 1 - j)
+
+   for (x = 0; x < 256; ++x)
+   {
+      for (j = 0; j < roots; ++j)
+      {
+         u64 product = spimod_fec_mul(tables, x, generator[roots - 1 - j]);
+
+         tables->_encode[x][j / 8] |= product << (8 * (j % 8));
+      }
+   }
+
+   fec->_tables = tables;
+   fec->_t = roots / 2;
+
+   spimod_fec_layout(fec);
+
+   return 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_term()
+ * Purpose:  Frees the lookup tables and disables error correction.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: fec (the state to terminate).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_fec_term(
+   struct spimod_fec* fec)
+{
+   vfree(fec->_tables);
+
+   fec->_tables = NULL;
+   fec->_t = 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_resize()
+ * Purpose:  Spreads the codewords over frames of a new size.
+ *
+ * Parameters:
+ *
+ * - IN:     dataSize (the data in a frame of the new size).
+ * - OUT:    N/A
+ * - IN/OUT: fec (the state).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_fec_resize(
+   struct spimod_fec* fec,
+   const u32 dataSize)
+{
+   fec->_dataSize = dataSize;
+
+   spimod_fec_layout(fec);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_overhead()
+ * Purpose:  Returns the bytes of parity added to every packet.
+ *
+ * Parameters:
+ *
+ * - IN:     fec (the state).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The parity in bytes, 0 when disabled.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_fec_overhead(
+   const struct spimod_fec* fec)
+{
+   return fec->_codewords * 2 * fec->_t;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_encode()
+ * Purpose:  Writes the parity of an outbound packet.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: fec (the state).
+ *           pkt (the outbound packet).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_fec_encode(
+   struct spimod_fec* fec,
+   struct packet* pkt)
+{
+   u8 received[2 * SPIMOD_FEC_MAX_T];
+   int c;
+
+   for (c = 0; c < (int)fec->_codewords; ++c)
+   {
+      spimod_fec_remainder(fec, spimod_fec_gather(fec, pkt, c, received));
+      spimod_fec_scatter(fec, pkt, c, 1);
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_decode()
+ * Purpose:  Corrects a received packet in place.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: fec (the state).
+ *           pkt (the inbound packet).
+ *
+ * Returns:  Bytes corrected, or -1 if the packet could not be.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_fec_decode(
+   struct spimod_fec* fec,
+   struct packet* pkt)
+{
+   const int roots = 2 * fec->_t;
+   u8 received[2 * SPIMOD_FEC_MAX_T];
+   int corrected = 0;
+   int failed = 0;
+   int c, i;
+
+   for (c = 0; c < (int)fec->_codewords; ++c)
+   {
+      int len = spimod_fec_gather(fec, pkt, c, received);
+      int damaged = 0;
+      int count;
+
+      spimod_fec_remainder(fec, len);
+
+      for (i = 0; i < roots; ++i)
+      {
+         fec->_parity[i] ^= received[i];
+         damaged |= fec->_parity[i];
+      }
+
+      if (!damaged)
+      {
+         continue;
+      }
+
+      count = spimod_fec_correct(fec, len, fec->_parity);
+
+      if (count < 0)
+      {
+         failed = 1;
+      }
+      else
+      {
+         spimod_fec_scatter(fec, pkt, c, 0);
+
+         corrected += count;
+      }
+   }
+
+   fec->_corrected += corrected;
+
+   if (failed)
+   {
+      ++fec->_failed;
+
+      return -1;
+   }
+
+   if (corrected > 0)
+   {
+      ++fec->_repaired;
+   }
+
+   return corrected;
+}
@@ -0,0 +1,171 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_fec
+ *
+ * Purpose:     Optional forward error correction, so packets damaged by a
+ *              few bit errors are repaired rather than lost.  The whole
+ *              packet, header and trailers included, is protected by
+ *              interleaved Reed-Solomon codewords over GF(2^8), each
+ *              correcting up to _t damaged bytes.  The parity takes the
+ *              spimod_fec_overhead() bytes of _data just before the ARQ
+ *              trailer, so the data a packet can hold drops by as much.
+ *              Consecutive bytes belong to different codewords, so a burst
+ *              of errors is shared between them.
+ *
+ *              Shared by the driver and the slave model; both ends of the
+ *              link must use the same _t.
+ *
+ * ***************************************************************************/
+
+#ifndef SPI_FEC_H
+#define SPI_FEC_H
+
+#include "spi_protocol.h"
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_init()
+ * Purpose:  Builds the lookup tables for t correctable bytes per codeword.
+ *
+ * Parameters:
+ *
+ * - IN:     t (bytes corrected per codeword, 0 to disable, at most
+ *           SPIMOD_FEC_MAX_T).
+ * - OUT:    N/A
+ * - IN/OUT: fec (the state to initialise).
+ *
+ * Returns:  0 on success, -1 on failure (disabled).
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_fec_init(
+   struct spimod_fec* fec,
+   const u32 t);
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_term()
+ * Purpose:  Frees the lookup tables and disables error correction.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: fec (the state to terminate).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_fec_term(
+   struct spimod_fec* fec);
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_resize()
+ * Purpose:  Changes the frame size the codewords cover, once both ends
+ *           have agreed on it.  Larger frames take more codewords, so more
+ *           parity.
+ *
+ * Parameters:
+ *
+ * - IN:     dataSize (the data in a frame of the new size).
+ * - OUT:    N/A
+ * - IN/OUT: fec (the state).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_fec_resize(
+   struct spimod_fec* fec,
+   const u32 dataSize);
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_overhead()
+ * Purpose:  Returns the bytes of parity added to every packet.
+ *
+ * Parameters:
+ *
+ * - IN:     fec (the state).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The parity in bytes, 0 when disabled.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_fec_overhead(
+   const struct spimod_fec* fec);
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_encode()
+ * Purpose:  Writes the parity of an outbound packet.  Must be called last,
+ *           after any CRC is added.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: fec (the state).
+ *           pkt (the outbound packet, _len at most _offset).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_fec_encode(
+   struct spimod_fec* fec,
+   struct packet* pkt);
+
+/******************************************************************************
+ *
+ * Function: spimod_fec_decode()
+ * Purpose:  Corrects a received packet in place, before anything else in
+ *           it is read.  Bytes corrected are counted in _corrected, packets
+ *           repaired in _repaired and packets beyond repair in _failed.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: fec (the state).
+ *           pkt (the inbound packet).
+ *
+ * Returns:  Bytes corrected, or -1 if the packet could not be.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_fec_decode(
+   struct spimod_fec* fec,
+   struct packet* pkt);
+
+#endif
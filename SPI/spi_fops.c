@@ -10,11 +10,17 @@
 
 #include "spi_fops.h"
 #include "spi_protocol.h"
+#include "spi_datagram.h"
+#include "spi_priority.h"
+#include "spi_bulk.h"
+#include "spi_cursor.h"
 #include "spi4.h"
 
 #include <linux/module.h>
 #include <linux/kernel.h>
-#include <asm/uaccess.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+#include <linux/delay.h>
 
 #define __NO_VERSION_
 
@@ -23,212 +29,1768 @@
 extern struct spimod_device_state device_state;
 extern struct spimod_transaction device_transaction;
 
+/* Module parameters */
+
+static int idle_release_ms = 5000;
+module_param(idle_release_ms, int, 0644);
+MODULE_PARM_DESC(idle_release_ms,
+                 "Free buffers this long after the last close, -1 never (default 5000)");
+
+static bool datagram = 0;
+module_param(datagram, bool, 0644);
+MODULE_PARM_DESC(datagram, "Open in datagram (message) mode (default 0)");
+
+static bool persistent = 0;
+module_param(persistent, bool, 0644);
+MODULE_PARM_DESC(persistent,
+                 "Keep receiving while closed, and keep the buffers on reopen (default 0)");
+
+/******************************************************************************
+ *
+ * Function: spimod_resize_buffers()
+ * Purpose:  Resizes a channel's transmit and / or receive circular buffers, keeping
+ *           any data already queued in them.  The read / write timer is
+ *           stopped for the duration so the buffers are not in use.  Must be
+ *           called with device_state._fop_sem held.
+ *
+ * Parameters:
+ *
+ * - IN:     txSize (new transmit buffer size, 0 to leave unchanged).
+ *           rxSize (new receive buffer size, 0 to leave unchanged).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel whose buffers are resized).
+ *
+ * Returns:  0 on success, -EINVAL if a size is out of range, -EBUSY if more
+ *           data is queued than a new size can hold, -ENOMEM if storage
+ *           could not be allocated.
+ *
+ * Globals:
+ *
+ * - device_state._timer (stopped and restarted if running).
+ * - The channel's _wait (woken).
+ *
+ * ***************************************************************************/
+
+static long spimod_resize_buffers(
+   struct spimod_channel* chan,
+   const unsigned int txSize,
+   const unsigned int rxSize)
+{
+   long result = 0;
+
+   if ((txSize != 0 && (txSize < PACKET_DATA_SIZE || txSize > MAX_BUFFER_SIZE)) ||
+       (rxSize != 0 && (rxSize < PACKET_DATA_SIZE || rxSize > MAX_BUFFER_SIZE)))
+   {
+      return -EINVAL;
+   }
+
+   if ((txSize != 0 &&
+        txSize < circular_buffer_num_bytes_available(chan->_txBuffer)) ||
+       (rxSize != 0 &&
+        rxSize < circular_buffer_num_bytes_available(chan->_rxBuffer)))
+   {
+      return -EBUSY;
+   }
+
+   if (device_state._timer_running)
+   {
+      hrtimer_cancel(&device_state._timer);
+   }
+
+   if (txSize != 0 && txSize != chan->_txBufferSize)
+   {
+      if (circular_buffer_resize(chan->_txBuffer, txSize) < 0)
+      {
+         result = -ENOMEM;
+      }
+      else
+      {
+         chan->_txBufferSize = txSize;
+      }
+   }
+
+   if (0 == result && rxSize != 0 && rxSize != chan->_rxBufferSize)
+   {
+      if (circular_buffer_resize(chan->_rxBuffer, rxSize) < 0)
+      {
+         result = -ENOMEM;
+      }
+      else
+      {
+         chan->_rxBufferSize = rxSize;
+      }
+   }
+
+   // Writers may now have room
+
+   wake_up_interruptible(&chan->_wait);
+
+   if (device_state._timer_running)
+   {
+      hrtimer_start(&device_state._timer,
+                    spimod_pump_interval(),
+                    HRTIMER_MODE_REL);
+   }
+
+   return result;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_set_mode()
+ * Purpose:  Switches a channel between stream and datagram mode.  Both
+ *           of its circular buffers are emptied, and any bulk send
+ *           abandoned, with the read / write timer stopped; what was
+ *           queued counts as sent (see spi_cursor.h).  Must be called
+ *           with device_state._fop_sem held.
+ *
+ * Parameters:
+ *
+ * - IN:     mode (SPIMOD_MODE_STREAM or SPIMOD_MODE_DATAGRAM).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel, its buffers cleared, its bulk pages
+ *           unpinned, its transmit cursors caught up and _datagram set).
+ *
+ * Returns:  0 on success, -EINVAL for an unknown mode.
+ *
+ * Globals:
+ *
+ * - device_state._timer (stopped and restarted if running).
+ * - The channel's _wait (woken).
+ *
+ * ***************************************************************************/
+
+static long spimod_set_mode(
+   struct spimod_channel* chan,
+   const unsigned long mode)
+{
+   if (mode != SPIMOD_MODE_STREAM && mode != SPIMOD_MODE_DATAGRAM)
+   {
+      return -EINVAL;
+   }
+
+   if (device_state._timer_running)
+   {
+      hrtimer_cancel(&device_state._timer);
+   }
+
+   circular_buffer_reset(chan->_txBuffer);
+   circular_buffer_reset(chan->_rxBuffer);
+
+   spimod_datagram_reset(chan);
+   spimod_bulk_release(chan);
+   spimod_cursor_discard(chan);
+
+   chan->_datagram = (SPIMOD_MODE_DATAGRAM == mode);
+
+   // Waiters check again against the new mode and empty buffers
+
+   wake_up_interruptible(&chan->_wait);
+
+   if (device_state._timer_running)
+   {
+      hrtimer_start(&device_state._timer,
+                    spimod_pump_interval(),
+                    HRTIMER_MODE_REL);
+   }
+
+   return 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_set_bus_config()
+ * Purpose:  Changes the bus clock, SPI mode and word size between frames.
+ *           The read / write timer is stopped and any transfer in flight
+ *           allowed to complete first.  Must be called with
+ *           device_state._fop_sem held.
+ *
+ * Parameters:
+ *
+ * - IN:     config (the new settings, from user space).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 on success, -EFAULT if config could not be read, -EBUSY if
+ *           the transfer in flight did not complete, otherwise as
+ *           spimod_bus_setup().
+ *
+ * Globals:
+ *
+ * - device_state._timer (stopped and restarted if running).
+ * - device_transaction._busy (waited on).
+ *
+ * ***************************************************************************/
+
+static long spimod_set_bus_config(
+   struct spi_ioc_bus_config __user* config)
+{
+   unsigned int speedHz, mode, bitsPerWord;
+   long result = 0;
+   int waitMs;
+
+   if (get_user(speedHz, &config->_speedHz) ||
+       get_user(mode, &config->_mode) ||
+       get_user(bitsPerWord, &config->_bitsPerWord))
+   {
+      return -EFAULT;
+   }
+
+   if (device_state._timer_running)
+   {
+      hrtimer_cancel(&device_state._timer);
+   }
+
+   // A frame takes a few ms even at the slowest useful clock
+
+   for (waitMs = 0; device_transaction._busy && waitMs < 100; ++waitMs)
+   {
+      msleep(1);
+   }
+
+   if (device_transaction._busy)
+   {
+      result = -EBUSY;
+   }
+   else
+   {
+      result = spimod_bus_setup(speedHz, mode, bitsPerWord);
+   }
+
+   if (device_state._timer_running)
+   {
+      hrtimer_start(&device_state._timer,
+                    spimod_pump_interval(),
+                    HRTIMER_MODE_REL);
+   }
+
+   return result;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_send()
+ * Purpose:  Queues data from user space on a channel, as one message in
+ *           datagram mode.  Must be called with device_state._fop_sem
+ *           held.
+ *
+ * Parameters:
+ *
+ * - IN:     buf (user space data).
+ *           len (size of the data).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel, its _txBuffer receives the data, counted
+ *           in _txQueued).
+ *
+ * Returns:  len if queued, 0 if there is not yet room for all of it,
+ *           negative integer on failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static long spimod_send(
+   struct spimod_channel* chan,
+   __u8* buf,
+   const unsigned short len)
+{
+   long numBytes;
+
+   if (chan->_datagram)
+   {
+      numBytes = spimod_datagram_send_user(chan, buf, len);
+   }
+   else
+   {
+      numBytes = circular_buffer_write_user(chan->_txBuffer, buf, len);
+
+      if (numBytes != len)
+      {
+         printk(KERN_ALERT "IOCTL_SEND_DATA - requested %d written %ld\n",
+                len,
+                numBytes);
+      }
+   }
+
+   if (numBytes > 0)
+   {
+      spimod_cursor_queued(chan, numBytes);
+   }
+
+   return numBytes;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_receive()
+ * Purpose:  Removes received data from a channel into user space, one
+ *           whole message in datagram mode.  Must be called with
+ *           device_state._fop_sem held.
+ *
+ * Parameters:
+ *
+ * - IN:     len (size of the user space buffer).
+ * - OUT:    buf (user space buffer).
+ * - IN/OUT: chan (the channel, the data is removed from its _rxBuffer).
+ *
+ * Returns:  The number of bytes received, 0 if there were none, negative
+ *           integer on failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static long spimod_receive(
+   struct spimod_channel* chan,
+   __u8* buf,
+   const unsigned short len)
+{
+   if (chan->_datagram)
+   {
+      return spimod_datagram_receive_user(chan, buf, len);
+   }
+
+   return circular_buffer_read_user(chan->_rxBuffer, buf, len);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_put_status()
+ * Purpose:  Reports a channel's status to user space.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    status (user space status).
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 on success, -EFAULT if the status could not be written.
+ *
+ * Globals:
+ *
+ * - device_transaction._inPacket->_status (for slave CTS status).
+ *
+ * ***************************************************************************/
+
+static long spimod_put_status(
+   struct spimod_channel* chan,
+   struct spi_ioc_status* status)
+{
+   unsigned int available = chan->_datagram
+                  ? spimod_datagram_next_length(chan)
+                  : circular_buffer_num_bytes_available(chan->_rxBuffer);
+   unsigned int clearToSend =
+      ((device_transaction._inPacket->_status & PACKET_STATUS_MASK)
+          == SLAVE_RX_ABLE) ? 1: 0;
+
+   if (put_user(available, &status->_rxBytesAvailable) ||
+       put_user(clearToSend, &status->_clearToSend))
+   {
+      return -EFAULT;
+   }
+
+   return 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_send_vector()
+ * Purpose:  Queues the messages of a vector in order, stopping at the first
+ *           that is not queued whole, and wakes the pump if any were.
+ *           Must be called with device_state._fop_sem held.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel).
+ *           vector (user space vector, its entries' _result and its _done
+ *           are set).
+ *
+ * Returns:  The number of messages queued, -EINVAL if there are more than
+ *           SPIMOD_VECTOR_MAX, -EFAULT if the vector could not be accessed.
+ *
+ * Globals:
+ *
+ * - device_state._idle (see spimod_pump_wake()).
+ *
+ * ***************************************************************************/
+
+static long spimod_send_vector(
+   struct spimod_channel* chan,
+   struct spi_ioc_vector* vector)
+{
+   struct spi_ioc_iovec* entries;
+   struct spi_ioc_iovec entry;
+   __u32 count, done;
+   long result;
+   int fault = 0;
+
+   if (get_user(entries, &vector->_entries) ||
+       get_user(count, &vector->_count))
+   {
+      return -EFAULT;
+   }
+
+   if (count > SPIMOD_VECTOR_MAX)
+   {
+      return -EINVAL;
+   }
+
+   for (done = 0; done < count; ++done)
+   {
+      if (copy_from_user(&entry, &entries[done], sizeof(entry)))
+      {
+         fault = 1;
+         break;
+      }
+
+      result = spimod_send(chan, entry._buf, entry._bufLen);
+
+      if (put_user((__s32)result, &entries[done]._result))
+      {
+         fault = 1;
+         break;
+      }
+
+      if (result != entry._bufLen)
+      {
+         break;
+      }
+   }
+
+   if (done > 0)
+   {
+      spimod_pump_wake();
+   }
+
+   if (put_user(done, &vector->_done) || fault)
+   {
+      return -EFAULT;
+   }
+
+   return done;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_receive_vector()
+ * Purpose:  Fills the buffers of a vector in order, stopping at the first
+ *           that receives nothing.  Must be called with
+ *           device_state._fop_sem held.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel).
+ *           vector (user space vector, its entries' _result and its _done
+ *           are set).
+ *
+ * Returns:  The number of buffers that received anything, -EINVAL if there
+ *           are more than SPIMOD_VECTOR_MAX, -EFAULT if the vector could
+ *           not be accessed.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static long spimod_receive_vector(
+   struct spimod_channel* chan,
+   struct spi_ioc_vector* vector)
+{
+   struct spi_ioc_iovec* entries;
+   struct spi_ioc_iovec entry;
+   __u32 count, done;
+   long result;
+   int fault = 0;
+
+   if (get_user(entries, &vector->_entries) ||
+       get_user(count, &vector->_count))
+   {
+      return -EFAULT;
+   }
+
+   if (count > SPIMOD_VECTOR_MAX)
+   {
+      return -EINVAL;
+   }
+
+   for (done = 0; done < count; ++done)
+   {
+      if (copy_from_user(&entry, &entries[done], sizeof(entry)))
+      {
+         fault = 1;
+         break;
+      }
+
+      result = spimod_receive(chan, entry._buf, entry._bufLen);
+
+      if (put_user((__s32)result, &entries[done]._result))
+      {
+         fault = 1;
+         break;
+      }
+
+      if (result <= 0)
+      {
+         break;
+      }
+   }
+
+   if (put_user(done, &vector->_done) || fault)
+   {
+      return -EFAULT;
+   }
+
+   return done;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_send_bulk()
+ * Purpose:  Starts a bulk send from user space (see spi_bulk.h), with the
+ *           read / write timer stopped while its pages are handed to the
+ *           pump.  Must be called with device_state._fop_sem held.
+ *
+ * Parameters:
+ *
+ * - IN:     bulk (_buf and _len, from user space).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel, _len counted in its _txQueued).
+ *
+ * Returns:  _len on success, -EFAULT if bulk could not be read, otherwise
+ *           as spimod_bulk_start().
+ *
+ * Globals:
+ *
+ * - device_state._timer (stopped and restarted if running).
+ *
+ * ***************************************************************************/
+
+static long spimod_send_bulk(
+   struct spimod_channel* chan,
+   struct spi_ioc_bulk __user* bulk)
+{
+   __u8* buf;
+   __u32 len;
+   long result;
+
+   if (get_user(buf, &bulk->_buf) || get_user(len, &bulk->_len))
+   {
+      return -EFAULT;
+   }
+
+   if (device_state._timer_running)
+   {
+      hrtimer_cancel(&device_state._timer);
+   }
+
+   result = spimod_bulk_start(chan, buf, len);
+
+   if (result > 0)
+   {
+      spimod_cursor_queued(chan, result);
+   }
+
+   if (device_state._timer_running)
+   {
+      hrtimer_start(&device_state._timer,
+                    spimod_pump_interval(),
+                    HRTIMER_MODE_REL);
+   }
+
+   return result;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_put_bulk_status()
+ * Purpose:  Reports the progress of a channel's last bulk send.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    bulk (_len and _sent, in user space).
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 while the send is under way, 0 once done (or if there has
+ *           been none), -EFAULT if bulk could not be written.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static long spimod_put_bulk_status(
+   struct spimod_channel* chan,
+   struct spi_ioc_bulk __user* bulk)
+{
+   const u32 len = chan->_bulkLen;
+   const u32 sent = chan->_bulkSent;
+
+   if (put_user(len, &bulk->_len) || put_user(sent, &bulk->_sent))
+   {
+      return -EFAULT;
+   }
+
+   return sent < len;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_put_tx_cursor()
+ * Purpose:  Reports a channel's transmit cursors (see spi_cursor.h).
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    cursor (user space cursors).
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 on success, -EFAULT if cursor could not be written.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static long spimod_put_tx_cursor(
+   struct spimod_channel* chan,
+   struct spi_ioc_tx_cursor __user* cursor)
+{
+   struct spi_ioc_tx_cursor value;
+
+   value._queued = atomic64_read(&chan->_txQueued);
+   value._sent = atomic64_read(&chan->_txSent);
+   value._acked = atomic64_read(&chan->_txAcked);
+   value._discarded = atomic64_read(&chan->_txDiscarded);
+
+   if (copy_to_user(cursor, &value, sizeof(value)))
+   {
+      return -EFAULT;
+   }
+
+   return 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_wait_tx()
+ * Purpose:  Waits for a channel's data up to a transmit cursor to be sent,
+ *           or acknowledged.  Called without device_state._fop_sem, which
+ *           other calls need while this one waits.
+ *
+ * Parameters:
+ *
+ * - IN:     wait (_cursor, _timeoutMs and _acked, from user space).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel, waited on in its _wait).
+ *
+ * Returns:  0 once the cursor has been reached, -ECANCELED if it was
+ *           reached by discarding the data before it, -EAGAIN if not and
+ *           _timeoutMs is 0, -ETIMEDOUT if not within _timeoutMs, -EINVAL
+ *           for a cursor beyond _txQueued, -ERESTARTSYS if interrupted,
+ *           -EFAULT if wait could not be read.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static long spimod_wait_tx(
+   struct spimod_channel* chan,
+   struct spi_ioc_tx_wait __user* wait)
+{
+   struct spi_ioc_tx_wait value;
+   long remaining;
+
+   if (copy_from_user(&value, wait, sizeof(value)))
+   {
+      return -EFAULT;
+   }
+
+   if (value._cursor > (u64)atomic64_read(&chan->_txQueued))
+   {
+      return -EINVAL;
+   }
+
+   if (spimod_cursor_reached(chan, value._cursor, value._acked))
+   {
+      return spimod_cursor_discarded(chan, value._cursor) ? -ECANCELED : 0;
+   }
+
+   if (0 == value._timeoutMs)
+   {
+      return -EAGAIN;
+   }
+
+   remaining = wait_event_interruptible_timeout(
+      chan->_wait,
+      spimod_cursor_reached(chan, value._cursor, value._acked),
+      msecs_to_jiffies(value._timeoutMs));
+
+   if (remaining < 0)
+   {
+      return -ERESTARTSYS;
+   }
+
+   if (0 == remaining)
+   {
+      return -ETIMEDOUT;
+   }
+
+   return spimod_cursor_discarded(chan, value._cursor) ? -ECANCELED : 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_ioctl()
+ * Purpose:  Generic handler for ioctl() calls received by this driver.
+ *
+ * Parameters:
+ *
+ * - IN:     ioctl_num (the ioctl call id).
+ * - OUT:    N/A
+ * - IN/OUT: file (file pointer data, private_data is the channel).
+ *           ioctl_param (pointer to data specific to the ioctl id).
+ *
+ * Returns:  Specific to the ioctl id but >= 0 on success, negative integer
+ *           on failure.
+ *
+ * Globals:
+ *
+ * - device_transaction._inPacket->_status (for slave CTS status).
+ * - The channel's _txBuffer (to add data from the user).
+ * - The channel's _rxBuffer (to extract data for the user).
+ * - The channel's _txBufferSize, _rxBufferSize (reported / changed).
+ * - The channel's _datagram (message mode, changed by IOCTL_SET_MODE).
+ * - The channel's _txPriority, _rxPriority (for IOCTL_SEND_PRIORITY and
+ *   IOCTL_RECEIVE_PRIORITY).
+ * - device_state._busSpeedHz, _busMode, _bitsPerWord (reported / changed,
+ *   for the whole device).
+ * - The channel's _bulkPages, _bulkLen, _bulkSent (for IOCTL_SEND_BULK
+ *   and IOCTL_GET_BULK_STATUS).
+ * - The channel's _txQueued, _txSent, _txAcked (for IOCTL_SEND_TRACKED,
+ *   IOCTL_GET_TX_CURSOR and IOCTL_WAIT_TX, which waits on its _wait
+ *   without device_state._fop_sem).
+ * - device_state._idle (data sent wakes the pump, see spimod_pump_wake()).
+ *
+ * ***************************************************************************/
+
+long spimod_ioctl(
+   struct file* file,
+   unsigned int ioctl_num,
+   unsigned long ioctl_param)
+{
+   struct spimod_channel* chan = file->private_data;
+   long result = 0;
+
+   struct spi_ioc_transfer* data_params = NULL;
+   struct spi_ioc_status* status_params = NULL;
+   struct spi_ioc_buffer_sizes* size_params = NULL;
+   struct spi_ioc_bus_config* bus_params = NULL;
+   struct spi_ioc_batch* batch_params = NULL;
+   struct spi_ioc_tracked* tracked_params = NULL;
+
+   unsigned short tempUS1;
+   unsigned int tempUI1, tempUI2;
+   __u64 tempU64;
+   __u8* tempBuf;
+
+   //printk(KERN_ALERT "spimod_ioctl()\n");
+
+   // Waiting for the pump must not hold up the other calls
+
+   if (IOCTL_WAIT_TX == ioctl_num)
+   {
+      return spimod_wait_tx(chan, (struct spi_ioc_tx_wait*)ioctl_param);
+   }
+
+   if (down_interruptible(&device_state._fop_sem))
+   {
+      return -ERESTARTSYS;
+   }
+
+   switch (ioctl_num)
+   {
+      case IOCTL_SEND_DATA:
+
+         //printk(KERN_ALERT "IOCTL_SEND_DATA\n");
+
+         data_params = (struct spi_ioc_transfer*)ioctl_param;
+ 
+         get_user(tempUS1, &data_params->_bufLen);
+         get_user(tempBuf, &data_params->_buf);
+
+         result = spimod_send(chan, tempBuf, tempUS1);
+
+         if (result > 0)
+         {
+            spimod_pump_wake();
+         }
+
+         break;
+
+      case IOCTL_RECEIVE_DATA:
+
+         //printk(KERN_ALERT "IOCTL_RECEIVE_DATA\n");
+
+         data_params = (struct spi_ioc_transfer*)ioctl_param;
+
+         get_user(tempUS1, &data_params->_bufLen);
+         get_user(tempBuf, &data_params->_buf);
+
+         result = spimod_receive(chan, tempBuf, tempUS1);
+
+         break;
+
+      case IOCTL_GET_STATUS:
+
+         //printk(KERN_ALERT "IOCTL_GET_STATUS\n");
+
+         status_params = (struct spi_ioc_status*)ioctl_param;
+
+         result = spimod_put_status(chan, status_params);
+
+         break;
+
+      case IOCTL_GET_BUFFER_SIZES:
+
+         size_params = (struct spi_ioc_buffer_sizes*)ioctl_param;
+
+         if (put_user(chan->_txBufferSize, &size_params->_txSize) ||
+             put_user(chan->_rxBufferSize, &size_params->_rxSize))
+         {
+            result = -EFAULT;
+         }
+
+         break;
+
+      case IOCTL_SET_BUFFER_SIZES:
+
+         size_params = (struct spi_ioc_buffer_sizes*)ioctl_param;
+
+         if (get_user(tempUI1, &size_params->_txSize) ||
+             get_user(tempUI2, &size_params->_rxSize))
+         {
+            result = -EFAULT;
+         }
+         else
+         {
+            result = spimod_resize_buffers(chan, tempUI1, tempUI2);
+         }
+
+         break;
+
+      case IOCTL_SET_MODE:
+
+         result = spimod_set_mode(chan, ioctl_param);
+
+         break;
+
+      case IOCTL_SEND_PRIORITY:
+
+         data_params = (struct spi_ioc_transfer*)ioctl_param;
+
+         get_user(tempUS1, &data_params->_bufLen);
+         get_user(tempBuf, &data_params->_buf);
+
+         result = spimod_priority_send_user(chan, tempBuf, tempUS1);
+
+         if (result > 0)
+         {
+            spimod_pump_wake();
+         }
+
+         break;
+
+      case IOCTL_RECEIVE_PRIORITY:
+
+         data_params = (struct spi_ioc_transfer*)ioctl_param;
+
+         get_user(tempUS1, &data_params->_bufLen);
+         get_user(tempBuf, &data_params->_buf);
+
+         result = spimod_priority_receive_user(chan, tempBuf, tempUS1);
+
+         break;
+
+      case IOCTL_GET_BUS_CONFIG:
+
+         bus_params = (struct spi_ioc_bus_config*)ioctl_param;
+
+         if (put_user(device_state._busSpeedHz, &bus_params->_speedHz) ||
+             put_user(device_state._busMode, &bus_params->_mode) ||
+             put_user(device_state._bitsPerWord, &bus_params->_bitsPerWord))
+         {
+            result = -EFAULT;
+         }
+
+         break;
+
+      case IOCTL_SET_BUS_CONFIG:
+
+         result = spimod_set_bus_config((struct spi_ioc_bus_config*)ioctl_param);
+
+         break;
+
+      case IOCTL_SEND_VECTOR:
+
+         result = spimod_send_vector(chan, (struct spi_ioc_vector*)ioctl_param);
+
+         break;
+
+      case IOCTL_RECEIVE_VECTOR:
+
+         result = spimod_receive_vector(chan,
+                                        (struct spi_ioc_vector*)ioctl_param);
+
+         break;
+
+      case IOCTL_TRANSFER_VECTOR:
+
+         batch_params = (struct spi_ioc_batch*)ioctl_param;
+
+         result = spimod_send_vector(chan, &batch_params->_send);
+
+         if (result >= 0)
+         {
+            result = spimod_receive_vector(chan, &batch_params->_receive);
+         }
+
+         // As IOCTL_RECEIVE_VECTOR, the number sent being in _send._done
+
+         if (result >= 0)
+         {
+            tempUI1 = result;
+
+            result = spimod_put_status(chan, &batch_params->_status);
+         }
+
+         if (result >= 0)
+         {
+            result = tempUI1;
+         }
+
+         break;
+
+      case IOCTL_SEND_BULK:
+
+         result = spimod_send_bulk(chan, (struct spi_ioc_bulk*)ioctl_param);
+
+         if (result > 0)
+         {
+            spimod_pump_wake();
+         }
+
+         break;
+
+      case IOCTL_GET_BULK_STATUS:
+
+         result = spimod_put_bulk_status(chan,
+                                         (struct spi_ioc_bulk*)ioctl_param);
+
+         break;
+
+      case IOCTL_SEND_TRACKED:
+
+         tracked_params = (struct spi_ioc_tracked*)ioctl_param;
+
+         get_user(tempUS1, &tracked_params->_bufLen);
+         get_user(tempBuf, &tracked_params->_buf);
+
+         result = spimod_send(chan, tempBuf, tempUS1);
+
+         if (result > 0)
+         {
+            spimod_pump_wake();
+         }
+
+         tempU64 = atomic64_read(&chan->_txQueued);
+
+         if (result >= 0 &&
+             copy_to_user(&tracked_params->_cursor,
+                          &tempU64,
+                          sizeof(tempU64)))
+         {
+            result = -EFAULT;
+         }
+
+         break;
+
+      case IOCTL_GET_TX_CURSOR:
+
+         result = spimod_put_tx_cursor(chan,
+                                       (struct spi_ioc_tx_cursor*)ioctl_param);
+
+         break;
+
+      default:
+
+         printk(KERN_ALERT "Unsupported ioctl\n");
+
+         result = -1;
+
+         break;
+   }
+
+   up(&device_state._fop_sem);
+
+   return result;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_readable()
+ * Purpose:  Reports whether a read would find data, without taking
+ *           device_state._fop_sem - the read itself has the last word.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 if data has been received (a whole message in datagram
+ *           mode), else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static int spimod_readable(
+   struct spimod_channel* chan)
+{
+   if (chan->_datagram)
+   {
+      return atomic_read(&chan->_rxMessages) > 0;
+   }
+
+   return circular_buffer_num_bytes_available(chan->_rxBuffer) > 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_writable()
+ * Purpose:  Reports whether a write of length bytes would queue anything,
+ *           without taking device_state._fop_sem.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           length (size of the write, the whole message in datagram mode).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 if there is room for some of it (all of it in datagram mode,
+ *           where a message too large ever to fit fails before waiting),
+ *           else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static int spimod_writable(
+   struct spimod_channel* chan,
+   const int length)
+{
+   struct circular_buffer* tx = chan->_txBuffer;
+
+   if (chan->_datagram)
+   {
+      return spimod_datagram_room(chan) >= length;
+   }
+
+   return tx->_size < tx->_capacity;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_lock()
+ * Purpose:  Takes device_state._fop_sem for a read or write, giving up at
+ *           once if it is held and the caller may not wait.
+ *
+ * Parameters:
+ *
+ * - IN:     nowait (O_NONBLOCK or IOCB_NOWAIT).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 with the semaphore held, -EAGAIN or -ERESTARTSYS if not.
+ *
+ * Globals:
+ *
+ * - device_state._fop_sem (taken).
+ *
+ * ***************************************************************************/
+
+static int spimod_lock(
+   const int nowait)
+{
+   if (nowait)
+   {
+      return down_trylock(&device_state._fop_sem) ? -EAGAIN : 0;
+   }
+
+   return down_interruptible(&device_state._fop_sem) ? -ERESTARTSYS : 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_wait()
+ * Purpose:  Waits for the pump to make a channel readable or writable after
+ *           a read or write found nothing to do.
+ *
+ * Parameters:
+ *
+ * - IN:     nowait (O_NONBLOCK or IOCB_NOWAIT).
+ *           length (size of a write, 0 for a read).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel, waited on in its _wait).
+ *
+ * Returns:  0 to try again, -EAGAIN if the caller may not wait,
+ *           -ERESTARTSYS if interrupted.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static int spimod_wait(
+   struct spimod_channel* chan,
+   const int nowait,
+   const int length)
+{
+   int interrupted;
+
+   if (nowait)
+   {
+      return -EAGAIN;
+   }
+
+   if (length > 0)
+   {
+      interrupted = wait_event_interruptible(chan->_wait,
+                                             spimod_writable(chan, length));
+   }
+   else
+   {
+      interrupted = wait_event_interruptible(chan->_wait,
+                                             spimod_readable(chan));
+   }
+
+   return interrupted ? -ERESTARTSYS : 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_read_once()
+ * Purpose:  Removes what has been received into user space, one whole
+ *           message in datagram mode.  Must be called with
+ *           device_state._fop_sem held.
+ *
+ * Parameters:
+ *
+ * - IN:     length (size of the user space buffer).
+ * - OUT:    buf (user space buffer).
+ * - IN/OUT: chan (the channel).
+ *
+ * Returns:  Number of bytes read, 0 if there are none, negative integer on
+ *           failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static ssize_t spimod_read_once(
+   struct spimod_channel* chan,
+   char __user* buf,
+   const int length)
+{
+   ssize_t result;
+
+   if (chan->_datagram)
+   {
+      return spimod_datagram_receive_user(chan, buf, length);
+   }
+
+   if (0 == circular_buffer_num_bytes_available(chan->_rxBuffer))
+   {
+      return 0;
+   }
+
+   result = circular_buffer_read_user(chan->_rxBuffer, buf, length);
+
+   return (0 == result) ? -EFAULT : result;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_write_once()
+ * Purpose:  Queues as much from user space as fits, or one whole message in
+ *           datagram mode, counts it in _txQueued and wakes the pump.  Must
+ *           be called with device_state._fop_sem held.
+ *
+ * Parameters:
+ *
+ * - IN:     buf (user space data).
+ *           length (size of the data).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel).
+ *
+ * Returns:  Number of bytes written, 0 if there is no room yet, negative
+ *           integer on failure.
+ *
+ * Globals:
+ *
+ * - device_state._idle (see spimod_pump_wake()).
+ *
+ * ***************************************************************************/
+
+static ssize_t spimod_write_once(
+   struct spimod_channel* chan,
+   const char __user* buf,
+   const int length)
+{
+   struct circular_buffer* tx = chan->_txBuffer;
+   ssize_t result;
+
+   if (chan->_datagram)
+   {
+      result = spimod_datagram_send_user(chan, buf, length);
+   }
+   else if (tx->_size == tx->_capacity)
+   {
+      result = 0;
+   }
+   else
+   {
+      result = circular_buffer_write_user(tx,
+                                          buf,
+                                          min(length,
+                                              tx->_capacity - tx->_size));
+
+      if (0 == result)
+      {
+         result = -EFAULT;
+      }
+   }
+
+   if (result > 0)
+   {
+      spimod_cursor_queued(chan, result);
+      spimod_pump_wake();
+   }
+
+   return result;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_read()
+ * Purpose:  Handler for the read() system call.  Returns what has been
+ *           received, one whole message in datagram mode, waiting for the
+ *           pump to receive something unless the file is O_NONBLOCK.
+ *
+ * Parameters:
+ *
+ * - IN:     count (size of the user-supplied buffer).
+ * - OUT:    N/A
+ * - IN/OUT: file (file pointer data, private_data is the channel).
+ *           buf(user-supplied buffer).
+ *           offp (offset within the file - not used).
+ *
+ * Returns:  Number of bytes read, -EAGAIN if there are none and the file is
+ *           O_NONBLOCK, negative integer on failure.
+ *
+ * Globals:
+ *
+ * - The channel's _rxBuffer (to extract data for the user).
+ * - The channel's _wait (waited on).
+ *
+ * ***************************************************************************/
+
+ssize_t spimod_read(
+   struct file* file,
+   char __user* buf,
+   size_t count,
+   loff_t* offp)
+{
+   struct spimod_channel* chan = file->private_data;
+   const int nowait = (file->f_flags & O_NONBLOCK) != 0;
+   int length = min_t(size_t, count, INT_MAX);
+   ssize_t result;
+
+   if (0 == length)
+   {
+      return 0;
+   }
+
+   do
+   {
+      result = spimod_lock(nowait);
+
+      if (0 == result)
+      {
+         result = spimod_read_once(chan, buf, length);
+
+         up(&device_state._fop_sem);
+      }
+   }
+   while (0 == result && 0 == (result = spimod_wait(chan, nowait, 0)));
+
+   return result;
+}
+
 /******************************************************************************
  *
- * Function: spimod_ioctl()
- * Purpose:  Generic handler for ioctl() calls received by this driver.
+ * Function: spimod_write()
+ * Purpose:  Handler for the write() system call.  Queues as much as fits,
+ *           or one whole message in datagram mode, waiting for the pump to
+ *           make room unless the file is O_NONBLOCK.
  *
  * Parameters:
  *
- * - IN:     ioctl_num (the ioctl call id).
+ * - IN:     count (size of the user-supplied buffer).
+ *           buf (user-supplied buffer).
  * - OUT:    N/A
- * - IN/OUT: file (file pointer data - not used).
- *           ioctl_param (pointer to data specific to the ioctl id).
+ * - IN/OUT: file (file pointer data, private_data is the channel).
+ *           offp (offset within the file - not used).
  *
- * Returns:  Specific to the ioctl id but >= 0 on success, negative integer
- *           on failure.
+ * Returns:  Number of bytes written, -EAGAIN if there is no room yet and the
+ *           file is O_NONBLOCK, negative integer on failure.
  *
  * Globals:
  *
- * - device_state._txBuffer (to add data from the user).
- * - device_state._rxBuffer (to extract data for the user).
- * - device_transaction._inPacket->_status (for slave CTS status).
+ * - The channel's _txBuffer (to add data from the user).
+ * - The channel's _wait (waited on).
+ * - device_state._idle (data sent wakes the pump, see spimod_pump_wake()).
  *
  * ***************************************************************************/
 
-long spimod_ioctl(
+ssize_t spimod_write(
    struct file* file,
-   unsigned int ioctl_num,
-   unsigned long ioctl_param)
+   const char __user* buf,
+   size_t count,
+   loff_t* offp)
 {
-   long result = 0;
+   struct spimod_channel* chan = file->private_data;
+   const int nowait = (file->f_flags & O_NONBLOCK) != 0;
+   int length = min_t(size_t, count, INT_MAX);
+   ssize_t result;
 
-   struct spi_ioc_transfer* data_params = NULL;
-   struct spi_ioc_status* status_params = NULL;
+   if (0 == length)
+   {
+      return 0;
+   }
 
-   int numBytes;
-   unsigned short tempUS1;
-   unsigned int tempUI1, tempUI2;
+   do
+   {
+      result = spimod_lock(nowait);
 
-   //printk(KERN_ALERT "spimod_ioctl()\n");
+      if (0 == result)
+      {
+         result = spimod_write_once(chan, buf, length);
 
-   if (down_interruptible(&device_state._fop_sem))
+         up(&device_state._fop_sem);
+      }
+   }
+   while (0 == result && 0 == (result = spimod_wait(chan, nowait, length)));
+
+   return result;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_poll()
+ * Purpose:  Handler for poll(), select() and epoll: reports whether the
+ *           channel is readable or writable, and waits on its _wait for the
+ *           pump to change that.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: file (file pointer data, private_data is the channel).
+ *           wait (the poll table).
+ *
+ * Returns:  EPOLLIN | EPOLLRDNORM if read() would return data, EPOLLPRI if
+ *           a priority message is waiting, EPOLLOUT | EPOLLWRNORM if write()
+ *           would queue something.
+ *
+ * Globals:
+ *
+ * - The channel's _rxBuffer, _txBuffer, _rxPriority (checked).
+ *
+ * ***************************************************************************/
+
+spimod_poll_t spimod_poll(
+   struct file* file,
+   poll_table* wait)
+{
+   struct spimod_channel* chan = file->private_data;
+   spimod_poll_t mask = 0;
+
+   poll_wait(file, &chan->_wait, wait);
+
+   if (spimod_readable(chan))
    {
-      return -ERESTARTSYS;
+      mask |= EPOLLIN | EPOLLRDNORM;
    }
 
-   switch (ioctl_num)
+   if (atomic_read(&chan->_rxPriorityMessages) > 0)
    {
-      case IOCTL_SEND_DATA:
+      mask |= EPOLLPRI;
+   }
 
-         //printk(KERN_ALERT "IOCTL_SEND_DATA\n");
+   if (spimod_writable(chan, 1))
+   {
+      mask |= EPOLLOUT | EPOLLWRNORM;
+   }
 
-         data_params = (struct spi_ioc_transfer*)ioctl_param;
- 
-         get_user(tempUS1, &data_params->_bufLen);
+   return mask;
+}
 
-         numBytes = circular_buffer_write_user(device_state._txBuffer,
-                                               data_params->_buf,
-                                               tempUS1);
+#if SPIMOD_HAVE_READ_ITER
 
-         if (numBytes != data_params->_bufLen)
-         {
-            printk(KERN_ALERT "IOCTL_SEND_DATA - requested %d written %d\n",
-                   data_params->_bufLen,
-                   numBytes);
-         }
+/******************************************************************************
+ *
+ * Function: spimod_iocb_nowait()
+ * Purpose:  Reports whether a read_iter / write_iter request may not wait:
+ *           IOCB_NOWAIT, set by io_uring for its first attempt at each, or
+ *           an O_NONBLOCK file.
+ *
+ * Parameters:
+ *
+ * - IN:     iocb (the request).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 or 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
 
-         result = numBytes;
+static int spimod_iocb_nowait(
+   const struct kiocb* iocb)
+{
+#if SPIMOD_HAVE_NOWAIT
+   if (iocb->ki_flags & IOCB_NOWAIT)
+   {
+      return 1;
+   }
+#endif
 
-         break;
+   return (iocb->ki_filp->f_flags & O_NONBLOCK) != 0;
+}
 
-      case IOCTL_RECEIVE_DATA:
+/******************************************************************************
+ *
+ * Function: spimod_read_iter_once()
+ * Purpose:  As spimod_read_once(), scattered over the segments.
+ *
+ * Parameters:
+ *
+ * - IN:     length (size of the segments).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel).
+ *           to (the segments, advanced past the data read).
+ *
+ * Returns:  As spimod_read_once().
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
 
-         //printk(KERN_ALERT "IOCTL_RECEIVE_DATA\n");
+static ssize_t spimod_read_iter_once(
+   struct spimod_channel* chan,
+   struct iov_iter* to,
+   const int length)
+{
+   ssize_t result;
 
-         data_params = (struct spi_ioc_transfer*)ioctl_param;
+   if (chan->_datagram)
+   {
+      return spimod_datagram_receive_iter(chan, to);
+   }
 
-         get_user(tempUS1, &data_params->_bufLen);
+   if (0 == circular_buffer_num_bytes_available(chan->_rxBuffer))
+   {
+      return 0;
+   }
 
-         numBytes = circular_buffer_read_user(device_state._rxBuffer,
-                                              data_params->_buf,
-                                              tempUS1);
+   result = circular_buffer_read_iter(chan->_rxBuffer, to, length);
 
-         result = numBytes;
+   return (0 == result) ? -EFAULT : result;
+}
 
-         break;
+/******************************************************************************
+ *
+ * Function: spimod_write_iter_once()
+ * Purpose:  As spimod_write_once(), gathered from the segments.
+ *
+ * Parameters:
+ *
+ * - IN:     length (size of the segments).
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel).
+ *           from (the segments, advanced past the data written).
+ *
+ * Returns:  As spimod_write_once().
+ *
+ * Globals:
+ *
+ * - device_state._idle (see spimod_pump_wake()).
+ *
+ * ***************************************************************************/
 
-      case IOCTL_GET_STATUS:
+static ssize_t spimod_write_iter_once(
+   struct spimod_channel* chan,
+   struct iov_iter* from,
+   const int length)
+{
+   struct circular_buffer* tx = chan->_txBuffer;
+   ssize_t result;
 
-         //printk(KERN_ALERT "IOCTL_GET_STATUS\n");
+   if (chan->_datagram)
+   {
+      result = spimod_datagram_send_iter(chan, from);
+   }
+   else if (tx->_size == tx->_capacity)
+   {
+      result = 0;
+   }
+   else
+   {
+      result = circular_buffer_write_iter(tx, from, length);
 
-         status_params = (struct spi_ioc_status*)ioctl_param;
+      if (0 == result)
+      {
+         result = -EFAULT;
+      }
+   }
 
-         tempUI1 = circular_buffer_num_bytes_available(device_state._rxBuffer);
-         tempUI2 = (device_transaction._inPacket->_status == SLAVE_RX_ABLE)
-		      ? 1: 0;
+   if (result > 0)
+   {
+      spimod_cursor_queued(chan, result);
+      spimod_pump_wake();
+   }
 
-         put_user(tempUI1, &status_params->_rxBytesAvailable);
-         put_user(tempUI2, &status_params->_clearToSend);
+   return result;
+}
 
-         result = 0;
+/******************************************************************************
+ *
+ * Function: spimod_read_iter()
+ * Purpose:  Handler for readv() (and read() where there is no read
+ *           handler, and splice() and io_uring): as spimod_read(), scattered
+ *           over the segments, and not waiting for IOCB_NOWAIT either.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: iocb (the request, ki_filp->private_data is the channel).
+ *           to (the segments, advanced past the data read).
+ *
+ * Returns:  As spimod_read(), -EAGAIN rather than waiting for data or
+ *           device_state._fop_sem with IOCB_NOWAIT.
+ *
+ * Globals:
+ *
+ * - The channel's _rxBuffer (to extract data for the user).
+ * - The channel's _wait (waited on).
+ *
+ * ***************************************************************************/
 
-         break;
+ssize_t spimod_read_iter(
+   struct kiocb* iocb,
+   struct iov_iter* to)
+{
+   struct spimod_channel* chan = iocb->ki_filp->private_data;
+   const int nowait = spimod_iocb_nowait(iocb);
+   int length = min_t(size_t, iov_iter_count(to), INT_MAX);
+   ssize_t result;
 
-      default:
+   if (0 == length)
+   {
+      return 0;
+   }
 
-         printk(KERN_ALERT "Unsupported ioctl\n");
+   do
+   {
+      result = spimod_lock(nowait);
 
-         result = -1;
+      if (0 == result)
+      {
+         result = spimod_read_iter_once(chan, to, length);
 
-         break;
+         up(&device_state._fop_sem);
+      }
    }
-
-   up(&device_state._fop_sem);
+   while (0 == result && 0 == (result = spimod_wait(chan, nowait, 0)));
 
    return result;
 }
 
 /******************************************************************************
  *
- * Function: spimod_read()
- * Purpose:  Handler for the read() system call.
- *
- *           Not implemented.
+ * Function: spimod_write_iter()
+ * Purpose:  Handler for writev() (and write() where there is no write
+ *           handler, and splice(), sendfile() and io_uring): as
+ *           spimod_write(), gathered from the segments, which make up one
+ *           message in datagram mode, and not waiting for IOCB_NOWAIT
+ *           either.
  *
  * Parameters:
  *
- * - IN:     count (size of the user-supplied buffer).
+ * - IN:     N/A
  * - OUT:    N/A
- * - IN/OUT: file (file pointer data).
- *           buf(user-supplied buffer).
- *           offp (offset within the file).
+ * - IN/OUT: iocb (the request, ki_filp->private_data is the channel).
+ *           from (the segments, advanced past the data written).
  *
- * Returns:  Number of bytes read, negative integer on failure.
+ * Returns:  As spimod_write(), -EAGAIN rather than waiting for room or
+ *           device_state._fop_sem with IOCB_NOWAIT.
  *
  * Globals:
  *
- * - N/A
+ * - The channel's _txBuffer (to add data from the user).
+ * - The channel's _wait (waited on).
+ * - device_state._idle (data sent wakes the pump, see spimod_pump_wake()).
  *
  * ***************************************************************************/
 
-ssize_t spimod_read(
-   struct file* file,
-   char __user* buf,
-   size_t count,
-   loff_t* offp)
+ssize_t spimod_write_iter(
+   struct kiocb* iocb,
+   struct iov_iter* from)
 {
-   printk(KERN_ALERT "spimod_read() - not implemented\n");
+   struct spimod_channel* chan = iocb->ki_filp->private_data;
+   const int nowait = spimod_iocb_nowait(iocb);
+   int length = min_t(size_t, iov_iter_count(from), INT_MAX);
+   ssize_t result;
 
-   return 0;
+   if (0 == length)
+   {
+      return 0;
+   }
+
+   do
+   {
+      result = spimod_lock(nowait);
+
+      if (0 == result)
+      {
+         result = spimod_write_iter_once(chan, from, length);
+
+         up(&device_state._fop_sem);
+      }
+   }
+   while (0 == result && 0 == (result = spimod_wait(chan, nowait, length)));
+
+   return result;
 }
 
+#endif
+
 /******************************************************************************
  *
- * Function: spimod_write()
- * Purpose:  Handler for the write() system call.
- *
- *           Not implemented.
+ * Function: spimod_release_work()
+ * Purpose:  Frees the buffers and frames once the device has been closed
+ *           for idle_release_ms.  Waits for a transfer still in flight to
+ *           complete first.
  *
  * Parameters:
  *
- * - IN:     count (size of the user-supplied buffer).
- *           buf (user-supplied buffer).
+ * - IN:     N/A
  * - OUT:    N/A
- * - IN/OUT: file (file pointer data).
- *           offp (offset within the file).
+ * - IN/OUT: work (the work item - not used).
  *
- * Returns:  Number of bytes written, negative integer on failure.
+ * Returns:  N/A
  *
  * Globals:
  *
- * - N/A
+ * - device_state._openCount (nothing is freed if the device is open).
+ * - device_transaction._busy (checked for a transfer in flight).
+ * - device_state._channels (their buffers destroyed).
+ * - device_transaction._pool (destroyed).
  *
  * ***************************************************************************/
 
-ssize_t spimod_write(
-   struct file* file,
-   const char __user* buf,
-   size_t count,
-   loff_t* offp)
+void spimod_release_work(
+   struct work_struct* work)
 {
-   printk(KERN_ALERT "spimod_write() - not implemented\n");
+   down(&device_state._fop_sem);
 
-   return 0;
+   if (0 == device_state._openCount)
+   {
+      if (device_transaction._busy)
+      {
+         schedule_delayed_work(&device_state._releaseWork, 1);
+      }
+      else
+      {
+         spimod_resources_release();
+      }
+   }
+
+   up(&device_state._fop_sem);
 }
 
 /******************************************************************************
  *
  * Function: spimod_open()
- * Purpose:  Handler for the open() system call.  Resets the transmit and
- *           receive circular buffers, clears the outbound and inbound packets
- *           and starts the read / write timer.
+ * Purpose:  Handler for the open() system call.  Allocates the buffers and
+ *           frames if they have been released, resets the channel's
+ *           transmit and receive circular buffers and, if the timer is not
+ *           running, clears the outbound and inbound packets and starts it.
+ *           A channel closed with persistent set keeps its buffers and
+ *           mode, including data received while it was closed.
  *
  * Parameters:
  *
  * - IN:     N/A
  * - OUT:    N/A
- * - IN/OUT: i (current file system inode - not used).
- *           file (file pointer data - not used).
+ * - IN/OUT: i (current file system inode, its cdev identifies the channel).
+ *           file (file pointer data, private_data set to the channel and
+ *           FMODE_NOWAIT to its f_mode).
  *
  * Returns:  0 on success, negative integer on failure.
  *
  * Globals:
  *
- * - device_state._txBuffer (cleared).
- * - device_state._rxBuffer (cleared).
+ * - device_state._releaseWork (cancelled).
+ * - device_state._openCount (incremented).
+ * - device_state._channels (the channel's buffers, including the priority
+ *   ones, created / cleared, its transmit cursors caught up and _datagram
+ *   set from the datagram module parameter, unless _kept).
  * - device_transaction._outPacket (cleared).
  * - device_transaction._inPacket (cleared).
+ * - device_transaction._inPending, _failed (cleared).
+ * - device_state._idle, _idleCount (cleared, the pump starts busy).
+ * - device_state._syncLost, _slipPending (cleared).
+ * - device_state._dataSize (agreed again by the handshake).
  * - device_state._timer (started).
  *
  * ***************************************************************************/
@@ -237,6 +1799,8 @@ int spimod_open(
    struct inode* i,
    struct file* file)
 {
+   struct spimod_channel* chan =
+      container_of(i->i_cdev, struct spimod_channel, _cdev);
    int status = 0;
 
    if (down_interruptible(&device_state._fop_sem))
@@ -244,18 +1808,60 @@ int spimod_open(
       return -ERESTARTSYS;
    }
 
-   circular_buffer_reset(device_state._txBuffer);
-   circular_buffer_reset(device_state._rxBuffer);
+   cancel_delayed_work(&device_state._releaseWork);
+
+   if (spimod_resources_acquire() < 0)
+   {
+      up(&device_state._fop_sem);
+
+      return -ENOMEM;
+   }
+
+   file->private_data = chan;
+
+#if SPIMOD_HAVE_NOWAIT
+   file->f_mode |= FMODE_NOWAIT;
+#endif
+
+   ++device_state._openCount;
+   ++chan->_openCount;
+
+   // Persistent channels are picked up where they were left
 
-   memset(device_transaction._outPacket, 0, PACKET_SIZE);
-   memset(device_transaction._inPacket, 0, PACKET_SIZE);
+   if (!(persistent && chan->_kept))
+   {
+      circular_buffer_reset(chan->_txBuffer);
+      circular_buffer_reset(chan->_rxBuffer);
+
+      chan->_datagram = datagram;
+
+      spimod_datagram_reset(chan);
+      spimod_priority_reset(chan);
+      spimod_cursor_discard(chan);
+
+      wake_up_interruptible(&chan->_wait);
+   }
+
+   chan->_kept = 0;
 
    if (!device_state._timer_running)
    {
-      hrtimer_start(
-         &device_state._timer,
-         ktime_set(device_state._timer_period_s, device_state._timer_period_ns),
-         HRTIMER_MODE_REL);
+      memset(device_transaction._outPacket, 0, PACKET_SIZE);
+      memset(device_transaction._inPacket, 0, PACKET_SIZE);
+
+      device_transaction._inPending = 0;
+      device_transaction._failed = 0;
+
+      device_state._idle = 0;
+      device_state._idleCount = 0;
+      device_state._syncLost = 0;
+      device_state._slipPending = 0;
+
+      spimod_handshake_start();
+
+      hrtimer_start(&device_state._timer,
+                    spimod_pump_interval(),
+                    HRTIMER_MODE_REL);
 
       device_state._timer_running = 1;
    }
@@ -268,21 +1874,28 @@ int spimod_open(
 /******************************************************************************
  *
  * Function: spimod_close()
- * Purpose:  Handler for the close() system call.  Stops the read / write
- *           timer.
+ * Purpose:  Handler for the close() system call.  The last close of a
+ *           channel abandons its bulk send.  On the last close of any
+ *           channel, stops the read / write timer and schedules the buffers
+ *           and frames to be freed after idle_release_ms, unless persistent
+ *           is set, when the pump keeps receiving into the buffers.
  *
  * Parameters:
  *
  * - IN:     N/A
  * - OUT:    N/A
  * - IN/OUT: i (current file system inode - not used).
- *           file (file pointer data - not used).
+ *           file (file pointer data, private_data is the channel).
  *
  * Returns:  Always 0.
  *
  * Globals:
  *
- * - device_state._timer (stopped).
+ * - device_state._timer (stopped, unless persistent).
+ * - device_state._openCount (decremented).
+ * - device_state._channels (the channel's _openCount decremented, _kept
+ *   set from persistent, its bulk pages unpinned on its last close).
+ * - device_state._releaseWork (scheduled).
  *
  * ***************************************************************************/
 
@@ -290,18 +1903,64 @@ int spimod_close(
    struct inode* i,
    struct file* file)
 {
+   struct spimod_channel* chan = file->private_data;
    int status = 0;
 
-   if (down_interruptible(&device_state._fop_sem))
+   // The return value of release is ignored, so a signal must not skip
+   // the close and leave the device open for good
+
+   down(&device_state._fop_sem);
+
+   if (chan->_openCount > 0)
    {
-      return -ERESTARTSYS;
+      --chan->_openCount;
    }
 
-   if (device_state._timer_running)
+   if (0 == chan->_openCount)
    {
-      hrtimer_cancel(&device_state._timer);
+      chan->_kept = persistent;
+
+      // Nobody is left to see a bulk send finish, so its pages are let go
+
+      if (chan->_bulkPages != NULL)
+      {
+         if (device_state._timer_running)
+         {
+            hrtimer_cancel(&device_state._timer);
+         }
+
+         spimod_bulk_release(chan);
+
+         if (device_state._timer_running)
+         {
+            hrtimer_start(&device_state._timer,
+                          spimod_pump_interval(),
+                          HRTIMER_MODE_REL);
+         }
+      }
+   }
+
+   if (device_state._openCount > 0)
+   {
+      --device_state._openCount;
+   }
+
+   // A persistent device keeps pumping, so keeps its buffers too
+
+   if (0 == device_state._openCount && !persistent)
+   {
+      if (device_state._timer_running)
+      {
+         hrtimer_cancel(&device_state._timer);
+
+         device_state._timer_running = 0;
+      }
 
-      device_state._timer_running = 0;
+      if (idle_release_ms >= 0)
+      {
+         schedule_delayed_work(&device_state._releaseWork,
+                               msecs_to_jiffies(idle_release_ms));
+      }
    }
 
    up(&device_state._fop_sem);
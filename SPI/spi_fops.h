@@ -10,7 +10,10 @@
 #ifndef SPI_FOPS_H
 #define SPI_FOPS_H
 
+#include "spi_compat.h"
+
 #include <linux/fs.h>
+#include <linux/workqueue.h>
 
 /******************************************************************************
  *
@@ -21,17 +24,29 @@
  *
  * - IN:     ioctl_num (the ioctl call id).
  * - OUT:    N/A
- * - IN/OUT: file (file pointer data - not used).
+ * - IN/OUT: file (file pointer data, private_data is the channel).
  *           ioctl_param (pointer to data specific to the ioctl id).
  *
  * Returns:  Specific to the ioctl id but >= 0 on success, negative integer
- *           on failure.
+ *           on failure.  The vectored ioctls handle every message under
+ *           one acquisition of device_state._fop_sem.
  *
  * Globals:
  *
- * - device_state._txBuffer (to add data from the user).
- * - device_state._rxBuffer (to extract data for the user).
  * - device_transaction._inPacket->_status (for slave CTS status).
+ * - The channel's _txBuffer (to add data from the user).
+ * - The channel's _rxBuffer (to extract data for the user).
+ * - The channel's _txBufferSize, _rxBufferSize (reported / changed).
+ * - The channel's _datagram (message mode, changed by IOCTL_SET_MODE).
+ * - The channel's _txPriority, _rxPriority (for IOCTL_SEND_PRIORITY and
+ *   IOCTL_RECEIVE_PRIORITY).
+ * - The channel's _bulkPages, _bulkLen, _bulkSent (for IOCTL_SEND_BULK
+ *   and IOCTL_GET_BULK_STATUS).
+ * - The channel's _txQueued, _txSent, _txAcked (for IOCTL_SEND_TRACKED,
+ *   IOCTL_GET_TX_CURSOR and IOCTL_WAIT_TX, which waits on its _wait
+ *   without device_state._fop_sem).
+ * - device_state._busSpeedHz, _busMode, _bitsPerWord (reported / changed,
+ *   for the whole device).
  *
  * ***************************************************************************/
 
@@ -43,23 +58,28 @@ long spimod_ioctl(
 /******************************************************************************
  *
  * Function: spimod_read()
- * Purpose:  Handler for the read() system call.
- *
- *           Not implemented.
+ * Purpose:  Handler for the read() system call.  Returns whatever has been
+ *           received, up to count bytes, or in datagram mode the next whole
+ *           message (-EMSGSIZE if count is too small, the message is kept).
+ *           Waits for the pump to receive something unless the file is
+ *           O_NONBLOCK.
  *
  * Parameters:
  *
  * - IN:     count (size of the user-supplied buffer).
  * - OUT:    N/A
- * - IN/OUT: file (file pointer data).
+ * - IN/OUT: file (file pointer data, private_data is the channel).
  *           buf(user-supplied buffer).
- *           offp (offset within the file).
+ *           offp (offset within the file - not used).
  *
- * Returns:  Number of bytes read, negative integer on failure.
+ * Returns:  Number of bytes read, -EAGAIN if nothing has been received and
+ *           the file is O_NONBLOCK, -ERESTARTSYS if interrupted while
+ *           waiting, negative integer on failure.
  *
  * Globals:
  *
- * - N/A
+ * - The channel's _rxBuffer (to extract data for the user).
+ * - The channel's _wait (waited on).
  *
  * ***************************************************************************/
 
@@ -72,23 +92,30 @@ ssize_t spimod_read(
 /******************************************************************************
  *
  * Function: spimod_write()
- * Purpose:  Handler for the write() system call.
- *
- *           Not implemented.
+ * Purpose:  Handler for the write() system call.  Queues as much of the
+ *           data as fits in the transmit buffer, or in datagram mode all of
+ *           it as one message or nothing.  Waits for the pump to make room
+ *           for some of it (all of it in datagram mode) unless the file is
+ *           O_NONBLOCK.
  *
  * Parameters:
  *
  * - IN:     count (size of the user-supplied buffer).
  *           buf (user-supplied buffer).
  * - OUT:    N/A
- * - IN/OUT: file (file pointer data).
- *           offp (offset within the file).
+ * - IN/OUT: file (file pointer data, private_data is the channel).
+ *           offp (offset within the file - not used).
  *
- * Returns:  Number of bytes written, negative integer on failure.
+ * Returns:  Number of bytes written, -EAGAIN if there is no room yet and
+ *           the file is O_NONBLOCK, -ERESTARTSYS if interrupted while
+ *           waiting, negative integer on failure (as IOCTL_SEND_DATA in
+ *           datagram mode).
  *
  * Globals:
  *
- * - N/A
+ * - The channel's _txBuffer (to add data from the user).
+ * - The channel's _wait (waited on).
+ * - device_state._idle (data sent wakes the pump, see spimod_pump_wake()).
  *
  * ***************************************************************************/
 
@@ -98,28 +125,163 @@ ssize_t spimod_write(
    size_t count,
    loff_t* offp);
 
+/******************************************************************************
+ *
+ * Function: spimod_poll()
+ * Purpose:  Handler for poll(), select() and epoll (and io_uring, which
+ *           polls the device where a read or write would wait).  The pump
+ *           wakes the channel's waiters whenever it receives data for it or
+ *           makes room in its transmit buffer.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: file (file pointer data, private_data is the channel).
+ *           wait (the poll table).
+ *
+ * Returns:  EPOLLIN | EPOLLRDNORM if read() would return data, EPOLLPRI if
+ *           IOCTL_RECEIVE_PRIORITY would, EPOLLOUT | EPOLLWRNORM if write()
+ *           would queue something (in datagram mode, a one byte message).
+ *
+ * Globals:
+ *
+ * - The channel's _rxBuffer, _txBuffer, _rxPriority (checked).
+ *
+ * ***************************************************************************/
+
+spimod_poll_t spimod_poll(
+   struct file* file,
+   poll_table* wait);
+
+#if SPIMOD_HAVE_READ_ITER
+
+/******************************************************************************
+ *
+ * Function: spimod_read_iter()
+ * Purpose:  Handler for readv(): as spimod_read(), the data scattered over
+ *           the segments in order.  In datagram mode one message is read,
+ *           if it fits in all of them.  Also backs splice() out of the
+ *           device, from 4.9, and io_uring reads: with IOCB_NOWAIT it
+ *           returns -EAGAIN rather than waiting for data or for another
+ *           caller to finish, and io_uring then polls the device.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: iocb (the request, ki_filp->private_data is the channel).
+ *           to (the segments).
+ *
+ * Returns:  As spimod_read(), -EAGAIN for IOCB_NOWAIT as for O_NONBLOCK.
+ *
+ * Globals:
+ *
+ * - The channel's _rxBuffer (to extract data for the user).
+ * - The channel's _wait (waited on).
+ *
+ * ***************************************************************************/
+
+ssize_t spimod_read_iter(
+   struct kiocb* iocb,
+   struct iov_iter* to);
+
+/******************************************************************************
+ *
+ * Function: spimod_write_iter()
+ * Purpose:  Handler for writev(): as spimod_write(), the data gathered from
+ *           the segments in order.  In datagram mode the segments make up
+ *           one message; use IOCTL_SEND_VECTOR to send several.  Also backs
+ *           splice() and sendfile() into the device, a pipe's worth at a
+ *           time, and io_uring writes, which IOCB_NOWAIT keeps from
+ *           waiting as for spimod_read_iter().
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: iocb (the request, ki_filp->private_data is the channel).
+ *           from (the segments).
+ *
+ * Returns:  As spimod_write(), -EAGAIN for IOCB_NOWAIT as for O_NONBLOCK.
+ *
+ * Globals:
+ *
+ * - The channel's _txBuffer (to add data from the user).
+ * - The channel's _wait (waited on).
+ * - device_state._idle (data sent wakes the pump, see spimod_pump_wake()).
+ *
+ * ***************************************************************************/
+
+ssize_t spimod_write_iter(
+   struct kiocb* iocb,
+   struct iov_iter* from);
+
+#endif
+
+/******************************************************************************
+ *
+ * Function: spimod_release_work()
+ * Purpose:  Frees the buffers and frames once the device has been closed
+ *           for idle_release_ms (module parameter, -1 to keep them).  Waits
+ *           for a transfer still in flight to complete first.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: work (the work item - not used).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._openCount (nothing is freed if the device is open).
+ * - device_transaction._busy (checked for a transfer in flight).
+ * - device_state._channels (their buffers destroyed).
+ * - device_transaction._pool (destroyed).
+ *
+ * ***************************************************************************/
+
+void spimod_release_work(
+   struct work_struct* work);
+
 /******************************************************************************
  *
  * Function: spimod_open()
- * Purpose:  Handler for the open() system call.  Resets the transmit and
- *           receive circular buffers, clears the outbound and inbound packets
- *           and starts the read / write timer.
+ * Purpose:  Handler for the open() system call.  Allocates the buffers and
+ *           frames if they have been released, resets the channel's
+ *           transmit and receive circular buffers and, if the timer is not
+ *           running, clears the outbound and inbound packets and starts it.
+ *
+ *           If persistent was set when it was closed (see spimod_close())
+ *           the channel is not reset: whatever the slave sent while it was
+ *           closed, up to the size of its receive buffer, is there to
+ *           read, and its mode is unchanged.
  *
  * Parameters:
  *
  * - IN:     N/A
  * - OUT:    N/A
- * - IN/OUT: i (current file system inode - not used).
- *           file (file pointer data - not used).
+ * - IN/OUT: i (current file system inode, its cdev identifies the channel).
+ *           file (file pointer data, private_data set to the channel and
+ *           FMODE_NOWAIT to its f_mode, from 4.14, for io_uring).
  *
  * Returns:  0 on success, negative integer on failure.
  *
  * Globals:
  *
- * - device_state._txBuffer (cleared).
- * - device_state._rxBuffer (cleared).
+ * - device_state._releaseWork (cancelled).
+ * - device_state._openCount (incremented).
+ * - device_state._channels (the channel's buffers, including the priority
+ *   ones, created / cleared, its transmit cursors caught up and _datagram
+ *   set from the datagram module parameter, unless _kept).
  * - device_transaction._outPacket (cleared).
  * - device_transaction._inPacket (cleared).
+ * - device_transaction._inPending (cleared).
+ * - device_state._idle, _idleCount (cleared, the pump starts busy).
+ * - device_state._syncLost, _slipPending (cleared).
+ * - device_state._dataSize (agreed again by the handshake).
  * - device_state._timer (started).
  *
  * ***************************************************************************/
@@ -131,21 +293,34 @@ int spimod_open(
 /******************************************************************************
  *
  * Function: spimod_close()
- * Purpose:  Handler for the close() system call.  Stops the read / write
- *           timer.
+ * Purpose:  Handler for the close() system call.  The last close of a
+ *           channel abandons its bulk send and unpins its pages.  On the
+ *           last close of any channel, stops the read / write timer and
+ *           schedules the buffers and frames to be freed after
+ *           idle_release_ms.
+ *
+ *           Loaded with persistent=1 (read at each close) the timer keeps
+ *           running and nothing is freed: the pump goes on receiving into
+ *           the channels' buffers, data beyond their size being counted in
+ *           rx_dropped, until the next open picks it up.  The pump stops
+ *           when the module is unloaded.
  *
  * Parameters:
  *
  * - IN:     N/A
  * - OUT:    N/A
  * - IN/OUT: i (current file system inode - not used).
- *           file (file pointer data - not used).
+ *           file (file pointer data, private_data is the channel).
  *
  * Returns:  Always 0.
  *
  * Globals:
  *
- * - device_state._timer (stopped).
+ * - device_state._timer (stopped, unless persistent).
+ * - device_state._openCount (decremented).
+ * - device_state._channels (the channel's _openCount decremented, _kept
+ *   set from persistent, its bulk pages unpinned on its last close).
+ * - device_state._releaseWork (scheduled).
  *
  * ***************************************************************************/
 
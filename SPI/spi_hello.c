@@ -0,0 +1,189 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_hello
+ *
+ * Purpose:     Frame size and feature handshake, see spi_hello.h.
+ *
+ *              The hello is stored in host byte order, like the header
+ *              fields, and its CRC covers it as it would the data of any
+ *              other packet, as its _len is 0.
+ *
+ * ***************************************************************************/
+
+#include "spi_hello.h"
+#include "spi_crc.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+
+#define __NO_VERSION__
+
+/******************************************************************************
+ *
+ * Function: spimod_hello_build()
+ * Purpose:  Builds a sealed hello packet.
+ *
+ * Parameters:
+ *
+ * - IN:     status (the low byte of _status).
+ *           maxData (the most data a frame may carry).
+ *           features (the SPIMOD_FEATURE_ flags).
+ * - OUT:    pkt (the packet).
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_hello_build(
+   struct packet* pkt,
+   const short status,
+   const u32 maxData,
+   const u32 features)
+{
+   struct packet_hello hello;
+
+   hello._version = SPIMOD_PROTOCOL_VERSION;
+   hello._maxData = maxData;
+   hello._features = features;
+
+   pkt->_sync = PACKET_SYNC;
+   pkt->_status = status | PACKET_FLAG_HELLO;
+   pkt->_len = 0;
+
+   memset(pkt->_data, 0, PACKET_DATA_SIZE);
+   memcpy(pkt->_data, &hello, sizeof(hello));
+
+   spimod_packet_seal(pkt, PACKET_DATA_SIZE);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_hello_parse()
+ * Purpose:  Checks and reads a hello packet.
+ *
+ * Parameters:
+ *
+ * - IN:     pkt (the packet).
+ * - OUT:    hello (the hello).
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 if the hello is intact and can be agreed with, else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_hello_parse(
+   const struct packet* pkt,
+   struct packet_hello* hello)
+{
+   if ((PACKET_SYNC != pkt->_sync)
+    || !(pkt->_status & PACKET_FLAG_HELLO)
+    || !spimod_packet_verify(pkt, PACKET_DATA_SIZE))
+   {
+      return 0;
+   }
+
+   memcpy(hello, pkt->_data, sizeof(struct packet_hello));
+
+   return (hello->_version >= 1) && (hello->_maxData >= PACKET_DATA_SIZE);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_hello_agree()
+ * Purpose:  Returns the data each frame carries once both ends have agreed.
+ *
+ * Parameters:
+ *
+ * - IN:     mine (the most data a frame may carry at this end).
+ *           theirs (the most data a frame may carry at the other).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  From PACKET_DATA_SIZE to PACKET_DATA_MAX bytes.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+u32 spimod_hello_agree(
+   const u32 mine,
+   const u32 theirs)
+{
+   u32 dataSize = min_t(u32, min_t(u32, mine, theirs), PACKET_DATA_MAX);
+
+   // The base frame keeps its size, only larger ones are whole words
+
+   dataSize = ((PACKET_HEADER_SIZE + dataSize) & ~3U) - PACKET_HEADER_SIZE;
+
+   return max_t(u32, dataSize, PACKET_DATA_SIZE);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_hello_data_size()
+ * Purpose:  Returns the data in the frames of a transfer.
+ *
+ * Parameters:
+ *
+ * - IN:     len (the length of the transfer in bytes).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The data in each frame.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+u32 spimod_hello_data_size(
+   const unsigned int len)
+{
+   if (len <= PACKET_FRAME_SIZE)
+   {
+      return PACKET_DATA_SIZE;
+   }
+
+   return min_t(u32, len - PACKET_HEADER_SIZE, PACKET_DATA_MAX);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_hello_max_data()
+ * Purpose:  Returns the most data a frame may carry at this end.
+ *
+ * Parameters:
+ *
+ * - IN:     maxFrame (the largest frame in bytes).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  From PACKET_DATA_SIZE to PACKET_DATA_MAX bytes.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+u32 spimod_hello_max_data(
+   const unsigned int maxFrame)
+{
+   const u32 frame = clamp_t(u32, maxFrame, PACKET_SIZE, PACKET_MAX_SIZE);
+
+   return spimod_hello_agree(frame - PACKET_HEADER_SIZE, PACKET_DATA_MAX);
+}
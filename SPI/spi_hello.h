@@ -0,0 +1,158 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_hello
+ *
+ * Purpose:     The handshake agreeing the frame size and features of the
+ *              link.  A hello packet is flagged PACKET_FLAG_HELLO, has a
+ *              _len of 0, so a slave that does not know it sees an empty
+ *              packet, and carries a struct packet_hello at the start of
+ *              _data.  Whatever the frame size in use, it is laid out as a
+ *              frame of PACKET_DATA_SIZE, always sealed with its CRC and
+ *              never numbered or encoded, so either end can read it before
+ *              they agree.
+ *
+ *              The master sends hellos until the slave answers with its
+ *              own, then both use the largest frame both support; the
+ *              slave follows the length of the transfers it sees.
+ *
+ *              Shared by the driver and the slave model.
+ *
+ * ***************************************************************************/
+
+#ifndef SPI_HELLO_H
+#define SPI_HELLO_H
+
+#include "spi_protocol.h"
+
+/* Version 1 adds the handshake itself; anything older never answers */
+
+#define SPIMOD_PROTOCOL_VERSION		1
+
+/******************************************************************************
+ *
+ * Function: spimod_hello_build()
+ * Purpose:  Builds a sealed hello packet.
+ *
+ * Parameters:
+ *
+ * - IN:     status (the low byte of _status, the slave state).
+ *           maxData (the most data a frame may carry at this end).
+ *           features (the SPIMOD_FEATURE_ flags in use at this end).
+ * - OUT:    pkt (the packet, its PACKET_DATA_SIZE bytes of data cleared).
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_hello_build(
+   struct packet* pkt,
+   const short status,
+   const u32 maxData,
+   const u32 features);
+
+/******************************************************************************
+ *
+ * Function: spimod_hello_parse()
+ * Purpose:  Checks a packet flagged PACKET_FLAG_HELLO against its CRC and
+ *           reads the hello it carries.
+ *
+ * Parameters:
+ *
+ * - IN:     pkt (the packet).
+ * - OUT:    hello (the hello, in host byte order like the header).
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 if the hello is intact and can be agreed with, else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_hello_parse(
+   const struct packet* pkt,
+   struct packet_hello* hello);
+
+/******************************************************************************
+ *
+ * Function: spimod_hello_agree()
+ * Purpose:  Returns the data each frame carries once both ends have said
+ *           how much they support: the smaller, rounded down so that a
+ *           larger frame is a whole number of 32 bit words.
+ *
+ * Parameters:
+ *
+ * - IN:     mine (the most data a frame may carry at this end).
+ *           theirs (the most data a frame may carry at the other).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  From PACKET_DATA_SIZE to PACKET_DATA_MAX bytes.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+u32 spimod_hello_agree(
+   const u32 mine,
+   const u32 theirs);
+
+/******************************************************************************
+ *
+ * Function: spimod_hello_data_size()
+ * Purpose:  Returns the data in the frames of a transfer, for the slave,
+ *           which follows the frame size the master uses.
+ *
+ * Parameters:
+ *
+ * - IN:     len (the length of the transfer in bytes).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  PACKET_DATA_SIZE for a transfer of a frame of that size, padded
+ *           or not, else what a frame of len bytes carries.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+u32 spimod_hello_data_size(
+   const unsigned int len);
+
+/******************************************************************************
+ *
+ * Function: spimod_hello_max_data()
+ * Purpose:  Returns the most data a frame may carry at this end, given the
+ *           largest frame it is configured for.
+ *
+ * Parameters:
+ *
+ * - IN:     maxFrame (the largest frame in bytes, header included).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  PACKET_DATA_SIZE for anything up to PACKET_SIZE (so 0 asks for
+ *           no handshake), else up to PACKET_DATA_MAX.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+u32 spimod_hello_max_data(
+   const unsigned int maxFrame);
+
+#endif
@@ -0,0 +1,2564 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_kunit
+ *
+ * Purpose:     KUnit tests for the circular buffer, the frame pool and the
+ *              packet protocol, plus microbenchmarks of the buffer and
+ *              packet hot paths reporting ns/byte.
+ *
+ *              The benchmarks only report unless bench_limit_ps_per_byte is
+ *              set, in which case any copy slower than the limit fails, e.g.
+ *              kunit.py run --kernel_args spimod_kunit.bench_limit_ps_per_byte=500
+ *
+ * ***************************************************************************/
+
+#include "spi_protocol.h"
+#include "circular_buffer.h"
+#include "frame_pool.h"
+#include "spi_datagram.h"
+#include "spi_priority.h"
+#include "spi_crc.h"
+#include "spi_arq.h"
+#include "spi_fec.h"
+#include "spi_hello.h"
+#include "spi_bulk.h"
+#include "spi_cursor.h"
+#include "spi_compat.h"
+
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mman.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+
+#define __NO_VERSION__
+
+/* The driver globals, normally defined in spi_core.c */
+
+struct spimod_device_state device_state;
+struct spimod_transaction device_transaction;
+
+/* The channel used by all but the multiplexing tests */
+
+static struct spimod_channel* const channel0 = &device_state._channels[0];
+
+/* Constants */
+
+#define TEST_CAPACITY		16
+#define BENCH_BUFFER_SIZE	(1024 * 16)
+#define BENCH_ROUNDS		256
+
+/* kunit_vm_mmap() gives the test a user mapping from 6.10 */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define SPIMOD_KUNIT_HAVE_USER_MEMORY	1
+#else
+#define SPIMOD_KUNIT_HAVE_USER_MEMORY	0
+#endif
+
+#ifndef KUNIT_CASE_SLOW
+#define KUNIT_CASE_SLOW(test)		KUNIT_CASE(test)
+#endif
+
+/* A user address below mmap_min_addr, so always faults */
+
+#define BAD_USER_POINTER		((char*)16)
+
+static unsigned int bench_limit_ps_per_byte = 0;
+
+module_param(bench_limit_ps_per_byte, uint, 0644);
+MODULE_PARM_DESC(bench_limit_ps_per_byte,
+                 "Fail benchmarks slower than this many picoseconds per byte (0 = report only)");
+
+/* A circular buffer wrap / full / empty case: the buffer starts with size
+   bytes from begin and length bytes are written or read */
+
+struct cb_case
+{
+   const char*	_name;
+   int		_begin;
+   int		_size;
+   int		_length;
+   int		_expected;
+};
+
+static const struct cb_case write_cases[] =
+{
+   { "empty",			0,	0,	5,	5  },
+   { "fill from start",		0,	0,	16,	16 },
+   { "fill to end",		4,	0,	12,	12 },
+   { "wrap",			10,	2,	8,	8  },
+   { "wrap to full",		10,	2,	14,	14 },
+   { "after wrap",		12,	8,	4,	4  },
+   { "ends at capacity",	8,	4,	4,	4  },
+   { "longer than free",	0,	10,	7,	0  },
+   { "longer than free wrap",	10,	2,	15,	0  },
+   { "full",			5,	16,	1,	0  },
+   { "zero length",		3,	4,	0,	0  },
+};
+
+static const struct cb_case read_cases[] =
+{
+   { "empty",			0,	0,	4,	0  },
+   { "empty mid buffer",	7,	0,	4,	0  },
+   { "partial",			0,	10,	4,	4  },
+   { "more than available",	0,	3,	8,	3  },
+   { "to end",			12,	4,	4,	4  },
+   { "wrap",			12,	8,	8,	8  },
+   { "wrap leaving data",	14,	10,	5,	5  },
+   { "full from start",		0,	16,	16,	16 },
+   { "full wrap",		9,	16,	16,	16 },
+   { "partial wrap",		14,	6,	16,	6  },
+   { "zero length",		3,	4,	0,	0  },
+};
+
+/* circular_buffer_write_iter() writes as much as fits */
+
+static const struct cb_case write_iter_cases[] =
+{
+   { "empty",			0,	0,	5,	5  },
+   { "fill from start",		0,	0,	16,	16 },
+   { "wrap",			10,	2,	8,	8  },
+   { "wrap to full",		10,	2,	14,	14 },
+   { "ends at capacity",	8,	4,	4,	4  },
+   { "longer than free",	0,	10,	7,	6  },
+   { "longer than free wrap",	10,	2,	15,	14 },
+   { "full",			5,	16,	1,	0  },
+   { "zero length",		3,	4,	0,	0  },
+};
+
+static void cb_case_desc(
+   const struct cb_case* c,
+   char* desc)
+{
+   strscpy(desc, c->_name, KUNIT_PARAM_DESC_SIZE);
+}
+
+KUNIT_ARRAY_PARAM(write, write_cases, cb_case_desc);
+KUNIT_ARRAY_PARAM(read, read_cases, cb_case_desc);
+KUNIT_ARRAY_PARAM(write_iter, write_iter_cases, cb_case_desc);
+
+/******************************************************************************
+ *
+ * Function: cb_setup()
+ * Purpose:  Returns a TEST_CAPACITY byte buffer holding c->_size bytes from
+ *           c->_begin; byte i of the contents is 0x80 + i, free space is
+ *           0xEE.
+ *
+ * ***************************************************************************/
+
+static struct circular_buffer* cb_setup(
+   struct kunit* test,
+   const struct cb_case* c)
+{
+   struct circular_buffer* buf = circular_buffer_init(TEST_CAPACITY);
+   int i;
+
+   KUNIT_ASSERT_NOT_NULL(test, buf);
+
+   memset(buf->_data, 0xEE, TEST_CAPACITY);
+
+   for (i = 0; i < c->_size; ++i)
+   {
+      buf->_data[(c->_begin + i) % TEST_CAPACITY] = (char)(0x80 + i);
+   }
+
+   buf->_beginIndex = c->_begin;
+   buf->_endIndex = (c->_begin + c->_size) % TEST_CAPACITY;
+   buf->_size = c->_size;
+
+   return buf;
+}
+
+/******************************************************************************
+ *
+ * Function: cb_check_write()
+ * Purpose:  Checks the buffer state after written bytes of data were
+ *           appended to the case's initial contents.
+ *
+ * ***************************************************************************/
+
+static void cb_check_write(
+   struct kunit* test,
+   const struct cb_case* c,
+   struct circular_buffer* buf,
+   const char* data,
+   const int written)
+{
+   int i;
+
+   KUNIT_EXPECT_EQ(test, written, c->_expected);
+   KUNIT_EXPECT_EQ(test, buf->_size, c->_size + c->_expected);
+   KUNIT_EXPECT_EQ(test, buf->_beginIndex, c->_begin);
+   KUNIT_EXPECT_EQ(test,
+                   buf->_endIndex,
+                   (c->_begin + c->_size + c->_expected) % TEST_CAPACITY);
+
+   for (i = 0; i < c->_size; ++i)
+   {
+      KUNIT_EXPECT_EQ(test,
+                      buf->_data[(c->_begin + i) % TEST_CAPACITY],
+                      (char)(0x80 + i));
+   }
+
+   for (i = 0; i < c->_expected; ++i)
+   {
+      KUNIT_EXPECT_EQ(test,
+                      buf->_data[(c->_begin + c->_size + i) % TEST_CAPACITY],
+                      data[i]);
+   }
+
+   for (i = c->_size + c->_expected; i < TEST_CAPACITY; ++i)
+   {
+      KUNIT_EXPECT_EQ(test,
+                      buf->_data[(c->_begin + i) % TEST_CAPACITY],
+                      (char)0xEE);
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: cb_check_read()
+ * Purpose:  Checks the data returned and the buffer state after read bytes
+ *           were taken from the case's initial contents.
+ *
+ * ***************************************************************************/
+
+static void cb_check_read(
+   struct kunit* test,
+   const struct cb_case* c,
+   struct circular_buffer* buf,
+   const char* data,
+   const int read)
+{
+   int i;
+
+   KUNIT_EXPECT_EQ(test, read, c->_expected);
+   KUNIT_EXPECT_EQ(test, buf->_size, c->_size - c->_expected);
+   KUNIT_EXPECT_EQ(test,
+                   buf->_beginIndex,
+                   (c->_begin + c->_expected) % TEST_CAPACITY);
+   KUNIT_EXPECT_EQ(test,
+                   buf->_endIndex,
+                   (c->_begin + c->_size) % TEST_CAPACITY);
+
+   for (i = 0; i < c->_expected; ++i)
+   {
+      KUNIT_EXPECT_EQ(test, data[i], (char)(0x80 + i));
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: user_buffer()
+ * Purpose:  Maps a page of user memory for the _user copy functions.
+ *
+ * ***************************************************************************/
+
+static char* user_buffer(
+   struct kunit* test)
+{
+#if SPIMOD_KUNIT_HAVE_USER_MEMORY
+   unsigned long addr = kunit_vm_mmap(test, NULL, 0, PAGE_SIZE,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_ANONYMOUS | MAP_PRIVATE, 0);
+
+   KUNIT_ASSERT_NE_MSG(test, addr, 0UL, "kunit_vm_mmap() failed");
+   KUNIT_ASSERT_FALSE(test, IS_ERR_VALUE(addr));
+
+   return (char*)addr;
+#else
+   kunit_skip(test, "user memory needs kunit_vm_mmap() (6.10+)");
+
+   return NULL;
+#endif
+}
+
+/* Circular buffer tests */
+
+static void circular_buffer_write_test(
+   struct kunit* test)
+{
+   const struct cb_case* c = test->param_value;
+   struct circular_buffer* buf = cb_setup(test, c);
+   char data[TEST_CAPACITY];
+   int i;
+
+   for (i = 0; i < TEST_CAPACITY; ++i)
+   {
+      data[i] = (char)(0x10 + i);
+   }
+
+   cb_check_write(test, c, buf, data,
+                  circular_buffer_write(buf, data, c->_length));
+
+   circular_buffer_term(buf);
+}
+
+static void circular_buffer_write_user_test(
+   struct kunit* test)
+{
+   const struct cb_case* c = test->param_value;
+   char* ubuf = user_buffer(test);
+   struct circular_buffer* buf = cb_setup(test, c);
+   char data[TEST_CAPACITY];
+   int i;
+
+   for (i = 0; i < TEST_CAPACITY; ++i)
+   {
+      data[i] = (char)(0x10 + i);
+   }
+
+   KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, data, TEST_CAPACITY), 0UL);
+
+   cb_check_write(test, c, buf, data,
+                  circular_buffer_write_user(buf, ubuf, c->_length));
+
+   circular_buffer_term(buf);
+}
+
+static void circular_buffer_read_test(
+   struct kunit* test)
+{
+   const struct cb_case* c = test->param_value;
+   struct circular_buffer* buf = cb_setup(test, c);
+   char data[TEST_CAPACITY];
+
+   cb_check_read(test, c, buf, data,
+                 circular_buffer_read(buf, data, c->_length));
+
+   circular_buffer_term(buf);
+}
+
+static void circular_buffer_read_user_test(
+   struct kunit* test)
+{
+   const struct cb_case* c = test->param_value;
+   char* ubuf = user_buffer(test);
+   struct circular_buffer* buf = cb_setup(test, c);
+   char data[TEST_CAPACITY];
+   int read;
+
+   read = circular_buffer_read_user(buf, ubuf, c->_length);
+
+   KUNIT_ASSERT_EQ(test, copy_from_user(data, ubuf, TEST_CAPACITY), 0UL);
+
+   cb_check_read(test, c, buf, data, read);
+
+   circular_buffer_term(buf);
+}
+
+#if SPIMOD_HAVE_READ_ITER
+
+/* The iterators are split in two segments of 3 bytes and the rest, so the
+   copies also cross from one segment to the next */
+
+static void cb_kvec(
+   struct kvec* vec,
+   char* data,
+   const int length)
+{
+   vec[0].iov_base = data;
+   vec[0].iov_len = min(length, 3);
+   vec[1].iov_base = data + vec[0].iov_len;
+   vec[1].iov_len = length - vec[0].iov_len;
+}
+
+static void circular_buffer_write_iter_test(
+   struct kunit* test)
+{
+   const struct cb_case* c = test->param_value;
+   struct circular_buffer* buf = cb_setup(test, c);
+   char data[TEST_CAPACITY];
+   struct kvec vec[2];
+   struct iov_iter iter;
+   int i, written;
+
+   for (i = 0; i < TEST_CAPACITY; ++i)
+   {
+      data[i] = (char)(0x10 + i);
+   }
+
+   cb_kvec(vec, data, c->_length);
+   iov_iter_kvec(&iter, WRITE, vec, 2, c->_length);
+
+   written = circular_buffer_write_iter(buf, &iter, c->_length);
+
+   KUNIT_EXPECT_EQ(test, (int)iov_iter_count(&iter), c->_length - written);
+
+   cb_check_write(test, c, buf, data, written);
+
+   circular_buffer_term(buf);
+}
+
+static void circular_buffer_read_iter_test(
+   struct kunit* test)
+{
+   const struct cb_case* c = test->param_value;
+   struct circular_buffer* buf = cb_setup(test, c);
+   char data[TEST_CAPACITY];
+   struct kvec vec[2];
+   struct iov_iter iter;
+   int read;
+
+   cb_kvec(vec, data, c->_length);
+   iov_iter_kvec(&iter, READ, vec, 2, c->_length);
+
+   read = circular_buffer_read_iter(buf, &iter, c->_length);
+
+   KUNIT_EXPECT_EQ(test, (int)iov_iter_count(&iter), c->_length - read);
+
+   cb_check_read(test, c, buf, data, read);
+
+   circular_buffer_term(buf);
+}
+
+#endif
+
+/* A faulting user copy must leave the buffer untouched, both when the copy
+   is done in a single step and when it wraps */
+
+static void circular_buffer_user_fault_test(
+   struct kunit* test)
+{
+   static const struct cb_case faults[] =
+   {
+      { "write single step",	0,	4,	8,	0 },
+      { "write two steps",	10,	2,	8,	0 },
+      { "read single step",	0,	8,	4,	0 },
+      { "read two steps",	12,	8,	8,	0 },
+   };
+
+   int i;
+
+   for (i = 0; i < ARRAY_SIZE(faults); ++i)
+   {
+      const struct cb_case* c = &faults[i];
+      struct circular_buffer* buf = cb_setup(test, c);
+      int result;
+
+      if (i < 2)
+      {
+         result = circular_buffer_write_user(buf, BAD_USER_POINTER,
+                                             c->_length);
+      }
+      else
+      {
+         result = circular_buffer_read_user(buf, BAD_USER_POINTER,
+                                            c->_length);
+      }
+
+      KUNIT_EXPECT_EQ_MSG(test, result, 0, "%s", c->_name);
+      KUNIT_EXPECT_EQ_MSG(test, buf->_size, c->_size, "%s", c->_name);
+      KUNIT_EXPECT_EQ_MSG(test, buf->_beginIndex, c->_begin, "%s", c->_name);
+      KUNIT_EXPECT_EQ_MSG(test,
+                          buf->_endIndex,
+                          (c->_begin + c->_size) % TEST_CAPACITY,
+                          "%s", c->_name);
+
+      circular_buffer_term(buf);
+   }
+}
+
+static void circular_buffer_resize_test(
+   struct kunit* test)
+{
+   const struct cb_case* c = test->param_value;
+   struct circular_buffer* buf = cb_setup(test, c);
+   int i;
+
+   if (c->_size > 0)
+   {
+      KUNIT_EXPECT_EQ(test, circular_buffer_resize(buf, c->_size - 1), -1);
+      KUNIT_EXPECT_EQ(test, buf->_size, c->_size);
+   }
+
+   KUNIT_ASSERT_EQ(test, circular_buffer_resize(buf, TEST_CAPACITY * 2), 0);
+
+   KUNIT_EXPECT_EQ(test, buf->_capacity, TEST_CAPACITY * 2);
+   KUNIT_EXPECT_EQ(test, buf->_size, c->_size);
+   KUNIT_EXPECT_EQ(test, buf->_beginIndex, 0);
+   KUNIT_EXPECT_EQ(test, buf->_endIndex, c->_size);
+
+   for (i = 0; i < c->_size; ++i)
+   {
+      KUNIT_EXPECT_EQ(test, (u8)buf->_data[i], (u8)(0x80 + i));
+   }
+
+   KUNIT_EXPECT_EQ(test, circular_buffer_resize(buf, 0), -1);
+   KUNIT_EXPECT_EQ(test, circular_buffer_resize(NULL, TEST_CAPACITY), -1);
+
+   circular_buffer_term(buf);
+}
+
+static void circular_buffer_null_test(
+   struct kunit* test)
+{
+   struct circular_buffer* buf = circular_buffer_init(TEST_CAPACITY);
+   char data[4] = { 0 };
+
+   KUNIT_ASSERT_NOT_NULL(test, buf);
+
+   KUNIT_EXPECT_NULL(test, circular_buffer_init(0));
+
+   KUNIT_EXPECT_EQ(test, circular_buffer_write(NULL, data, 4), 0);
+   KUNIT_EXPECT_EQ(test, circular_buffer_write(buf, NULL, 4), 0);
+   KUNIT_EXPECT_EQ(test, circular_buffer_write(buf, data, -1), 0);
+   KUNIT_EXPECT_EQ(test, circular_buffer_read(NULL, data, 4), 0);
+   KUNIT_EXPECT_EQ(test, circular_buffer_read(buf, NULL, 4), 0);
+   KUNIT_EXPECT_EQ(test, circular_buffer_num_bytes_available(NULL), 0);
+   KUNIT_EXPECT_EQ(test, buf->_size, 0);
+
+   KUNIT_EXPECT_EQ(test, circular_buffer_write(buf, data, 4), 4);
+
+   circular_buffer_reset(buf);
+
+   KUNIT_EXPECT_EQ(test, circular_buffer_num_bytes_available(buf), 0);
+   KUNIT_EXPECT_EQ(test, buf->_beginIndex, 0);
+   KUNIT_EXPECT_EQ(test, buf->_endIndex, 0);
+
+   circular_buffer_term(buf);
+}
+
+/* Frame pool tests */
+
+static void frame_pool_test(
+   struct kunit* test)
+{
+   struct frame_pool* pool = frame_pool_init(NULL, 3, PACKET_SIZE);
+   void* frames[3];
+   int i;
+
+   KUNIT_ASSERT_NOT_NULL(test, pool);
+
+   for (i = 0; i < 3; ++i)
+   {
+      frames[i] = frame_pool_get(pool);
+
+      KUNIT_ASSERT_NOT_NULL(test, frames[i]);
+      KUNIT_EXPECT_EQ(test,
+                      (unsigned long)frames[i] % L1_CACHE_BYTES,
+                      0UL);
+      KUNIT_EXPECT_GE(test, (int)pool->_stride, (int)PACKET_SIZE);
+   }
+
+   KUNIT_EXPECT_PTR_NE(test, frames[0], frames[1]);
+   KUNIT_EXPECT_PTR_NE(test, frames[1], frames[2]);
+
+   // Exhausted: fails without allocating, and is counted
+
+   KUNIT_EXPECT_NULL(test, frame_pool_get(pool));
+   KUNIT_EXPECT_EQ(test, pool->_exhausted, 1U);
+   KUNIT_EXPECT_EQ(test, pool->_available, 0U);
+   KUNIT_EXPECT_EQ(test, pool->_lowWater, 0U);
+
+   // Frames are recycled most recently put first
+
+   frame_pool_put(pool, frames[1]);
+   frame_pool_put(pool, NULL);
+
+   KUNIT_EXPECT_EQ(test, pool->_available, 1U);
+   KUNIT_EXPECT_PTR_EQ(test, frame_pool_get(pool), frames[1]);
+
+   frame_pool_put(pool, frames[0]);
+   frame_pool_put(pool, frames[1]);
+   frame_pool_put(pool, frames[2]);
+
+   KUNIT_EXPECT_EQ(test, pool->_available, 3U);
+   KUNIT_EXPECT_EQ(test, pool->_lowWater, 0U);
+
+   // kmalloc() pools have no DMA addresses, but offsets still hold
+
+   KUNIT_EXPECT_EQ(test,
+                   (u64)(frame_pool_dma(pool, frames[2])
+                         - frame_pool_dma(pool, frames[0])),
+                   (u64)((char*)frames[2] - (char*)frames[0]));
+
+   frame_pool_term(pool);
+
+   KUNIT_EXPECT_NULL(test, frame_pool_init(NULL, 0, PACKET_SIZE));
+}
+
+/* Lazily allocated device resources */
+
+static void resources_test(
+   struct kunit* test)
+{
+   struct circular_buffer* tx;
+   struct frame_pool* pool;
+
+   memset(&device_state, 0, sizeof(device_state));
+   memset(&device_transaction, 0, sizeof(device_transaction));
+
+   device_state._numChannels = 1;
+   device_state._dataSize = PACKET_DATA_SIZE;
+   device_state._maxData = PACKET_DATA_SIZE;
+
+   channel0->_txBufferSize = TEST_CAPACITY;
+   channel0->_rxBufferSize = TEST_CAPACITY * 2;
+
+   KUNIT_ASSERT_EQ(test, spimod_resources_acquire(), 0);
+
+   tx = channel0->_txBuffer;
+   pool = device_transaction._pool;
+
+   KUNIT_ASSERT_NOT_NULL(test, tx);
+   KUNIT_ASSERT_NOT_NULL(test, channel0->_rxBuffer);
+   KUNIT_ASSERT_NOT_NULL(test, pool);
+   KUNIT_EXPECT_NOT_NULL(test, device_transaction._outPacket);
+   KUNIT_EXPECT_NOT_NULL(test, device_transaction._inPacket);
+   KUNIT_EXPECT_EQ(test, channel0->_rxBuffer->_capacity, TEST_CAPACITY * 2);
+
+   // Acquiring again keeps what is already allocated
+
+   KUNIT_ASSERT_EQ(test, spimod_resources_acquire(), 0);
+   KUNIT_EXPECT_PTR_EQ(test, channel0->_txBuffer, tx);
+   KUNIT_EXPECT_PTR_EQ(test, device_transaction._pool, pool);
+
+   spimod_resources_release();
+
+   KUNIT_EXPECT_NULL(test, channel0->_txBuffer);
+   KUNIT_EXPECT_NULL(test, channel0->_rxBuffer);
+   KUNIT_EXPECT_NULL(test, device_transaction._pool);
+   KUNIT_EXPECT_NULL(test, device_transaction._outPacket);
+
+   // Releasing twice is harmless
+
+   spimod_resources_release();
+}
+
+/* Packet protocol tests, run against private tx / rx buffers and packets */
+
+static int protocol_init(
+   struct kunit* test)
+{
+   memset(&device_state, 0, sizeof(device_state));
+   memset(&device_transaction, 0, sizeof(device_transaction));
+
+   device_state._numChannels = 1;
+   device_state._dataSize = PACKET_DATA_SIZE;
+   device_state._maxData = PACKET_DATA_SIZE;
+
+   channel0->_txBuffer = circular_buffer_init(BENCH_BUFFER_SIZE);
+   channel0->_rxBuffer = circular_buffer_init(BENCH_BUFFER_SIZE);
+
+   spin_lock_init(&channel0->_txLock);
+
+   device_transaction._outPacket = kunit_kzalloc(test, PACKET_MAX_SIZE,
+                                                 GFP_KERNEL);
+   device_transaction._inPacket = kunit_kzalloc(test, PACKET_MAX_SIZE,
+                                                GFP_KERNEL);
+
+   spimod_datagram_reset(channel0);
+
+   if (NULL == channel0->_txBuffer || NULL == channel0->_rxBuffer
+    || NULL == device_transaction._outPacket
+    || NULL == device_transaction._inPacket)
+   {
+      return -ENOMEM;
+   }
+
+   return 0;
+}
+
+static void protocol_exit(
+   struct kunit* test)
+{
+   int c;
+
+   for (c = 0; c < SPIMOD_MAX_CHANNELS; ++c)
+   {
+      circular_buffer_term(device_state._channels[c]._txBuffer);
+      circular_buffer_term(device_state._channels[c]._rxBuffer);
+      circular_buffer_term(device_state._channels[c]._txPriority);
+      circular_buffer_term(device_state._channels[c]._rxPriority);
+
+      device_state._channels[c]._txBuffer = NULL;
+      device_state._channels[c]._rxBuffer = NULL;
+      device_state._channels[c]._txPriority = NULL;
+      device_state._channels[c]._rxPriority = NULL;
+   }
+
+   spimod_arq_term(&device_state._arq);
+   spimod_fec_term(&device_state._fec);
+}
+
+static void fill_tx(
+   const int length)
+{
+   char data[256];
+   int offset, i;
+
+   for (offset = 0; offset < length; offset += sizeof(data))
+   {
+      int chunk = min_t(int, sizeof(data), length - offset);
+
+      for (i = 0; i < chunk; ++i)
+      {
+         data[i] = (char)(offset + i);
+      }
+
+      circular_buffer_write(channel0->_txBuffer, data, chunk);
+   }
+}
+
+static void create_outbound_empty_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+
+   memset(out, 0xEE, PACKET_SIZE);
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, out->_sync, PACKET_SYNC);
+   KUNIT_EXPECT_EQ(test, out->_status, (short)SLAVE_RX_UNABLE);
+   KUNIT_EXPECT_EQ(test, out->_len, 0);
+   KUNIT_EXPECT_TRUE(test, !memchr_inv(out->_data, 0, PACKET_DATA_SIZE));
+}
+
+static void create_outbound_partial_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   int i;
+
+   fill_tx(100);
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, out->_len, 100);
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_txBuffer),
+                   0);
+
+   for (i = 0; i < 100; ++i)
+   {
+      KUNIT_EXPECT_EQ(test, out->_data[i], (unsigned char)i);
+   }
+
+   KUNIT_EXPECT_TRUE(test, !memchr_inv(out->_data + 100, 0,
+                                       PACKET_DATA_SIZE - 100));
+}
+
+static void create_outbound_full_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   int i;
+
+   // Start near the end of the ring so the packet is read in two steps
+
+   channel0->_txBuffer->_beginIndex = BENCH_BUFFER_SIZE - 100;
+   channel0->_txBuffer->_endIndex = BENCH_BUFFER_SIZE - 100;
+
+   fill_tx(PACKET_DATA_SIZE + 10);
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, out->_len, PACKET_DATA_SIZE);
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_txBuffer),
+                   10);
+
+   for (i = 0; i < PACKET_DATA_SIZE; ++i)
+   {
+      KUNIT_EXPECT_EQ(test, out->_data[i], (unsigned char)i);
+   }
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, out->_len, 10);
+   KUNIT_EXPECT_EQ(test, out->_data[0], (unsigned char)PACKET_DATA_SIZE);
+}
+
+static void process_inbound_test(
+   struct kunit* test)
+{
+   struct packet* in = device_transaction._inPacket;
+   char data[PACKET_DATA_SIZE];
+   int i;
+
+   in->_sync = PACKET_SYNC;
+   in->_status = SLAVE_RX_ABLE;
+   in->_len = PACKET_DATA_SIZE;
+
+   for (i = 0; i < PACKET_DATA_SIZE; ++i)
+   {
+      in->_data[i] = (unsigned char)(i * 7);
+   }
+
+   spimod_process_inbound_packet();
+
+   KUNIT_ASSERT_EQ(test,
+                   circular_buffer_read(channel0->_rxBuffer,
+                                        data,
+                                        PACKET_DATA_SIZE),
+                   PACKET_DATA_SIZE);
+
+   KUNIT_EXPECT_EQ(test, memcmp(data, in->_data, PACKET_DATA_SIZE), 0);
+
+   // An empty packet adds nothing
+
+   in->_len = 0;
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   0);
+}
+
+static void process_inbound_invalid_test(
+   struct kunit* test)
+{
+   struct packet* in = device_transaction._inPacket;
+
+   in->_sync = 0x5A5A;
+   in->_len = 10;
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   0);
+
+   in->_sync = PACKET_SYNC;
+   in->_len = PACKET_DATA_SIZE + 1;
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   0);
+}
+
+static void process_inbound_overflow_test(
+   struct kunit* test)
+{
+   struct packet* in = device_transaction._inPacket;
+   int free = 20;
+
+   channel0->_rxBuffer->_size = BENCH_BUFFER_SIZE - free;
+   channel0->_rxBuffer->_endIndex = BENCH_BUFFER_SIZE - free;
+
+   in->_sync = PACKET_SYNC;
+   in->_len = free + 1;
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   BENCH_BUFFER_SIZE - free);
+   KUNIT_EXPECT_EQ(test, device_state._statRxDropped, (u64)(free + 1));
+
+   in->_len = free;
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   BENCH_BUFFER_SIZE);
+   KUNIT_EXPECT_EQ(test, device_state._statRxDropped, (u64)(free + 1));
+}
+
+/* Datagram mode: messages are queued as a u16 length and the data */
+
+static void queue_message(
+   const u16 length)
+{
+   circular_buffer_write(channel0->_txBuffer, (const char*)&length,
+                         sizeof(length));
+
+   fill_tx(length);
+}
+
+static void datagram_loop_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   struct packet* in = device_transaction._inPacket;
+   const u16 lengths[] = { 1, PACKET_DATA_SIZE, PACKET_DATA_SIZE * 2 + 7 };
+   char data[PACKET_DATA_SIZE * 3];
+   u16 header;
+   int frames = 0;
+   int i;
+
+   channel0->_datagram = 1;
+
+   for (i = 0; i < ARRAY_SIZE(lengths); ++i)
+   {
+      queue_message(lengths[i]);
+   }
+
+   // Send every frame straight back, as an echoing slave would
+
+   do
+   {
+      spimod_create_outbound_packet();
+
+      memcpy(in, out, PACKET_SIZE);
+
+      spimod_process_inbound_packet();
+
+      ++frames;
+   }
+   while (out->_len > 0);
+
+   KUNIT_EXPECT_EQ(test, frames, 1 + 1 + 3 + 1);
+
+   for (i = 0; i < ARRAY_SIZE(lengths); ++i)
+   {
+      KUNIT_ASSERT_EQ(test,
+                      spimod_datagram_next_length(channel0),
+                      (int)lengths[i]);
+
+      circular_buffer_read(channel0->_rxBuffer, (char*)&header,
+                           sizeof(header));
+
+      KUNIT_ASSERT_EQ(test,
+                      circular_buffer_read(channel0->_rxBuffer,
+                                           data,
+                                           header),
+                      (int)lengths[i]);
+
+      KUNIT_EXPECT_EQ(test, data[0], (char)0);
+      KUNIT_EXPECT_EQ(test, data[header - 1], (char)(header - 1));
+   }
+
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   0);
+}
+
+static void datagram_fragment_flags_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+
+   channel0->_datagram = 1;
+
+   // A message is not sent until all of it has been queued
+
+   queue_message(16);
+   circular_buffer_unwrite(channel0->_txBuffer, 8);
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, out->_len, 0);
+   KUNIT_EXPECT_EQ(test, out->_status, (short)SLAVE_RX_UNABLE);
+
+   fill_tx(8);
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, out->_len, 16);
+   KUNIT_EXPECT_EQ(test, out->_status,
+                   (short)(PACKET_FLAG_FIRST | PACKET_FLAG_LAST));
+}
+
+static void datagram_lost_fragment_test(
+   struct kunit* test)
+{
+   struct packet* in = device_transaction._inPacket;
+
+   channel0->_datagram = 1;
+
+   in->_sync = PACKET_SYNC;
+   in->_len = 10;
+
+   // First fragment, then a new message before the last: discarded
+
+   in->_status = SLAVE_RX_ABLE | PACKET_FLAG_FIRST;
+   spimod_process_inbound_packet();
+
+   in->_status = SLAVE_RX_ABLE | PACKET_FLAG_FIRST;
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, device_state._statDatagramErrors, 1U);
+
+   in->_status = SLAVE_RX_ABLE | PACKET_FLAG_LAST;
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, spimod_datagram_next_length(channel0), 20);
+
+   // A last fragment without a first is discarded
+
+   circular_buffer_reset(channel0->_rxBuffer);
+   spimod_datagram_reset(channel0);
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, device_state._statDatagramErrors, 2U);
+   KUNIT_EXPECT_EQ(test, spimod_datagram_next_length(channel0), 0);
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   0);
+}
+
+static void datagram_overflow_test(
+   struct kunit* test)
+{
+   struct packet* in = device_transaction._inPacket;
+   int free = PACKET_DATA_SIZE + 10;
+
+   channel0->_datagram = 1;
+
+   channel0->_rxBuffer->_size = BENCH_BUFFER_SIZE - free;
+   channel0->_rxBuffer->_endIndex = BENCH_BUFFER_SIZE - free;
+
+   in->_sync = PACKET_SYNC;
+   in->_len = PACKET_DATA_SIZE;
+
+   in->_status = SLAVE_RX_ABLE | PACKET_FLAG_FIRST;
+   spimod_process_inbound_packet();
+
+   in->_status = SLAVE_RX_ABLE | PACKET_FLAG_LAST;
+   spimod_process_inbound_packet();
+
+   // The partial message is taken back out again
+
+   KUNIT_EXPECT_EQ(test, device_state._statDatagramDropped, 1U);
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   BENCH_BUFFER_SIZE - free);
+}
+
+/* The pump flags a channel for waking when it drains or fills it */
+
+static void wake_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   struct packet* in = device_transaction._inPacket;
+
+   channel0->_datagram = 1;
+
+   KUNIT_EXPECT_EQ(test, spimod_datagram_room(channel0),
+                   BENCH_BUFFER_SIZE - (int)sizeof(u16));
+
+   // Nothing to send leaves the writers asleep
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, channel0->_wake, 0U);
+
+   queue_message(20);
+
+   KUNIT_EXPECT_EQ(test, spimod_datagram_room(channel0),
+                   BENCH_BUFFER_SIZE - 2 * (int)sizeof(u16) - 20);
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, channel0->_wake, 1U);
+
+   // Echoed back, the message wakes the readers
+
+   channel0->_wake = 0;
+
+   memcpy(in, out, PACKET_SIZE);
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, channel0->_wake, 1U);
+   KUNIT_EXPECT_EQ(test, spimod_datagram_next_length(channel0), 20);
+}
+
+#if SPIMOD_HAVE_READ_ITER
+
+/* writev() and readv() in datagram mode: the segments make up one message */
+
+static void datagram_iter_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   struct packet* in = device_transaction._inPacket;
+   char sent[] = "hello world";
+   char received[20];
+   struct kvec vec[2];
+   struct iov_iter iter;
+
+   channel0->_datagram = 1;
+
+   vec[0].iov_base = sent;
+   vec[0].iov_len = 6;
+   vec[1].iov_base = sent + 6;
+   vec[1].iov_len = 5;
+
+   iov_iter_kvec(&iter, WRITE, vec, 2, 0);
+
+   KUNIT_EXPECT_EQ(test, spimod_datagram_send_iter(channel0, &iter), -EINVAL);
+
+   iov_iter_kvec(&iter, WRITE, vec, 2, 11);
+
+   KUNIT_EXPECT_EQ(test, spimod_datagram_send_iter(channel0, &iter), 11);
+   KUNIT_EXPECT_EQ(test, (int)iov_iter_count(&iter), 0);
+
+   spimod_create_outbound_packet();
+
+   memcpy(in, out, PACKET_SIZE);
+
+   spimod_process_inbound_packet();
+
+   // Too little room in all the segments keeps the message
+
+   vec[0].iov_base = received;
+   vec[0].iov_len = 4;
+   vec[1].iov_base = received + 4;
+   vec[1].iov_len = 4;
+
+   iov_iter_kvec(&iter, READ, vec, 2, 8);
+
+   KUNIT_EXPECT_EQ(test, spimod_datagram_receive_iter(channel0, &iter),
+                   -EMSGSIZE);
+   KUNIT_EXPECT_EQ(test, spimod_datagram_next_length(channel0), 11);
+
+   vec[1].iov_len = 16;
+
+   iov_iter_kvec(&iter, READ, vec, 2, 20);
+
+   KUNIT_EXPECT_EQ(test, spimod_datagram_receive_iter(channel0, &iter), 11);
+   KUNIT_EXPECT_EQ(test, memcmp(received, sent, 11), 0);
+   KUNIT_EXPECT_EQ(test, spimod_datagram_next_length(channel0), 0);
+}
+
+#endif
+
+/* Multiplexing: channels 1 and up get their own buffers */
+
+static void add_channels(
+   struct kunit* test,
+   const int count)
+{
+   int c;
+
+   device_state._numChannels = count;
+
+   for (c = 1; c < count; ++c)
+   {
+      struct spimod_channel* chan = &device_state._channels[c];
+
+      chan->_txBuffer = circular_buffer_init(BENCH_BUFFER_SIZE);
+      chan->_rxBuffer = circular_buffer_init(BENCH_BUFFER_SIZE);
+
+      KUNIT_ASSERT_NOT_NULL(test, chan->_txBuffer);
+      KUNIT_ASSERT_NOT_NULL(test, chan->_rxBuffer);
+
+      spimod_datagram_reset(chan);
+   }
+}
+
+static int next_segment(
+   const struct packet* pkt,
+   int* offset,
+   struct packet_segment* segment)
+{
+   if (*offset + SEGMENT_HEADER_SIZE > pkt->_len)
+   {
+      return 0;
+   }
+
+   memcpy(segment, pkt->_data + *offset, SEGMENT_HEADER_SIZE);
+
+   *offset += SEGMENT_HEADER_SIZE + segment->_len;
+
+   return 1;
+}
+
+static void multiplex_fair_share_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   struct spimod_channel* chan1 = &device_state._channels[1];
+   struct spimod_channel* chan2 = &device_state._channels[2];
+   const int share = PACKET_DATA_SIZE / 3 - SEGMENT_HEADER_SIZE;
+   char data[PACKET_DATA_SIZE * 2];
+   struct packet_segment segment;
+   int offset = 0;
+
+   add_channels(test, 3);
+
+   memset(data, 0, sizeof(data));
+
+   fill_tx(PACKET_DATA_SIZE * 2);
+   circular_buffer_write(chan1->_txBuffer, data, PACKET_DATA_SIZE * 2);
+   circular_buffer_write(chan2->_txBuffer, data, PACKET_DATA_SIZE * 2);
+
+   // Every busy channel gets the same share, starting from channel 0
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_TRUE(test, out->_status & PACKET_FLAG_CHANNELS);
+
+   KUNIT_ASSERT_TRUE(test, next_segment(out, &offset, &segment));
+   KUNIT_EXPECT_EQ(test, (int)segment._channel, 0);
+   KUNIT_EXPECT_EQ(test, (int)segment._len, share);
+
+   KUNIT_ASSERT_TRUE(test, next_segment(out, &offset, &segment));
+   KUNIT_EXPECT_EQ(test, (int)segment._channel, 1);
+   KUNIT_EXPECT_EQ(test, (int)segment._len, share);
+
+   KUNIT_ASSERT_TRUE(test, next_segment(out, &offset, &segment));
+   KUNIT_EXPECT_EQ(test, (int)segment._channel, 2);
+   KUNIT_EXPECT_EQ(test, (int)segment._len, share);
+
+   KUNIT_EXPECT_FALSE(test, next_segment(out, &offset, &segment));
+
+   // The next packet starts from channel 1, and a share channel 1 cannot
+   // use goes to the others
+
+   circular_buffer_reset(chan1->_txBuffer);
+   circular_buffer_write(chan1->_txBuffer, data, 10);
+
+   spimod_create_outbound_packet();
+
+   offset = 0;
+
+   KUNIT_ASSERT_TRUE(test, next_segment(out, &offset, &segment));
+   KUNIT_EXPECT_EQ(test, (int)segment._channel, 1);
+   KUNIT_EXPECT_EQ(test, (int)segment._len, 10);
+
+   KUNIT_ASSERT_TRUE(test, next_segment(out, &offset, &segment));
+   KUNIT_EXPECT_EQ(test, (int)segment._channel, 2);
+   KUNIT_EXPECT_EQ(test, (int)segment._len, share);
+
+   KUNIT_ASSERT_TRUE(test, next_segment(out, &offset, &segment));
+   KUNIT_EXPECT_EQ(test, (int)segment._channel, 0);
+   KUNIT_EXPECT_EQ(test, (int)segment._len, share);
+
+   KUNIT_ASSERT_TRUE(test, next_segment(out, &offset, &segment));
+   KUNIT_EXPECT_EQ(test, (int)segment._channel, 2);
+
+   KUNIT_EXPECT_EQ(test, (int)out->_len, PACKET_DATA_SIZE);
+}
+
+static void multiplex_loop_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   struct packet* in = device_transaction._inPacket;
+   struct spimod_channel* chan1 = &device_state._channels[1];
+   struct packet_segment segment;
+   const u16 length = PACKET_DATA_SIZE;
+   int frames = 0;
+
+   add_channels(test, 2);
+
+   // Channel 0 streams, channel 1 sends one message
+
+   chan1->_datagram = 1;
+
+   fill_tx(100);
+
+   circular_buffer_write(chan1->_txBuffer, (const char*)&length,
+                         sizeof(length));
+   circular_buffer_write(chan1->_txBuffer, (const char*)out, length);
+
+   do
+   {
+      spimod_create_outbound_packet();
+
+      memcpy(in, out, PACKET_SIZE);
+
+      spimod_process_inbound_packet();
+
+      ++frames;
+   }
+   while (out->_len > 0);
+
+   KUNIT_EXPECT_EQ(test, frames, 3);
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   100);
+   KUNIT_EXPECT_EQ(test, spimod_datagram_next_length(chan1), (int)length);
+   KUNIT_EXPECT_EQ(test, device_state._statSegmentErrors, 0U);
+
+   // A segment for a channel that does not exist ends the packet
+
+   segment._channel = 2;
+   segment._flags = 0;
+   segment._len = 1;
+
+   in->_status = SLAVE_RX_ABLE | PACKET_FLAG_CHANNELS;
+   in->_len = SEGMENT_HEADER_SIZE + 1;
+
+   memcpy(in->_data, &segment, SEGMENT_HEADER_SIZE);
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, device_state._statSegmentErrors, 1U);
+
+   // As does one longer than the packet
+
+   segment._channel = 0;
+   segment._len = 2;
+
+   memcpy(in->_data, &segment, SEGMENT_HEADER_SIZE);
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, device_state._statSegmentErrors, 2U);
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   100);
+}
+
+/* Priority lane: messages are queued behind a priority_header */
+
+static void priority_preempt_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   struct packet* in = device_transaction._inPacket;
+   struct priority_header header;
+   struct packet_segment segment;
+   char data[PACKET_DATA_SIZE];
+   int offset = 0;
+   int frames = 0;
+
+   channel0->_txPriority = circular_buffer_init(PRIORITY_BUFFER_SIZE);
+   channel0->_rxPriority = circular_buffer_init(PRIORITY_BUFFER_SIZE);
+
+   KUNIT_ASSERT_NOT_NULL(test, channel0->_txPriority);
+   KUNIT_ASSERT_NOT_NULL(test, channel0->_rxPriority);
+
+   spimod_priority_reset(channel0);
+
+   // Start a three frame message, then queue a priority message
+
+   channel0->_datagram = 1;
+
+   queue_message(PACKET_DATA_SIZE * 2 + 7);
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, out->_status,
+                   (short)(SLAVE_RX_UNABLE | PACKET_FLAG_FIRST));
+
+   memcpy(in, out, PACKET_SIZE);
+   spimod_process_inbound_packet();
+
+   header._queuedNs = ktime_to_ns(ktime_get());
+   header._len = 10;
+
+   memset(data, 0x5A, header._len);
+
+   circular_buffer_write(channel0->_txPriority, (const char*)&header,
+                         sizeof(header));
+   circular_buffer_write(channel0->_txPriority, data, header._len);
+
+   KUNIT_EXPECT_EQ(test, spimod_priority_pending(channel0), 10);
+
+   // It goes first in the next packet, the message continues after it
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_TRUE(test, out->_status & PACKET_FLAG_CHANNELS);
+
+   KUNIT_ASSERT_TRUE(test, next_segment(out, &offset, &segment));
+   KUNIT_EXPECT_EQ(test, (int)segment._flags, PACKET_FLAG_PRIORITY >> 8);
+   KUNIT_EXPECT_EQ(test, (int)segment._len, 10);
+
+   KUNIT_ASSERT_TRUE(test, next_segment(out, &offset, &segment));
+   KUNIT_EXPECT_EQ(test, (int)segment._flags, 0);
+   KUNIT_EXPECT_EQ(test, (int)segment._len,
+                   PACKET_DATA_SIZE - 10 - 2 * SEGMENT_HEADER_SIZE);
+
+   KUNIT_EXPECT_EQ(test, device_state._statPriorityMessages, 1ULL);
+
+   // Both arrive intact when echoed
+
+   do
+   {
+      memcpy(in, out, PACKET_SIZE);
+
+      spimod_process_inbound_packet();
+
+      spimod_create_outbound_packet();
+
+      ++frames;
+   }
+   while (in->_len > 0);
+
+   KUNIT_EXPECT_EQ(test, frames, 3);
+   KUNIT_EXPECT_EQ(test, device_state._statDatagramErrors, 0U);
+   KUNIT_EXPECT_EQ(test, spimod_datagram_next_length(channel0),
+                   PACKET_DATA_SIZE * 2 + 7);
+   KUNIT_EXPECT_EQ(test, atomic_read(&channel0->_rxPriorityMessages), 1);
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxPriority),
+                   (int)sizeof(u16) + 10);
+}
+
+/* Packet CRC: the trailer takes the last PACKET_CRC_SIZE bytes of _data */
+
+static void crc_loop_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   struct packet* in = device_transaction._inPacket;
+   const char check[] = "123456789";
+
+   // The standard CRC-32C check value
+
+   KUNIT_EXPECT_EQ(test, ~crc32c(~0U, check, sizeof(check) - 1), 0xE3069283U);
+
+   device_state._crc = 1;
+
+   KUNIT_EXPECT_EQ(test, spimod_packet_capacity(),
+                   PACKET_DATA_SIZE - PACKET_CRC_SIZE);
+
+   fill_tx(PACKET_DATA_SIZE);
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, (int)out->_len, PACKET_DATA_SIZE - PACKET_CRC_SIZE);
+   KUNIT_EXPECT_TRUE(test, out->_status & PACKET_FLAG_CRC);
+   KUNIT_EXPECT_TRUE(test, spimod_packet_verify(out, PACKET_DATA_SIZE));
+
+   memcpy(in, out, PACKET_SIZE);
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   PACKET_DATA_SIZE - PACKET_CRC_SIZE);
+   KUNIT_EXPECT_EQ(test, device_state._statCrcErrors, 0U);
+
+   // The rest follows in the next packet
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, (int)out->_len, PACKET_CRC_SIZE);
+   KUNIT_EXPECT_TRUE(test, spimod_packet_verify(out, PACKET_DATA_SIZE));
+}
+
+static void crc_corrupt_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   struct packet* in = device_transaction._inPacket;
+   const int bits[] = { 2 * 8 + 3,		// _status
+                        4 * 8,			// _len
+                        6 * 8 + 100,		// _data
+                        (PACKET_SIZE - 1) * 8 + 7 };	// the trailer
+   int i;
+
+   device_state._crc = 1;
+
+   fill_tx(100);
+
+   spimod_create_outbound_packet();
+
+   // Any single bit flipped is caught
+
+   for (i = 0; i < ARRAY_SIZE(bits); ++i)
+   {
+      memcpy(in, out, PACKET_SIZE);
+
+      ((u8*)in)[bits[i] / 8] ^= 1 << (bits[i] % 8);
+
+      KUNIT_EXPECT_FALSE(test, spimod_packet_verify(in, PACKET_DATA_SIZE));
+
+      spimod_process_inbound_packet();
+   }
+
+   KUNIT_EXPECT_EQ(test, device_state._statCrcErrors, 4U);
+
+   // So is a packet without one, while a bad sync word is a bad frame
+
+   memcpy(in, out, PACKET_SIZE);
+   in->_status &= ~PACKET_FLAG_CRC;
+
+   spimod_process_inbound_packet();
+
+   in->_status |= PACKET_FLAG_CRC;
+   in->_sync = 0x5A5A;
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, device_state._statCrcErrors, 5U);
+   KUNIT_EXPECT_EQ(test, device_state._statBadFrames, 1U);
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   0);
+
+   // Without _crc a packet that carries one is still checked
+
+   device_state._crc = 0;
+
+   memcpy(in, out, PACKET_SIZE);
+   in->_data[0] ^= 1;
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, device_state._statCrcErrors, 6U);
+
+   in->_data[0] ^= 1;
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   100);
+}
+
+/* Retransmission: the test plays the peer with its own spimod_arq */
+
+static int arq_delivered;
+static unsigned char arq_first[8];
+
+static void arq_collect(
+   void* context,
+   const struct packet* pkt)
+{
+   if (arq_delivered < ARRAY_SIZE(arq_first))
+   {
+      arq_first[arq_delivered] = pkt->_data[0];
+   }
+
+   ++arq_delivered;
+}
+
+static void arq_selective_repeat_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   struct packet* in = device_transaction._inPacket;
+   struct spimod_arq* peer = kunit_kzalloc(test, sizeof(*peer), GFP_KERNEL);
+   struct packet* sent = kunit_kzalloc(test, 4 * sizeof(struct packet),
+                                       GFP_KERNEL);
+   int capacity;
+   int i;
+
+   KUNIT_ASSERT_NOT_NULL(test, peer);
+   KUNIT_ASSERT_NOT_NULL(test, sent);
+
+   KUNIT_ASSERT_EQ(test,
+                   spimod_arq_init(&device_state._arq, 4, 5,
+                                   device_state._maxData),
+                   0);
+   KUNIT_ASSERT_EQ(test, spimod_arq_init(peer, 4, 5, PACKET_DATA_SIZE), 0);
+
+   capacity = spimod_packet_capacity();
+
+   KUNIT_EXPECT_EQ(test, capacity, PACKET_DATA_SIZE - PACKET_TRAILER_SIZE);
+
+   arq_delivered = 0;
+
+   // Four packets fill the window, so the fifth carries no data
+
+   fill_tx(capacity * 4 + 10);
+
+   for (i = 0; i < 4; ++i)
+   {
+      spimod_create_outbound_packet();
+
+      KUNIT_EXPECT_EQ(test, (int)out->_len, capacity);
+      KUNIT_EXPECT_TRUE(test, out->_status & PACKET_FLAG_SEQ);
+
+      memcpy(&sent[i], out, PACKET_SIZE);
+   }
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, (int)out->_len, 0);
+   KUNIT_EXPECT_TRUE(test, out->_status & PACKET_FLAG_ARQ);
+   KUNIT_EXPECT_FALSE(test, out->_status & PACKET_FLAG_SEQ);
+
+   // The second is lost: the third and fourth are held
+
+   spimod_arq_receive(peer, &sent[0], arq_collect, NULL);
+   spimod_arq_receive(peer, &sent[2], arq_collect, NULL);
+   spimod_arq_receive(peer, &sent[3], arq_collect, NULL);
+
+   KUNIT_EXPECT_EQ(test, arq_delivered, 1);
+
+   // The peer acknowledges the first and, selectively, the others
+
+   memset(in, 0, PACKET_SIZE);
+   in->_sync = PACKET_SYNC;
+
+   spimod_arq_stamp(peer, in);
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, (int)device_state._arq._base, 1);
+
+   // That opens the window for the rest of the data, then only the lost
+   // packet is resent when its time is up
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, (int)out->_len, 10);
+   KUNIT_EXPECT_EQ(test, device_state._arq._retransmits, 0U);
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, memcmp(out->_data, sent[1]._data, capacity), 0);
+   KUNIT_EXPECT_EQ(test, device_state._arq._retransmits, 1U);
+
+   spimod_arq_receive(peer, out, arq_collect, NULL);
+
+   KUNIT_EXPECT_EQ(test, arq_delivered, 4);
+
+   for (i = 0; i < 4; ++i)
+   {
+      KUNIT_EXPECT_EQ(test, arq_first[i], sent[i]._data[0]);
+   }
+
+   // A duplicate is not delivered again
+
+   spimod_arq_receive(peer, &sent[2], arq_collect, NULL);
+
+   KUNIT_EXPECT_EQ(test, arq_delivered, 4);
+   KUNIT_EXPECT_EQ(test, peer->_duplicates, 1U);
+
+   // Once acknowledged nothing more is resent
+
+   spimod_arq_stamp(peer, in);
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, (int)device_state._arq._base, 4);
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, (int)out->_len, 0);
+   KUNIT_EXPECT_EQ(test, device_state._arq._retransmits, 1U);
+
+   spimod_arq_term(peer);
+}
+
+/* Bus settings: frames stay a whole number of the widest words */
+
+static void bus_setup_test(
+   struct kunit* test)
+{
+   KUNIT_EXPECT_EQ(test, PACKET_FRAME_SIZE % 4, 0U);
+   KUNIT_EXPECT_GE(test, PACKET_FRAME_SIZE, PACKET_SIZE);
+   KUNIT_EXPECT_LT(test, PACKET_FRAME_SIZE, PACKET_SIZE + 4);
+
+   // Unsupported settings are refused before the device is touched
+
+   KUNIT_EXPECT_EQ(test, spimod_bus_setup(0, SPI_MODE_0, 8), -EINVAL);
+   KUNIT_EXPECT_EQ(test, spimod_bus_setup(4000000, 4, 8), -EINVAL);
+   KUNIT_EXPECT_EQ(test, spimod_bus_setup(4000000, SPI_MODE_0, 12), -EINVAL);
+   KUNIT_EXPECT_EQ(test, spimod_bus_setup(4000000, SPI_MODE_0, 32), -ENODEV);
+   KUNIT_EXPECT_EQ(test, device_state._bitsPerWord, 0U);
+}
+
+/* Forward error correction: the parity takes the end of _data */
+
+static void fec_correct_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   struct packet* in = device_transaction._inPacket;
+   const int overhead = 7 * 2 * 4;
+   int i;
+
+   device_state._crc = 1;
+
+   KUNIT_ASSERT_EQ(test, spimod_fec_init(&device_state._fec, 4), 0);
+   KUNIT_EXPECT_EQ(test, spimod_fec_overhead(&device_state._fec), overhead);
+   KUNIT_EXPECT_EQ(test, spimod_packet_capacity(),
+                   PACKET_DATA_SIZE - PACKET_TRAILER_SIZE - overhead);
+
+   fill_tx(PACKET_DATA_SIZE);
+
+   spimod_create_outbound_packet();
+
+   // A clean packet needs no correction
+
+   memcpy(in, out, PACKET_SIZE);
+
+   KUNIT_EXPECT_EQ(test, spimod_fec_decode(&device_state._fec, in), 0);
+   KUNIT_EXPECT_EQ(test, memcmp(in, out, PACKET_SIZE), 0);
+
+   // A burst of 7 codewords times 4 bytes, here across the end of the data
+   // and the start of the parity, is repaired
+
+   for (i = 0; i < 28; ++i)
+   {
+      in->_data[device_state._fec._offset - 13 + i] ^= 0xA5;
+   }
+
+   KUNIT_EXPECT_FALSE(test, spimod_packet_verify(in, PACKET_DATA_SIZE));
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, device_state._fec._corrected, 28U);
+   KUNIT_EXPECT_EQ(test, device_state._fec._repaired, 1U);
+   KUNIT_EXPECT_EQ(test, device_state._statCrcErrors, 0U);
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   (int)out->_len);
+
+   // A burst too long is beyond repair and the packet is discarded
+
+   memcpy(in, out, PACKET_SIZE);
+
+   for (i = 0; i < 100; ++i)
+   {
+      in->_data[i] ^= 0x5A;
+   }
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, device_state._fec._failed, 1U);
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   (int)out->_len);
+}
+
+/* Handshake: hellos until the slave answers, then the frames agreed */
+
+static void handshake_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   struct packet* in = device_transaction._inPacket;
+   struct packet_hello hello;
+
+   // Larger frames are whole words, the base frame keeps its size
+
+   KUNIT_EXPECT_EQ(test, spimod_hello_agree(PACKET_DATA_MAX, 4000), 3998U);
+   KUNIT_EXPECT_EQ(test, spimod_hello_agree(PACKET_DATA_MAX, 65535),
+                   (u32)PACKET_DATA_MAX);
+   KUNIT_EXPECT_EQ(test, spimod_hello_agree(PACKET_DATA_SIZE + 1, 4000),
+                   (u32)PACKET_DATA_SIZE);
+   KUNIT_EXPECT_EQ(test, spimod_hello_data_size(PACKET_FRAME_SIZE),
+                   (u32)PACKET_DATA_SIZE);
+   KUNIT_EXPECT_EQ(test, spimod_hello_data_size(4004), 3998U);
+   KUNIT_EXPECT_EQ(test, spimod_hello_max_data(0), (u32)PACKET_DATA_SIZE);
+   KUNIT_EXPECT_EQ(test, spimod_hello_max_data(65536), (u32)PACKET_DATA_MAX);
+
+   // max_frame_size 0 asks for nothing more, so there is nothing to agree
+
+   spimod_handshake_start();
+
+   KUNIT_EXPECT_EQ(test, device_state._helloLeft, 0U);
+   KUNIT_EXPECT_EQ(test, device_state._dataSize, (u32)PACKET_DATA_SIZE);
+
+   device_state._maxData = PACKET_DATA_MAX;
+   device_state._helloLeft = 2;
+
+   fill_tx(5000);
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, (int)out->_len, 0);
+   KUNIT_EXPECT_TRUE(test, spimod_hello_parse(out, &hello));
+   KUNIT_EXPECT_EQ(test, (int)hello._maxData, PACKET_DATA_MAX);
+   KUNIT_EXPECT_EQ(test, device_state._helloLeft, 1U);
+
+   // A damaged hello is counted and ignored
+
+   spimod_hello_build(in, SLAVE_RX_ABLE, 4000, SPIMOD_FEATURE_CRC);
+
+   in->_data[2] ^= 1;
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, device_state._statCrcErrors, 1U);
+   KUNIT_EXPECT_EQ(test, device_state._dataSize, (u32)PACKET_DATA_SIZE);
+
+   // The slave's hello settles it
+
+   spimod_hello_build(in, SLAVE_RX_ABLE, 4000, SPIMOD_FEATURE_CRC);
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, device_state._helloLeft, 0U);
+   KUNIT_EXPECT_EQ(test, device_state._dataSize, 3998U);
+   KUNIT_EXPECT_EQ(test, device_state._peerVersion, 1U);
+   KUNIT_EXPECT_EQ(test, device_state._peerFeatures, SPIMOD_FEATURE_CRC);
+   KUNIT_EXPECT_EQ(test, spimod_packet_capacity(), 3998);
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer), 0);
+
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, (int)out->_len, 3998);
+   KUNIT_EXPECT_FALSE(test, out->_status & PACKET_FLAG_HELLO);
+
+   // Those still in flight change nothing, and data fills the new frames
+
+   spimod_hello_build(in, SLAVE_RX_ABLE, PACKET_DATA_SIZE, 0);
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test, device_state._dataSize, 3998U);
+
+   memcpy(in, out, sizeof(struct packet));
+
+   spimod_process_inbound_packet();
+
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer),
+                   3998);
+}
+
+/* Idle: header-only polls after _idleFrames (16) empty frames each way,
+   until the slave announces data or data is queued to send.  There is no
+   bus, so transfers are queued but never complete. */
+
+static void idle_pump(
+   const int polled)
+{
+   device_transaction._inPending = 1;
+   device_transaction._inPoll = polled;
+
+   spimod_pump();
+}
+
+static void idle_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   struct packet* in = device_transaction._inPacket;
+   int i;
+
+   device_transaction._pool = frame_pool_init(NULL, 2, PACKET_MAX_SIZE);
+
+   KUNIT_ASSERT_NOT_NULL(test, device_transaction._pool);
+
+   device_state._timer_period_ns = NANOSECS_PER_SEC / WRITE_FREQUENCY;
+   device_state._idleFrames = 16;
+
+   in->_sync = PACKET_SYNC;
+
+   for (i = 0; i < 16; ++i)
+   {
+      KUNIT_EXPECT_EQ(test, device_state._idle, 0U);
+
+      idle_pump(0);
+   }
+
+   KUNIT_EXPECT_EQ(test, device_state._idle, 1U);
+   KUNIT_EXPECT_EQ(test, device_state._statIdleEntries, 1U);
+   KUNIT_EXPECT_EQ(test, (s64)ktime_to_ns(spimod_pump_interval()),
+                   (s64)(10 * NSEC_PER_MSEC));
+
+   // Only the header goes, and an empty one back keeps the pump idle
+
+   idle_pump(1);
+
+   KUNIT_EXPECT_EQ(test, device_transaction._poll, 1U);
+   KUNIT_EXPECT_EQ(test, device_transaction._transfer.len,
+                   (unsigned int)PACKET_HEADER_SIZE);
+   KUNIT_EXPECT_EQ(test, (int)out->_len, 0);
+   KUNIT_EXPECT_EQ(test, device_state._statIdlePolls, (u64)1);
+   KUNIT_EXPECT_EQ(test, device_state._idle, 1U);
+
+   // The slave announcing data ends it, and the data is not delivered yet
+
+   in->_len = 100;
+
+   idle_pump(1);
+
+   KUNIT_EXPECT_EQ(test, device_state._idle, 0U);
+   KUNIT_EXPECT_EQ(test,
+                   circular_buffer_num_bytes_available(channel0->_rxBuffer), 0);
+
+   // So does data to send, which goes in the next frame
+
+   in->_len = 0;
+
+   for (i = 0; i < 16; ++i)
+   {
+      idle_pump(0);
+   }
+
+   KUNIT_EXPECT_EQ(test, device_state._idle, 1U);
+
+   fill_tx(100);
+
+   spimod_pump_wake();
+
+   KUNIT_EXPECT_EQ(test, device_state._idle, 0U);
+   KUNIT_EXPECT_EQ(test, (s64)ktime_to_ns(spimod_pump_interval()),
+                   (s64)(NANOSECS_PER_SEC / WRITE_FREQUENCY));
+
+   idle_pump(0);
+
+   KUNIT_EXPECT_EQ(test, device_transaction._poll, 0U);
+   KUNIT_EXPECT_EQ(test, (int)out->_len, 100);
+   KUNIT_EXPECT_EQ(test, device_transaction._transfer.len, PACKET_SIZE);
+   KUNIT_EXPECT_EQ(test, device_state._statIdlePolls, (u64)2);
+
+   frame_pool_term(device_transaction._pool);
+
+   device_transaction._pool = NULL;
+}
+
+/* Resync: every 4 frames in a row without a sync word either realign to a
+   sync word further into the frame with a short transfer, or restart the
+   handshake.  As above, transfers never complete. */
+
+static void resync_pump(void)
+{
+   device_transaction._inPending = 1;
+   device_transaction._inPoll = 0;
+   device_transaction._inSlip = device_transaction._slip;
+
+   spimod_pump();
+}
+
+static void resync_test(
+   struct kunit* test)
+{
+   struct packet* in = device_transaction._inPacket;
+   const unsigned short sync = PACKET_SYNC;
+   const unsigned short len = 100;
+   int i;
+
+   device_transaction._pool = frame_pool_init(NULL, 2, PACKET_MAX_SIZE);
+
+   KUNIT_ASSERT_NOT_NULL(test, device_transaction._pool);
+
+   // Nothing to realign to: the slave is taken to have restarted
+
+   memset(in, 0, PACKET_SIZE);
+
+   for (i = 0; i < 4; ++i)
+   {
+      KUNIT_EXPECT_EQ(test, device_state._statResyncs, 0U);
+
+      resync_pump();
+   }
+
+   KUNIT_EXPECT_EQ(test, device_state._syncLost, 4U);
+   KUNIT_EXPECT_EQ(test, device_state._statResyncs, 1U);
+   KUNIT_EXPECT_EQ(test, device_state._statSlips, 0U);
+   KUNIT_EXPECT_EQ(test, device_state._arq._adopt, 0U);
+
+   // A frame starting 12 bytes in is realigned to by a transfer of 12
+
+   memcpy((u8*)in + 12 + offsetof(struct packet, _sync), &sync, sizeof(sync));
+   memcpy((u8*)in + 12 + offsetof(struct packet, _len), &len, sizeof(len));
+
+   for (i = 0; i < 4; ++i)
+   {
+      resync_pump();
+   }
+
+   KUNIT_EXPECT_EQ(test, device_state._statResyncs, 2U);
+   KUNIT_EXPECT_EQ(test, device_state._statSlips, 1U);
+   KUNIT_EXPECT_EQ(test, device_state._slipPending, 12U);
+
+   resync_pump();
+
+   KUNIT_EXPECT_EQ(test, device_transaction._slip, 12U);
+   KUNIT_EXPECT_EQ(test, device_transaction._transfer.len, 12U);
+   KUNIT_EXPECT_EQ(test, device_state._slipPending, 0U);
+
+   // What comes back from the short transfer is neither end's frame
+
+   resync_pump();
+
+   KUNIT_EXPECT_EQ(test, device_transaction._slip, 0U);
+   KUNIT_EXPECT_EQ(test, device_transaction._transfer.len, PACKET_SIZE);
+   KUNIT_EXPECT_EQ(test, device_state._syncLost, 9U);
+
+   // Then the frames line up again
+
+   memset(in, 0, PACKET_SIZE);
+   in->_sync = PACKET_SYNC;
+
+   resync_pump();
+
+   KUNIT_EXPECT_EQ(test, device_state._syncLost, 0U);
+   KUNIT_EXPECT_EQ(test, device_state._statResyncs, 2U);
+
+   frame_pool_term(device_transaction._pool);
+
+   device_transaction._pool = NULL;
+}
+
+/* Resync with retransmission: the slave may not have restarted, so its
+   _base is only taken up once more than a window away.  Held packets are
+   delivered once and in order, or counted as lost. */
+
+static void arq_resync_data(
+   struct spimod_arq* peer,
+   struct packet* pkt,
+   const unsigned char byte)
+{
+   memset(pkt, 0, PACKET_SIZE);
+
+   pkt->_sync = PACKET_SYNC;
+   pkt->_len = 1;
+   pkt->_data[0] = byte;
+
+   spimod_arq_stamp(peer, pkt);
+}
+
+static void arq_resync_test(
+   struct kunit* test)
+{
+   struct spimod_arq* arq = &device_state._arq;
+   struct spimod_arq* peer = kunit_kzalloc(test, sizeof(*peer), GFP_KERNEL);
+   struct packet* sent = kunit_kzalloc(test, 4 * sizeof(struct packet),
+                                       GFP_KERNEL);
+   int i;
+
+   KUNIT_ASSERT_NOT_NULL(test, peer);
+   KUNIT_ASSERT_NOT_NULL(test, sent);
+
+   KUNIT_ASSERT_EQ(test,
+                   spimod_arq_init(arq, 4, 5, device_state._maxData), 0);
+   KUNIT_ASSERT_EQ(test, spimod_arq_init(peer, 4, 5, PACKET_DATA_SIZE), 0);
+
+   device_transaction._pool = frame_pool_init(NULL, 2, PACKET_MAX_SIZE);
+
+   KUNIT_ASSERT_NOT_NULL(test, device_transaction._pool);
+
+   arq_delivered = 0;
+
+   for (i = 0; i < 4; ++i)
+   {
+      arq_resync_data(peer, &sent[i], 10 + i);
+   }
+
+   // The second is lost: the third and fourth are held
+
+   spimod_arq_receive(arq, &sent[0], arq_collect, NULL);
+   spimod_arq_receive(arq, &sent[2], arq_collect, NULL);
+   spimod_arq_receive(arq, &sent[3], arq_collect, NULL);
+
+   KUNIT_EXPECT_EQ(test, arq_delivered, 1);
+
+   // Four frames without a sync word: the slave is taken to have restarted
+
+   memset(device_transaction._inPacket, 0, PACKET_SIZE);
+
+   for (i = 0; i < 4; ++i)
+   {
+      resync_pump();
+   }
+
+   KUNIT_EXPECT_EQ(test, device_state._statResyncs, 1U);
+
+   // It had not, and still has _base 0: its resends complete the held
+   // packets and nothing is delivered twice
+
+   spimod_arq_receive(arq, &sent[1], arq_collect, NULL);
+   spimod_arq_receive(arq, &sent[0], arq_collect, NULL);
+
+   KUNIT_EXPECT_EQ(test, arq_delivered, 4);
+
+   for (i = 0; i < 4; ++i)
+   {
+      KUNIT_EXPECT_EQ(test, arq_first[i], 10 + i);
+   }
+
+   KUNIT_EXPECT_EQ(test, arq->_duplicates, 1U);
+   KUNIT_EXPECT_EQ(test, arq->_lost, 0U);
+   KUNIT_EXPECT_EQ(test, arq->_resyncs, 0U);
+
+   // A restart far from our numbering is taken up, and the packet held
+   // for the old numbering is lost
+
+   arq_resync_data(peer, &sent[0], 14);
+   arq_resync_data(peer, &sent[1], 15);
+
+   spimod_arq_receive(arq, &sent[1], arq_collect, NULL);
+
+   memset(peer->_frames, 0,
+          2 * peer->_window * sizeof(struct spimod_arq_frame));
+
+   peer->_base = 1000;
+   peer->_next = 1000;
+
+   arq_resync_data(peer, &sent[2], 16);
+
+   spimod_arq_receive(arq, &sent[2], arq_collect, NULL);
+
+   KUNIT_EXPECT_EQ(test, arq_delivered, 5);
+   KUNIT_EXPECT_EQ(test, arq->_lost, 1U);
+   KUNIT_EXPECT_EQ(test, arq->_resyncs, 1U);
+   KUNIT_EXPECT_EQ(test, (int)arq->_expected, 1001);
+
+   frame_pool_term(device_transaction._pool);
+
+   device_transaction._pool = NULL;
+
+   spimod_arq_term(peer);
+}
+
+/* Bulk send: kernel pages stand in for the pinned user pages, and the
+   work item only records that the send finished rather than unpinning
+   them */
+
+static int bulk_finished;
+
+static void bulk_done(
+   struct work_struct* work)
+{
+   ++bulk_finished;
+}
+
+static void bulk_order_test(
+   struct kunit* test)
+{
+   struct packet* out = device_transaction._outPacket;
+   const int bulkLen = 300;
+   struct page* pages[2];
+   char* sent;
+   int total = 0;
+   int i;
+
+   // Neither a datagram channel nor an empty send can start one
+
+   channel0->_datagram = 1;
+
+   KUNIT_EXPECT_EQ(test, spimod_bulk_start(channel0, NULL, 100), -EINVAL);
+
+   channel0->_datagram = 0;
+
+   KUNIT_EXPECT_EQ(test, spimod_bulk_start(channel0, NULL, 0), -EINVAL);
+
+   sent = kunit_kzalloc(test, 4 * PACKET_DATA_SIZE, GFP_KERNEL);
+   pages[0] = alloc_page(GFP_KERNEL);
+   pages[1] = alloc_page(GFP_KERNEL);
+
+   KUNIT_ASSERT_NOT_NULL(test, sent);
+   KUNIT_ASSERT_NOT_NULL(test, pages[0]);
+   KUNIT_ASSERT_NOT_NULL(test, pages[1]);
+
+   memset(page_address(pages[0]), 0xB0, PAGE_SIZE);
+   memset(page_address(pages[1]), 0xB1, PAGE_SIZE);
+
+   // 10 bytes queued before, 300 straddling the two pages, 5 after
+
+   fill_tx(10);
+
+   bulk_finished = 0;
+
+   INIT_WORK(&channel0->_bulkWork, bulk_done);
+
+   channel0->_bulkPages = pages;
+   channel0->_bulkNumPages = 2;
+   channel0->_bulkOffset = PAGE_SIZE - 100;
+   channel0->_bulkAfter = 10;
+   channel0->_bulkSent = 0;
+   channel0->_bulkLen = bulkLen;
+
+   circular_buffer_write(channel0->_txBuffer, "after", 5);
+
+   KUNIT_EXPECT_TRUE(test, spimod_bulk_active(channel0));
+   KUNIT_EXPECT_EQ(test, spimod_bulk_pending(channel0), 10 + bulkLen);
+   KUNIT_EXPECT_EQ(test, spimod_bulk_start(channel0, NULL, 100), -EBUSY);
+
+   for (i = 0; i < 4; ++i)
+   {
+      spimod_create_outbound_packet();
+
+      memcpy(sent + total, out->_data, out->_len);
+
+      total += out->_len;
+   }
+
+   flush_work(&channel0->_bulkWork);
+
+   KUNIT_EXPECT_EQ(test, total, 10 + bulkLen + 5);
+   KUNIT_EXPECT_FALSE(test, spimod_bulk_active(channel0));
+   KUNIT_EXPECT_EQ(test, bulk_finished, 1);
+   KUNIT_EXPECT_EQ(test, device_state._statBulkSends, 1U);
+   KUNIT_EXPECT_EQ(test, device_state._statBulkBytes, (u64)bulkLen);
+
+   for (i = 0; i < 10; ++i)
+   {
+      KUNIT_EXPECT_EQ(test, sent[i], (char)i);
+   }
+
+   for (i = 0; i < bulkLen; ++i)
+   {
+      KUNIT_EXPECT_EQ(test, sent[10 + i], (char)((i < 100) ? 0xB0 : 0xB1));
+   }
+
+   KUNIT_EXPECT_EQ(test, memcmp(sent + 10 + bulkLen, "after", 5), 0);
+
+   // The pages were never pinned, so are not unpinned either
+
+   channel0->_bulkPages = NULL;
+
+   __free_page(pages[0]);
+   __free_page(pages[1]);
+}
+
+/* Transmit cursors: data counts as sent once its frame's transfer is
+   done, and as acknowledged once the packet carrying it is */
+
+static void cursor_test(
+   struct kunit* test)
+{
+   const struct spimod_arq* arq = &device_state._arq;
+   u64 length;
+
+   KUNIT_ASSERT_EQ(test,
+                   spimod_arq_init(&device_state._arq, 4, 5,
+                                   device_state._maxData),
+                   0);
+
+   length = spimod_packet_capacity() + 10;
+
+   fill_tx(length);
+
+   KUNIT_EXPECT_EQ(test, spimod_cursor_queued(channel0, length), length);
+
+   // Two numbered packets, the second with the last 10 bytes
+
+   spimod_create_outbound_packet();
+   spimod_cursor_transmitted();
+   spimod_create_outbound_packet();
+
+   KUNIT_EXPECT_EQ(test, (u64)atomic64_read(&channel0->_txFramed), length);
+   KUNIT_EXPECT_EQ(test, (u64)atomic64_read(&channel0->_txSent), length - 10);
+   KUNIT_EXPECT_EQ(test, (u64)atomic64_read(&channel0->_txAcked), (u64)0);
+   KUNIT_EXPECT_EQ(test, (int)(u16)(arq->_next - arq->_base), 2);
+
+   spimod_cursor_transmitted();
+
+   KUNIT_EXPECT_TRUE(test, spimod_cursor_reached(channel0, length, 0));
+   KUNIT_EXPECT_FALSE(test, spimod_cursor_reached(channel0, length, 1));
+
+   // The slave acknowledges the first, then both
+
+   ++device_state._arq._base;
+
+   spimod_cursor_acknowledge();
+
+   KUNIT_EXPECT_EQ(test, (u64)atomic64_read(&channel0->_txAcked), length - 10);
+   KUNIT_EXPECT_EQ(test, channel0->_wake, 1U);
+
+   ++device_state._arq._base;
+
+   spimod_cursor_acknowledge();
+
+   KUNIT_EXPECT_TRUE(test, spimod_cursor_reached(channel0, length, 1));
+
+   KUNIT_EXPECT_FALSE(test, spimod_cursor_discarded(channel0, length));
+
+   // Data emptied from the buffer is not waited for, but is not sent either
+
+   KUNIT_EXPECT_EQ(test, spimod_cursor_queued(channel0, 20), length + 20);
+
+   spimod_cursor_discard(channel0);
+
+   KUNIT_EXPECT_TRUE(test, spimod_cursor_reached(channel0, length + 20, 1));
+   KUNIT_EXPECT_TRUE(test, spimod_cursor_discarded(channel0, length + 20));
+   KUNIT_EXPECT_FALSE(test, spimod_cursor_discarded(channel0, length));
+   KUNIT_EXPECT_EQ(test, (u64)atomic64_read(&channel0->_txDiscarded),
+                   (u64)20);
+}
+
+/* A frame whose transfer failed is not counted as sent: without
+   retransmission its data is lost, and counted as discarded */
+
+static void cursor_failed_test(
+   struct kunit* test)
+{
+   fill_tx(100);
+   spimod_cursor_queued(channel0, 100);
+   spimod_create_outbound_packet();
+
+   device_transaction._failed = 1;
+
+   spimod_cursor_transmitted();
+
+   KUNIT_EXPECT_EQ(test, (u64)atomic64_read(&channel0->_txSent), (u64)100);
+   KUNIT_EXPECT_EQ(test, (u64)atomic64_read(&channel0->_txDiscarded),
+                   (u64)100);
+   KUNIT_EXPECT_TRUE(test, spimod_cursor_discarded(channel0, 100));
+
+   fill_tx(50);
+   spimod_cursor_queued(channel0, 50);
+   spimod_create_outbound_packet();
+
+   device_transaction._failed = 0;
+
+   spimod_cursor_transmitted();
+
+   KUNIT_EXPECT_EQ(test, (u64)atomic64_read(&channel0->_txSent), (u64)150);
+   KUNIT_EXPECT_FALSE(test, spimod_cursor_discarded(channel0, 150));
+
+   // With retransmission the frame is kept to be resent
+
+   KUNIT_ASSERT_EQ(test,
+                   spimod_arq_init(&device_state._arq, 4, 5,
+                                   device_state._maxData),
+                   0);
+
+   fill_tx(20);
+   spimod_cursor_queued(channel0, 20);
+   spimod_create_outbound_packet();
+
+   device_transaction._failed = 1;
+
+   spimod_cursor_transmitted();
+
+   KUNIT_EXPECT_EQ(test, (u64)atomic64_read(&channel0->_txSent), (u64)150);
+   KUNIT_EXPECT_EQ(test, (u64)atomic64_read(&channel0->_txDiscarded),
+                   (u64)100);
+}
+
+/******************************************************************************
+ *
+ * Function: bench_report()
+ * Purpose:  Reports ns/byte for a benchmark and fails it if slower than
+ *           bench_limit_ps_per_byte.
+ *
+ * ***************************************************************************/
+
+static void bench_report(
+   struct kunit* test,
+   const char* name,
+   const int size,
+   const u64 ns,
+   const u64 bytes,
+   const u64 ops)
+{
+   u64 ps_per_byte = div64_u64(ns * 1000, max_t(u64, bytes, 1));
+
+   kunit_info(test, "%s %d: %llu.%03llu ns/byte, %llu ns/op\n",
+              name,
+              size,
+              ps_per_byte / 1000,
+              ps_per_byte % 1000,
+              div64_u64(ns, max_t(u64, ops, 1)));
+
+   if (bench_limit_ps_per_byte)
+   {
+      KUNIT_EXPECT_LE_MSG(test, ps_per_byte, (u64)bench_limit_ps_per_byte,
+                          "%s %d slower than the limit", name, size);
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: bench_copies()
+ * Purpose:  Times filling and draining a 16 KB ring in size byte copies with
+ *           either the kernel or the _user copy functions.  Sizes that do
+ *           not divide the ring exercise the two-step (wrapping) paths.
+ *
+ * ***************************************************************************/
+
+static void bench_copies(
+   struct kunit* test,
+   const int size,
+   char* data,
+   const int user)
+{
+   struct circular_buffer* buf = circular_buffer_init(BENCH_BUFFER_SIZE);
+   u64 writeNs = 0, readNs = 0;
+   u64 bytes = 0, ops = 0;
+   int round;
+
+   KUNIT_ASSERT_NOT_NULL(test, buf);
+
+   for (round = 0; round < BENCH_ROUNDS; ++round)
+   {
+      u64 start;
+      int n = 0;
+
+      start = ktime_get_ns();
+
+      while ((user ? circular_buffer_write_user(buf, data, size)
+                   : circular_buffer_write(buf, data, size)) == size)
+      {
+         ++n;
+      }
+
+      writeNs += ktime_get_ns() - start;
+
+      start = ktime_get_ns();
+
+      while ((user ? circular_buffer_read_user(buf, data, size)
+                   : circular_buffer_read(buf, data, size)) > 0)
+      {
+      }
+
+      readNs += ktime_get_ns() - start;
+
+      bytes += (u64)n * size;
+      ops += n;
+
+      cond_resched();
+   }
+
+   bench_report(test, user ? "circular_buffer_write_user" : "circular_buffer_write",
+                size, writeNs, bytes, ops);
+   bench_report(test, user ? "circular_buffer_read_user" : "circular_buffer_read",
+                size, readNs, bytes, ops);
+
+   circular_buffer_term(buf);
+}
+
+static const int bench_sizes[] = { 64, 512, PACKET_DATA_SIZE };
+
+static void circular_buffer_bench(
+   struct kunit* test)
+{
+   char* data = kunit_kzalloc(test, PACKET_DATA_SIZE, GFP_KERNEL);
+   int i;
+
+   KUNIT_ASSERT_NOT_NULL(test, data);
+
+   for (i = 0; i < ARRAY_SIZE(bench_sizes); ++i)
+   {
+      bench_copies(test, bench_sizes[i], data, 0);
+   }
+}
+
+static void circular_buffer_user_bench(
+   struct kunit* test)
+{
+   char* ubuf = user_buffer(test);
+   int i;
+
+   for (i = 0; i < ARRAY_SIZE(bench_sizes); ++i)
+   {
+      bench_copies(test, bench_sizes[i], ubuf, 1);
+   }
+}
+
+/* Times building full outbound packets and consuming full inbound ones */
+
+static void packet_bench(
+   struct kunit* test)
+{
+   struct packet* in = device_transaction._inPacket;
+   char* sink = kunit_kzalloc(test, PACKET_DATA_SIZE, GFP_KERNEL);
+   u64 createNs = 0, processNs = 0;
+   u64 frames = 0;
+   int round, i;
+
+   KUNIT_ASSERT_NOT_NULL(test, sink);
+
+   for (round = 0; round < BENCH_ROUNDS; ++round)
+   {
+      for (i = 0; i < BENCH_BUFFER_SIZE / PACKET_DATA_SIZE; ++i)
+      {
+         u64 start;
+
+         fill_tx(PACKET_DATA_SIZE);
+
+         start = ktime_get_ns();
+         spimod_create_outbound_packet();
+         createNs += ktime_get_ns() - start;
+
+         memcpy(in, device_transaction._outPacket, PACKET_SIZE);
+
+         start = ktime_get_ns();
+         spimod_process_inbound_packet();
+         processNs += ktime_get_ns() - start;
+
+         circular_buffer_read(channel0->_rxBuffer, sink, PACKET_DATA_SIZE);
+
+         ++frames;
+      }
+
+      cond_resched();
+   }
+
+   bench_report(test, "spimod_create_outbound_packet", PACKET_DATA_SIZE,
+                createNs, frames * PACKET_DATA_SIZE, frames);
+   bench_report(test, "spimod_process_inbound_packet", PACKET_DATA_SIZE,
+                processNs, frames * PACKET_DATA_SIZE, frames);
+}
+
+/* The suites */
+
+static struct kunit_case circular_buffer_test_cases[] =
+{
+   KUNIT_CASE_PARAM(circular_buffer_write_test, write_gen_params),
+   KUNIT_CASE_PARAM(circular_buffer_write_user_test, write_gen_params),
+   KUNIT_CASE_PARAM(circular_buffer_read_test, read_gen_params),
+   KUNIT_CASE_PARAM(circular_buffer_read_user_test, read_gen_params),
+#if SPIMOD_HAVE_READ_ITER
+   KUNIT_CASE_PARAM(circular_buffer_write_iter_test, write_iter_gen_params),
+   KUNIT_CASE_PARAM(circular_buffer_read_iter_test, read_gen_params),
+#endif
+   KUNIT_CASE(circular_buffer_user_fault_test),
+   KUNIT_CASE_PARAM(circular_buffer_resize_test, read_gen_params),
+   KUNIT_CASE(circular_buffer_null_test),
+   KUNIT_CASE_SLOW(circular_buffer_bench),
+   KUNIT_CASE_SLOW(circular_buffer_user_bench),
+   {}
+};
+
+static struct kunit_suite circular_buffer_test_suite =
+{
+   .name = "spimod_circular_buffer",
+   .test_cases = circular_buffer_test_cases,
+};
+
+static struct kunit_case frame_pool_test_cases[] =
+{
+   KUNIT_CASE(frame_pool_test),
+   KUNIT_CASE(resources_test),
+   {}
+};
+
+static struct kunit_suite frame_pool_test_suite =
+{
+   .name = "spimod_frame_pool",
+   .test_cases = frame_pool_test_cases,
+};
+
+static struct kunit_case protocol_test_cases[] =
+{
+   KUNIT_CASE(create_outbound_empty_test),
+   KUNIT_CASE(create_outbound_partial_test),
+   KUNIT_CASE(create_outbound_full_test),
+   KUNIT_CASE(process_inbound_test),
+   KUNIT_CASE(process_inbound_invalid_test),
+   KUNIT_CASE(process_inbound_overflow_test),
+   KUNIT_CASE(datagram_loop_test),
+   KUNIT_CASE(datagram_fragment_flags_test),
+   KUNIT_CASE(datagram_lost_fragment_test),
+   KUNIT_CASE(datagram_overflow_test),
+   KUNIT_CASE(wake_test),
+#if SPIMOD_HAVE_READ_ITER
+   KUNIT_CASE(datagram_iter_test),
+#endif
+   KUNIT_CASE(multiplex_fair_share_test),
+   KUNIT_CASE(multiplex_loop_test),
+   KUNIT_CASE(priority_preempt_test),
+   KUNIT_CASE(crc_loop_test),
+   KUNIT_CASE(crc_corrupt_test),
+   KUNIT_CASE(arq_selective_repeat_test),
+   KUNIT_CASE(bus_setup_test),
+   KUNIT_CASE(fec_correct_test),
+   KUNIT_CASE(handshake_test),
+   KUNIT_CASE(idle_test),
+   KUNIT_CASE(resync_test),
+   KUNIT_CASE(arq_resync_test),
+   KUNIT_CASE(bulk_order_test),
+   KUNIT_CASE(cursor_test),
+   KUNIT_CASE(cursor_failed_test),
+   KUNIT_CASE_SLOW(packet_bench),
+   {}
+};
+
+static struct kunit_suite protocol_test_suite =
+{
+   .name = "spimod_protocol",
+   .init = protocol_init,
+   .exit = protocol_exit,
+   .test_cases = protocol_test_cases,
+};
+
+kunit_test_suites(&circular_buffer_test_suite,
+                  &frame_pool_test_suite,
+                  &protocol_test_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("KUnit tests for the SPI device driver");
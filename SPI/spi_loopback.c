@@ -0,0 +1,749 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_loopback
+ *
+ * Purpose:     A virtual SPI controller completing transfers in software
+ *              against a model of the slave (spi_slave_model.c), so the
+ *              driver can be loaded and load-tested on any Linux machine.
+ *
+ *              One controller is registered per entry of bus_num (by default
+ *              buses 2 and 1, as used by spi1 and spi2).  Transfers take the
+ *              time they would on a real bus at clock_hz, plus latency_us
+ *              and word_gap_ns per word.  model, clock_hz, latency_us,
+ *              word_gap_ns, generator_bytes, crc and error_interval may be
+ *              changed at run time under
+ *              /sys/module/spi_loopback/parameters.  arq_window and fec must
+ *              be set if, and only if, the driver's are.
+ *
+ *              error_interval flips bits at random in both directions, on
+ *              average one in every error_interval bits, to exercise the
+ *              CRC, retransmission and error correction.
+ *
+ * ***************************************************************************/
+
+#include "spi_slave_model.h"
+#include "spi_arq.h"
+#include "spi_fec.h"
+#include "spi_hello.h"
+#include "spi_compat.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+
+/* Constants */
+
+#define LOOPBACK_MAX_BUSES		4
+
+static const int LOOPBACK_FIFO_SIZE	= 1024 * 64;
+
+/* Module parameters */
+
+static int bus_num[LOOPBACK_MAX_BUSES] = { 2, 1 };
+static int num_buses = 2;
+module_param_array(bus_num, int, &num_buses, 0444);
+MODULE_PARM_DESC(bus_num, "SPI bus numbers to register (default 2,1)");
+
+static char* modalias[LOOPBACK_MAX_BUSES] = { "spimod1", "spimod2" };
+module_param_array(modalias, charp, NULL, 0444);
+MODULE_PARM_DESC(modalias, "Driver of the slave declared on each bus, on "
+                           "kernels without spi_busnum_to_master()");
+
+static char model[16] = "echo";
+module_param_string(model, model, sizeof(model), 0644);
+MODULE_PARM_DESC(model, "Slave behaviour: echo, generator or sink");
+
+static unsigned int clock_hz = 0;
+module_param(clock_hz, uint, 0644);
+MODULE_PARM_DESC(clock_hz, "Simulated bus clock, 0 for the requested speed");
+
+static unsigned int latency_us = 0;
+module_param(latency_us, uint, 0644);
+MODULE_PARM_DESC(latency_us, "Additional latency per message");
+
+static unsigned int word_gap_ns = 0;
+module_param(word_gap_ns, uint, 0644);
+MODULE_PARM_DESC(word_gap_ns, "Additional time per word, as a controller's "
+                              "FIFO accesses would take");
+
+static unsigned int generator_bytes = PACKET_DATA_SIZE;
+module_param(generator_bytes, uint, 0644);
+MODULE_PARM_DESC(generator_bytes, "Payload per packet sent by the generator");
+
+static bool crc = 0;
+module_param(crc, bool, 0644);
+MODULE_PARM_DESC(crc, "Protect every packet with a CRC-32C, as spimod crc=1");
+
+static unsigned int arq_window = 0;
+module_param(arq_window, uint, 0444);
+MODULE_PARM_DESC(arq_window, "Packets held for retransmission, as spimod "
+                             "arq_window (default 0, disabled)");
+
+static unsigned int arq_timeout = 4;
+module_param(arq_timeout, uint, 0444);
+MODULE_PARM_DESC(arq_timeout,
+                 "Packets sent before an unacknowledged one is resent (default 4)");
+
+static unsigned int fec = 0;
+module_param(fec, uint, 0444);
+MODULE_PARM_DESC(fec, "Bytes corrected per FEC codeword, as spimod fec "
+                      "(default 0, disabled)");
+
+static unsigned int max_frame_size = 8192;
+module_param(max_frame_size, uint, 0444);
+MODULE_PARM_DESC(max_frame_size, "Largest frame agreed with spimod "
+                                 "max_frame_size (default 8192)");
+
+static unsigned int error_interval = 0;
+module_param(error_interval, uint, 0644);
+MODULE_PARM_DESC(error_interval,
+                 "Average bits between injected bit errors, 0 for none");
+
+/* The state of one loopback controller */
+
+struct spi_loopback
+{
+   struct platform_device*	_pdev;
+   struct spi_controller*	_controller;
+   spinlock_t			_lock;
+   struct list_head		_queue;
+   struct hrtimer		_timer;
+   int				_busy;
+   // Set by spi_loopback_remove(), after which messages are refused
+   int				_dead;
+   struct spimod_slave		_slave;
+   // Bit errors: _nextError counts down the bits to the next one
+   u32				_nextError;
+   unsigned long		_bitErrors;
+   u8				_wire[sizeof(struct packet) + sizeof(u32)];
+};
+
+static struct spi_loopback* loopbacks[LOOPBACK_MAX_BUSES];
+
+/******************************************************************************
+ *
+ * Function: spi_loopback_model()
+ * Purpose:  Parses the model module parameter.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The selected slave model, echo if not recognised.
+ *
+ * Globals:
+ *
+ * - model (read).
+ *
+ * ***************************************************************************/
+
+static slaveModelType spi_loopback_model(void)
+{
+   if (0 == strncmp(model, "generator", 9))
+   {
+      return SLAVE_MODEL_GENERATOR;
+   }
+
+   if (0 == strncmp(model, "sink", 4))
+   {
+      return SLAVE_MODEL_SINK;
+   }
+
+   return SLAVE_MODEL_ECHO;
+}
+
+/******************************************************************************
+ *
+ * Function: spi_loopback_duration()
+ * Purpose:  Calculates how long a message would occupy the bus.
+ *
+ * Parameters:
+ *
+ * - IN:     msg (the message to time).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The duration in nanoseconds.
+ *
+ * Globals:
+ *
+ * - clock_hz, latency_us, word_gap_ns (read).
+ *
+ * ***************************************************************************/
+
+static u64 spi_loopback_duration(
+   struct spi_message* msg)
+{
+   struct spi_transfer* xfer;
+   u64 ns = (u64)latency_us * NSEC_PER_USEC;
+
+   list_for_each_entry(xfer, &msg->transfers, transfer_list)
+   {
+      u32 hz = clock_hz;
+      u32 bits = xfer->bits_per_word ? xfer->bits_per_word
+                                     : msg->spi->bits_per_word;
+
+      if (0 == hz)
+      {
+         hz = xfer->speed_hz ? xfer->speed_hz : msg->spi->max_speed_hz;
+      }
+
+      if (hz > 0)
+      {
+         ns += div_u64((u64)xfer->len * 8 * NSEC_PER_SEC, hz);
+      }
+
+      ns += (u64)(xfer->len / (bits > 8 ? bits / 8 : 1)) * word_gap_ns;
+   }
+
+   return ns;
+}
+
+/******************************************************************************
+ *
+ * Function: spi_loopback_corrupt()
+ * Purpose:  Flips bits of a buffer at random, on average one in every
+ *           error_interval bits.
+ *
+ * Parameters:
+ *
+ * - IN:     len (length of the buffer in bytes).
+ * - OUT:    N/A
+ * - IN/OUT: lb (the controller, its _nextError and _bitErrors updated).
+ *           buf (the buffer, may be NULL).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - error_interval (read).
+ *
+ * ***************************************************************************/
+
+static void spi_loopback_corrupt(
+   struct spi_loopback* lb,
+   u8* buf,
+   const unsigned int len)
+{
+   const u32 interval = error_interval;
+   u64 pos = 0;
+
+   if (0 == interval || NULL == buf)
+   {
+      return;
+   }
+
+   while (pos + lb->_nextError < (u64)len * 8)
+   {
+      pos += lb->_nextError;
+
+      buf[pos / 8] ^= 1 << (pos % 8);
+
+      ++lb->_bitErrors;
+      ++pos;
+
+      // Uniform over 0 to twice the interval, so interval on average
+
+      lb->_nextError = ((u64)spimod_random_u32() * 2 * interval) >> 32;
+   }
+
+   lb->_nextError -= (u64)len * 8 - pos;
+}
+
+/******************************************************************************
+ *
+ * Function: spi_loopback_timer_callback()
+ * Purpose:  Completes the message at the head of the queue against the
+ *           slave model, then times the next message, if any.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: timer (the controller's timer).
+ *
+ * Returns:  HRTIMER_RESTART while messages remain queued.
+ *
+ * Globals:
+ *
+ * - model, generator_bytes, crc, error_interval (read).
+ *
+ * ***************************************************************************/
+
+static enum hrtimer_restart spi_loopback_timer_callback(
+   struct hrtimer* timer)
+{
+   struct spi_loopback* lb = container_of(timer, struct spi_loopback, _timer);
+   struct spi_message* msg;
+   struct spi_transfer* xfer;
+   enum hrtimer_restart result = HRTIMER_NORESTART;
+   unsigned long flags;
+
+   spin_lock_irqsave(&lb->_lock, flags);
+
+   msg = list_first_entry(&lb->_queue, struct spi_message, queue);
+
+   list_del_init(&msg->queue);
+
+   spin_unlock_irqrestore(&lb->_lock, flags);
+
+   lb->_slave._model = spi_loopback_model();
+   lb->_slave._generatorBytes = generator_bytes;
+   lb->_slave._crc = crc;
+
+   list_for_each_entry(xfer, &msg->transfers, transfer_list)
+   {
+      const void* tx = xfer->tx_buf;
+
+      // The master's buffer is left alone; the slave receives a copy
+
+      if (error_interval > 0 && tx != NULL && xfer->len <= sizeof(lb->_wire))
+      {
+         memcpy(lb->_wire, tx, xfer->len);
+
+         spi_loopback_corrupt(lb, lb->_wire, xfer->len);
+
+         tx = lb->_wire;
+      }
+
+      spimod_slave_transfer(&lb->_slave, tx, xfer->rx_buf, xfer->len);
+
+      spi_loopback_corrupt(lb, xfer->rx_buf, xfer->len);
+
+      msg->actual_length += xfer->len;
+   }
+
+   msg->status = 0;
+
+   if (msg->complete)
+   {
+      msg->complete(msg->context);
+   }
+
+   spin_lock_irqsave(&lb->_lock, flags);
+
+   if (list_empty(&lb->_queue))
+   {
+      lb->_busy = 0;
+   }
+   else
+   {
+      msg = list_first_entry(&lb->_queue, struct spi_message, queue);
+
+      hrtimer_forward_now(timer, ns_to_ktime(spi_loopback_duration(msg)));
+
+      result = HRTIMER_RESTART;
+   }
+
+   spin_unlock_irqrestore(&lb->_lock, flags);
+
+   return result;
+}
+
+/******************************************************************************
+ *
+ * Function: spi_loopback_transfer()
+ * Purpose:  Controller callback queueing a message for completion.
+ *
+ * Parameters:
+ *
+ * - IN:     spi (the target device).
+ * - OUT:    N/A
+ * - IN/OUT: msg (the message to transfer).
+ *
+ * Returns:  0, or -ESHUTDOWN once the controller is being removed.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static int spi_loopback_transfer(
+   struct spi_device* spi,
+   struct spi_message* msg)
+{
+   struct spi_loopback* lb =
+      spi_controller_get_devdata(spimod_controller_of(spi));
+   unsigned long flags;
+
+   msg->actual_length = 0;
+   msg->status = -EINPROGRESS;
+
+   spin_lock_irqsave(&lb->_lock, flags);
+
+   if (lb->_dead)
+   {
+      spin_unlock_irqrestore(&lb->_lock, flags);
+
+      return -ESHUTDOWN;
+   }
+
+   list_add_tail(&msg->queue, &lb->_queue);
+
+   if (!lb->_busy)
+   {
+      lb->_busy = 1;
+
+      hrtimer_start(&lb->_timer,
+                    ns_to_ktime(spi_loopback_duration(msg)),
+                    HRTIMER_MODE_REL);
+   }
+
+   spin_unlock_irqrestore(&lb->_lock, flags);
+
+   return 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spi_loopback_setup()
+ * Purpose:  Controller callback validating a device's settings.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: spi (the device to set up).
+ *
+ * Returns:  0 on success, -EINVAL for unsupported word sizes.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static int spi_loopback_setup(
+   struct spi_device* spi)
+{
+   switch (spi->bits_per_word)
+   {
+      case 0:
+      case 8:
+      case 16:
+      case 32:
+         return 0;
+
+      default:
+         return -EINVAL;
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spi_loopback_add()
+ * Purpose:  Creates and registers the loopback controller for one bus.
+ *
+ * Parameters:
+ *
+ * - IN:     index (entry of bus_num / modalias to use).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 on success, -1 on failure.
+ *
+ * Globals:
+ *
+ * - loopbacks[index] (created).
+ *
+ * ***************************************************************************/
+
+static int __init spi_loopback_add(
+   const int index)
+{
+   struct platform_device* pdev;
+   struct spi_controller* controller;
+   struct spi_loopback* lb;
+   int error;
+
+   pdev = platform_device_register_simple("spi_loopback", index, NULL, 0);
+
+   if (IS_ERR(pdev))
+   {
+      printk(KERN_ALERT "platform_device_register_simple() failed\n");
+
+      return -1;
+   }
+
+   controller = spi_alloc_host(&pdev->dev, sizeof(struct spi_loopback));
+
+   if (!controller)
+   {
+      printk(KERN_ALERT "spi_alloc_host() failed\n");
+
+      goto fail_1;
+   }
+
+   lb = spi_controller_get_devdata(controller);
+
+   memset(lb, 0, sizeof(struct spi_loopback));
+
+   lb->_pdev = pdev;
+   lb->_controller = controller;
+
+   spin_lock_init(&lb->_lock);
+   INIT_LIST_HEAD(&lb->_queue);
+
+   spimod_hrtimer_setup(&lb->_timer,
+                        spi_loopback_timer_callback,
+                        CLOCK_MONOTONIC,
+                        HRTIMER_MODE_REL);
+
+   if (spimod_slave_init(&lb->_slave, LOOPBACK_FIFO_SIZE) < 0)
+   {
+      printk(KERN_ALERT "spimod_slave_init() failed\n");
+
+      goto fail_2;
+   }
+
+   lb->_slave._maxData = spimod_hello_max_data(max_frame_size);
+
+   if (spimod_arq_init(&lb->_slave._arq, arq_window, arq_timeout,
+                       lb->_slave._maxData) < 0)
+   {
+      printk(KERN_ALERT "spimod_arq_init() failed\n");
+
+      goto fail_3;
+   }
+
+   if (spimod_fec_init(&lb->_slave._fec, fec) < 0)
+   {
+      printk(KERN_ALERT "spimod_fec_init() failed\n");
+
+      goto fail_3;
+   }
+
+   controller->bus_num = bus_num[index];
+   controller->num_chipselect = 2;
+   controller->mode_bits = SPI_CPOL | SPI_CPHA;
+   controller->setup = spi_loopback_setup;
+   controller->transfer = spi_loopback_transfer;
+
+   error = spi_register_controller(controller);
+
+   if (error < 0)
+   {
+      printk(KERN_ALERT "spi_register_controller(%d) failed: %d\n",
+             bus_num[index], error);
+
+      goto fail_3;
+   }
+
+   loopbacks[index] = lb;
+
+#if !SPIMOD_HAVE_BUSNUM_TO_MASTER
+   {
+      // The driver can no longer add its own device, so declare it here
+
+      struct spi_board_info info;
+
+      memset(&info, 0, sizeof(info));
+
+      strscpy(info.modalias, modalias[index], SPI_NAME_SIZE);
+
+      info.max_speed_hz = SPI_BUS_SPEED;
+      info.bus_num = bus_num[index];
+      info.chip_select = SPI_BUS_CS1;
+      info.mode = SPI_MODE_0;
+
+      if (!spi_new_device(controller, &info))
+      {
+         printk(KERN_ALERT "spi_new_device(%s) failed\n", modalias[index]);
+      }
+   }
+#endif
+
+   printk(KERN_ALERT "Loopback SPI controller on bus %d\n", bus_num[index]);
+
+   return 0;
+
+fail_3:
+   spimod_slave_term(&lb->_slave);
+
+fail_2:
+   spi_controller_put(controller);
+
+fail_1:
+   platform_device_unregister(pdev);
+
+   return -1;
+}
+
+/******************************************************************************
+ *
+ * Function: spi_loopback_flush()
+ * Purpose:  Completes every message still queued with -ESHUTDOWN, so their
+ *           senders are not left waiting.  The timer must be stopped.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: lb (the controller, its queue emptied).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static void spi_loopback_flush(
+   struct spi_loopback* lb)
+{
+   struct spi_message* msg;
+   unsigned long flags;
+
+   spin_lock_irqsave(&lb->_lock, flags);
+
+   while (!list_empty(&lb->_queue))
+   {
+      msg = list_first_entry(&lb->_queue, struct spi_message, queue);
+
+      list_del_init(&msg->queue);
+
+      spin_unlock_irqrestore(&lb->_lock, flags);
+
+      msg->status = -ESHUTDOWN;
+
+      if (msg->complete)
+      {
+         msg->complete(msg->context);
+      }
+
+      spin_lock_irqsave(&lb->_lock, flags);
+   }
+
+   lb->_busy = 0;
+
+   spin_unlock_irqrestore(&lb->_lock, flags);
+}
+
+/******************************************************************************
+ *
+ * Function: spi_loopback_remove()
+ * Purpose:  Unregisters and destroys the loopback controller for one bus.
+ *           New messages are refused first; those still queued once the
+ *           controller is unregistered are completed with -ESHUTDOWN
+ *           before the slave model goes.
+ *
+ * Parameters:
+ *
+ * - IN:     index (entry of loopbacks to remove).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - loopbacks[index] (destroyed).
+ *
+ * ***************************************************************************/
+
+static void spi_loopback_remove(
+   const int index)
+{
+   struct spi_loopback* lb = loopbacks[index];
+   struct spi_controller* controller;
+   struct platform_device* pdev;
+   unsigned long flags;
+
+   if (NULL == lb)
+   {
+      return;
+   }
+
+   printk(KERN_ALERT "Loopback bus %d: %lu frames, %lu bytes in, %lu bytes "
+                     "out, %lu dropped, %lu bad frames, %lu CRC errors, "
+                     "%u resent, %lu bit errors, %u repaired, %u beyond "
+                     "repair\n",
+          bus_num[index],
+          lb->_slave._framesReceived,
+          lb->_slave._bytesReceived,
+          lb->_slave._bytesSent,
+          lb->_slave._bytesDropped,
+          lb->_slave._badFrames,
+          lb->_slave._crcErrors,
+          lb->_slave._arq._retransmits,
+          lb->_bitErrors,
+          lb->_slave._fec._repaired,
+          lb->_slave._fec._failed);
+
+   pdev = lb->_pdev;
+   controller = lb->_controller;
+
+   spin_lock_irqsave(&lb->_lock, flags);
+
+   lb->_dead = 1;
+
+   spin_unlock_irqrestore(&lb->_lock, flags);
+
+   // lb goes with the controller, so hold it until the queue is flushed
+
+   spi_controller_get(controller);
+
+   spi_unregister_controller(controller);
+
+   hrtimer_cancel(&lb->_timer);
+
+   spi_loopback_flush(lb);
+
+   spimod_slave_term(&lb->_slave);
+
+   spi_controller_put(controller);
+
+   platform_device_unregister(pdev);
+
+   loopbacks[index] = NULL;
+}
+
+static int __init spi_loopback_init(void)
+{
+   int i;
+
+   if (num_buses > LOOPBACK_MAX_BUSES)
+   {
+      num_buses = LOOPBACK_MAX_BUSES;
+   }
+
+   for (i = 0; i < num_buses; ++i)
+   {
+      if (spi_loopback_add(i) < 0)
+      {
+         while (--i >= 0)
+         {
+            spi_loopback_remove(i);
+         }
+
+         return -1;
+      }
+   }
+
+   return 0;
+}
+
+static void __exit spi_loopback_exit(void)
+{
+   int i;
+
+   for (i = 0; i < num_buses; ++i)
+   {
+      spi_loopback_remove(i);
+   }
+}
+
+module_init(spi_loopback_init);
+module_exit(spi_loopback_exit);
+
+MODULE_AUTHOR("Siddarth Sharma & Steve Turnbull");
+MODULE_DESCRIPTION("Loopback SPI controller with a simulated spimod slave");
+MODULE_LICENSE("GPL");
+MODULE_VERSION("1.0");
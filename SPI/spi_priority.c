@@ -0,0 +1,329 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_priority
+ *
+ * Purpose:     Priority lane for latency-critical messages, see
+ *              spi_priority.h.
+ *
+ *              The priority transmit buffer holds each message behind a
+ *              priority_header recording when it was queued, the priority
+ *              receive buffer behind a 16 bit length.  _rxPriorityMessages
+ *              counts the messages received, so the reader never sees a
+ *              length before its data.
+ *
+ * ***************************************************************************/
+
+#include "spi_priority.h"
+#include "circular_buffer.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+
+#define __NO_VERSION__
+
+/* Externs, declared in spi_core.c */
+
+extern struct spimod_device_state device_state;
+
+/* Constants */
+
+static const int PRIORITY_TX_HEADER_SIZE = sizeof(struct priority_header);
+static const int PRIORITY_RX_HEADER_SIZE = sizeof(u16);
+
+/******************************************************************************
+ *
+ * Function: spimod_priority_reset()
+ * Purpose:  Empties the channel's priority buffers.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel's _txPriority and _rxPriority are cleared).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_priority_reset(
+   struct spimod_channel* chan)
+{
+   circular_buffer_reset(chan->_txPriority);
+   circular_buffer_reset(chan->_rxPriority);
+
+   atomic_set(&chan->_rxPriorityMessages, 0);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_priority_send_user()
+ * Purpose:  Queues one message from user space in the priority transmit
+ *           circular buffer, whole or not at all.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           data (user space message).
+ *           length (size of the message).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  length if queued, 0 if there is not yet room, negative integer
+ *           on failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_priority_send_user(
+   struct spimod_channel* chan,
+   const char __user* data,
+   const int length)
+{
+   struct circular_buffer* buf = chan->_txPriority;
+   struct priority_header header;
+
+   if (length <= 0)
+   {
+      return -EINVAL;
+   }
+
+   // Trailers and parity, if any, take room from the segment
+
+   if (length > PRIORITY_MAX_SIZE
+                - (device_state._dataSize - spimod_packet_capacity()))
+   {
+      return -EMSGSIZE;
+   }
+
+   if (PRIORITY_TX_HEADER_SIZE + length > buf->_capacity - buf->_size)
+   {
+      return 0;
+   }
+
+   header._queuedNs = ktime_to_ns(ktime_get());
+   header._len = length;
+
+   circular_buffer_write(buf, (const char*)&header, PRIORITY_TX_HEADER_SIZE);
+
+   // The pump only takes a message once all of it is queued
+
+   if (circular_buffer_write_user(buf, data, length) != length)
+   {
+      circular_buffer_unwrite(buf, PRIORITY_TX_HEADER_SIZE);
+
+      return -EFAULT;
+   }
+
+   return length;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_priority_receive_user()
+ * Purpose:  Removes the oldest priority message received into user space.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           length (size of the user space buffer).
+ * - OUT:    data (user space buffer).
+ * - IN/OUT: N/A
+ *
+ * Returns:  Size of the message, 0 if there is none, negative integer on
+ *           failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_priority_receive_user(
+   struct spimod_channel* chan,
+   char __user* data,
+   const int length)
+{
+   struct circular_buffer* buf = chan->_rxPriority;
+   u16 size = 0;
+
+   if (0 == atomic_read(&chan->_rxPriorityMessages))
+   {
+      return 0;
+   }
+
+   circular_buffer_peek(buf, 0, (char*)&size, PRIORITY_RX_HEADER_SIZE);
+
+   if (size > length)
+   {
+      return -EMSGSIZE;
+   }
+
+   circular_buffer_discard(buf, PRIORITY_RX_HEADER_SIZE);
+
+   atomic_dec(&chan->_rxPriorityMessages);
+
+   if (circular_buffer_read_user(buf, data, size) != size)
+   {
+      circular_buffer_discard(buf, size);
+
+      return -EFAULT;
+   }
+
+   return size;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_priority_pending()
+ * Purpose:  Returns the size of the next priority message to send.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  Size of the message if it is completely queued, else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_priority_pending(
+   struct spimod_channel* chan)
+{
+   struct circular_buffer* buf = chan->_txPriority;
+   struct priority_header header;
+
+   if (circular_buffer_num_bytes_available(buf) < PRIORITY_TX_HEADER_SIZE)
+   {
+      return 0;
+   }
+
+   circular_buffer_peek(buf, 0, (char*)&header, PRIORITY_TX_HEADER_SIZE);
+
+   if (PRIORITY_TX_HEADER_SIZE + header._len > buf->_size)
+   {
+      return 0;
+   }
+
+   return header._len;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_priority_fill()
+ * Purpose:  Removes the next priority message to send, if it fits, and
+ *           records how long it was queued.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           space (room left in the packet).
+ * - OUT:    data (the message).
+ * - IN/OUT: N/A
+ *
+ * Returns:  Size of the message, 0 if there is none or it does not fit.
+ *
+ * Globals:
+ *
+ * - device_state._statPriorityMessages, _statPriorityNs,
+ *   _statPriorityMaxNs (updated).
+ *
+ * ***************************************************************************/
+
+int spimod_priority_fill(
+   struct spimod_channel* chan,
+   char* data,
+   const int space)
+{
+   struct circular_buffer* buf = chan->_txPriority;
+   struct priority_header header;
+   u64 ns;
+
+   if (0 == spimod_priority_pending(chan))
+   {
+      return 0;
+   }
+
+   circular_buffer_peek(buf, 0, (char*)&header, PRIORITY_TX_HEADER_SIZE);
+
+   if (header._len > space)
+   {
+      return 0;
+   }
+
+   circular_buffer_discard(buf, PRIORITY_TX_HEADER_SIZE);
+   circular_buffer_read(buf, data, header._len);
+
+   ns = ktime_to_ns(ktime_get()) - header._queuedNs;
+
+   device_state._statPriorityMessages++;
+   device_state._statPriorityNs += ns;
+
+   if (ns > device_state._statPriorityMaxNs)
+   {
+      device_state._statPriorityMaxNs = ns;
+   }
+
+   return header._len;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_priority_deliver()
+ * Purpose:  Adds an inbound priority message to the priority receive
+ *           circular buffer.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           data (the message, already validated).
+ *           len (size of the message).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._statPriorityDropped (updated).
+ *
+ * ***************************************************************************/
+
+void spimod_priority_deliver(
+   struct spimod_channel* chan,
+   const char* data,
+   const int len)
+{
+   struct circular_buffer* buf = chan->_rxPriority;
+   u16 header = len;
+
+   if (0 == len)
+   {
+      return;
+   }
+
+   if (PRIORITY_RX_HEADER_SIZE + len > buf->_capacity - buf->_size)
+   {
+      ++device_state._statPriorityDropped;
+
+      return;
+   }
+
+   circular_buffer_write(buf, (const char*)&header, PRIORITY_RX_HEADER_SIZE);
+   circular_buffer_write(buf, data, len);
+
+   atomic_inc(&chan->_rxPriorityMessages);
+}
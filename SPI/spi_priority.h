@@ -0,0 +1,191 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_priority
+ *
+ * Purpose:     Priority lane for short, latency-critical messages.  Each
+ *              channel has a small priority transmit and receive circular
+ *              buffer besides its normal ones.  Priority messages are sent
+ *              whole, each as a segment flagged PACKET_FLAG_PRIORITY, at the
+ *              start of the next packet - ahead of, and if need be between
+ *              the fragments of, anything queued in the normal buffers.
+ *              Inbound priority segments are kept in the priority receive
+ *              buffer, one message at a time.
+ *
+ * ***************************************************************************/
+
+#ifndef SPI_PRIORITY_H
+#define SPI_PRIORITY_H
+
+#include "spi_protocol.h"
+
+/* The header of each message in the priority transmit buffer */
+
+#pragma pack(1)
+
+struct priority_header
+{
+   u64				_queuedNs;
+   u16				_len;
+};
+
+#pragma pack()
+
+/******************************************************************************
+ *
+ * Function: spimod_priority_reset()
+ * Purpose:  Empties the channel's priority buffers.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: chan (the channel's _txPriority and _rxPriority are cleared).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_priority_reset(
+   struct spimod_channel* chan);
+
+/******************************************************************************
+ *
+ * Function: spimod_priority_send_user()
+ * Purpose:  Queues one message from user space in the priority transmit
+ *           circular buffer, whole or not at all.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           data (user space message).
+ *           length (size of the message, 1 to PRIORITY_MAX_SIZE bytes, less
+ *           any CRC, ARQ trailer and FEC parity packets carry).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  length if queued, 0 if there is not yet room for it, -EINVAL if
+ *           it is empty, -EMSGSIZE if it does not fit in a packet, -EFAULT
+ *           if it could not be copied.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_priority_send_user(
+   struct spimod_channel* chan,
+   const char __user* data,
+   const int length);
+
+/******************************************************************************
+ *
+ * Function: spimod_priority_receive_user()
+ * Purpose:  Removes the oldest priority message received into user space.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           length (size of the user space buffer).
+ * - OUT:    data (user space buffer).
+ * - IN/OUT: N/A
+ *
+ * Returns:  Size of the message, 0 if there is none, -EMSGSIZE if it is
+ *           larger than length (the message is kept), -EFAULT if it could
+ *           not be copied (the message is lost).
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_priority_receive_user(
+   struct spimod_channel* chan,
+   char __user* data,
+   const int length);
+
+/******************************************************************************
+ *
+ * Function: spimod_priority_pending()
+ * Purpose:  Returns the size of the next priority message to send.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  Size of the message if it is completely queued, else 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_priority_pending(
+   struct spimod_channel* chan);
+
+/******************************************************************************
+ *
+ * Function: spimod_priority_fill()
+ * Purpose:  Removes the next priority message to send, if it fits in space
+ *           bytes, and records how long it was queued.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           space (room left in the packet).
+ * - OUT:    data (the message).
+ * - IN/OUT: N/A
+ *
+ * Returns:  Size of the message, 0 if there is none or it does not fit.
+ *
+ * Globals:
+ *
+ * - device_state._statPriorityMessages, _statPriorityNs,
+ *   _statPriorityMaxNs (updated).
+ *
+ * ***************************************************************************/
+
+int spimod_priority_fill(
+   struct spimod_channel* chan,
+   char* data,
+   const int space);
+
+/******************************************************************************
+ *
+ * Function: spimod_priority_deliver()
+ * Purpose:  Adds an inbound priority message to the priority receive
+ *           circular buffer.  Messages that do not fit are counted in
+ *           _statPriorityDropped and discarded.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           data (the message, already validated).
+ *           len (size of the message).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._statPriorityDropped (updated).
+ *
+ * ***************************************************************************/
+
+void spimod_priority_deliver(
+   struct spimod_channel* chan,
+   const char* data,
+   const int len);
+
+#endif
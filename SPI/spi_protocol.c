@@ -9,10 +9,22 @@
  * ***************************************************************************/
 
 #include "spi_protocol.h"
+#include "spi_capture.h"
+#include "spi_datagram.h"
+#include "spi_priority.h"
+#include "spi_crc.h"
+#include "spi_arq.h"
+#include "spi_fec.h"
+#include "spi_hello.h"
+#include "spi_bulk.h"
+#include "spi_cursor.h"
+#include "spi_compat.h"
 #include "circular_buffer.h"
+#include "spi4.h"
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/slab.h>
 
 #define __NO_VERSION_
 
@@ -26,6 +38,65 @@ extern struct spimod_transaction device_transaction;
 extern const int SPI_BUS;
 extern const char this_driver_name[];
 
+/* Module parameters */
+
+static bool dma_coherent = 1;
+module_param(dma_coherent, bool, 0444);
+MODULE_PARM_DESC(dma_coherent,
+                 "Use pre-mapped DMA-coherent frames where supported (default 1)");
+
+/* Outbound, inbound and in flight receive packets, plus one spare */
+
+static const int MIN_FRAMES = 4;
+
+static int frame_pool_size = 8;
+module_param(frame_pool_size, int, 0444);
+MODULE_PARM_DESC(frame_pool_size, "Packets preallocated per device (minimum 4)");
+
+static unsigned int arq_window = 0;
+module_param(arq_window, uint, 0444);
+MODULE_PARM_DESC(arq_window,
+                 "Packets held for retransmission, 0 to disable (up to 16, default 0)");
+
+static unsigned int arq_timeout = 4;
+module_param(arq_timeout, uint, 0444);
+MODULE_PARM_DESC(arq_timeout,
+                 "Packets sent before an unacknowledged one is resent (default 4)");
+
+static unsigned int bus_speed_hz = 4000000;
+module_param(bus_speed_hz, uint, 0444);
+MODULE_PARM_DESC(bus_speed_hz, "Bus clock in Hz (default 4000000)");
+
+static unsigned int spi_mode = 0;
+module_param(spi_mode, uint, 0444);
+MODULE_PARM_DESC(spi_mode, "SPI mode, 0 to 3 (default 0)");
+
+static unsigned int bits_per_word = 8;
+module_param(bits_per_word, uint, 0444);
+MODULE_PARM_DESC(bits_per_word, "Bits per word, 8, 16 or 32 (default 8)");
+
+static unsigned int fec = 0;
+module_param(fec, uint, 0444);
+MODULE_PARM_DESC(fec,
+                 "Bytes corrected per FEC codeword, 0 to disable (up to 16, default 0)");
+
+static unsigned int idle_frames = 0;
+module_param(idle_frames, uint, 0644);
+MODULE_PARM_DESC(idle_frames,
+                 "Empty frames in a row before the pump only polls the slave, 0 never (default 0, taken at open)");
+
+static unsigned int idle_poll_ms = 10;
+module_param(idle_poll_ms, uint, 0644);
+MODULE_PARM_DESC(idle_poll_ms, "Milliseconds between polls of an idle slave (default 10)");
+
+/* Hellos sent at open before giving up on the slave answering */
+
+static const u32 HELLO_FRAMES = 16;
+
+/* Inbound frames in a row without a sync word before resynchronising */
+
+static const u32 RESYNC_FRAMES = 4;
+
 /******************************************************************************
  *
  * Function: spimod_probe()
@@ -100,6 +171,37 @@ int spimod_remove(
    return 0;
 }
 
+/******************************************************************************
+ *
+ * Function: spimod_bus_valid()
+ * Purpose:  Checks a bus clock, SPI mode and word size.
+ *
+ * Parameters:
+ *
+ * - IN:     speedHz (the bus clock).
+ *           mode (the SPI mode).
+ *           bitsPerWord (the word size).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 if the driver supports them, otherwise 0.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static int spimod_bus_valid(
+   const u32 speedHz,
+   const u32 mode,
+   const u32 bitsPerWord)
+{
+   return speedHz > 0
+       && 0 == (mode & ~(SPI_CPHA | SPI_CPOL))
+       && (8 == bitsPerWord || 16 == bitsPerWord || 32 == bitsPerWord);
+}
+
 /******************************************************************************
  *
  * Function: add_spimod_device_to_bus()
@@ -115,10 +217,14 @@ int spimod_remove(
  *
  * Globals:
  *
- * - N/A
+ * - device_state._busSpeedHz, _busMode, _bitsPerWord (set from the module
+ *   parameters, or from a device already declared on the chip select that
+ *   this driver is not bound to).
  *
  * ***************************************************************************/
 
+#if SPIMOD_HAVE_BUSNUM_TO_MASTER
+
 int add_spimod_device_to_bus(void)
 {
    struct spi_master *spi_master;
@@ -127,6 +233,13 @@ int add_spimod_device_to_bus(void)
    char buff[64];
    int status = 0;
 
+   if (!spimod_bus_valid(bus_speed_hz, spi_mode, bits_per_word))
+   {
+      printk(KERN_ALERT "Unsupported bus_speed_hz, spi_mode or bits_per_word\n");
+
+      return -1;
+   }
+
    spi_master = spi_busnum_to_master(SPI_BUS);
 
    if (!spi_master)
@@ -174,12 +287,31 @@ int add_spimod_device_to_bus(void)
 
          status = -1;
       }
+      else if (device_state._spi_device != NULL)
+      {
+         // Already bound to this driver, so apply the module parameters
+
+         if (spimod_bus_setup(bus_speed_hz, spi_mode, bits_per_word) < 0)
+         {
+            printk(KERN_ALERT "Unsupported bus_speed_hz, spi_mode or bits_per_word\n");
+
+            status = -1;
+         }
+      }
+      else
+      {
+         // Report what the device was declared with
+
+         device_state._busSpeedHz = to_spi_device(pdev)->max_speed_hz;
+         device_state._busMode = to_spi_device(pdev)->mode;
+         device_state._bitsPerWord = to_spi_device(pdev)->bits_per_word;
+      }
    }
    else
    {
-      spi_device->max_speed_hz = SPI_BUS_SPEED;
-      spi_device->mode = SPI_MODE_0;
-      spi_device->bits_per_word = 8;
+      spi_device->max_speed_hz = bus_speed_hz;
+      spi_device->mode = spi_mode;
+      spi_device->bits_per_word = bits_per_word;
       spi_device->irq = -1;
       spi_device->controller_state = NULL;
       spi_device->controller_data = NULL;
@@ -194,6 +326,12 @@ int add_spimod_device_to_bus(void)
 
          printk(KERN_ALERT "spi_add_device() failed: %d\n", status);
       }
+      else
+      {
+         device_state._busSpeedHz = bus_speed_hz;
+         device_state._busMode = spi_mode;
+         device_state._bitsPerWord = bits_per_word;
+      }
    }
 
    put_device(&spi_master->dev);
@@ -201,6 +339,133 @@ int add_spimod_device_to_bus(void)
    return status;
 }
 
+#else
+
+int add_spimod_device_to_bus(void)
+{
+   struct device *pdev;
+   char buff[64];
+   int status = 0;
+
+   /* Controllers can no longer be looked up by bus number, so the device
+      must already be declared (device tree, board code or spi_loopback) */
+
+   snprintf(buff, sizeof(buff), "spi%d.%d", SPI_BUS, SPI_BUS_CS1);
+
+   pdev = bus_find_device_by_name(&spi_bus_type, NULL, buff);
+
+   if (!pdev)
+   {
+      printk(KERN_ALERT "SPI device %s not declared\n", buff);
+      printk(KERN_ALERT "Missing modprobe spi_loopback?\n");
+
+      return -1;
+   }
+
+   if (pdev->driver && pdev->driver->name &&
+       strcmp(this_driver_name, pdev->driver->name))
+   {
+      printk(KERN_ALERT "Driver [%s] already registered for %s\n",
+             pdev->driver->name, buff);
+
+      status = -1;
+   }
+   else if (NULL == device_state._spi_device)
+   {
+      printk(KERN_ALERT "%s is not bound - modalias should be %s\n",
+             buff, this_driver_name);
+
+      status = -1;
+   }
+   else if (spimod_bus_setup(bus_speed_hz, spi_mode, bits_per_word) < 0)
+   {
+      printk(KERN_ALERT "Unsupported bus_speed_hz, spi_mode or bits_per_word\n");
+
+      status = -1;
+   }
+
+   put_device(pdev);
+
+   return status;
+}
+
+#endif
+
+/******************************************************************************
+ *
+ * Function: spimod_bus_setup()
+ * Purpose:  Changes the bus clock, SPI mode and word size of the device.
+ *           The read / write timer must be stopped and no transfer in
+ *           flight.
+ *
+ * Parameters:
+ *
+ * - IN:     speedHz (the bus clock).
+ *           mode (SPI_MODE_0 to SPI_MODE_3).
+ *           bitsPerWord (8, 16 or 32).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 on success, -EINVAL for an unsupported setting, -ENODEV if
+ *           there is no device, or the error from spi_setup() (the previous
+ *           settings are kept).
+ *
+ * Globals:
+ *
+ * - device_state._spi_device (its settings changed).
+ * - device_state._busSpeedHz, _busMode, _bitsPerWord (set on success).
+ *
+ * ***************************************************************************/
+
+int spimod_bus_setup(
+   const u32 speedHz,
+   const u32 mode,
+   const u32 bitsPerWord)
+{
+   struct spi_device* spi_device = device_state._spi_device;
+   u32 oldSpeedHz, oldMode, oldBitsPerWord;
+   int status;
+
+   if (!spimod_bus_valid(speedHz, mode, bitsPerWord))
+   {
+      return -EINVAL;
+   }
+
+   if (NULL == spi_device)
+   {
+      return -ENODEV;
+   }
+
+   oldSpeedHz = spi_device->max_speed_hz;
+   oldMode = spi_device->mode;
+   oldBitsPerWord = spi_device->bits_per_word;
+
+   spi_device->max_speed_hz = speedHz;
+   spi_device->mode = (oldMode & ~(SPI_CPHA | SPI_CPOL)) | mode;
+   spi_device->bits_per_word = bitsPerWord;
+
+   status = spi_setup(spi_device);
+
+   if (status < 0)
+   {
+      printk(KERN_ALERT "spi_setup() failed: %d\n", status);
+
+      spi_device->max_speed_hz = oldSpeedHz;
+      spi_device->mode = oldMode;
+      spi_device->bits_per_word = oldBitsPerWord;
+
+      spi_setup(spi_device);
+
+      return status;
+   }
+
+   device_state._busSpeedHz = speedHz;
+   device_state._busMode = mode;
+   device_state._bitsPerWord = bitsPerWord;
+
+   return 0;
+}
+
 /******************************************************************************
  *
  * Function: spimod_completion_handler()
@@ -216,6 +481,12 @@ int add_spimod_device_to_bus(void)
  *
  * Globals:
  *
+ * - device_transaction._inPacket (returned to the pool, replaced by the
+ *   received packet).
+ * - device_transaction._rxPacket (cleared).
+ * - device_transaction._inPending (set to 1).
+ * - device_transaction._inPoll, _inSlip (set from _poll, _slip).
+ * - device_transaction._failed (set from the message's status).
  * - device_transaction._busy (set to 0).
  *
  * ***************************************************************************/
@@ -223,8 +494,30 @@ int add_spimod_device_to_bus(void)
 static void spimod_completion_handler(
    void* arg)
 {
+   u64 ns = ktime_to_ns(ktime_get()) - device_transaction._queuedNs;
+
    //printk(KERN_ALERT "spimod_completion_handler()\n");
 
+   device_state._statTransferNs += ns;
+
+   if (ns > device_state._statTransferMaxNs)
+   {
+      device_state._statTransferMaxNs = ns;
+   }
+
+   // The received packet becomes the inbound packet; the previous one (no
+   // longer referenced - the pump only reads it while no transfer is in
+   // flight) goes back to the pool
+
+   frame_pool_put(device_transaction._pool, device_transaction._inPacket);
+
+   device_transaction._inPacket = device_transaction._rxPacket;
+   device_transaction._rxPacket = NULL;
+   device_transaction._inPending = 1;
+   device_transaction._inPoll = device_transaction._poll;
+   device_transaction._inSlip = device_transaction._slip;
+   device_transaction._failed = (0 != device_transaction._msg.status);
+
    device_transaction._busy = 0;
 }
 
@@ -253,25 +546,79 @@ static void spimod_completion_handler(
  * - device_transaction._msg (initialised for the read / write).
  * - device_transaction._transfer (initialised for the read / write).
  * - device_transaction._transfer.tx_buf (set to point at the out packet).
- * - device_transaction._transfer.rx_buf (set to point at the in packet).
+ * - device_transaction._rxPacket (taken from the pool if not already held).
+ * - device_transaction._transfer.rx_buf (set to point at _rxPacket).
+ * - device_state._bitsPerWord (wider words transfer the padded frame).
+ * - device_transaction._poll (only the header is transferred if set).
+ * - device_transaction._slip (if set, the bytes transferred).
  * - device_transaction._busy (set to 1 on success).
+ * - device_transaction._failed (set on failure).
  *
  * ***************************************************************************/
 
 int spimod_queue_spi_read_write(void)
 {
+   struct frame_pool* pool = device_transaction._pool;
    int status = 0;
    unsigned long flags;
 
+   // Receive into a fresh packet so the last one can still be processed
+
+   if (NULL == device_transaction._rxPacket)
+   {
+      device_transaction._rxPacket = frame_pool_get(pool);
+
+      if (NULL == device_transaction._rxPacket)
+      {
+         device_transaction._failed = 1;
+
+         return -ENOMEM;
+      }
+   }
+
    spi_message_init(&device_transaction._msg);
 
    device_transaction._msg.complete = spimod_completion_handler;
    device_transaction._msg.context = NULL;
 
    device_transaction._transfer.tx_buf = device_transaction._outPacket;
-   device_transaction._transfer.rx_buf = device_transaction._inPacket;
+   device_transaction._transfer.rx_buf = device_transaction._rxPacket;
+
+#if SPIMOD_HAVE_IS_DMA_MAPPED
+   if (pool->_dmaDevice != NULL)
+   {
+      device_transaction._msg.is_dma_mapped = 1;
+
+      device_transaction._transfer.tx_dma =
+         frame_pool_dma(pool, device_transaction._outPacket);
+      device_transaction._transfer.rx_dma =
+         frame_pool_dma(pool, device_transaction._rxPacket);
+   }
+#endif
+
+   // Wider words need a whole number of them
+
+   device_transaction._transfer.len = PACKET_HEADER_SIZE;
+
+   if (!device_transaction._poll)
+   {
+      device_transaction._transfer.len += device_state._dataSize;
+   }
+
+   if (device_state._bitsPerWord > 8)
+   {
+      device_transaction._transfer.len =
+         (device_transaction._transfer.len + 3) & ~3U;
+   }
 
-   device_transaction._transfer.len = PACKET_SIZE;
+   // Whole words already
+
+   if (device_transaction._slip > 0)
+   {
+      device_transaction._transfer.len = device_transaction._slip;
+   }
+
+   device_transaction._queuedNs = ktime_to_ns(ktime_get());
 
    spi_message_add_tail(&device_transaction._transfer, &device_transaction._msg);
 
@@ -294,6 +641,8 @@ int spimod_queue_spi_read_write(void)
    }
    else
    {
+      device_transaction._failed = 1;
+
       printk(KERN_NOTICE "spimod_queue_spi_read_write() failed: %d\n", status);
    }
 
@@ -302,9 +651,8 @@ int spimod_queue_spi_read_write(void)
 
 /******************************************************************************
  *
- * Function: spimod_create_outbound_packet()
- * Purpose:  Initialises and populates the outbound packet with up to 
- *           PACKET_DATA_SIZE bytes from the transmit circular buffer.
+ * Function: spimod_packet_capacity()
+ * Purpose:  Returns the data an outbound packet can carry.
  *
  * Parameters:
  *
@@ -312,48 +660,189 @@ int spimod_queue_spi_read_write(void)
  * - OUT:    N/A
  * - IN/OUT: N/A
  *
- * Returns:  N/A
+ * Returns:  _dataSize, less PACKET_CRC_SIZE when _crc is set, less
+ *           PACKET_TRAILER_SIZE when retransmission is enabled, or the FEC
+ *           parity offset when error correction is.
  *
  * Globals:
  *
- * - device_state._txBuffer (used to populate the outgoing packet).
- * - device_transaction._outPacket (initialised and populated with data).
+ * - device_state._dataSize, _crc, _arq._window, _fec (read).
  *
  * ***************************************************************************/
 
-void spimod_create_outbound_packet(void)
+int spimod_packet_capacity(void)
+{
+   if (device_state._fec._t > 0)
+   {
+      return device_state._fec._offset;
+   }
+
+   if (device_state._arq._window > 0)
+   {
+      return device_state._dataSize - PACKET_TRAILER_SIZE;
+   }
+
+   return device_state._dataSize - (device_state._crc ? PACKET_CRC_SIZE : 0);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_channel_pending()
+ * Purpose:  Returns how many bytes a channel has ready to send.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  Bytes queued, including those of a bulk send (stream mode), or
+ *           of whole messages sendable (datagram mode), 0 if none.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static int spimod_channel_pending(
+   struct spimod_channel* chan)
+{
+   if (chan->_datagram)
+   {
+      return spimod_datagram_pending(chan);
+   }
+
+   if (spimod_bulk_active(chan))
+   {
+      return spimod_bulk_pending(chan);
+   }
+
+   return circular_buffer_num_bytes_available(chan->_txBuffer);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_stream_fill()
+ * Purpose:  Removes up to space bytes from a stream channel's transmit
+ *           circular buffer, or its bulk send under way.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           space (room left in the packet).
+ * - OUT:    data (where to copy the bytes).
+ * - IN/OUT: N/A
+ *
+ * Returns:  Number of bytes copied.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static int spimod_stream_fill(
+   struct spimod_channel* chan,
+   char* data,
+   const int space)
 {
-   /* Read data from the tx buffer into our outbound packet */
+   int len;
+
+   // What was queued after a bulk send waits for it to finish
+
+   if (spimod_bulk_active(chan))
+   {
+      len = spimod_bulk_fill(chan, data, space);
+
+      if (spimod_bulk_active(chan))
+      {
+         return len;
+      }
+
+      return len + circular_buffer_read(
+         chan->_txBuffer,
+         data + len,
+         min_t(int, circular_buffer_num_bytes_available(chan->_txBuffer),
+               space - len));
+   }
+
+   len = min_t(int, circular_buffer_num_bytes_available(chan->_txBuffer),
+               space);
+
+   return circular_buffer_read(chan->_txBuffer, data, len);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_channel_fill()
+ * Purpose:  Removes up to space bytes from a channel's transmit circular
+ *           buffer, or a bulk send under way, or the next fragment of a
+ *           message in datagram mode, and counts it framed (see
+ *           spi_cursor.h).  Writers waiting for room are woken once the
+ *           frame is done.
+ *
+ * Parameters:
+ *
+ * - IN:     chan (the channel).
+ *           space (room left in the packet).
+ * - OUT:    data (where to copy the bytes).
+ *           flags (PACKET_FLAG_FIRST / _LAST for a fragment, else 0).
+ * - IN/OUT: N/A
+ *
+ * Returns:  Number of bytes copied.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
 
-   int len = circular_buffer_num_bytes_available(device_state._txBuffer);
+static int spimod_channel_fill(
+   struct spimod_channel* chan,
+   char* data,
+   const int space,
+   short* flags)
+{
+   int len;
 
-   if (len > PACKET_DATA_SIZE)
+   if (chan->_datagram)
    {
-      len = PACKET_DATA_SIZE;
+      len = spimod_datagram_fragment(chan, data, space, flags);
    }
+   else
+   {
+      *flags = 0;
 
-   //printk(KERN_ALERT "Got %d bytes from tx buffer\n", len);
+      len = spimod_stream_fill(chan, data, space);
+   }
 
-   device_transaction._outPacket->_sync = PACKET_SYNC;
-   device_transaction._outPacket->_status = SLAVE_RX_UNABLE;
-   device_transaction._outPacket->_len = len;
+   if (len > 0)
+   {
+      spimod_cursor_framed(chan, len);
 
-   memset(device_transaction._outPacket->_data, 0, PACKET_DATA_SIZE);
+      chan->_wake = 1;
+   }
 
-   circular_buffer_read(device_state._txBuffer,
-                        device_transaction._outPacket->_data,
-                        len);
+   return len;
 }
 
 /******************************************************************************
  *
- * Function: spimod_process_inbound_packet()
- * Purpose:  Validates the received packet and adds its data (if any) into the
- *           receive circular buffer.
+ * Function: spimod_channel_deliver()
+ * Purpose:  Adds received bytes to a channel's receive circular buffer, or
+ *           reassembles them in datagram mode.  A priority message goes to
+ *           the priority receive buffer instead.  Bytes that do not fit
+ *           are dropped and counted.  Readers waiting for data are woken
+ *           once the frame is done.
  *
  * Parameters:
  *
- * - IN:     N/A
+ * - IN:     chan (the channel).
+ *           flags (PACKET_FLAG_FIRST / _LAST for a fragment,
+ *           PACKET_FLAG_PRIORITY for a priority message, else 0).
+ *           data (the bytes received).
+ *           len (number of bytes received).
  * - OUT:    N/A
  * - IN/OUT: N/A
  *
@@ -361,28 +850,1677 @@ void spimod_create_outbound_packet(void)
  *
  * Globals:
  *
- * - device_state._rxBuffer (expanded with data from the incoming packet).
- * - device_transaction._inPacket (validated and data extracted).
+ * - device_state._statRxDropped (updated).
  *
  * ***************************************************************************/
 
-void spimod_process_inbound_packet(void)
+static void spimod_channel_deliver(
+   struct spimod_channel* chan,
+   const short flags,
+   const char* data,
+   const int len)
 {
-   //printk (KERN_ALERT "Received %d bytes!\n", device_transaction._inPacket->_len);
+   int numWritten;
+
+   chan->_wake = 1;
+
+   if (flags & PACKET_FLAG_PRIORITY)
+   {
+      spimod_priority_deliver(chan, data, len);
 
-   if ((PACKET_SYNC == device_transaction._inPacket->_sync)
-    && (device_transaction._inPacket->_len <= PACKET_DATA_SIZE))
+      return;
+   }
+
+   if (chan->_datagram)
+   {
+      spimod_datagram_reassemble(chan, flags, data, len);
+
+      return;
+   }
+
+   numWritten = circular_buffer_write(chan->_rxBuffer, data, len);
+
+   if (numWritten != len)
    {
-      int numWritten;
+      device_state._statRxDropped += len - numWritten;
 
-      numWritten = circular_buffer_write(device_state._rxBuffer,
-                                         device_transaction._inPacket->_data,
-                                         device_transaction._inPacket->_len);
+      // Expected while a persistent channel is closed, so not logged then
 
-      if (numWritten != device_transaction._inPacket->_len)
+      if (chan->_openCount > 0)
       {
-         printk(KERN_ALERT "Rx buffer overflow - %d bytes\n",
-                device_transaction._inPacket->_len);
+         printk(KERN_ALERT "Rx buffer overflow - %d bytes\n", len);
       }
    }
 }
+
+/******************************************************************************
+ *
+ * Function: spimod_add_segment()
+ * Purpose:  Writes a segment header into the outbound packet.
+ *
+ * Parameters:
+ *
+ * - IN:     offset (where the segment starts).
+ *           channel (the channel the data is for).
+ *           flags (PACKET_FLAG_* for the data).
+ *           len (size of the data, already copied after the header).
+ * - OUT:    N/A
+ * - IN/OUT: pkt (the outbound packet).
+ *
+ * Returns:  The offset of the next segment.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static int spimod_add_segment(
+   struct packet* pkt,
+   const int offset,
+   const int channel,
+   const short flags,
+   const int len)
+{
+   struct packet_segment segment;
+
+   segment._channel = channel;
+   segment._flags = (flags >> 8) & 0xFF;
+   segment._len = len;
+
+   memcpy(pkt->_data + offset, &segment, SEGMENT_HEADER_SIZE);
+
+   return offset + SEGMENT_HEADER_SIZE + len;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_multiplex_outbound()
+ * Purpose:  Fills the outbound packet with segments.  Priority messages
+ *           that fit go first, whole, even if that splits a message being
+ *           sent from the normal buffers.  Each channel with normal data is
+ *           then given an equal share of the room left, and whatever
+ *           remains goes to the channels still with data in turn.  The
+ *           channel served first rotates with every packet, so no channel
+ *           can starve the others.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: pkt (the outbound packet, already initialised as empty).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._channels (their transmit buffers are read).
+ * - device_state._nextChannel (advanced).
+ *
+ * ***************************************************************************/
+
+static void spimod_multiplex_outbound(
+   struct packet* pkt)
+{
+   const int count = device_state._numChannels;
+   const int capacity = spimod_packet_capacity();
+   int pending[SPIMOD_MAX_CHANNELS];
+   int active = 0;
+   int offset = 0;
+   int share = 0;
+   int pass, i;
+
+   for (i = 0; i < count; ++i)
+   {
+      int c = (device_state._nextChannel + i) % count;
+      struct spimod_channel* chan = &device_state._channels[c];
+      int len;
+
+      while ((len = spimod_priority_fill(
+                       chan,
+                       pkt->_data + offset + SEGMENT_HEADER_SIZE,
+                       capacity - offset - SEGMENT_HEADER_SIZE)) > 0)
+      {
+         offset = spimod_add_segment(pkt, offset, c, PACKET_FLAG_PRIORITY, len);
+      }
+   }
+
+   for (i = 0; i < count; ++i)
+   {
+      pending[i] = spimod_channel_pending(&device_state._channels[i]);
+
+      if (pending[i] > 0)
+      {
+         ++active;
+      }
+   }
+
+   if (active > 0)
+   {
+      share = (capacity - offset) / active - SEGMENT_HEADER_SIZE;
+   }
+
+   for (pass = 0; pass < 2 && active > 0; ++pass)
+   {
+      for (i = 0; i < count; ++i)
+      {
+         int c = (device_state._nextChannel + i) % count;
+         struct spimod_channel* chan = &device_state._channels[c];
+         int space = capacity - offset - SEGMENT_HEADER_SIZE;
+         short flags;
+         int len;
+
+         if (0 == pass)
+         {
+            space = min(space, share);
+         }
+
+         if (0 == pending[c] || space <= 0)
+         {
+            continue;
+         }
+
+         len = spimod_channel_fill(chan,
+                                   pkt->_data + offset + SEGMENT_HEADER_SIZE,
+                                   space,
+                                   &flags);
+
+         pending[c] = spimod_channel_pending(chan);
+
+         if (len > 0)
+         {
+            offset = spimod_add_segment(pkt, offset, c, flags, len);
+         }
+      }
+   }
+
+   device_state._nextChannel = (device_state._nextChannel + 1) % count;
+
+   if (offset > 0)
+   {
+      pkt->_status |= PACKET_FLAG_CHANNELS;
+      pkt->_len = offset;
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_demultiplex_inbound()
+ * Purpose:  Delivers each segment of a multiplexed inbound packet to its
+ *           channel.  The rest of the packet is discarded, and counted in
+ *           _statSegmentErrors, at the first segment that is out of bounds
+ *           or addressed to a channel that does not exist.
+ *
+ * Parameters:
+ *
+ * - IN:     pkt (the inbound packet, already validated).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._channels (their receive buffers are added to).
+ * - device_state._statSegmentErrors (updated).
+ *
+ * ***************************************************************************/
+
+static void spimod_demultiplex_inbound(
+   const struct packet* pkt)
+{
+   int offset = 0;
+
+   while (offset < pkt->_len)
+   {
+      struct packet_segment segment;
+
+      if (offset + SEGMENT_HEADER_SIZE > pkt->_len)
+      {
+         ++device_state._statSegmentErrors;
+
+         return;
+      }
+
+      memcpy(&segment, pkt->_data + offset, SEGMENT_HEADER_SIZE);
+
+      offset += SEGMENT_HEADER_SIZE;
+
+      if (segment._channel >= device_state._numChannels
+       || offset + segment._len > pkt->_len)
+      {
+         ++device_state._statSegmentErrors;
+
+         return;
+      }
+
+      spimod_channel_deliver(&device_state._channels[segment._channel],
+                             (short)(segment._flags << 8),
+                             pkt->_data + offset,
+                             segment._len);
+
+      offset += segment._len;
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_deliver_inbound()
+ * Purpose:  Delivers the data of a validated inbound packet: a multiplexed
+ *           packet is split between the channels, any other is for
+ *           channel 0.  Called directly, or by spimod_arq_receive() once
+ *           the packet is in order.
+ *
+ * Parameters:
+ *
+ * - IN:     context (unused).
+ *           pkt (the inbound packet).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._channels (their receive buffers are added to).
+ *
+ * ***************************************************************************/
+
+static void spimod_deliver_inbound(
+   void* context,
+   const struct packet* pkt)
+{
+   if (pkt->_status & PACKET_FLAG_CHANNELS)
+   {
+      spimod_demultiplex_inbound(pkt);
+   }
+   else
+   {
+      spimod_channel_deliver(&device_state._channels[0],
+                             pkt->_status,
+                             pkt->_data,
+                             pkt->_len);
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_features()
+ * Purpose:  Returns the SPIMOD_FEATURE_ flags of the options in use.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The flags.
+ *
+ * Globals:
+ *
+ * - device_state._crc, _arq._window, _fec._t (read).
+ *
+ * ***************************************************************************/
+
+static u32 spimod_features(void)
+{
+   u32 features = 0;
+
+   if (device_state._crc)
+   {
+      features |= SPIMOD_FEATURE_CRC;
+   }
+
+   if (device_state._arq._window > 0)
+   {
+      features |= SPIMOD_FEATURE_ARQ;
+   }
+
+   if (device_state._fec._t > 0)
+   {
+      features |= SPIMOD_FEATURE_FEC;
+   }
+
+   return features;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_resize()
+ * Purpose:  Changes the data each frame carries, and with it where the
+ *           trailers and parity go.
+ *
+ * Parameters:
+ *
+ * - IN:     dataSize (from PACKET_DATA_SIZE to PACKET_DATA_MAX).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._dataSize (set).
+ * - device_state._arq, _fec (resized).
+ *
+ * ***************************************************************************/
+
+static void spimod_resize(
+   const u32 dataSize)
+{
+   device_state._dataSize = dataSize;
+
+   spimod_arq_resize(&device_state._arq, dataSize);
+   spimod_fec_resize(&device_state._fec, dataSize);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_handshake_start()
+ * Purpose:  Returns to PACKET_DATA_SIZE frames and, if _maxData allows
+ *           larger ones, starts the handshake with the slave.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._maxData (read).
+ * - device_state._dataSize (reset).
+ * - device_state._helloLeft, _peerVersion, _peerFeatures (set).
+ *
+ * ***************************************************************************/
+
+void spimod_handshake_start(void)
+{
+   spimod_resize(PACKET_DATA_SIZE);
+
+   device_state._helloLeft =
+      (device_state._maxData > PACKET_DATA_SIZE) ? HELLO_FRAMES : 0;
+   device_state._peerVersion = 0;
+   device_state._peerFeatures = 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_handshake_receive()
+ * Purpose:  Handles a hello from the slave: while the handshake is under
+ *           way, switches to the frame size both ends support.  Hellos
+ *           still in flight once it has are ignored.
+ *
+ * Parameters:
+ *
+ * - IN:     pkt (the inbound packet, flagged PACKET_FLAG_HELLO).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._helloLeft (cleared once agreed).
+ * - device_state._peerVersion, _peerFeatures (set).
+ * - device_state._dataSize (agreed).
+ * - device_state._statCrcErrors (updated).
+ *
+ * ***************************************************************************/
+
+static void spimod_handshake_receive(
+   const struct packet* pkt)
+{
+   struct packet_hello hello;
+
+   if (!spimod_hello_parse(pkt, &hello))
+   {
+      ++device_state._statCrcErrors;
+
+      return;
+   }
+
+   if (0 == device_state._helloLeft)
+   {
+      return;
+   }
+
+   device_state._helloLeft = 0;
+   device_state._peerVersion = hello._version;
+   device_state._peerFeatures = hello._features;
+
+   spimod_resize(spimod_hello_agree(device_state._maxData, hello._maxData));
+
+   printk(KERN_NOTICE "spimod: slave protocol %u, using %u byte frames\n",
+          hello._version, PACKET_HEADER_SIZE + device_state._dataSize);
+
+   if (hello._features != spimod_features())
+   {
+      printk(KERN_NOTICE "spimod: slave features 0x%x, ours 0x%x\n",
+             hello._features, spimod_features());
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_create_outbound_packet()
+ * Purpose:  Initialises and populates the outbound packet with up to 
+ *           spimod_packet_capacity() bytes from the transmit circular
+ *           buffer, or the next fragment of a message in datagram mode.
+ *           With more than one channel, or priority messages to send, the
+ *           packet is divided into segments (see
+ *           spimod_multiplex_outbound()).  With retransmission enabled a
+ *           packet due to be resent takes precedence, and nothing new is
+ *           sent while the window is full.  When _crc is set the finished
+ *           packet is sealed with its CRC, and with _fec enabled its parity
+ *           is added last.  While the handshake is under way a hello is
+ *           sent instead (see spimod_handshake_start()).
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._channels (their transmit buffers are used to populate
+ *   the outgoing packet).
+ * - device_state._crc (read).
+ * - device_state._arq (packets resent, numbered and acknowledged).
+ * - device_state._channels (_txFramedAt recorded for a newly numbered
+ *   packet).
+ * - device_state._fec (parity added).
+ * - device_state._dataSize (read).
+ * - device_state._helloLeft (decremented while the handshake is sent).
+ * - device_transaction._outPacket (initialised and populated with data).
+ *
+ * ***************************************************************************/
+
+void spimod_create_outbound_packet(void)
+{
+   struct packet* pkt = device_transaction._outPacket;
+   struct spimod_channel* chan = &device_state._channels[0];
+   struct spimod_arq* arq = &device_state._arq;
+   int fill = 1;
+
+   if (device_state._helloLeft > 0)
+   {
+      spimod_hello_build(pkt, SLAVE_RX_UNABLE, device_state._maxData,
+                         spimod_features());
+
+      if (0 == --device_state._helloLeft)
+      {
+         printk(KERN_NOTICE "spimod: no handshake from the slave, "
+                            "using %u byte frames\n", PACKET_SIZE);
+      }
+
+      spimod_capture_packet(SPIMOD_CAPTURE_TX, pkt);
+
+      return;
+   }
+
+   pkt->_sync = PACKET_SYNC;
+   pkt->_status = SLAVE_RX_UNABLE;
+   pkt->_len = 0;
+
+   memset(pkt->_data, 0, device_state._dataSize);
+
+   if (arq->_window > 0)
+   {
+      fill = !spimod_arq_resend(arq, pkt) && spimod_arq_window_open(arq);
+   }
+
+   if (!fill)
+   {
+      // Resending, or waiting for the peer to acknowledge
+   }
+   else if (device_state._numChannels > 1
+    || circular_buffer_num_bytes_available(chan->_txPriority) > 0)
+   {
+      spimod_multiplex_outbound(pkt);
+   }
+   else
+   {
+      short flags;
+
+      /* Read data from the tx buffer into our outbound packet */
+
+      pkt->_len = spimod_channel_fill(chan,
+                                      pkt->_data,
+                                      spimod_packet_capacity(),
+                                      &flags);
+      pkt->_status |= flags;
+   }
+
+   if (arq->_window > 0)
+   {
+      const u16 next = arq->_next;
+
+      spimod_arq_stamp(arq, pkt);
+
+      // A packet newly numbered is acknowledged with what it carries
+
+      if (arq->_next != next)
+      {
+         spimod_cursor_stamp(next);
+      }
+   }
+
+   if (device_state._crc)
+   {
+      spimod_packet_seal(pkt, device_state._dataSize);
+   }
+
+   if (device_state._fec._t > 0)
+   {
+      spimod_fec_encode(&device_state._fec, pkt);
+   }
+
+   //printk(KERN_ALERT "Got %d bytes from tx buffer\n", pkt->_len);
+
+   spimod_capture_packet(SPIMOD_CAPTURE_TX, pkt);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_process_inbound_packet()
+ * Purpose:  Validates the received packet and adds its data (if any) into the
+ *           receive circular buffer, reassembling messages in datagram mode.
+ *           A multiplexed packet is split between the channels; any other
+ *           packet is for channel 0.  Packets with a bad sync word or
+ *           length, or a bad CRC, are counted and discarded.  A packet
+ *           flagged PACKET_FLAG_CRC is checked even when _crc is not set.
+ *           With retransmission enabled, packets flagged PACKET_FLAG_ARQ
+ *           go through spimod_arq_receive() and are delivered in order.
+ *           With error correction enabled the packet is corrected in place
+ *           first, unless it passes its CRC, and discarded if it cannot be.
+ *           A hello goes to spimod_handshake_receive() instead.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._channels (receive buffers expanded with data from the
+ *   incoming packet).
+ * - device_state._crc (read).
+ * - device_state._arq (acknowledgements and packets held).
+ * - device_state._fec (corrections counted).
+ * - device_state._statBadFrames, _statCrcErrors (updated).
+ * - device_state._dataSize (read).
+ * - device_transaction._inPacket (validated and data extracted).
+ *
+ * ***************************************************************************/
+
+void spimod_process_inbound_packet(void)
+{
+   struct packet* pkt = device_transaction._inPacket;
+
+   //printk (KERN_ALERT "Received %d bytes!\n", pkt->_len);
+
+   spimod_capture_packet(SPIMOD_CAPTURE_RX, pkt);
+
+   // Hellos are never encoded, whatever has been agreed
+
+   if (pkt->_status & PACKET_FLAG_HELLO)
+   {
+      spimod_handshake_receive(pkt);
+
+      return;
+   }
+
+   // Captured as received.  Checking the CRC costs far less than
+   // decoding, so only packets that fail it are decoded.
+
+   if (device_state._fec._t > 0
+    && !(device_state._crc && spimod_packet_verify(pkt, device_state._dataSize))
+    && spimod_fec_decode(&device_state._fec, pkt) < 0)
+   {
+      return;
+   }
+
+   if ((PACKET_SYNC != pkt->_sync)
+    || (pkt->_len > device_state._dataSize)
+    || ((pkt->_status & PACKET_FLAG_ARQ)
+     && pkt->_len > device_state._dataSize - PACKET_TRAILER_SIZE))
+   {
+      ++device_state._statBadFrames;
+
+      return;
+   }
+
+   if ((device_state._crc || (pkt->_status & PACKET_FLAG_CRC))
+    && !spimod_packet_verify(pkt, device_state._dataSize))
+   {
+      ++device_state._statCrcErrors;
+
+      return;
+   }
+
+   if (device_state._arq._window > 0 && (pkt->_status & PACKET_FLAG_ARQ))
+   {
+      spimod_arq_receive(&device_state._arq, pkt, spimod_deliver_inbound, NULL);
+   }
+   else
+   {
+      spimod_deliver_inbound(NULL, pkt);
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_frames_init()
+ * Purpose:  Creates the frame pool and takes the outbound and inbound
+ *           packets from it, DMA-coherent if possible.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 on success, -1 on failure.
+ *
+ * Globals:
+ *
+ * - device_state._spi_device (its controller's DMA device is used).
+ * - device_state._maxData (frames are allocated to carry as much).
+ * - device_transaction._pool (created).
+ * - device_transaction._outPacket, _inPacket (taken from the pool).
+ *
+ * ***************************************************************************/
+
+int spimod_frames_init(void)
+{
+   struct device* dev = NULL;
+   int count = max(frame_pool_size, MIN_FRAMES);
+   unsigned int size = (PACKET_HEADER_SIZE + device_state._maxData + 3) & ~3U;
+
+#if SPIMOD_HAVE_IS_DMA_MAPPED
+   if (dma_coherent && device_state._spi_device != NULL)
+   {
+      dev = spimod_controller_of(device_state._spi_device)->dev.parent;
+   }
+#endif
+
+   if (dev != NULL)
+   {
+      device_transaction._pool = frame_pool_init(dev, count, size);
+
+      if (NULL == device_transaction._pool)
+      {
+         printk(KERN_NOTICE "dma_alloc_coherent() failed - using kmalloc()\n");
+      }
+   }
+
+   if (NULL == device_transaction._pool)
+   {
+      device_transaction._pool = frame_pool_init(NULL, count, size);
+   }
+
+   if (NULL == device_transaction._pool)
+   {
+      return -1;
+   }
+
+   device_transaction._outPacket = frame_pool_get(device_transaction._pool);
+   device_transaction._inPacket = frame_pool_get(device_transaction._pool);
+   device_transaction._rxPacket = NULL;
+   device_transaction._inPending = 0;
+
+   memset(device_transaction._outPacket, 0, size);
+   memset(device_transaction._inPacket, 0, size);
+
+   return 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_frames_term()
+ * Purpose:  Destroys the pool created by spimod_frames_init().
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_transaction._pool (destroyed).
+ * - device_transaction._outPacket, _inPacket, _rxPacket (cleared).
+ *
+ * ***************************************************************************/
+
+void spimod_frames_term(void)
+{
+   frame_pool_term(device_transaction._pool);
+
+   device_transaction._pool = NULL;
+   device_transaction._outPacket = NULL;
+   device_transaction._inPacket = NULL;
+   device_transaction._rxPacket = NULL;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_resources_acquire()
+ * Purpose:  Allocates the transmit and receive circular buffers of every
+ *           channel, the frame pool and the retransmission window, if not
+ *           already allocated.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 on success, -1 on failure (nothing left allocated).
+ *
+ * Globals:
+ *
+ * - device_state._channels (buffers created at their _txBufferSize and
+ *   _rxBufferSize).
+ * - device_transaction._pool (created).
+ * - device_state._arq (window allocated for arq_window packets).
+ * - device_state._fec (tables built for fec bytes per codeword).
+ * - device_state._idleFrames (set to idle_frames).
+ *
+ * ***************************************************************************/
+
+int spimod_resources_acquire(void)
+{
+   u32 i;
+
+   device_state._idleFrames = idle_frames;
+
+   for (i = 0; i < device_state._numChannels; ++i)
+   {
+      struct spimod_channel* chan = &device_state._channels[i];
+
+      if (NULL == chan->_txBuffer)
+      {
+         chan->_txBuffer = circular_buffer_init(chan->_txBufferSize);
+      }
+
+      if (NULL == chan->_rxBuffer)
+      {
+         chan->_rxBuffer = circular_buffer_init(chan->_rxBufferSize);
+      }
+
+      if (NULL == chan->_txPriority)
+      {
+         chan->_txPriority = circular_buffer_init(PRIORITY_BUFFER_SIZE);
+      }
+
+      if (NULL == chan->_rxPriority)
+      {
+         chan->_rxPriority = circular_buffer_init(PRIORITY_BUFFER_SIZE);
+      }
+
+      if ((NULL == chan->_txBuffer)
+       || (NULL == chan->_rxBuffer)
+       || (NULL == chan->_txPriority)
+       || (NULL == chan->_rxPriority))
+      {
+         printk(KERN_ALERT "circular_buffer_init() failed tx = %p rx = %p\n",
+                chan->_txBuffer,
+                chan->_rxBuffer);
+
+         spimod_resources_release();
+
+         return -1;
+      }
+   }
+
+   if (NULL == device_transaction._pool)
+   {
+      // The packets are allocated against the probed device's controller
+
+      if (spimod_frames_init() < 0)
+      {
+         printk(KERN_ALERT "spimod_frames_init() failed\n");
+
+         spimod_resources_release();
+
+         return -1;
+      }
+
+      printk(KERN_ALERT "Using %s frames\n",
+             device_transaction._pool->_dmaDevice ? "DMA-coherent"
+                                                   : "kmalloc()");
+   }
+
+   if (arq_window > 0 && NULL == device_state._arq._frames)
+   {
+      if (spimod_arq_init(&device_state._arq, arq_window, arq_timeout,
+                          device_state._maxData) < 0)
+      {
+         printk(KERN_ALERT "spimod_arq_init() failed\n");
+
+         spimod_resources_release();
+
+         return -1;
+      }
+   }
+
+   if (fec > 0 && NULL == device_state._fec._tables)
+   {
+      if (spimod_fec_init(&device_state._fec, fec) < 0)
+      {
+         printk(KERN_ALERT "spimod_fec_init() failed\n");
+
+         spimod_resources_release();
+
+         return -1;
+      }
+   }
+
+   return 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_resources_release()
+ * Purpose:  Frees everything allocated by spimod_resources_acquire().
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._channels (their buffers destroyed).
+ * - device_transaction._pool (destroyed).
+ * - device_state._arq (window freed, packets held are lost).
+ * - device_state._fec (tables freed).
+ *
+ * ***************************************************************************/
+
+void spimod_resources_release(void)
+{
+   u32 i;
+
+   for (i = 0; i < SPIMOD_MAX_CHANNELS; ++i)
+   {
+      struct spimod_channel* chan = &device_state._channels[i];
+
+      circular_buffer_term(chan->_txBuffer);
+      circular_buffer_term(chan->_rxBuffer);
+      circular_buffer_term(chan->_txPriority);
+      circular_buffer_term(chan->_rxPriority);
+
+      chan->_txBuffer = NULL;
+      chan->_rxBuffer = NULL;
+      chan->_txPriority = NULL;
+      chan->_rxPriority = NULL;
+
+      chan->_kept = 0;
+   }
+
+   spimod_frames_term();
+
+   spimod_arq_term(&device_state._arq);
+
+   spimod_fec_term(&device_state._fec);
+}
+
+/* debugfs files for state that only exists while the device is in use */
+
+static int spimod_stats_pool_get(void* data, u64* val)
+{
+   if (down_interruptible(&device_state._fop_sem))
+   {
+      return -ERESTARTSYS;
+   }
+
+   *val = 0;
+
+   if (device_transaction._pool != NULL)
+   {
+      *val = *(u32*)((char*)device_transaction._pool + (size_t)data);
+   }
+
+   up(&device_state._fop_sem);
+
+   return 0;
+}
+
+static int spimod_stats_pool_set(void* data, u64 val)
+{
+   if (down_interruptible(&device_state._fop_sem))
+   {
+      return -ERESTARTSYS;
+   }
+
+   if (device_transaction._pool != NULL)
+   {
+      *(u32*)((char*)device_transaction._pool + (size_t)data) = (u32)val;
+   }
+
+   up(&device_state._fop_sem);
+
+   return 0;
+}
+
+static int spimod_stats_memory_get(void* data, u64* val)
+{
+   struct frame_pool* pool;
+   u32 i;
+
+   if (down_interruptible(&device_state._fop_sem))
+   {
+      return -ERESTARTSYS;
+   }
+
+   pool = device_transaction._pool;
+
+   *val = 0;
+
+   for (i = 0; i < device_state._numChannels; ++i)
+   {
+      struct spimod_channel* chan = &device_state._channels[i];
+
+      if (chan->_txBuffer != NULL)
+      {
+         *val += chan->_txBuffer->_capacity;
+      }
+
+      if (chan->_rxBuffer != NULL)
+      {
+         *val += chan->_rxBuffer->_capacity;
+      }
+
+      if (chan->_txPriority != NULL)
+      {
+         *val += chan->_txPriority->_capacity + chan->_rxPriority->_capacity;
+      }
+   }
+
+   if (pool != NULL)
+   {
+      *val += (u64)pool->_stride * pool->_count;
+   }
+
+   *val += 2 * device_state._arq._window
+         * (sizeof(struct spimod_arq_frame) + PACKET_HEADER_SIZE
+            + device_state._arq._maxData);
+
+   if (device_state._fec._tables != NULL)
+   {
+      *val += sizeof(struct spimod_fec_tables);
+   }
+
+   up(&device_state._fop_sem);
+
+   return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(spimod_stats_pool_fops,
+                        spimod_stats_pool_get, spimod_stats_pool_set, "%llu\n");
+DEFINE_SIMPLE_ATTRIBUTE(spimod_stats_memory_fops,
+                        spimod_stats_memory_get, NULL, "%llu\n");
+
+/******************************************************************************
+ *
+ * Function: spimod_stats_init()
+ * Purpose:  Publishes the pump statistics in debugfs.
+ *
+ * Parameters:
+ *
+ * - IN:     parent (the driver's debugfs directory, may be NULL).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._stat* (published).
+ * - device_transaction._pool (its counters published, 0 while released).
+ * - device_state._channels (their buffer capacities published).
+ *
+ * ***************************************************************************/
+
+void spimod_stats_init(
+   struct dentry* parent)
+{
+   if (IS_ERR_OR_NULL(parent))
+   {
+      return;
+   }
+
+   debugfs_create_u64("frames", 0644, parent, &device_state._statFrames);
+   debugfs_create_u64("pump_ns", 0644, parent, &device_state._statPumpNs);
+   debugfs_create_u64("pump_max_ns", 0644, parent,
+                      &device_state._statPumpMaxNs);
+   debugfs_create_u64("transfer_ns", 0644, parent,
+                      &device_state._statTransferNs);
+   debugfs_create_u64("transfer_max_ns", 0644, parent,
+                      &device_state._statTransferMaxNs);
+   debugfs_create_u32("datagram_errors", 0644, parent,
+                      &device_state._statDatagramErrors);
+   debugfs_create_u32("datagram_dropped", 0644, parent,
+                      &device_state._statDatagramDropped);
+   debugfs_create_u32("segment_errors", 0644, parent,
+                      &device_state._statSegmentErrors);
+   debugfs_create_u64("priority_messages", 0644, parent,
+                      &device_state._statPriorityMessages);
+   debugfs_create_u64("priority_ns", 0644, parent,
+                      &device_state._statPriorityNs);
+   debugfs_create_u64("priority_max_ns", 0644, parent,
+                      &device_state._statPriorityMaxNs);
+   debugfs_create_u32("priority_dropped", 0644, parent,
+                      &device_state._statPriorityDropped);
+   debugfs_create_u32("bad_frames", 0644, parent,
+                      &device_state._statBadFrames);
+   debugfs_create_u32("crc_errors", 0644, parent,
+                      &device_state._statCrcErrors);
+   debugfs_create_u32("arq_retransmits", 0644, parent,
+                      &device_state._arq._retransmits);
+   debugfs_create_u32("arq_duplicates", 0644, parent,
+                      &device_state._arq._duplicates);
+   debugfs_create_u32("arq_lost", 0644, parent, &device_state._arq._lost);
+   debugfs_create_u32("arq_resyncs", 0644, parent,
+                      &device_state._arq._resyncs);
+   debugfs_create_u32("fec_corrected", 0644, parent,
+                      &device_state._fec._corrected);
+   debugfs_create_u32("fec_repaired", 0644, parent,
+                      &device_state._fec._repaired);
+   debugfs_create_u32("fec_failed", 0644, parent, &device_state._fec._failed);
+   debugfs_create_u32("frame_size", 0444, parent, &device_state._dataSize);
+   debugfs_create_u32("peer_version", 0444, parent,
+                      &device_state._peerVersion);
+   debugfs_create_x32("peer_features", 0444, parent,
+                      &device_state._peerFeatures);
+   debugfs_create_u64("timer_wakeups", 0644, parent,
+                      &device_state._statTimerWakeups);
+   debugfs_create_u64("idle_polls", 0644, parent,
+                      &device_state._statIdlePolls);
+   debugfs_create_u32("idle_entries", 0644, parent,
+                      &device_state._statIdleEntries);
+   debugfs_create_u32("idle", 0444, parent, &device_state._idle);
+   debugfs_create_u64("rx_dropped", 0644, parent,
+                      &device_state._statRxDropped);
+   debugfs_create_u32("resyncs", 0644, parent, &device_state._statResyncs);
+   debugfs_create_u32("slips", 0644, parent, &device_state._statSlips);
+   debugfs_create_u32("bulk_sends", 0644, parent,
+                      &device_state._statBulkSends);
+   debugfs_create_u64("bulk_bytes", 0644, parent,
+                      &device_state._statBulkBytes);
+
+   // The pool comes and goes, so its counters are read through it
+
+   debugfs_create_file("frames_available", 0444, parent,
+                       (void*)offsetof(struct frame_pool, _available),
+                       &spimod_stats_pool_fops);
+   debugfs_create_file("frames_low", 0644, parent,
+                       (void*)offsetof(struct frame_pool, _lowWater),
+                       &spimod_stats_pool_fops);
+   debugfs_create_file("frames_exhausted", 0644, parent,
+                       (void*)offsetof(struct frame_pool, _exhausted),
+                       &spimod_stats_pool_fops);
+
+   debugfs_create_file("memory_bytes", 0444, parent, NULL,
+                       &spimod_stats_memory_fops);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_tx_pending()
+ * Purpose:  Returns whether any channel has data or priority messages
+ *           waiting to be sent.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  1 if there is anything to send, else 0.
+ *
+ * Globals:
+ *
+ * - device_state._channels (their transmit and priority buffers read).
+ *
+ * ***************************************************************************/
+
+static int spimod_tx_pending(void)
+{
+   u32 c;
+
+   for (c = 0; c < device_state._numChannels; ++c)
+   {
+      struct spimod_channel* chan = &device_state._channels[c];
+
+      if (spimod_channel_pending(chan) > 0
+       || circular_buffer_num_bytes_available(chan->_txPriority) > 0)
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_idle_exit()
+ * Purpose:  Returns the pump to full frames.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._idle, _idleCount (cleared).
+ *
+ * ***************************************************************************/
+
+static void spimod_idle_exit(void)
+{
+   WRITE_ONCE(device_state._idle, 0);
+   device_state._idleCount = 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_idle_update()
+ * Purpose:  Counts frames in a row with nothing sent or received, and goes
+ *           idle after _idleFrames of them.  A frame is only quiet if the
+ *           handshake is over and nothing is waiting to be sent or
+ *           acknowledged, so nothing is left undone while idle.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_transaction._outPacket, _inPacket (read).
+ * - device_state._arq (checked for unacknowledged packets).
+ * - device_state._idleFrames (read).
+ * - device_state._idle, _idleCount (updated).
+ * - device_state._statIdleEntries (updated).
+ *
+ * ***************************************************************************/
+
+static void spimod_idle_update(void)
+{
+   const struct packet* out = device_transaction._outPacket;
+   const struct packet* in = device_transaction._inPacket;
+
+   if (0 == device_state._idleFrames || device_state._idle)
+   {
+      return;
+   }
+
+   if ((out->_len != 0) || (out->_status & PACKET_FLAG_HELLO)
+    || (PACKET_SYNC != in->_sync) || (in->_len != 0)
+    || (in->_status & PACKET_FLAG_HELLO)
+    || (device_state._arq._base != device_state._arq._next)
+    || spimod_tx_pending())
+   {
+      device_state._idleCount = 0;
+
+      return;
+   }
+
+   if (++device_state._idleCount >= device_state._idleFrames)
+   {
+      WRITE_ONCE(device_state._idle, 1);
+
+      ++device_state._statIdleEntries;
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_create_poll_packet()
+ * Purpose:  Initialises the outbound packet as an empty header, all that
+ *           is transferred while the pump is idle.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_transaction._outPacket (header initialised).
+ * - device_state._statIdlePolls (updated).
+ *
+ * ***************************************************************************/
+
+static void spimod_create_poll_packet(void)
+{
+   struct packet* pkt = device_transaction._outPacket;
+
+   pkt->_sync = PACKET_SYNC;
+   pkt->_status = SLAVE_RX_UNABLE;
+   pkt->_len = 0;
+
+   ++device_state._statIdlePolls;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_process_poll_reply()
+ * Purpose:  Checks the header the slave returned to a poll: one announcing
+ *           data, or not a header at all, returns the pump to full frames,
+ *           which carry the data (the slave keeps it for them) or count the
+ *           bad frame.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_transaction._inPacket (its header read).
+ * - device_state._idle, _idleCount (cleared if the slave is not idle).
+ *
+ * ***************************************************************************/
+
+static void spimod_process_poll_reply(void)
+{
+   const struct packet* pkt = device_transaction._inPacket;
+
+   if ((PACKET_SYNC != pkt->_sync) || (pkt->_len != 0))
+   {
+      spimod_idle_exit();
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_resync()
+ * Purpose:  Recovers from losing sync with the slave.  A slave that has
+ *           slipped still sends whole packets, just not where they are
+ *           expected, so the received frame is searched for a sync word
+ *           followed by a plausible length, at whole words from its
+ *           start; a transfer of that many bytes then realigns the frames.
+ *           If there is none the slave is taken to have restarted and the
+ *           handshake starts again.  Retransmission is left alone, as this
+ *           may be wrong: spimod_arq_receive() takes up the numbering of a
+ *           slave that really restarted from its trailers.
+ *
+ * Parameters:
+ *
+ * - IN:     pkt (the inbound packet, as received).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._dataSize, _bitsPerWord (read).
+ * - device_state._slipPending (set if the slave has slipped).
+ * - device_state._statResyncs, _statSlips (updated).
+ *
+ * ***************************************************************************/
+
+static void spimod_resync(
+   const struct packet* pkt)
+{
+   const u8* bytes = (const u8*)pkt;
+   const u32 size = PACKET_HEADER_SIZE + device_state._dataSize;
+   const u32 word = max_t(u32, device_state._bitsPerWord / 8, 1);
+   u32 offset;
+
+   ++device_state._statResyncs;
+
+   for (offset = word; offset + PACKET_HEADER_SIZE <= size; offset += word)
+   {
+      unsigned short sync, len;
+
+      memcpy(&sync, bytes + offset + offsetof(struct packet, _sync),
+             sizeof(sync));
+      memcpy(&len, bytes + offset + offsetof(struct packet, _len),
+             sizeof(len));
+
+      if (PACKET_SYNC == sync && len <= device_state._dataSize)
+      {
+         device_state._slipPending = offset;
+
+         ++device_state._statSlips;
+
+         return;
+      }
+   }
+
+   spimod_idle_exit();
+
+   spimod_handshake_start();
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_sync_update()
+ * Purpose:  Counts inbound frames in a row without a sync word, and
+ *           resynchronises after every RESYNC_FRAMES of them.  Logs the
+ *           loss and the recovery once each.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_transaction._inPacket (its sync word read).
+ * - device_state._syncLost (updated).
+ *
+ * ***************************************************************************/
+
+static void spimod_sync_update(void)
+{
+   const struct packet* pkt = device_transaction._inPacket;
+
+   if (PACKET_SYNC == pkt->_sync)
+   {
+      if (device_state._syncLost >= RESYNC_FRAMES)
+      {
+         printk(KERN_NOTICE "spimod: sync with the slave regained after "
+                            "%u frames\n", device_state._syncLost);
+      }
+
+      device_state._syncLost = 0;
+
+      return;
+   }
+
+   if (0 == ++device_state._syncLost % RESYNC_FRAMES)
+   {
+      if (RESYNC_FRAMES == device_state._syncLost)
+      {
+         printk(KERN_NOTICE "spimod: lost sync with the slave\n");
+      }
+
+      spimod_resync(pkt);
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_create_slip_packet()
+ * Purpose:  Clears the header of the outbound packet for a transfer of
+ *           _slip bytes, so the slave does not take its end as a packet.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_transaction._outPacket (header cleared).
+ *
+ * ***************************************************************************/
+
+static void spimod_create_slip_packet(void)
+{
+   memset(device_transaction._outPacket, 0, PACKET_HEADER_SIZE);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_wake_channels()
+ * Purpose:  Wakes whoever waits on each channel that the last frame sent
+ *           from or delivered to, once per frame rather than per segment.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._channels (_wake cleared, _wait woken).
+ *
+ * ***************************************************************************/
+
+static void spimod_wake_channels(void)
+{
+   u32 c;
+
+   for (c = 0; c < device_state._numChannels; ++c)
+   {
+      struct spimod_channel* chan = &device_state._channels[c];
+
+      if (chan->_wake)
+      {
+         chan->_wake = 0;
+
+         wake_up_interruptible(&chan->_wait);
+      }
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_pump()
+ * Purpose:  Performs one step of the read / write pump: populates the
+ *           outbound packet, queues the transaction and processes the
+ *           packet received by the previous one (if not yet processed).
+ *           Does nothing if the previous transaction is still in progress.
+ *           While idle only headers are exchanged, until either end has
+ *           data again.  Frames received without a sync word for a while
+ *           resynchronise the link (see spimod_resync()).
+ *
+ *           Called from the timer callback in spi_core.c (and by the user
+ *           space simulation in sim/).
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_transaction._busy (checks to see if a read / write transaction is
+ *   already in progress).
+ * - device_transaction._inPending (cleared once the inbound packet has been
+ *   processed).
+ * - device_transaction._poll (set while idle).
+ * - device_transaction._slip (set from _slipPending, which is cleared).
+ * - device_state._idle (entered and left).
+ * - device_state._syncLost (updated).
+ * - device_state._channels (transmit cursors advanced, readers and writers
+ *   woken).
+ *
+ * ***************************************************************************/
+
+void spimod_pump(void)
+{
+   if (!device_transaction._busy)
+   {
+      u64 start = ktime_to_ns(ktime_get());
+      u64 ns;
+
+      // The last frame, if any, has been clocked out
+
+      spimod_cursor_transmitted();
+
+      // Data may have been queued as the pump went idle, without a wake
+
+      if (device_state._idle && spimod_tx_pending())
+      {
+         spimod_idle_exit();
+      }
+
+      device_transaction._slip = device_state._slipPending;
+      device_transaction._poll = device_state._idle;
+
+      device_state._slipPending = 0;
+
+      if (device_transaction._slip > 0)
+      {
+         spimod_create_slip_packet();
+      }
+      else if (device_transaction._poll)
+      {
+         spimod_create_poll_packet();
+      }
+      else
+      {
+         spimod_create_outbound_packet();
+      }
+
+      spimod_queue_spi_read_write();
+
+      if (device_transaction._inPending)
+      {
+         if (device_transaction._inSlip)
+         {
+            // Neither end's frame
+         }
+         else if (device_transaction._inPoll)
+         {
+            spimod_process_poll_reply();
+         }
+         else
+         {
+            spimod_sync_update();
+
+            spimod_process_inbound_packet();
+
+            spimod_idle_update();
+         }
+
+         device_transaction._inPending = 0;
+      }
+
+      spimod_cursor_acknowledge();
+
+      spimod_wake_channels();
+
+      ns = ktime_to_ns(ktime_get()) - start;
+
+      device_state._statFrames++;
+      device_state._statPumpNs += ns;
+
+      if (ns > device_state._statPumpMaxNs)
+      {
+         device_state._statPumpMaxNs = ns;
+      }
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_pump_interval()
+ * Purpose:  Returns the time to the next step of the pump.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The timer period, or idle_poll_ms while idle.
+ *
+ * Globals:
+ *
+ * - device_state._idle (read).
+ * - device_state._timer_period_s, _timer_period_ns (read).
+ *
+ * ***************************************************************************/
+
+ktime_t spimod_pump_interval(void)
+{
+   if (device_state._idle && idle_poll_ms > 0)
+   {
+      return ns_to_ktime((u64)idle_poll_ms * NSEC_PER_MSEC);
+   }
+
+   return ktime_set(device_state._timer_period_s, device_state._timer_period_ns);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_pump_wake()
+ * Purpose:  Returns an idle pump to full frames and runs it now.  The pump
+ *           only changes _idle from the timer callback, so it is stopped
+ *           while _idle is cleared.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._idle, _idleCount (cleared).
+ * - device_state._timer_running (read).
+ * - device_state._timer (stopped, then restarted to expire at once).
+ *
+ * ***************************************************************************/
+
+void spimod_pump_wake(void)
+{
+   if (!READ_ONCE(device_state._idle))
+   {
+      return;
+   }
+
+   if (device_state._timer_running)
+   {
+      hrtimer_cancel(&device_state._timer);
+   }
+
+   spimod_idle_exit();
+
+   if (device_state._timer_running)
+   {
+      hrtimer_start(&device_state._timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+   }
+}
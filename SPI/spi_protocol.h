@@ -12,15 +12,25 @@
 #define SPI_PROTOCOL_H
 
 #include "circular_buffer.h"
+#include "frame_pool.h"
 
 #include <linux/spi/spi.h>
 #include <linux/semaphore.h>
 #include <linux/cdev.h>
 #include <linux/hrtimer.h>
+#include <linux/debugfs.h>
+#include <linux/dma-mapping.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+
+/* Every frame carries PACKET_DATA_SIZE bytes of data until the handshake
+   at open (see spi_hello.h) agrees on more, up to PACKET_DATA_MAX */
 
 #define PACKET_DATA_SIZE		1540
+#define PACKET_DATA_MAX			8186
 
-/* The packet used for the SPI transmit / receive interaction */
+/* The packet used for the SPI transmit / receive interaction, of which only
+   the header and the _data of the frame size in use are transferred */
 
 #pragma pack(1)
 
@@ -29,7 +39,7 @@ struct packet
    unsigned short		_sync;
    short               		_status;
    unsigned short		_len;
-   unsigned char		_data[PACKET_DATA_SIZE];
+   unsigned char		_data[PACKET_DATA_MAX];
 };
 
 #pragma pack()
@@ -43,6 +53,211 @@ struct spimod_transaction
    struct packet*		_outPacket;
    struct packet*		_inPacket;
    u32				_busy;
+   // Set when the last frame could not be queued or its transfer failed,
+   // so its data was never clocked out
+   u32				_failed;
+   // Frames, from _pool: _rxPacket receives the transfer in flight, then
+   // replaces _inPacket on completion (setting _inPending)
+   struct frame_pool*		_pool;
+   struct packet*		_rxPacket;
+   u32				_inPending;
+   // While idle the transfer is a header-only poll (_poll), and so was
+   // the one that received _inPacket (_inPoll); a transfer of _slip bytes
+   // realigns the frames with the slave's
+   u32				_poll;
+   u32				_inPoll;
+   u32				_slip;
+   u32				_inSlip;
+   // Statistics
+   u64				_queuedNs;
+};
+
+/* A logical channel, published as its own minor device with its own
+   buffers.  With more than one channel the packet data is a sequence of
+   segments, each addressed to one channel */
+
+#define SPIMOD_MAX_CHANNELS		8
+
+/* Numbered packets whose _txFramed each channel keeps until acknowledged
+   (see spi_cursor.c), more than a retransmission window and one */
+
+#define SPIMOD_CURSOR_SLOTS		32
+
+struct spimod_channel
+{
+   dev_t			_devt;
+   struct cdev			_cdev;
+   u32				_openCount;
+   // Set by the last close when persistent, so the next open keeps what
+   // was received in between
+   u32				_kept;
+   // Buffers, allocated on first open and released when idle
+   struct circular_buffer*      _txBuffer;
+   struct circular_buffer*	_rxBuffer;
+   u32				_txBufferSize;
+   u32				_rxBufferSize;
+   // Message-oriented mode (see spi_datagram.c): bytes of the message
+   // being sent, complete messages held and the message being reassembled
+   u32				_datagram;
+   u32				_txRemaining;
+   atomic_t			_rxMessages;
+   u32				_rxActive;
+   u32				_rxPartial;
+   u32				_rxLength;
+   // Priority lane (see spi_priority.c), sent ahead of everything above
+   struct circular_buffer*	_txPriority;
+   struct circular_buffer*	_rxPriority;
+   atomic_t			_rxPriorityMessages;
+   // Bulk send (see spi_bulk.c): _bulkLen bytes from pinned user pages,
+   // starting _bulkOffset into the first, sent after the _bulkAfter bytes
+   // queued before it; _bulkWork unpins them once all are _bulkSent
+   struct page**		_bulkPages;
+   u32				_bulkNumPages;
+   u32				_bulkOffset;
+   u32				_bulkLen;
+   u32				_bulkSent;
+   u32				_bulkAfter;
+   struct work_struct		_bulkWork;
+   // Readers, writers and poll() wait on _wait, woken by the pump after
+   // each frame that set _wake
+   wait_queue_head_t		_wait;
+   u32				_wake;
+   // Transmit cursors (see spi_cursor.c): bytes ever queued, put into
+   // frames, clocked out and acknowledged, with _txFramed as of each
+   // numbered packet.  Atomic, as the pump updates them in interrupt
+   // context while the file operations read them
+   atomic64_t			_txQueued;
+   atomic64_t			_txFramed;
+   atomic64_t			_txSent;
+   atomic64_t			_txAcked;
+   u64				_txFramedAt[SPIMOD_CURSOR_SLOTS];
+   // Bytes that will never be sent, which the others pass over, and the
+   // cursors either side of the last run of them, under _txLock
+   atomic64_t			_txDiscarded;
+   spinlock_t			_txLock;
+   u64				_txDiscardFrom;
+   u64				_txDiscardTo;
+};
+
+/* The header of each segment of a multiplexed packet, followed by _len
+   bytes of data for _channel.  _flags holds PACKET_FLAG_FIRST / _LAST or
+   PACKET_FLAG_PRIORITY shifted down by 8 bits. */
+
+#pragma pack(1)
+
+struct packet_segment
+{
+   unsigned char		_channel;
+   unsigned char		_flags;
+   unsigned short		_len;
+};
+
+#pragma pack()
+
+/* The trailer of a packet flagged PACKET_FLAG_ARQ, at PACKET_ARQ_OFFSET in
+   _data.  _seq numbers a packet carrying data (flagged PACKET_FLAG_SEQ),
+   _base is the oldest packet the sender may still resend, _ack the next
+   packet expected from the peer and bit N of _sack acknowledges packet
+   _ack + 1 + N, already received out of order. */
+
+#pragma pack(1)
+
+struct packet_arq
+{
+   unsigned short		_seq;
+   unsigned short		_base;
+   unsigned short		_ack;
+   unsigned short		_sack;
+};
+
+#pragma pack()
+
+/* The handshake carried at the start of _data by a packet flagged
+   PACKET_FLAG_HELLO (see spi_hello.h): the protocol version, the most
+   data a frame may carry and the SPIMOD_FEATURE_ flags of the sender */
+
+#pragma pack(1)
+
+struct packet_hello
+{
+   unsigned short		_version;
+   unsigned short		_maxData;
+   unsigned int			_features;
+};
+
+#pragma pack()
+
+/* A packet held by the retransmission window (see spi_arq.c): sent and
+   not yet acknowledged, or received ahead of a lost one */
+
+struct spimod_arq_frame
+{
+   u32				_valid;
+   u32				_sentAt;
+   u16				_seq;
+};
+
+/* Selective-repeat retransmission state, one per end of the link */
+
+#define SPIMOD_ARQ_MAX_WINDOW		16
+
+struct spimod_arq
+{
+   u32				_window;
+   u32				_timeout;
+   u32				_dataSize;
+   // Each slot in _frames keeps its packet in _packets, sized for frames
+   // of up to _maxData
+   struct spimod_arq_frame*	_frames;
+   u8*				_packets;
+   u32				_maxData;
+   u32				_ticks;
+   // Sending: _base is the oldest packet not yet acknowledged
+   u16				_base;
+   u16				_next;
+   // Receiving; _adopt takes _expected from the next trailer
+   u16				_expected;
+   u32				_adopt;
+   // Statistics
+   u32				_retransmits;
+   u32				_duplicates;
+   u32				_lost;
+   u32				_resyncs;
+};
+
+/* Forward error correction lookup tables (see spi_fec.c): powers and
+   logarithms of the generator of GF(2^8), the first doubled so a sum of
+   two logarithms needs no reduction, and each possible feedback byte
+   times the code's generator polynomial, as the 2 * _t parity bytes
+   packed into words */
+
+#define SPIMOD_FEC_MAX_T		16
+#define SPIMOD_FEC_MAX_SYMBOLS		255
+#define SPIMOD_FEC_WORDS		(2 * SPIMOD_FEC_MAX_T / 8)
+
+struct spimod_fec_tables
+{
+   u8				_exp[2 * SPIMOD_FEC_MAX_SYMBOLS];
+   u8				_log[SPIMOD_FEC_MAX_SYMBOLS + 1];
+   u64				_encode[256][SPIMOD_FEC_WORDS];
+};
+
+/* Forward error correction state, one per end of the link.  _symbols and
+   _parity hold the codeword being coded. */
+
+struct spimod_fec
+{
+   u32				_t;
+   u32				_dataSize;
+   u32				_codewords;
+   u32				_offset;
+   struct spimod_fec_tables*	_tables;
+   // Statistics
+   u32				_corrected;
+   u32				_repaired;
+   u32				_failed;
+   u8				_symbols[SPIMOD_FEC_MAX_SYMBOLS];
+   u8				_parity[2 * SPIMOD_FEC_MAX_T];
 };
 
 /* The device driver state */
@@ -52,18 +267,71 @@ struct spimod_device_state
    spinlock_t			_spi_lock;
    struct semaphore		_fop_sem;
    struct semaphore		_spi_sem;
-   dev_t			_devt;
-   struct cdev			_cdev;
    struct class*		_class;
    struct spi_device*		_spi_device;
+   // Bus settings, applied to _spi_device by spimod_bus_setup()
+   u32				_busSpeedHz;
+   u32				_busMode;
+   u32				_bitsPerWord;
+   // Frames carry _dataSize bytes of data, at most _maxData, as agreed
+   // with the slave by the handshake, which is sent for _helloLeft more
+   // packets
+   u32				_dataSize;
+   u32				_maxData;
+   u32				_helloLeft;
+   u32				_peerVersion;
+   u32				_peerFeatures;
    // Timer
    struct hrtimer		_timer;
    u32				_timer_period_s;
    u32				_timer_period_ns;
    u32				_timer_running;
-   // Buffers
-   struct circular_buffer*      _txBuffer;
-   struct circular_buffer*	_rxBuffer;
+   // Idle: after _idleFrames (0 never) frames with nothing to send or
+   // receive, counted in _idleCount, the pump only polls the slave's
+   // header, at a lower rate, while _idle
+   u32				_idleFrames;
+   u32				_idle;
+   u32				_idleCount;
+   // Sync: inbound frames in a row without PACKET_SYNC, and the bytes the
+   // next transfer is to be to realign with a slave that has slipped
+   u32				_syncLost;
+   u32				_slipPending;
+   // Channels; _nextChannel is served first in the next packet
+   struct spimod_channel	_channels[SPIMOD_MAX_CHANNELS];
+   u32				_numChannels;
+   u32				_nextChannel;
+   u32				_openCount;
+   struct delayed_work		_releaseWork;
+   // Diagnostics
+   struct dentry*		_debugfs;
+   u64				_statFrames;
+   u64				_statPumpNs;
+   u64				_statPumpMaxNs;
+   u64				_statTransferNs;
+   u64				_statTransferMaxNs;
+   u32				_statDatagramErrors;
+   u32				_statDatagramDropped;
+   u32				_statSegmentErrors;
+   u64				_statPriorityMessages;
+   u64				_statPriorityNs;
+   u64				_statPriorityMaxNs;
+   u32				_statPriorityDropped;
+   u64				_statTimerWakeups;
+   u64				_statIdlePolls;
+   u32				_statIdleEntries;
+   u64				_statRxDropped;
+   u32				_statResyncs;
+   u32				_statSlips;
+   u32				_statBulkSends;
+   u64				_statBulkBytes;
+   // Integrity: _crc protects every packet (see spi_crc.h), _arq
+   // resends those lost (see spi_arq.h) and _fec repairs those damaged
+   // (see spi_fec.h)
+   u32				_crc;
+   struct spimod_arq		_arq;
+   struct spimod_fec		_fec;
+   u32				_statBadFrames;
+   u32				_statCrcErrors;
 };
 
 /* The SPI slave state */
@@ -79,7 +347,52 @@ typedef enum
 
 static const unsigned short PACKET_SYNC	= 0xA5A5;
 
-static const unsigned int PACKET_SIZE   = sizeof(struct packet);
+/* The low byte of _status carries the slave state, the high byte flags
+   message fragments in datagram mode, multiplexed packets, packets
+   protected by a CRC (see spi_crc.h) or acknowledged (see spi_arq.h) and
+   the handshake (see spi_hello.h) */
+
+static const short PACKET_STATUS_MASK	= 0x00FF;
+static const short PACKET_FLAG_FIRST	= 0x0100;
+static const short PACKET_FLAG_LAST	= 0x0200;
+static const short PACKET_FLAG_CHANNELS	= 0x0400;
+static const short PACKET_FLAG_PRIORITY	= 0x0800;
+static const short PACKET_FLAG_CRC	= 0x1000;
+static const short PACKET_FLAG_ARQ	= 0x2000;
+static const short PACKET_FLAG_SEQ	= 0x4000;
+static const short PACKET_FLAG_HELLO	= (short)0x8000;
+
+/* Features announced by the handshake, which both ends should share */
+
+static const u32 SPIMOD_FEATURE_CRC	= 0x0001;
+static const u32 SPIMOD_FEATURE_ARQ	= 0x0002;
+static const u32 SPIMOD_FEATURE_FEC	= 0x0004;
+
+static const int PACKET_HEADER_SIZE	= offsetof(struct packet, _data);
+
+static const int PACKET_CRC_SIZE	= sizeof(u32);
+
+/* The ARQ trailer sits just before the CRC at the end of the data,
+   whether or not there is one */
+
+static const int PACKET_TRAILER_SIZE	= sizeof(u32) + sizeof(struct packet_arq);
+
+static const int SEGMENT_HEADER_SIZE	= sizeof(struct packet_segment);
+
+static const int PRIORITY_BUFFER_SIZE	= 1024 * 4;
+static const int PRIORITY_MAX_SIZE	= PACKET_DATA_SIZE
+                                          - sizeof(struct packet_segment);
+
+static const unsigned int PACKET_SIZE   = offsetof(struct packet, _data)
+                                          + PACKET_DATA_SIZE;
+static const unsigned int PACKET_MAX_SIZE = sizeof(struct packet);
+
+/* Frames are allocated, and transferred when words are wider than a byte,
+   padded to a whole number of the widest (32 bit) words.  Larger frames
+   are agreed as whole words. */
+
+static const unsigned int PACKET_FRAME_SIZE = (offsetof(struct packet, _data)
+                                               + PACKET_DATA_SIZE + 3) & ~3U;
 
 static const int SPI_BUS_CS1		= 1;
 static const int SPI_BUS_SPEED		= 4000000;
@@ -87,6 +400,8 @@ static const int SPI_BUS_SPEED		= 4000000;
 static const int WRITE_FREQUENCY	= 1000;
 static const int NANOSECS_PER_SEC	= 1000000000;
 
+static const unsigned int MAX_BUFFER_SIZE = 1024 * 1024 * 64;
+
 /* End of Constants */
 
 /******************************************************************************
@@ -149,12 +464,44 @@ int spimod_remove(
  *
  * Globals:
  *
- * - N/A
+ * - device_state._busSpeedHz, _busMode, _bitsPerWord (set from the module
+ *   parameters).
  *
  * ***************************************************************************/
 
 int add_spimod_device_to_bus(void);
 
+/******************************************************************************
+ *
+ * Function: spimod_bus_setup()
+ * Purpose:  Changes the bus clock, SPI mode and word size of the device.
+ *           The read / write timer must be stopped and no transfer in
+ *           flight.
+ *
+ * Parameters:
+ *
+ * - IN:     speedHz (the bus clock).
+ *           mode (SPI_MODE_0 to SPI_MODE_3).
+ *           bitsPerWord (8, 16 or 32).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 on success, -EINVAL for an unsupported setting, -ENODEV if
+ *           there is no device, or the error from spi_setup() (the previous
+ *           settings are kept).
+ *
+ * Globals:
+ *
+ * - device_state._spi_device (its settings changed).
+ * - device_state._busSpeedHz, _busMode, _bitsPerWord (set on success).
+ *
+ * ***************************************************************************/
+
+int spimod_bus_setup(
+   const u32 speedHz,
+   const u32 mode,
+   const u32 bitsPerWord);
+
 /******************************************************************************
  *
  * Function: spimod_queue_spi_read_write()
@@ -181,17 +528,49 @@ int add_spimod_device_to_bus(void);
  * - device_transaction._transfer (initialised for the read / write).
  * - device_transaction._transfer.tx_buf (set to point at the out packet).
  * - device_transaction._transfer.rx_buf (set to point at the in packet).
+ * - device_state._dataSize (the frame size transferred).
+ * - device_state._bitsPerWord (wider words transfer the padded frame).
  * - device_transaction._busy (set to 1 on success).
  *
  * ***************************************************************************/
 
 int spimod_queue_spi_read_write(void);
 
+/******************************************************************************
+ *
+ * Function: spimod_packet_capacity()
+ * Purpose:  Returns the data an outbound packet can carry: _dataSize,
+ *           less the CRC trailer when packets are protected, the ARQ
+ *           and CRC trailers when they are acknowledged, and the FEC parity
+ *           and both trailers when they are error corrected.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The capacity in bytes.
+ *
+ * Globals:
+ *
+ * - device_state._dataSize, _crc, _arq._window, _fec._t (read).
+ *
+ * ***************************************************************************/
+
+int spimod_packet_capacity(void);
+
 /******************************************************************************
  *
  * Function: spimod_create_outbound_packet()
  * Purpose:  Initialises and populates the outbound packet with up to 
- *           PACKET_DATA_SIZE bytes from the transmit circular buffer.
+ *           spimod_packet_capacity() bytes from the transmit circular
+ *           buffer.  With more than one channel the packet carries a
+ *           segment for each channel with data, each channel first getting
+ *           an equal share and the channel served first rotating every
+ *           packet.  When _crc is set the packet is sealed with its CRC,
+ *           and when _fec is enabled it is then encoded.  While the
+ *           handshake is under way the packet is a hello instead.
  *
  * Parameters:
  *
@@ -203,7 +582,9 @@ int spimod_queue_spi_read_write(void);
  *
  * Globals:
  *
- * - device_state._txBuffer (used to populate the outgoing packet).
+ * - device_state._channels (their transmit buffers are used to populate
+ *   the outgoing packet).
+ * - device_state._helloLeft (decremented while the handshake is sent).
  * - device_transaction._outPacket (initialised and populated with data).
  *
  * ***************************************************************************/
@@ -214,7 +595,13 @@ void spimod_create_outbound_packet(void);
  *
  * Function: spimod_process_inbound_packet()
  * Purpose:  Validates the received packet and adds its data (if any) into the
- *           receive circular buffer.
+ *           receive circular buffer of its channel (channel 0 unless the
+ *           packet is flagged PACKET_FLAG_CHANNELS).  When _fec is enabled
+ *           a packet that does not pass its CRC is first corrected, and
+ *           discarded if it cannot be.  A packet with a bad sync word or
+ *           length is counted in _statBadFrames, one that fails its CRC (or
+ *           lacks one when _crc is set) in _statCrcErrors, and either is
+ *           discarded.  A hello from the slave completes the handshake.
  *
  * Parameters:
  *
@@ -226,11 +613,282 @@ void spimod_create_outbound_packet(void);
  *
  * Globals:
  *
- * - device_state._rxBuffer (expanded with data from the incoming packet).
+ * - device_state._channels (receive buffers expanded with data from the
+ *   incoming packet).
+ * - device_state._crc (read).
+ * - device_state._fec (the packet is corrected in place).
+ * - device_state._dataSize (agreed by the handshake).
+ * - device_state._statBadFrames, _statCrcErrors, _statSegmentErrors
+ *   (rejected packets and malformed segments counted).
  * - device_transaction._inPacket (validated and data extracted).
  *
  * ***************************************************************************/
 
 void spimod_process_inbound_packet(void);
 
+/******************************************************************************
+ *
+ * Function: spimod_handshake_start()
+ * Purpose:  Returns to frames of PACKET_DATA_SIZE and, when _maxData
+ *           (set from max_frame_size) allows larger ones, has the next
+ *           packets sent be hellos (see spi_hello.h) until the slave
+ *           answers with its own or a few have gone unanswered.  Both ends
+ *           then use the largest frame both support, and the features the
+ *           slave announced are published in debugfs.  Called on open, with
+ *           the timer stopped, and by the pump if the slave seems to have
+ *           restarted.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._maxData (read).
+ * - device_state._dataSize (reset, and agreed later).
+ * - device_state._helloLeft, _peerVersion, _peerFeatures (set).
+ * - device_state._arq, _fec (resized with the frames).
+ *
+ * ***************************************************************************/
+
+void spimod_handshake_start(void);
+
+/******************************************************************************
+ *
+ * Function: spimod_frames_init()
+ * Purpose:  Creates the pool of frame_pool_size packets the transactions
+ *           use and takes the outbound and inbound packets from it.  If the
+ *           SPI controller has a DMA device (and dma_coherent is set) the
+ *           pool is DMA-coherent and every transfer is marked
+ *           is_dma_mapped, so the controller does no per-transfer mapping
+ *           or cache maintenance.  Otherwise the frames are kmalloc()ed and
+ *           mapped by the controller as before.
+ *
+ *           Must be called after the device has been probed.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 on success, -1 on failure.
+ *
+ * Globals:
+ *
+ * - device_state._spi_device (its controller's DMA device is used).
+ * - device_transaction._pool (created).
+ * - device_transaction._outPacket, _inPacket (taken from the pool).
+ *
+ * ***************************************************************************/
+
+int spimod_frames_init(void);
+
+/******************************************************************************
+ *
+ * Function: spimod_frames_term()
+ * Purpose:  Destroys the pool created by spimod_frames_init().
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_transaction._pool (destroyed).
+ * - device_transaction._outPacket, _inPacket, _rxPacket (cleared).
+ *
+ * ***************************************************************************/
+
+void spimod_frames_term(void);
+
+/******************************************************************************
+ *
+ * Function: spimod_resources_acquire()
+ * Purpose:  Allocates the transmit and receive circular buffers of every
+ *           channel and the frame pool, if not already allocated.
+ *           Nothing is allocated until the device is first opened.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  0 on success, -1 on failure (nothing left allocated).
+ *
+ * Globals:
+ *
+ * - device_state._channels (buffers created at their _txBufferSize and
+ *   _rxBufferSize).
+ * - device_transaction._pool (created).
+ * - device_state._idleFrames (set to the idle_frames module parameter).
+ *
+ * ***************************************************************************/
+
+int spimod_resources_acquire(void);
+
+/******************************************************************************
+ *
+ * Function: spimod_resources_release()
+ * Purpose:  Frees everything allocated by spimod_resources_acquire().  The
+ *           timer must be stopped and no transfer in flight.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._channels (their buffers destroyed).
+ * - device_transaction._pool (destroyed).
+ *
+ * ***************************************************************************/
+
+void spimod_resources_release(void);
+
+/******************************************************************************
+ *
+ * Function: spimod_stats_init()
+ * Purpose:  Publishes the pump statistics in debugfs: frames pumped, the
+ *           total and worst CPU time spent in the pump, and the total and
+ *           worst time from queueing a transfer to its completion, the
+ *           frame pool's free, lowest free and exhausted counts, the bytes
+ *           of buffer and frame memory currently allocated, datagrams
+ *           discarded as incomplete or for lack of space, bytes with no
+ *           room in a receive buffer, the frame size and slave features
+ *           agreed by the handshake, the timer wakeups and header-only
+ *           polls of the pump while idle, and the link resynchronised.
+ *           Writing 0 to a counter resets it.
+ *
+ * Parameters:
+ *
+ * - IN:     parent (the driver's debugfs directory, may be NULL).
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._stat* (published).
+ * - device_transaction._pool (its counters published).
+ *
+ * ***************************************************************************/
+
+void spimod_stats_init(
+   struct dentry* parent);
+
+/******************************************************************************
+ *
+ * Function: spimod_pump()
+ * Purpose:  Performs one step of the read / write pump: populates the
+ *           outbound packet, queues the transaction and processes the
+ *           packet received by the previous one (if not yet processed).
+ *           Does nothing if the previous transaction is still in progress.
+ *
+ *           After _idleFrames frames in a row with nothing sent or
+ *           received, nothing left to send and nothing unacknowledged, the
+ *           pump goes idle: each step then only clocks a packet header
+ *           each way, and spimod_pump_interval() lengthens to
+ *           idle_poll_ms.  A slave header announcing data, data queued to
+ *           send or spimod_pump_wake() returns to full frames.
+ *
+ *           After every 4 frames in a row received without a sync word the
+ *           link is resynchronised.  If a sync word is found further into
+ *           the frame the slave has slipped, and the next transfer is only
+ *           as long as that offset, which realigns the frames.  Otherwise
+ *           the slave is taken to have restarted and the handshake starts
+ *           again.
+ *
+ *           Called from the timer callback in spi_core.c (and by the user
+ *           space simulation in sim/).
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_transaction._busy (checks to see if a read / write transaction is
+ *   already in progress).
+ * - device_transaction._inPending (cleared once the inbound packet has been
+ *   processed).
+ * - device_transaction._poll, _inPoll (whether the transfers are polls).
+ * - device_transaction._slip, _inSlip (whether they realign the frames).
+ * - device_state._idle, _idleCount (updated).
+ * - device_state._syncLost, _slipPending (updated).
+ * - device_state._statResyncs, _statSlips (updated).
+ * - device_state._statIdlePolls, _statIdleEntries (updated).
+ *
+ * ***************************************************************************/
+
+void spimod_pump(void);
+
+/******************************************************************************
+ *
+ * Function: spimod_pump_interval()
+ * Purpose:  Returns the time to the next step of the pump, for the timer
+ *           callback to forward the timer by.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  The timer period, or idle_poll_ms while the pump is idle.
+ *
+ * Globals:
+ *
+ * - device_state._idle (read).
+ * - device_state._timer_period_s, _timer_period_ns (read).
+ *
+ * ***************************************************************************/
+
+ktime_t spimod_pump_interval(void);
+
+/******************************************************************************
+ *
+ * Function: spimod_pump_wake()
+ * Purpose:  Called once data has been queued to send: if the pump is idle,
+ *           returns it to full frames and runs it straight away rather than
+ *           at the next poll.  Does nothing otherwise.
+ *
+ *           Safe to call with the timer callback running; data queued as
+ *           the pump goes idle is still sent, at the next poll at worst.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: N/A
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - device_state._idle, _idleCount (cleared).
+ * - device_state._timer (restarted, if running and not in its callback).
+ *
+ * ***************************************************************************/
+
+void spimod_pump_wake(void);
+
 #endif
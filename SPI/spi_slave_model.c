@@ -0,0 +1,531 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_slave_model
+ *
+ * Purpose:     A software model of the SPI slave, speaking the packet
+ *              protocol of spi_protocol.c.  Used by the loopback controller
+ *              (spi_loopback.c) so the driver can be exercised without the
+ *              LEC-3517 board.
+ *
+ * ***************************************************************************/
+
+#include "spi_slave_model.h"
+#include "spi_crc.h"
+#include "spi_arq.h"
+#include "spi_fec.h"
+#include "spi_hello.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+
+#define __NO_VERSION__
+
+/* Each frame echoed is held in the FIFO behind its fragment flags and
+   length, so it is returned exactly as received */
+
+struct spimod_slave_record
+{
+   short			_flags;
+   unsigned short		_len;
+};
+
+static const int RECORD_SIZE = sizeof(struct spimod_slave_record);
+
+/******************************************************************************
+ *
+ * Function: spimod_slave_init()
+ * Purpose:  Initialises a slave model with a receive FIFO of fifoSize bytes.
+ *
+ * Parameters:
+ *
+ * - IN:     fifoSize (bytes the slave can hold for echoing).
+ * - OUT:    N/A
+ * - IN/OUT: slave (the slave to initialise).
+ *
+ * Returns:  0 on success, -1 on failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_slave_init(
+   struct spimod_slave* slave,
+   const int fifoSize)
+{
+   memset(slave, 0, sizeof(struct spimod_slave));
+
+   slave->_model = SLAVE_MODEL_ECHO;
+   slave->_generatorBytes = PACKET_DATA_SIZE;
+   slave->_maxData = PACKET_DATA_SIZE;
+   slave->_dataSize = PACKET_DATA_SIZE;
+
+   slave->_fifo = circular_buffer_init(fifoSize);
+
+   return (NULL == slave->_fifo) ? -1 : 0;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_slave_term()
+ * Purpose:  Releases the resources of a slave model.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: slave (the slave to terminate).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_slave_term(
+   struct spimod_slave* slave)
+{
+   circular_buffer_term(slave->_fifo);
+
+   slave->_fifo = NULL;
+
+   spimod_arq_term(&slave->_arq);
+   spimod_fec_term(&slave->_fec);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_slave_reset()
+ * Purpose:  Restarts the slave as after a reset of the real one.
+ *
+ * Parameters:
+ *
+ * - IN:     bootFrames (frames before it answers again).
+ * - OUT:    N/A
+ * - IN/OUT: slave (the slave to reset).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_slave_reset(
+   struct spimod_slave* slave,
+   const unsigned int bootFrames)
+{
+   circular_buffer_reset(slave->_fifo);
+
+   slave->_replyValid = 0;
+   slave->_hello = 0;
+   slave->_pattern = 0;
+   slave->_bootFrames = bootFrames;
+
+   slave->_dataSize = PACKET_DATA_SIZE;
+
+   spimod_arq_resize(&slave->_arq, PACKET_DATA_SIZE);
+   spimod_fec_resize(&slave->_fec, PACKET_DATA_SIZE);
+
+   // Numbered from 0 again, and ready for the master's numbers
+
+   if (slave->_arq._frames != NULL)
+   {
+      memset(slave->_arq._frames, 0,
+             2 * slave->_arq._window * sizeof(struct spimod_arq_frame));
+   }
+
+   slave->_arq._base = 0;
+   slave->_arq._next = 0;
+   slave->_arq._expected = 0;
+
+   spimod_arq_resync(&slave->_arq);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_slave_seal_reply()
+ * Purpose:  Completes the prepared reply with its ARQ trailer, CRC and FEC
+ *           parity, as configured, and marks it ready to send.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: slave (the slave to use).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static void spimod_slave_seal_reply(
+   struct spimod_slave* slave)
+{
+   if (slave->_arq._window > 0)
+   {
+      spimod_arq_stamp(&slave->_arq, &slave->_reply);
+   }
+
+   if (slave->_crc)
+   {
+      spimod_packet_seal(&slave->_reply, slave->_dataSize);
+   }
+
+   if (slave->_fec._t > 0)
+   {
+      spimod_fec_encode(&slave->_fec, &slave->_reply);
+   }
+
+   slave->_replyValid = 1;
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_slave_prepare_reply()
+ * Purpose:  Builds the packet the slave will clock out on the next transfer,
+ *           a hello if the master sent one.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: slave (the slave to use).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static void spimod_slave_prepare_reply(
+   struct spimod_slave* slave)
+{
+   struct packet* reply = &slave->_reply;
+   struct spimod_slave_record record = { 0, 0 };
+   slaveModelType model = slave->_model;
+   int capacity = (slave->_arq._window > 0)
+                     ? slave->_dataSize - PACKET_TRAILER_SIZE
+                     : slave->_dataSize - (slave->_crc ? PACKET_CRC_SIZE : 0);
+   short status;
+   int len = 0;
+   int i;
+
+   if (slave->_fec._t > 0)
+   {
+      capacity = slave->_fec._offset;
+   }
+
+   memset(reply, 0, PACKET_HEADER_SIZE + slave->_dataSize);
+
+   status = (slave->_fifo->_capacity - slave->_fifo->_size
+                >= RECORD_SIZE + slave->_dataSize)
+               ? SLAVE_RX_ABLE : SLAVE_RX_UNABLE;
+
+   if (slave->_hello)
+   {
+      u32 features = slave->_crc ? SPIMOD_FEATURE_CRC : 0;
+
+      if (slave->_arq._window > 0)
+      {
+         features |= SPIMOD_FEATURE_ARQ;
+      }
+
+      if (slave->_fec._t > 0)
+      {
+         features |= SPIMOD_FEATURE_FEC;
+      }
+
+      spimod_hello_build(reply, status, slave->_maxData, features);
+
+      slave->_hello = 0;
+      slave->_replyValid = 1;
+
+      return;
+   }
+
+   if (slave->_arq._window > 0 && spimod_arq_resend(&slave->_arq, reply))
+   {
+      spimod_slave_seal_reply(slave);
+
+      return;
+   }
+
+   if (slave->_arq._window > 0 && !spimod_arq_window_open(&slave->_arq))
+   {
+      model = SLAVE_MODEL_SINK;
+   }
+
+   switch (model)
+   {
+      case SLAVE_MODEL_ECHO:
+
+         if (circular_buffer_read(slave->_fifo,
+                                  (char*)&record,
+                                  RECORD_SIZE) == RECORD_SIZE)
+         {
+            len = circular_buffer_read(slave->_fifo,
+                                       reply->_data,
+                                       record._len);
+         }
+
+         break;
+
+      case SLAVE_MODEL_GENERATOR:
+
+         len = min_t(int, slave->_generatorBytes, capacity);
+
+         for (i = 0; i < len; ++i)
+         {
+            reply->_data[i] = slave->_pattern++;
+         }
+
+         break;
+
+      case SLAVE_MODEL_SINK:
+      default:
+
+         break;
+   }
+
+   reply->_sync = PACKET_SYNC;
+   reply->_len = len;
+
+   reply->_status = status | record._flags;
+
+   spimod_slave_seal_reply(slave);
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_slave_receive()
+ * Purpose:  Consumes the data of a validated packet from the master: the
+ *           echo model queues it to be returned, the others discard it.
+ *           Called directly, or by spimod_arq_receive() once the packet is
+ *           in order.
+ *
+ * Parameters:
+ *
+ * - IN:     in (the packet).
+ * - OUT:    N/A
+ * - IN/OUT: context (the slave to use).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+static void spimod_slave_receive(
+   void* context,
+   const struct packet* in)
+{
+   struct spimod_slave* slave = context;
+
+   slave->_bytesReceived += in->_len;
+
+   if ((SLAVE_MODEL_ECHO == slave->_model)
+    && (in->_len > 0 || (in->_status & PACKET_FLAG_FIRST)))
+   {
+      struct spimod_slave_record record;
+
+      // Segment headers are echoed with the data, so a multiplexed packet
+      // comes back flagged as one
+
+      record._flags = in->_status & (PACKET_FLAG_FIRST | PACKET_FLAG_LAST |
+                                     PACKET_FLAG_CHANNELS);
+      record._len = in->_len;
+
+      if (slave->_fifo->_capacity - slave->_fifo->_size
+             < RECORD_SIZE + in->_len)
+      {
+         slave->_bytesDropped += in->_len;
+      }
+      else
+      {
+         circular_buffer_write(slave->_fifo, (const char*)&record, RECORD_SIZE);
+         circular_buffer_write(slave->_fifo, in->_data, in->_len);
+      }
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: spimod_slave_transfer()
+ * Purpose:  Performs one full-duplex transfer against the slave: rx is
+ *           filled with the slave's prepared reply while the slave consumes
+ *           tx.  As on the real bus, the reply cannot depend on tx.
+ *
+ *           Either buffer may be NULL.  A transfer shorter than a packet
+ *           neither consumes the reply nor delivers tx.  The frame size
+ *           follows the length of the transfer, up to _maxData bytes of
+ *           data; a hello from the master is answered with the slave's
+ *           own.  Frames failing their CRC are dropped, so are never
+ *           echoed.  For _bootFrames frames after spimod_slave_reset()
+ *           only zeros are returned.  With _arq enabled
+ *           replies are numbered and resent, and frames are consumed once
+ *           and in order.  With _fec enabled tx is corrected in a copy,
+ *           _request, unless it passes its CRC.
+ *
+ * Parameters:
+ *
+ * - IN:     tx (bytes clocked out by the master).
+ *           len (length of the transfer in bytes).
+ * - OUT:    rx (bytes clocked in by the master).
+ * - IN/OUT: slave (the slave to use).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_slave_transfer(
+   struct spimod_slave* slave,
+   const void* tx,
+   void* rx,
+   const unsigned int len)
+{
+   const struct packet* in = tx;
+   unsigned int size;
+   u32 dataSize;
+
+   // Still restarting: nothing but zeros, and the master's frames are lost
+
+   if (slave->_bootFrames > 0)
+   {
+      if (rx != NULL)
+      {
+         memset(rx, 0, len);
+      }
+
+      if (len >= PACKET_SIZE)
+      {
+         --slave->_bootFrames;
+      }
+
+      return;
+   }
+
+   if (!slave->_replyValid)
+   {
+      spimod_slave_prepare_reply(slave);
+   }
+
+   size = PACKET_HEADER_SIZE + slave->_dataSize;
+
+   if (rx != NULL)
+   {
+      memcpy(rx, &slave->_reply, min_t(unsigned int, len, size));
+
+      if (len > size)
+      {
+         memset((char*)rx + size, 0, len - size);
+      }
+   }
+
+   if (len < PACKET_SIZE)
+   {
+      return;
+   }
+
+   slave->_bytesSent += slave->_reply._len;
+   slave->_replyValid = 0;
+
+   if (NULL == in)
+   {
+      return;
+   }
+
+   ++slave->_framesReceived;
+
+   // The reply just sent was built for the previous frame size
+
+   dataSize = spimod_hello_data_size(len);
+
+   if (dataSize > slave->_maxData)
+   {
+      ++slave->_badFrames;
+
+      return;
+   }
+
+   if (dataSize != slave->_dataSize)
+   {
+      slave->_dataSize = dataSize;
+
+      spimod_arq_resize(&slave->_arq, dataSize);
+      spimod_fec_resize(&slave->_fec, dataSize);
+   }
+
+   if (in->_status & PACKET_FLAG_HELLO)
+   {
+      struct packet_hello hello;
+
+      if (spimod_hello_parse(in, &hello))
+      {
+         slave->_hello = 1;
+      }
+      else
+      {
+         ++slave->_crcErrors;
+      }
+
+      return;
+   }
+
+   if (slave->_fec._t > 0
+    && !(slave->_crc && spimod_packet_verify(in, slave->_dataSize)))
+   {
+      memcpy(&slave->_request, in, PACKET_HEADER_SIZE + slave->_dataSize);
+
+      if (spimod_fec_decode(&slave->_fec, &slave->_request) < 0)
+      {
+         return;
+      }
+
+      in = &slave->_request;
+   }
+
+   if ((in->_sync != PACKET_SYNC)
+    || (in->_len > slave->_dataSize)
+    || ((in->_status & PACKET_FLAG_ARQ)
+     && in->_len > slave->_dataSize - PACKET_TRAILER_SIZE))
+   {
+      ++slave->_badFrames;
+
+      return;
+   }
+
+   if ((slave->_crc || (in->_status & PACKET_FLAG_CRC))
+    && !spimod_packet_verify(in, slave->_dataSize))
+   {
+      ++slave->_crcErrors;
+
+      return;
+   }
+
+   if (slave->_arq._window > 0 && (in->_status & PACKET_FLAG_ARQ))
+   {
+      spimod_arq_receive(&slave->_arq, in, spimod_slave_receive, slave);
+   }
+   else
+   {
+      spimod_slave_receive(slave, in);
+   }
+}
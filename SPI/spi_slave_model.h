@@ -0,0 +1,172 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spi_slave_model
+ *
+ * Purpose:     A software model of the SPI slave, speaking the packet
+ *              protocol of spi_protocol.c.  Used by the loopback controller
+ *              (spi_loopback.c) so the driver can be exercised without the
+ *              LEC-3517 board.
+ *
+ * ***************************************************************************/
+
+#ifndef SPI_SLAVE_MODEL_H
+#define SPI_SLAVE_MODEL_H
+
+#include "spi_protocol.h"
+#include "circular_buffer.h"
+
+/* The slave behaviours */
+
+typedef enum
+{
+   SLAVE_MODEL_ECHO,		// Returns every frame it receives, flags included
+   SLAVE_MODEL_GENERATOR,	// Sends a counting pattern, discards input
+   SLAVE_MODEL_SINK		// Discards input, sends nothing
+
+} slaveModelType;
+
+/* The slave state */
+
+struct spimod_slave
+{
+   slaveModelType		_model;
+   unsigned int			_generatorBytes;
+   int				_crc;
+   struct spimod_arq		_arq;
+   struct spimod_fec		_fec;
+   // Frames carry _dataSize bytes of data, following the transfers, and
+   // at most _maxData, as announced in the hello sent when _hello is set
+   u32				_maxData;
+   u32				_dataSize;
+   int				_hello;
+   // Frames still to go before the slave answers again after a reset
+   unsigned int			_bootFrames;
+   unsigned char		_pattern;
+   struct circular_buffer*	_fifo;
+   struct packet		_reply;
+   int				_replyValid;
+   // The frame from the master, copied to be corrected when _fec is enabled
+   struct packet		_request;
+   // Statistics
+   unsigned long		_framesReceived;
+   unsigned long		_bytesReceived;
+   unsigned long		_bytesSent;
+   unsigned long		_bytesDropped;
+   unsigned long		_badFrames;
+   unsigned long		_crcErrors;
+};
+
+/******************************************************************************
+ *
+ * Function: spimod_slave_init()
+ * Purpose:  Initialises a slave model with a receive FIFO of fifoSize bytes.
+ *
+ * Parameters:
+ *
+ * - IN:     fifoSize (bytes the slave can hold for echoing).
+ * - OUT:    N/A
+ * - IN/OUT: slave (the slave to initialise).
+ *
+ * Returns:  0 on success, -1 on failure.
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+int spimod_slave_init(
+   struct spimod_slave* slave,
+   const int fifoSize);
+
+/******************************************************************************
+ *
+ * Function: spimod_slave_term()
+ * Purpose:  Releases the resources of a slave model, including its
+ *           retransmission window and error correction tables.
+ *
+ * Parameters:
+ *
+ * - IN:     N/A
+ * - OUT:    N/A
+ * - IN/OUT: slave (the slave to terminate).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_slave_term(
+   struct spimod_slave* slave);
+
+/******************************************************************************
+ *
+ * Function: spimod_slave_reset()
+ * Purpose:  Restarts the slave as a reset of the real one would: what it
+ *           held is lost, its frames are PACKET_DATA_SIZE until the master
+ *           says otherwise, its packets are numbered from 0 again, and for
+ *           bootFrames frames it returns only zeros (no sync word) and
+ *           ignores the master.
+ *
+ * Parameters:
+ *
+ * - IN:     bootFrames (frames before it answers again).
+ * - OUT:    N/A
+ * - IN/OUT: slave (the slave to reset).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_slave_reset(
+   struct spimod_slave* slave,
+   const unsigned int bootFrames);
+
+/******************************************************************************
+ *
+ * Function: spimod_slave_transfer()
+ * Purpose:  Performs one full-duplex transfer against the slave: rx is
+ *           filled with the slave's prepared reply while the slave consumes
+ *           tx.  As on the real bus, the reply cannot depend on tx.
+ *
+ *           Either buffer may be NULL.  A transfer shorter than a packet
+ *           neither consumes the reply nor delivers tx.  When _crc is set
+ *           replies are sealed with their CRC and frames that fail theirs
+ *           are counted in _crcErrors and dropped.  When _arq is enabled
+ *           (see spi_arq.h) replies are numbered and resent until
+ *           acknowledged, and frames are consumed once and in order.  When
+ *           _fec is enabled (see spi_fec.h) replies are encoded, frames are
+ *           corrected before anything else, and those beyond repair are
+ *           counted in _fec._failed and dropped.
+ *
+ * Parameters:
+ *
+ * - IN:     tx (bytes clocked out by the master).
+ *           len (length of the transfer in bytes).
+ * - OUT:    rx (bytes clocked in by the master).
+ * - IN/OUT: slave (the slave to use).
+ *
+ * Returns:  N/A
+ *
+ * Globals:
+ *
+ * - N/A
+ *
+ * ***************************************************************************/
+
+void spimod_slave_transfer(
+   struct spimod_slave* slave,
+   const void* tx,
+   void* rx,
+   const unsigned int len);
+
+#endif
@@ -0,0 +1,729 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spibench
+ *
+ * Purpose:     Throughput and latency benchmark for the character device.
+ *              Sender threads write sequenced, timestamped messages at a
+ *              configured rate while a receiver thread reads the device
+ *              back.  With an echoing slave (or the loopback controller's
+ *              echo model) every message returns and its round trip latency
+ *              is measured; with any other slave only goodput is reported.
+ *              -b sets the bus clock, SPI mode and word size first, so
+ *              runs can compare settings.
+ *
+ *              Usage: spibench [-D device] [-a ioctl|rw] [-s msg_bytes]
+ *                              [-r msgs_per_s] [-t threads] [-d seconds]
+ *                              [-p poll_us] [-b hz[,mode[,bits]]]
+ *
+ * ***************************************************************************/
+
+#include "../spi4.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define MAX_THREADS		16
+#define MAX_MSG_SIZE		4096
+#define RX_CHUNK		2048
+
+static const uint32_t MSG_MAGIC		= 0x5350424DU;	// "SPBM"
+static const unsigned DRAIN_MS		= 500;
+
+/* The header at the start of every message; the rest is a fill pattern */
+
+struct bench_header
+{
+   uint32_t	_magic;
+   uint32_t	_thread;
+   uint32_t	_seq;
+   uint32_t	_reserved;
+   uint64_t	_sentNs;
+};
+
+/* The API used to move data through the device */
+
+typedef enum
+{
+   API_IOCTL,
+   API_RW
+} benchApiType;
+
+/* The benchmark settings and shared state */
+
+struct bench
+{
+   const char*		_device;
+   benchApiType		_api;
+   unsigned		_msgSize;
+   unsigned		_msgRate;
+   unsigned		_threads;
+   double		_seconds;
+   unsigned		_pollUs;
+   const char*		_bus;
+
+   int			_fd;
+   int			_busKnown;
+   struct spi_ioc_bus_config _busConfig;
+   volatile int		_sending;
+   volatile int		_receiving;
+   volatile int		_unsupported;
+   volatile int		_failed;
+   pthread_mutex_t	_txLock;
+
+   // Sender results (updated under _txLock)
+
+   uint64_t		_msgsSent;
+   uint64_t		_bytesSent;
+   uint64_t		_sendRetries;
+
+   // Receiver results (receiver thread only)
+
+   uint64_t		_bytesReceived;
+   uint64_t		_msgsReceived;
+   uint64_t		_msgsLost;
+   uint64_t		_bytesSkipped;
+   uint32_t		_expectedSeq[MAX_THREADS];
+   uint64_t*		_latencyNs;
+   size_t		_numLatencies;
+   size_t		_maxLatencies;
+};
+
+/******************************************************************************
+ *
+ * Function: now_ns()
+ * Purpose:  CLOCK_MONOTONIC in nanoseconds.
+ *
+ * ***************************************************************************/
+
+static uint64_t now_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/******************************************************************************
+ *
+ * Function: sleep_until_ns()
+ * Purpose:  Sleeps until the given CLOCK_MONOTONIC time.
+ *
+ * ***************************************************************************/
+
+static void sleep_until_ns(const uint64_t when)
+{
+   struct timespec ts;
+
+   ts.tv_sec = when / 1000000000ULL;
+   ts.tv_nsec = when % 1000000000ULL;
+
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+   {
+   }
+}
+
+/******************************************************************************
+ *
+ * Function: device_send()
+ * Purpose:  Queues up to len bytes for transmission with the selected API.
+ *
+ * Returns:  The number of bytes accepted, negative on error.
+ *
+ * ***************************************************************************/
+
+static long device_send(
+   struct bench* b,
+   const char* data,
+   const unsigned len)
+{
+   struct spi_ioc_transfer transfer;
+
+   if (API_RW == b->_api)
+   {
+      return write(b->_fd, data, len);
+   }
+
+   transfer._buf = (__u8*)data;
+   transfer._bufLen = len;
+
+   return ioctl(b->_fd, IOCTL_SEND_DATA, &transfer);
+}
+
+/******************************************************************************
+ *
+ * Function: device_receive()
+ * Purpose:  Reads up to len received bytes with the selected API.
+ *
+ * Returns:  The number of bytes read, negative on error.
+ *
+ * ***************************************************************************/
+
+static long device_receive(
+   struct bench* b,
+   char* data,
+   const unsigned len)
+{
+   struct spi_ioc_transfer transfer;
+
+   if (API_RW == b->_api)
+   {
+      return read(b->_fd, data, len);
+   }
+
+   transfer._buf = (__u8*)data;
+   transfer._bufLen = len;
+
+   return ioctl(b->_fd, IOCTL_RECEIVE_DATA, &transfer);
+}
+
+/******************************************************************************
+ *
+ * Function: send_message()
+ * Purpose:  Sends one whole message, retrying every _pollUs while the
+ *           transmit buffer is full.  The lock keeps messages from
+ *           different threads from interleaving when only part of one
+ *           fits.
+ *
+ * Returns:  0 on success, -1 if the run ended or the device failed.
+ *
+ * ***************************************************************************/
+
+static int send_message(
+   struct bench* b,
+   char* msg,
+   const unsigned thread,
+   const uint32_t seq)
+{
+   struct bench_header* header = (struct bench_header*)msg;
+   unsigned offset = 0;
+   int result = 0;
+
+   pthread_mutex_lock(&b->_txLock);
+
+   header->_magic = MSG_MAGIC;
+   header->_thread = thread;
+   header->_seq = seq;
+   header->_sentNs = now_ns();
+
+   while (offset < b->_msgSize)
+   {
+      long n = device_send(b, msg + offset, b->_msgSize - offset);
+
+      if (n < 0 && errno != EAGAIN && errno != EINTR)
+      {
+         perror("send");
+         b->_failed = 1;
+         result = -1;
+         break;
+      }
+
+      // write() returning 0 before anything was sent means it is a stub
+
+      if (0 == n && API_RW == b->_api && 0 == b->_bytesSent)
+      {
+         b->_unsupported = 1;
+         result = -1;
+         break;
+      }
+
+      if (n <= 0)
+      {
+         if (!b->_sending && 0 == offset)
+         {
+            result = -1;
+            break;
+         }
+
+         ++b->_sendRetries;
+
+         usleep(b->_pollUs);
+         continue;
+      }
+
+      offset += n;
+      b->_bytesSent += n;
+   }
+
+   if (offset == b->_msgSize)
+   {
+      ++b->_msgsSent;
+   }
+
+   pthread_mutex_unlock(&b->_txLock);
+
+   return result;
+}
+
+/******************************************************************************
+ *
+ * Function: sender_thread()
+ * Purpose:  Sends messages at _msgRate per second (as fast as the device
+ *           accepts them if 0) until the run ends.
+ *
+ * ***************************************************************************/
+
+struct sender_args
+{
+   struct bench*	_bench;
+   unsigned		_thread;
+};
+
+static void* sender_thread(void* arg)
+{
+   struct sender_args* args = arg;
+   struct bench* b = args->_bench;
+   char msg[MAX_MSG_SIZE];
+   uint64_t next = now_ns();
+   uint64_t period = b->_msgRate ? 1000000000ULL / b->_msgRate : 0;
+   uint32_t seq = 0;
+   unsigned i;
+
+   for (i = sizeof(struct bench_header); i < b->_msgSize; ++i)
+   {
+      msg[i] = (char)(i + args->_thread);
+   }
+
+   while (b->_sending)
+   {
+      if (period)
+      {
+         sleep_until_ns(next);
+
+         next += period;
+      }
+
+      if (send_message(b, msg, args->_thread, seq) < 0)
+      {
+         break;
+      }
+
+      ++seq;
+   }
+
+   return NULL;
+}
+
+/******************************************************************************
+ *
+ * Function: record_latency()
+ * Purpose:  Appends one round trip latency to the sample array.
+ *
+ * ***************************************************************************/
+
+static void record_latency(
+   struct bench* b,
+   const uint64_t latency)
+{
+   if (b->_numLatencies == b->_maxLatencies)
+   {
+      size_t size = b->_maxLatencies ? b->_maxLatencies * 2 : 65536;
+      uint64_t* grown = realloc(b->_latencyNs, size * sizeof(uint64_t));
+
+      if (NULL == grown)
+      {
+         return;
+      }
+
+      b->_latencyNs = grown;
+      b->_maxLatencies = size;
+   }
+
+   b->_latencyNs[b->_numLatencies++] = latency;
+}
+
+/******************************************************************************
+ *
+ * Function: parse_messages()
+ * Purpose:  Extracts the complete messages at the start of data, recording
+ *           their latency and any sequence gaps.  Bytes that do not start
+ *           a message are skipped one at a time until the stream realigns.
+ *
+ * Returns:  The number of bytes consumed.
+ *
+ * ***************************************************************************/
+
+static size_t parse_messages(
+   struct bench* b,
+   const char* data,
+   const size_t len)
+{
+   size_t offset = 0;
+
+   while (len - offset >= b->_msgSize)
+   {
+      struct bench_header header;
+
+      memcpy(&header, data + offset, sizeof(header));
+
+      if (header._magic != MSG_MAGIC || header._thread >= b->_threads)
+      {
+         ++b->_bytesSkipped;
+         ++offset;
+         continue;
+      }
+
+      if (header._seq > b->_expectedSeq[header._thread])
+      {
+         b->_msgsLost += header._seq - b->_expectedSeq[header._thread];
+      }
+
+      b->_expectedSeq[header._thread] = header._seq + 1;
+
+      record_latency(b, now_ns() - header._sentNs);
+
+      ++b->_msgsReceived;
+
+      offset += b->_msgSize;
+   }
+
+   return offset;
+}
+
+/******************************************************************************
+ *
+ * Function: receiver_thread()
+ * Purpose:  Reads the device until the run ends, polling every _pollUs when
+ *           nothing has been received.
+ *
+ * ***************************************************************************/
+
+static void* receiver_thread(void* arg)
+{
+   struct bench* b = arg;
+   char data[RX_CHUNK + MAX_MSG_SIZE];
+   size_t used = 0;
+
+   while (b->_receiving)
+   {
+      long n = device_receive(b, data + used, RX_CHUNK);
+
+      if (n < 0 && errno != EAGAIN && errno != EINTR)
+      {
+         perror("receive");
+         b->_failed = 1;
+         break;
+      }
+
+      if (n <= 0)
+      {
+         usleep(b->_pollUs);
+         continue;
+      }
+
+      b->_bytesReceived += n;
+      used += n;
+
+      n = parse_messages(b, data, used);
+
+      memmove(data, data + n, used - n);
+
+      used -= n;
+   }
+
+   return NULL;
+}
+
+/******************************************************************************
+ *
+ * Function: compare_u64()
+ * Purpose:  qsort() comparator for the latency samples.
+ *
+ * ***************************************************************************/
+
+static int compare_u64(const void* a, const void* b)
+{
+   const uint64_t ua = *(const uint64_t*)a;
+   const uint64_t ub = *(const uint64_t*)b;
+
+   return (ua > ub) - (ua < ub);
+}
+
+/******************************************************************************
+ *
+ * Function: percentile_us()
+ * Purpose:  Returns the p-th fraction of the sorted latency samples in us.
+ *
+ * ***************************************************************************/
+
+static double percentile_us(
+   const struct bench* b,
+   const double p)
+{
+   size_t index = (size_t)(p * (b->_numLatencies - 1));
+
+   return b->_latencyNs[index] / 1000.0;
+}
+
+/******************************************************************************
+ *
+ * Function: report()
+ * Purpose:  Prints the results of the run.
+ *
+ * ***************************************************************************/
+
+static void report(
+   struct bench* b,
+   const double elapsed,
+   const struct rusage* usage)
+{
+   double user = usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+   double sys = usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+
+   printf("%s, %s API, %u byte messages, %u thread(s) at ",
+          b->_device,
+          API_RW == b->_api ? "read/write" : "ioctl",
+          b->_msgSize,
+          b->_threads);
+
+   if (b->_msgRate)
+   {
+      printf("%u msgs/s each, %.2f s\n", b->_msgRate, elapsed);
+   }
+   else
+   {
+      printf("full rate, %.2f s\n", elapsed);
+   }
+
+   if (b->_busKnown)
+   {
+      printf("Bus:      %u Hz, mode %u, %u bit words\n",
+             b->_busConfig._speedHz,
+             b->_busConfig._mode,
+             b->_busConfig._bitsPerWord);
+   }
+
+   printf("Sent:     %llu msgs, %llu bytes, %.1f KB/s (%llu retries on a "
+          "full buffer)\n",
+          (unsigned long long)b->_msgsSent,
+          (unsigned long long)b->_bytesSent,
+          b->_bytesSent / elapsed / 1024.0,
+          (unsigned long long)b->_sendRetries);
+
+   printf("Received: %llu bytes, %.1f KB/s\n",
+          (unsigned long long)b->_bytesReceived,
+          b->_bytesReceived / elapsed / 1024.0);
+
+   if (b->_msgsReceived)
+   {
+      qsort(b->_latencyNs, b->_numLatencies, sizeof(uint64_t), compare_u64);
+
+      printf("Echoed:   %llu msgs, %llu lost, %llu bytes skipped\n",
+             (unsigned long long)b->_msgsReceived,
+             (unsigned long long)b->_msgsLost,
+             (unsigned long long)b->_bytesSkipped);
+
+      printf("Latency:  min %.0f p50 %.0f p90 %.0f p99 %.0f p99.9 %.0f "
+             "max %.0f us\n",
+             percentile_us(b, 0.0),
+             percentile_us(b, 0.5),
+             percentile_us(b, 0.9),
+             percentile_us(b, 0.99),
+             percentile_us(b, 0.999),
+             percentile_us(b, 1.0));
+   }
+   else
+   {
+      printf("Echoed:   none - the slave is not echoing, latency not "
+             "measured\n");
+   }
+
+   printf("CPU:      user %.3f s, system %.3f s, %.1f%% of one CPU "
+          "(the driver's timer work is not included)\n",
+          user,
+          sys,
+          100.0 * (user + sys) / elapsed);
+}
+
+int main(int argc, char* argv[])
+{
+   static struct bench b;
+   struct sender_args args[MAX_THREADS];
+   pthread_t senders[MAX_THREADS];
+   pthread_t receiver;
+   struct rusage usage;
+   uint64_t start, end;
+   unsigned i;
+   int opt;
+
+   b._device = "/dev/spimod1";
+   b._api = API_IOCTL;
+   b._msgSize = 64;
+   b._msgRate = 0;
+   b._threads = 1;
+   b._seconds = 10.0;
+   b._pollUs = 200;
+   b._bus = NULL;
+
+   while ((opt = getopt(argc, argv, "D:a:s:r:t:d:p:b:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'D':
+            b._device = optarg;
+            break;
+
+         case 'a':
+            if (0 == strcmp(optarg, "ioctl"))
+            {
+               b._api = API_IOCTL;
+            }
+            else if (0 == strcmp(optarg, "rw"))
+            {
+               b._api = API_RW;
+            }
+            else
+            {
+               fprintf(stderr, "Unknown API %s (the driver has no mmap "
+                       "interface; use ioctl or rw)\n", optarg);
+               return 1;
+            }
+            break;
+
+         case 's':
+            b._msgSize = strtoul(optarg, NULL, 0);
+            break;
+
+         case 'r':
+            b._msgRate = strtoul(optarg, NULL, 0);
+            break;
+
+         case 't':
+            b._threads = strtoul(optarg, NULL, 0);
+            break;
+
+         case 'd':
+            b._seconds = strtod(optarg, NULL);
+            break;
+
+         case 'p':
+            b._pollUs = strtoul(optarg, NULL, 0);
+            break;
+
+         case 'b':
+            b._bus = optarg;
+            break;
+
+         default:
+            fprintf(stderr, "Usage: %s [-D device] [-a ioctl|rw] "
+                    "[-s msg_bytes] [-r msgs_per_s] [-t threads] "
+                    "[-d seconds] [-p poll_us] [-b hz[,mode[,bits]]]\n",
+                    argv[0]);
+            return 1;
+      }
+   }
+
+   if (b._msgSize < sizeof(struct bench_header) || b._msgSize > MAX_MSG_SIZE)
+   {
+      fprintf(stderr, "Message size must be %zu to %d bytes\n",
+              sizeof(struct bench_header), MAX_MSG_SIZE);
+      return 1;
+   }
+
+   if (b._threads < 1 || b._threads > MAX_THREADS)
+   {
+      fprintf(stderr, "Threads must be 1 to %d\n", MAX_THREADS);
+      return 1;
+   }
+
+   // Non-blocking, so the receiver can notice the end of the run
+
+   b._fd = open(b._device, O_RDWR | O_NONBLOCK);
+
+   if (b._fd < 0)
+   {
+      perror(b._device);
+      return 1;
+   }
+
+   // Bus settings apply to the whole device, and stay after the run
+
+   if (b._bus != NULL)
+   {
+      struct spi_ioc_bus_config config;
+      char* next;
+
+      config._speedHz = strtoul(b._bus, &next, 0);
+      config._mode = (',' == *next) ? strtoul(next + 1, &next, 0) : 0;
+      config._bitsPerWord = (',' == *next) ? strtoul(next + 1, &next, 0) : 8;
+
+      if (ioctl(b._fd, IOCTL_SET_BUS_CONFIG, &config) < 0)
+      {
+         perror("IOCTL_SET_BUS_CONFIG");
+         return 1;
+      }
+   }
+
+   b._busKnown = (0 == ioctl(b._fd, IOCTL_GET_BUS_CONFIG, &b._busConfig));
+
+   pthread_mutex_init(&b._txLock, NULL);
+
+   b._sending = 1;
+   b._receiving = 1;
+
+   start = now_ns();
+
+   pthread_create(&receiver, NULL, receiver_thread, &b);
+
+   for (i = 0; i < b._threads; ++i)
+   {
+      args[i]._bench = &b;
+      args[i]._thread = i;
+
+      pthread_create(&senders[i], NULL, sender_thread, &args[i]);
+   }
+
+   end = start + (uint64_t)(b._seconds * 1e9);
+
+   while (now_ns() < end && !b._unsupported && !b._failed)
+   {
+      usleep(10000);
+   }
+
+   b._sending = 0;
+
+   for (i = 0; i < b._threads; ++i)
+   {
+      pthread_join(senders[i], NULL);
+   }
+
+   end = now_ns();
+
+   // Let the last messages come back before stopping the receiver
+
+   usleep(DRAIN_MS * 1000);
+
+   b._receiving = 0;
+
+   pthread_join(receiver, NULL);
+
+   getrusage(RUSAGE_SELF, &usage);
+
+   close(b._fd);
+
+   if (b._unsupported)
+   {
+      fprintf(stderr, "%s: write() returned 0 - read/write are not "
+              "supported by this driver, use -a ioctl\n", b._device);
+      return 1;
+   }
+
+   report(&b, (end - start) / 1e9, &usage);
+
+   free(b._latencyNs);
+
+   return b._failed ? 1 : 0;
+}
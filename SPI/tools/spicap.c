@@ -0,0 +1,316 @@
+/******************************************************************************
+ *
+ * Linux SPI Device Driver
+ *
+ * Module Name: spicap
+ *
+ * Purpose:     User space tool draining the per-CPU packet capture files of
+ *              the driver (see spi_capture.c) into a single pcap file,
+ *              ordered by timestamp.  Runs until interrupted.
+ *
+ *              Usage: spicap [-d debugfs_dir] [-o output.pcap]
+ *
+ * ***************************************************************************/
+
+#include "../spi4.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define MAX_CPUS		32
+#define CARRY_SIZE		(1024 * 128)
+
+static const uint32_t PCAP_MAGIC_NSEC	= 0xA1B23C4D;
+static const uint32_t LINKTYPE_USER0	= 147;
+static const uint32_t PCAP_SNAPLEN	= 65535;
+static const size_t PCAP_RECORD_SIZE	= 16;
+
+/* The pcap file header */
+
+struct pcap_file_header
+{
+   uint32_t	_magic;
+   uint16_t	_versionMajor;
+   uint16_t	_versionMinor;
+   int32_t	_thisZone;
+   uint32_t	_sigFigs;
+   uint32_t	_snapLen;
+   uint32_t	_linkType;
+};
+
+/* A per-CPU capture file and its partially parsed data */
+
+struct capture_source
+{
+   int		_fd;
+   size_t	_used;
+   char		_data[CARRY_SIZE];
+};
+
+/* A parsed record, pending sorting */
+
+struct capture_entry
+{
+   uint64_t	_ts;
+   const char*	_record;
+   size_t	_len;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal(int sig)
+{
+   (void)sig;
+
+   running = 0;
+}
+
+/******************************************************************************
+ *
+ * Function: compare_entries()
+ * Purpose:  qsort() comparator ordering records by timestamp.
+ *
+ * ***************************************************************************/
+
+static int compare_entries(const void* a, const void* b)
+{
+   const struct capture_entry* ea = a;
+   const struct capture_entry* eb = b;
+
+   return (ea->_ts > eb->_ts) - (ea->_ts < eb->_ts);
+}
+
+/******************************************************************************
+ *
+ * Function: open_sources()
+ * Purpose:  Opens capture0 ... captureN in the debugfs directory.
+ *
+ * Returns:  The number of files opened.
+ *
+ * ***************************************************************************/
+
+static int open_sources(
+   const char* dir,
+   struct capture_source** sources)
+{
+   int count = 0;
+   int cpu;
+
+   for (cpu = 0; cpu < MAX_CPUS; ++cpu)
+   {
+      char path[512];
+      int fd;
+
+      snprintf(path, sizeof(path), "%s/capture%d", dir, cpu);
+
+      fd = open(path, O_RDONLY | O_NONBLOCK);
+
+      if (fd < 0)
+      {
+         continue;
+      }
+
+      sources[count] = calloc(1, sizeof(struct capture_source));
+
+      if (NULL == sources[count])
+      {
+         close(fd);
+         break;
+      }
+
+      sources[count]->_fd = fd;
+
+      ++count;
+   }
+
+   return count;
+}
+
+/******************************************************************************
+ *
+ * Function: drain_sources()
+ * Purpose:  Reads whatever is available from every source, writes all
+ *           complete records to out in timestamp order and keeps any
+ *           trailing partial record for the next call.
+ *
+ * Returns:  The number of records written, negative on error.
+ *
+ * ***************************************************************************/
+
+static long drain_sources(
+   struct capture_source** sources,
+   const int count,
+   FILE* out)
+{
+   static struct capture_entry
+      entries[MAX_CPUS * (CARRY_SIZE / sizeof(struct spi_capture_record))];
+
+   size_t consumed[MAX_CPUS];
+   size_t numEntries = 0;
+   size_t i;
+   int s;
+
+   for (s = 0; s < count; ++s)
+   {
+      struct capture_source* src = sources[s];
+      size_t offset = 0;
+      ssize_t n;
+
+      n = read(src->_fd, src->_data + src->_used, CARRY_SIZE - src->_used);
+
+      if (n > 0)
+      {
+         src->_used += n;
+      }
+      else if (n < 0 && errno != EAGAIN && errno != EINTR)
+      {
+         perror("read");
+         return -1;
+      }
+
+      // Split into complete records
+
+      while (src->_used - offset >= sizeof(struct spi_capture_record))
+      {
+         const struct spi_capture_record* record =
+            (const struct spi_capture_record*)(src->_data + offset);
+
+         size_t len = PCAP_RECORD_SIZE + record->_capLen;
+
+         if (src->_used - offset < len)
+         {
+            break;
+         }
+
+         entries[numEntries]._ts = (uint64_t)record->_tsSec * 1000000000ULL
+                                 + record->_tsNsec;
+         entries[numEntries]._record = (const char*)record;
+         entries[numEntries]._len = len;
+
+         ++numEntries;
+
+         offset += len;
+      }
+
+      consumed[s] = offset;
+   }
+
+   qsort(entries, numEntries, sizeof(struct capture_entry), compare_entries);
+
+   for (i = 0; i < numEntries; ++i)
+   {
+      if (fwrite(entries[i]._record, 1, entries[i]._len, out)
+          != entries[i]._len)
+      {
+         perror("fwrite");
+         return -1;
+      }
+   }
+
+   for (s = 0; s < count; ++s)
+   {
+      struct capture_source* src = sources[s];
+
+      memmove(src->_data, src->_data + consumed[s], src->_used - consumed[s]);
+
+      src->_used -= consumed[s];
+   }
+
+   fflush(out);
+
+   return (long)numEntries;
+}
+
+int main(int argc, char* argv[])
+{
+   struct capture_source* sources[MAX_CPUS];
+   struct pcap_file_header header;
+   const char* dir = "/sys/kernel/debug/spimod1";
+   const char* outName = "spimod.pcap";
+   unsigned long total = 0;
+   FILE* out;
+   int count;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "d:o:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'd':
+            dir = optarg;
+            break;
+
+         case 'o':
+            outName = optarg;
+            break;
+
+         default:
+            fprintf(stderr, "Usage: %s [-d debugfs_dir] [-o output.pcap]\n",
+                    argv[0]);
+            return 1;
+      }
+   }
+
+   count = open_sources(dir, sources);
+
+   if (0 == count)
+   {
+      fprintf(stderr, "No capture files in %s - is debugfs mounted?\n", dir);
+      return 1;
+   }
+
+   out = fopen(outName, "wb");
+
+   if (NULL == out)
+   {
+      perror(outName);
+      return 1;
+   }
+
+   header._magic	= PCAP_MAGIC_NSEC;
+   header._versionMajor	= 2;
+   header._versionMinor	= 4;
+   header._thisZone	= 0;
+   header._sigFigs	= 0;
+   header._snapLen	= PCAP_SNAPLEN;
+   header._linkType	= LINKTYPE_USER0;
+
+   fwrite(&header, sizeof(header), 1, out);
+
+   signal(SIGINT, on_signal);
+   signal(SIGTERM, on_signal);
+
+   fprintf(stderr, "Capturing from %d CPU file(s) in %s, ^C to stop\n",
+           count, dir);
+
+   while (running)
+   {
+      long written = drain_sources(sources, count, out);
+
+      if (written < 0)
+      {
+         break;
+      }
+
+      total += written;
+
+      if (0 == written)
+      {
+         usleep(100000);
+      }
+   }
+
+   fclose(out);
+
+   fprintf(stderr, "%lu packets written to %s\n", total, outName);
+
+   return 0;
+}